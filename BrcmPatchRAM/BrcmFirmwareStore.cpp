@@ -20,14 +20,129 @@
 
 #include "Common.h"
 #include "BrcmFirmwareStore.h"
+#include "FirmwareCache.h"
 #ifdef FIRMWAREDATA
 #include "FirmwareData.h"
 #endif
 
+#include <libkern/OSByteOrder.h>
 #include <sys/time.h>
 #include <sys/vnode.h>
 #include <sys/fcntl.h>
 
+/***************************************
+ * Allocation accounting
+ ***************************************/
+static AllocationStats allocationStats[kAllocSiteCount];
+
+static void trackAllocation(AllocationSite site, SInt64 bytes)
+{
+    AllocationStats* stats = &allocationStats[site];
+    SInt64 current = OSAddAtomic64(bytes, &stats->current) + bytes;
+    
+    if (bytes > 0)
+    {
+        OSIncrementAtomic(&stats->allocations);
+        // not atomic, a racing update can only lose a momentary peak
+        if (current > stats->peak)
+            stats->peak = current;
+    }
+}
+
+static void* trackedMalloc(AllocationSite site, vm_size_t size)
+{
+    void* result = IOMalloc(size);
+    
+    if (result)
+        trackAllocation(site, size);
+    return result;
+}
+
+static void trackedFree(AllocationSite site, void* address, vm_size_t size)
+{
+    IOFree(address, size);
+    trackAllocation(site, -(SInt64)size);
+}
+
+/***************************************
+ * Firmware key index
+ ***************************************/
+UInt32 FirmwareIndex::hashKey(const char* key)
+{
+    UInt32 hash = 0x811C9DC5;
+    
+    while (*key)
+        hash = (hash ^ (UInt8)*key++) * 0x01000193;
+    return hash;
+}
+
+bool FirmwareIndex::init(UInt32 capacity)
+{
+    UInt32 slots = 16;
+    
+    // Keep the index at most half full so probe sequences stay short
+    while (slots < capacity * 2)
+        slots <<= 1;
+    
+    if (!(mSlots = (Slot*)trackedMalloc(kAllocIndex, slots * sizeof(Slot))))
+        return false;
+    
+    bzero(mSlots, slots * sizeof(Slot));
+    mMask = slots - 1;
+    mCount = 0;
+    mMaxProbes = 0;
+    return true;
+}
+
+void FirmwareIndex::free()
+{
+    if (mSlots)
+        trackedFree(kAllocIndex, mSlots, (mMask + 1) * sizeof(Slot));
+    mSlots = NULL;
+    mMask = 0;
+    mCount = 0;
+}
+
+bool FirmwareIndex::insert(const char* key, const void* value)
+{
+    if (!mSlots || mCount * 2 >= mMask + 1)
+        return false;
+    
+    UInt32 hash = hashKey(key);
+    UInt32 probes = 1;
+    UInt32 i;
+    
+    // The first entry for a key wins, as with a linear search
+    for (i = hash & mMask; mSlots[i].key; i = (i + 1) & mMask, probes++)
+    {
+        if (mSlots[i].hash == hash && !strcmp(mSlots[i].key, key))
+            return true;
+    }
+    mSlots[i].hash = hash;
+    mSlots[i].key = key;
+    mSlots[i].value = value;
+    mCount++;
+    
+    if (probes > mMaxProbes)
+        mMaxProbes = probes;
+    return true;
+}
+
+const void* FirmwareIndex::lookup(const char* key) const
+{
+    if (!mSlots)
+        return NULL;
+    
+    UInt32 hash = hashKey(key);
+    
+    for (UInt32 i = hash & mMask; mSlots[i].key; i = (i + 1) & mMask)
+    {
+        if (mSlots[i].hash == hash && !strcmp(mSlots[i].key, key))
+            return mSlots[i].value;
+    }
+    return NULL;
+}
+
 /***************************************
  * Zlib Decompression
  ***************************************/
@@ -54,7 +169,7 @@ extern "C"
         UInt32 total = num_items * size;
         UInt32 allocSize =  total + sizeof(zmem);
         
-        zmem = (z_mem*)IOMalloc(allocSize);
+        zmem = (z_mem*)trackedMalloc(kAllocZlib, allocSize);
         
         if (zmem)
         {
@@ -69,10 +184,23 @@ extern "C"
     {
         UInt32* skipper = (UInt32 *)ptr - 1;
         z_mem* zmem = (z_mem*)skipper;
-        IOFree((void*)zmem, zmem->alloc_size);
+        trackedFree(kAllocZlib, (void*)zmem, zmem->alloc_size);
     }
 };
 
+// Whether firmware starts with a zlib header rather than IntelHex text
+static bool isCompressedFirmware(OSData* firmware)
+{
+    if (firmware->getLength() < 2)
+        return false;
+    
+    UInt16 magic = OSReadLittleInt16(firmware->getBytesNoCopy(), 0);
+    
+    return magic == 0x0178      // Zlib no compression
+        || magic == 0x9c78      // Zlib default compression
+        || magic == 0xda78;     // Zlib maximum compression
+}
+
 /*
  * Decompress the firmware using zlib inflate (If not compressed, return data normally)
  */
@@ -85,11 +213,7 @@ OSData* BrcmFirmwareStore::decompressFirmware(OSData* firmware)
     OSData* result = NULL;
     
     // Verify if the data is compressed
-    UInt16* magic = (UInt16*)firmware->getBytesNoCopy();
-    
-    if (*magic != 0x0178     // Zlib no compression
-        && *magic != 0x9c78  // Zlib default compression
-        && *magic != 0xda78) // Zlib maximum compression
+    if (!isCompressedFirmware(firmware))
     {
         // Return the data as-is
         firmware->retain();
@@ -98,7 +222,7 @@ OSData* BrcmFirmwareStore::decompressFirmware(OSData* firmware)
     
     bufferSize = firmware->getLength() * 4;
     
-    buffer = IOMalloc(bufferSize);
+    buffer = trackedMalloc(kAllocDecompress, bufferSize);
     
     bzero(&zstream, sizeof(zstream));
     
@@ -115,7 +239,7 @@ OSData* BrcmFirmwareStore::decompressFirmware(OSData* firmware)
     
     if (zlib_result != Z_OK)
     {
-        IOFree(buffer, bufferSize);
+        trackedFree(kAllocDecompress, buffer, bufferSize);
         return NULL;
     }
     
@@ -126,7 +250,42 @@ OSData* BrcmFirmwareStore::decompressFirmware(OSData* firmware)
         result = OSData::withBytes(buffer, (unsigned int)zstream.total_out);
     
     inflateEnd(&zstream);
-    IOFree(buffer, bufferSize);
+    trackedFree(kAllocDecompress, buffer, bufferSize);
+    
+    return result;
+}
+
+/*
+ * Compress with zlib deflate, for the records CompactCache packs. Returns
+ * NULL if it could not be compressed.
+ */
+OSData* BrcmFirmwareStore::compressFirmware(OSData* firmware)
+{
+    z_stream zstream;
+    OSData* result = NULL;
+    
+    bzero(&zstream, sizeof(zstream));
+    zstream.zalloc = z_alloc;
+    zstream.zfree = z_free;
+    
+    if (deflateInit(&zstream, Z_BEST_COMPRESSION) != Z_OK)
+        return NULL;
+    
+    vm_size_t bufferSize = deflateBound(&zstream, firmware->getLength());
+    void* buffer = trackedMalloc(kAllocDecompress, bufferSize);
+    
+    if (buffer)
+    {
+        zstream.next_in   = (unsigned char*)firmware->getBytesNoCopy();
+        zstream.avail_in  = firmware->getLength();
+        zstream.next_out  = (unsigned char*)buffer;
+        zstream.avail_out = (unsigned int)bufferSize;
+        
+        if (deflate(&zstream, Z_FINISH) == Z_STREAM_END)
+            result = OSData::withBytes(buffer, (unsigned int)zstream.total_out);
+        trackedFree(kAllocDecompress, buffer, bufferSize);
+    }
+    deflateEnd(&zstream);
     
     return result;
 }
@@ -180,121 +339,573 @@ static char check_sum(const UInt8* data, UInt16 len)
     return (~crc + 1) & 0xFF;
 }
 
-OSArray* BrcmFirmwareStore::parseFirmware(OSData* firmwareData)
+#define HEX_LINE_INVALID    -1
+#define HEX_LINE_END        -2
+
+/*
+ * Parse the line at *cursor, which has to be complete before end, and move
+ * *cursor on to the next line. A data record is written to record as a
+ * LAUNCH_RAM command, which takes at most kLaunchRamRecordMax bytes, and
+ * its length is returned. Other records return 0, the end of file record
+ * HEX_LINE_END and an invalid line HEX_LINE_INVALID.
+ */
+static int parseHexLine(const UInt8** cursor, const UInt8* end, UInt32* address, UInt8* record)
 {
-    // Vendor Specific: Launch RAM
-    UInt8 HCI_VSC_LAUNCH_RAM[] = { 0x4c, 0xfc };
+    const UInt8* data = *cursor;
+    UInt8 binary[0x110];
+    int offset = 0;
+    int result = 0;
+    
+    bzero(binary, sizeof(binary));
+    data++;
+    
+    // Read all hex characters for this line
+    while (end - data >= 2 && validHexChar(*data) && offset < (int)sizeof(binary))
+    {
+        hex_nibble(*data++, binary[offset]);
+        hex_nibble(*data++, binary[offset++]);
+    }
+    
+    // Parse line data
+    UInt8 length = binary[0];
+    UInt16 addr = binary[1] << 8 | binary[2];
+    UInt8 record_type = binary[3];
+    UInt8 checksum = binary[HEX_HEADER_SIZE + length];
+    
+    UInt8 calc_checksum = check_sum(binary, HEX_HEADER_SIZE  + length);
+    
+    if (checksum != calc_checksum)
+    {
+        CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware, checksum mismatch.\n");
+        return HEX_LINE_INVALID;
+    }
+    
+    // ParseFirmware class only supports I32HEX format
+    switch (record_type)
+    {
+        // Data
+        case REC_TYPE_DATA:
+            if (length > kLaunchRamRecordMax - 7)
+            {
+                CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware, data record of %u bytes.\n", length);
+                return HEX_LINE_INVALID;
+            }
+            *address = (*address & 0xFFFF0000) | addr;
+            
+            // Vendor Specific: Launch RAM, with 4 bytes for the address
+            record[0] = 0x4c;
+            record[1] = 0xfc;
+            record[2] = length + 4;
+            OSWriteLittleInt32(record, 3, *address);
+            memcpy(record + 7, &binary[4], length);
+            result = 7 + length;
+            break;
+        // End of File
+        case REC_TYPE_EOF:
+            return HEX_LINE_END;
+        // Extended Segment Address
+        case REC_TYPE_ESA:
+            // Segment address multiplied by 16
+            *address = binary[4] << 8 | binary[5];
+            *address <<= 4;
+            break;
+            // Start Segment Address
+        case REC_TYPE_SSA:
+            // Set CS:IP register for 80x86
+            CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware, unsupported start segment address instruction.\n");
+            return HEX_LINE_INVALID;
+            // Extended Linear Address
+        case REC_TYPE_ELA:
+            // Set new higher 16 bits of the current address
+            *address = binary[4] << 24 | binary[5] << 16;
+            break;
+            // Start Linear Address
+        case REC_TYPE_SLA:
+            // Set EIP of 80386 and higher
+            CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware, unsupported start linear address instruction.\n");
+            return HEX_LINE_INVALID;
+        default:
+            CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware, unknown record type encountered: 0x%02x.\n", record_type);
+            return HEX_LINE_INVALID;
+    }
     
-    OSArray* instructions = OSArray::withCapacity(1);
+    // Skip over any trailing newlines / whitespace
+    while (data < end && !validHexChar(*data) && !(*data == HEX_LINE_PREFIX))
+        data++;
+    
+    *cursor = data;
+    return result;
+}
+
+/*
+ * Parse the records into a new array, or with stream set append them to
+ * stream as they are parsed, so that they can be sent while the rest is
+ * still being parsed. Stream is shared and only changed with mDataLock held.
+ */
+OSArray* BrcmFirmwareStore::parseFirmware(OSData* firmwareData, OSArray* stream)
+{
+    OSArray* instructions = stream;
+    if (instructions)
+        instructions->retain();
+    else
+        instructions = OSArray::withCapacity(1);
     if (!instructions)
         return NULL;
 
-    UInt8* data = (UInt8*)firmwareData->getBytesNoCopy();
+    const UInt8* data = (const UInt8*)firmwareData->getBytesNoCopy();
+    const UInt8* end = data + firmwareData->getLength();
     UInt32 address = 0;
-    UInt8 binary[0x110];
+    UInt8 record[kLaunchRamRecordMax];
+    SInt64 allocated = 0;
     
-    if (*data != HEX_LINE_PREFIX)
+    if (data == end || *data != HEX_LINE_PREFIX)
     {
-        DebugLog("parseFirmware - Invalid firmware data.\n");
+        CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware data.\n");
         goto exit_error;
     }
     
-    while (*data == HEX_LINE_PREFIX)
+    while (data < end && *data == HEX_LINE_PREFIX)
     {
-        bzero(binary, sizeof(binary));
-        data++;
+        int length = parseHexLine(&data, end, &address, record);
+        
+        if (length == HEX_LINE_END)
+            return instructions;
+        if (length == HEX_LINE_INVALID)
+            goto exit_error;
+        if (!length)
+            continue;
         
-        int offset = 0;
+        OSData* instruction = OSData::withBytes(record, length);
+        if (!instruction)
+            goto exit_error;
         
-        // Read all hex characters for this line
-        while (validHexChar(*data))
+        if (stream)
+            IOLockLock(mDataLock);
+        instructions->setObject(instruction);
+        if (stream)
         {
-            hex_nibble(*data++, binary[offset]);
-            hex_nibble(*data++, binary[offset++]);
+            // Only wake a reader that caught up with the decode
+            bool waiting = mStreamWaiters != 0;
+            IOLockUnlock(mDataLock);
+            if (waiting)
+                IOLockWakeup(mDataLock, stream, false);
         }
+        instruction->release();
+        trackAllocation(kAllocInstructions, length);
+        allocated += length;
+    }
+    
+    CategoryLog(kLogDecode, kLogInfo, "parseFirmware - Invalid firmware.\n");
+    
+exit_error:
+    OSSafeReleaseNULL(instructions);
+    trackAllocation(kAllocInstructions, -allocated);
+    return NULL;
+}
+
+/*
+ * Largest record of a packed firmware, the address as a varint of at most
+ * 5 bytes, the length and the data of a LAUNCH_RAM record.
+ */
+#define kPackedRecordMax    (5 + 1 + kLaunchRamRecordMax - 7)
+
+/*
+ * Pack the records of a firmware for CompactCache and deflate them. Each
+ * record is the distance of its address from the end of the record before
+ * as a varint, the length of its data and the data, without the text,
+ * addresses and checksums of IntelHex. Records almost always follow on
+ * from each other, so that deflated this is smaller than the .zhx and a
+ * lot smaller than the instructions. Returns NULL if the firmware is not
+ * valid, with the count of its records in records otherwise.
+ */
+OSData* BrcmFirmwareStore::packFirmware(OSData* firmware, UInt32* records)
+{
+    OSData* firmwareData = decompressFirmware(firmware);
+    if (!firmwareData)
+        return NULL;
+    
+    const UInt8* data = (const UInt8*)firmwareData->getBytesNoCopy();
+    const UInt8* end = data + firmwareData->getLength();
+    OSData* packed = OSData::withCapacity(firmwareData->getLength() / 2);
+    OSData* result = NULL;
+    UInt32 address = 0;
+    UInt32 next = 0;
+    UInt8 record[kLaunchRamRecordMax];
+    
+    *records = 0;
+    if (data == end || *data != HEX_LINE_PREFIX)
+        CategoryLog(kLogDecode, kLogInfo, "packFirmware - Invalid firmware data.\n");
+    
+    while (packed && data < end && *data == HEX_LINE_PREFIX)
+    {
+        int length = parseHexLine(&data, end, &address, record);
         
-        // Parse line data
-        UInt8 length = binary[0];
-        UInt16 addr = binary[1] << 8 | binary[2];
-        UInt8 record_type = binary[3];
-        UInt8 checksum = binary[HEX_HEADER_SIZE + length];
+        if (length == HEX_LINE_END)
+        {
+            result = compressFirmware(packed);
+            break;
+        }
+        if (length == HEX_LINE_INVALID)
+            break;
+        if (!length)
+            continue;
         
-        UInt8 calc_checksum = check_sum(binary, HEX_HEADER_SIZE  + length);
+        UInt8 header[6];
+        UInt32 distance = address - next;
+        int size = 0;
         
-        if (checksum != calc_checksum)
+        while (distance >= 0x80)
         {
-            DebugLog("parseFirmware - Invalid firmware, checksum mismatch.\n");
-            goto exit_error;
+            header[size++] = (distance & 0x7f) | 0x80;
+            distance >>= 7;
         }
+        header[size++] = distance;
+        header[size++] = length - 7;
         
-        // ParseFirmware class only supports I32HEX format
-        switch (record_type)
+        if (!packed->appendBytes(header, size) || !packed->appendBytes(record + 7, length - 7))
+            break;
+        next = address + length - 7;
+        (*records)++;
+    }
+    
+    if (!result)
+        CategoryLog(kLogDecode, kLogInfo, "packFirmware - Invalid firmware.\n");
+    OSSafeReleaseNULL(packed);
+    firmwareData->release();
+    return result;
+}
+
+/**********************************************
+ * Firmware read record by record
+ **********************************************/
+#define kStreamPackedSize   2048
+
+OSDefineMetaClassAndStructors(BrcmFirmwareStream, OSObject)
+
+BrcmFirmwareStream* BrcmFirmwareStream::withSource(OSData* source)
+{
+    BrcmFirmwareStream* stream = new BrcmFirmwareStream;
+    
+    if (stream && !stream->initWithSource(source))
+        OSSafeReleaseNULL(stream);
+    return stream;
+}
+
+bool BrcmFirmwareStream::initWithSource(OSData* source)
+{
+    if (!super::init() || !source || !isCompressedFirmware(source))
+        return false;
+    
+    mSource = source;
+    mSource->retain();
+    
+    if (!(mInflate = (z_stream*)trackedMalloc(kAllocZlib, sizeof(z_stream))))
+        return false;
+    if (!(mPacked = (UInt8*)trackedMalloc(kAllocDecompress, kStreamPackedSize)))
+        return false;
+    
+    bzero(mInflate, sizeof(z_stream));
+    mInflate->next_in = (unsigned char*)source->getBytesNoCopy();
+    mInflate->avail_in = source->getLength();
+    mInflate->zalloc = z_alloc;
+    mInflate->zfree = z_free;
+    
+    if (inflateInit(mInflate) != Z_OK)
+    {
+        trackedFree(kAllocZlib, mInflate, sizeof(z_stream));
+        mInflate = NULL;
+        return false;
+    }
+    mCursor = mEnd = mPacked;
+    return true;
+}
+
+void BrcmFirmwareStream::free()
+{
+    if (mInflate)
+    {
+        inflateEnd(mInflate);
+        trackedFree(kAllocZlib, mInflate, sizeof(z_stream));
+    }
+    if (mPacked)
+        trackedFree(kAllocDecompress, mPacked, kStreamPackedSize);
+    OSSafeReleaseNULL(mSource);
+    super::free();
+}
+
+/*
+ * Inflate more of the source after the records not read yet. The inflate
+ * state is freed as soon as all of the source is inflated.
+ */
+bool BrcmFirmwareStream::inflatePacked()
+{
+    size_t rest = mEnd - mCursor;
+    
+    memmove(mPacked, mCursor, rest);
+    mInflate->next_out = mPacked + rest;
+    mInflate->avail_out = kStreamPackedSize - (UInt32)rest;
+    
+    int result = inflate(mInflate, Z_SYNC_FLUSH);
+    mCursor = mPacked;
+    mEnd = mInflate->next_out;
+    
+    if (result == Z_STREAM_END)
+    {
+        inflateEnd(mInflate);
+        trackedFree(kAllocZlib, mInflate, sizeof(z_stream));
+        mInflate = NULL;
+    }
+    return result == Z_OK || result == Z_STREAM_END;
+}
+
+/*
+ * Inflate until the next record is complete, or the rest of the source.
+ */
+bool BrcmFirmwareStream::fillRecord()
+{
+    while (mInflate && mEnd - mCursor < kPackedRecordMax)
+    {
+        if (!inflatePacked())
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Read the next record into record as a LAUNCH_RAM command, capacity has to
+ * be at least kLaunchRamRecordMax. At the end of the firmware length is set
+ * to 0. kIOReturnError means that the firmware is not valid from here on.
+ */
+IOReturn BrcmFirmwareStream::readRecord(UInt8* record, UInt16 capacity, UInt16* length)
+{
+    *length = 0;
+    if (capacity < kLaunchRamRecordMax)
+        return kIOReturnNoSpace;
+    if (!fillRecord())
+        return kIOReturnError;
+    if (mCursor == mEnd)
+        return kIOReturnSuccess;
+    
+    UInt32 distance = 0;
+    
+    for (int shift = 0; ; shift += 7)
+    {
+        if (mCursor == mEnd || shift > 28)
+            return kIOReturnError;
+        
+        UInt8 byte = *mCursor++;
+        distance |= (UInt32)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    
+    if (mCursor == mEnd)
+        return kIOReturnError;
+    UInt8 dataLength = *mCursor++;
+    if (dataLength > kLaunchRamRecordMax - 7 || mEnd - mCursor < dataLength)
+        return kIOReturnError;
+    
+    // Vendor Specific: Launch RAM, with 4 bytes for the address
+    mAddress += distance;
+    record[0] = 0x4c;
+    record[1] = 0xfc;
+    record[2] = dataLength + 4;
+    OSWriteLittleInt32(record, 3, mAddress);
+    memcpy(record + 7, mCursor, dataLength);
+    
+    mCursor += dataLength;
+    mAddress += dataLength;
+    *length = 7 + dataLength;
+    mRecords++;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Read a firmware decoded on an earlier boot from the disk cache, with one
+ * read of the whole file. Returns NULL when there is no cache for the key
+ * or it was not decoded from the same source, so it is decoded again.
+ */
+OSArray* BrcmFirmwareStore::readFirmwareCache(OSString* firmwareKey, UInt32 sourceDigest)
+{
+    char path[PATH_MAX];
+    vnode_t vnode = NULLVP;
+    vfs_context_t context;
+    struct vnode_attr attributes;
+    OSArray* instructions = NULL;
+    UInt8* buffer = NULL;
+    vm_size_t size = 0;
+    int residual;
+    
+    snprintf(path, PATH_MAX, "%s/%s.%s", mCacheDirectory->getCStringNoCopy(), firmwareKey->getCStringNoCopy(), kBrcmFirmwareCache);
+    
+    if (!(context = vfs_context_create(NULL)))
+        return NULL;
+    
+    if (vnode_open(path, FREAD, 0, 0, &vnode, context))
+    {
+        vfs_context_rele(context);
+        return NULL;
+    }
+    
+    VATTR_INIT(&attributes);
+    VATTR_WANTED(&attributes, va_data_size);
+    
+    if (!vnode_getattr(vnode, &attributes, context) &&
+        attributes.va_data_size >= sizeof(FirmwareCacheHeader) && attributes.va_data_size <= kFirmwareCacheMaxBytes &&
+        (buffer = (UInt8*)trackedMalloc(kAllocDecompress, (size = (vm_size_t)attributes.va_data_size))))
+    {
+        if (!vn_rdwr(UIO_READ, vnode, (caddr_t)buffer, (int)size, 0, UIO_SYSSPACE, 0, vfs_context_ucred(context), &residual, vfs_context_proc(context)) &&
+            !residual && firmwareCacheCurrent(buffer, (UInt32)size, sourceDigest))
         {
-            // Data
-            case REC_TYPE_DATA:
-            {
-                address = (address & 0xFFFF0000) | addr;
-                
-                // Reserved 4 bytes for the address
-                length += 4;
-                
-                // Allocate instruction (Opcode - 2 bytes, length - 1 byte)
-                OSData* instruction = OSData::withCapacity(3 + length);
-                if (!instruction)
-                    goto exit_error;
-                
-                instruction->appendBytes(HCI_VSC_LAUNCH_RAM, sizeof(HCI_VSC_LAUNCH_RAM));
-                instruction->appendBytes(&length, sizeof(length));
-                instruction->appendBytes(&address, sizeof(address));
-                instruction->appendBytes(&binary[4], length - 4);
-                
-                instructions->setObject(instruction);
-                instruction->release();
-                break;
-            }
-            // End of File
-            case REC_TYPE_EOF:
-                return instructions;
-            // Extended Segment Address
-            case REC_TYPE_ESA:
-                // Segment address multiplied by 16
-                address = binary[4] << 8 | binary[5];
-                address <<= 4;
-                break;
-                // Start Segment Address
-            case REC_TYPE_SSA:
-                // Set CS:IP register for 80x86
-                DebugLog("parseFirmware - Invalid firmware, unsupported start segment address instruction.\n");
-                goto exit_error;
-                // Extended Linear Address
-            case REC_TYPE_ELA:
-                // Set new higher 16 bits of the current address
-                address = binary[4] << 24 | binary[5] << 16;
-                break;
-                // Start Linear Address
-            case REC_TYPE_SLA:
-                // Set EIP of 80386 and higher
-                DebugLog("parseFirmware - Invalid firmware, unsupported start linear address instruction.\n");
-                goto exit_error;
-            default:
-                DebugLog("parseFirmware - Invalid firmware, unknown record type encountered: 0x%02x.\n", record_type);
-                goto exit_error;
+            if ((instructions = readFirmwareCacheRecords(buffer, (UInt32)size)))
+                trackAllocation(kAllocInstructions, ((FirmwareCacheHeader*)buffer)->bytes);
+            else
+                AlwaysLog("Disk cache \"%s\" is damaged, ignoring it.\n", path);
         }
+    }
+    
+    if (buffer)
+        trackedFree(kAllocDecompress, buffer, size);
+    vnode_close(vnode, FREAD, context);
+    vfs_context_rele(context);
+    
+    return instructions;
+}
+
+/*
+ * Write decoded instructions to the disk cache with one write. Returns
+ * false when the write failed but may succeed later, for instance before
+ * the cache directory is mounted, see flushFirmwareCache.
+ */
+bool BrcmFirmwareStore::writeFirmwareCache(OSString* firmwareKey, UInt32 sourceDigest, UInt32 sourceBytes, OSArray* instructions)
+{
+    char path[PATH_MAX];
+    vnode_t vnode = NULLVP;
+    vfs_context_t context;
+    bool written = false;
+    int error;
+    
+    // Only records that read back as valid are worth writing
+    vm_size_t size = firmwareCacheSize(instructions);
+    if (!size)
+        return true;
+    
+    UInt8* buffer = (UInt8*)trackedMalloc(kAllocDecompress, size);
+    if (!buffer)
+        return false;
+    
+    buildFirmwareCache(buffer, sourceDigest, sourceBytes, instructions);
+    
+    snprintf(path, PATH_MAX, "%s/%s.%s", mCacheDirectory->getCStringNoCopy(), firmwareKey->getCStringNoCopy(), kBrcmFirmwareCache);
+    
+    if ((context = vfs_context_create(NULL)))
+    {
+        if (!(error = vnode_open(path, O_CREAT | O_TRUNC | FWRITE | O_NOFOLLOW, 0644, 0, &vnode, context)))
+        {
+            error = vn_rdwr(UIO_WRITE, vnode, (caddr_t)buffer, (int)size, 0, UIO_SYSSPACE, IO_UNIT, vfs_context_ucred(context), NULL, vfs_context_proc(context));
+            vnode_close(vnode, FWRITE, context);
+        }
+        vfs_context_rele(context);
         
-        // Skip over any trailing newlines / whitespace
-        while (!validHexChar(*data) && !(*data == HEX_LINE_PREFIX))
-            data++;
+        written = !error;
+        if (error)
+            CategoryLog(kLogStore, kLogInfo, "Unable to write disk cache \"%s\" (%d).\n", path, error);
+        else
+            CategoryLog(kLogStore, kLogDebug, "Wrote %u records to disk cache \"%s\".\n", instructions->getCount(), path);
     }
     
-    DebugLog("parseFirmware - Invalid firmware.\n");
+    trackedFree(kAllocDecompress, buffer, size);
+    return written;
+}
+
+/*
+ * Take the disk cache write that firmwareKey still needs, if any, so that
+ * only one thread writes it. Called with mDataLock held, the write itself
+ * is left to flushFirmwareCache once the lock is dropped.
+ */
+bool BrcmFirmwareStore::takeUnwrittenCache(OSString* firmwareKey, UnwrittenCache* cache)
+{
+    OSData* unwritten = OSDynamicCast(OSData, mUnwrittenCaches->getObject(firmwareKey));
+    if (!unwritten)
+        return false;
     
-exit_error:
-    OSSafeReleaseNULL(instructions);
-    return NULL;
+    *cache = *(const UnwrittenCache*)unwritten->getBytesNoCopy();
+    mUnwrittenCaches->removeObject(firmwareKey);
+    return true;
+}
+
+/*
+ * Write the disk cache taken by takeUnwrittenCache, without mDataLock so
+ * that other firmwares can be served during the vnode I/O. A firmware is
+ * decoded once per boot, usually from probe before CacheDirectory is
+ * writable, so a failed write is put back and tried on the next hit.
+ */
+void BrcmFirmwareStore::flushFirmwareCache(OSString* firmwareKey, OSArray* instructions, const UnwrittenCache& cache)
+{
+    if (writeFirmwareCache(firmwareKey, cache.sourceDigest, cache.sourceBytes, instructions))
+        return;
+    
+    if (OSData* unwritten = OSData::withBytes(&cache, sizeof(cache)))
+    {
+        IOLockLock(mDataLock);
+        mUnwrittenCaches->setObject(firmwareKey, unwritten);
+        IOLockUnlock(mDataLock);
+        unwritten->release();
+    }
 }
 
 OSDefineMetaClassAndStructors(BrcmFirmwareStore, IOService)
 
+// Shared with the drivers linked against the store, see Common.h
+unsigned gLogCategories = kLogAll;
+unsigned gLogLevel = kLogDefaultLevel;
+
+IOLock* BrcmFirmwareStore::mInstanceLock = NULL;
+BrcmFirmwareStore* BrcmFirmwareStore::mInstance = NULL;
+
+extern "C"
+{
+
+__attribute__((visibility("hidden")))
+kern_return_t BrcmFirmwareStore_Start(kmod_info_t* ki, void * d)
+{
+    if (!(BrcmFirmwareStore::mInstanceLock = IOLockAlloc()))
+        return KERN_FAILURE;
+
+    return KERN_SUCCESS;
+}
+
+__attribute__((visibility("hidden")))
+kern_return_t BrcmFirmwareStore_Stop(kmod_info_t* ki, void * d)
+{
+    if (BrcmFirmwareStore::mInstanceLock)
+    {
+        IOLockFree(BrcmFirmwareStore::mInstanceLock);
+        BrcmFirmwareStore::mInstanceLock = NULL;
+    }
+
+    return KERN_SUCCESS;
+}
+
+} // extern "C"
+
+/*
+ * Return the started firmware store retained, or NULL if it has not
+ * started yet. This avoids a registry lookup for clients linked against
+ * the store.
+ */
+BrcmFirmwareStore* BrcmFirmwareStore::copyInstance()
+{
+    BrcmFirmwareStore* instance;
+
+    IOLockLock(mInstanceLock);
+    if ((instance = mInstance))
+        instance->retain();
+    IOLockUnlock(mInstanceLock);
+
+    return instance;
+}
+
 bool BrcmFirmwareStore::start(IOService *provider)
 {
     DebugLog("Firmware store start\n");
@@ -312,9 +923,51 @@ bool BrcmFirmwareStore::start(IOService *provider)
     setProperty("RM,Build", "Release-" LOGNAME);
 #endif
 
+    UInt32 value;
+    if (OSNumber* logCategories = OSDynamicCast(OSNumber, getProperty("LogCategories")))
+        gLogCategories = logCategories->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_log", &value, sizeof value))
+        gLogCategories = value;
+
+    if (OSNumber* logLevel = OSDynamicCast(OSNumber, getProperty("LogLevel")))
+        gLogLevel = logLevel->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_loglevel", &value, sizeof value))
+        gLogLevel = value;
+
     mFirmwares = OSDictionary::withCapacity(1);
     if (!mFirmwares)
         return false;
+
+    mDecoding = OSDictionary::withCapacity(1);
+    if (!mDecoding)
+        return false;
+
+    if ((mCacheDirectory = OSDynamicCast(OSString, getProperty("CacheDirectory"))))
+    {
+        mCacheDirectory->retain();
+        AlwaysLog("Caching decoded firmware in \"%s\".\n", mCacheDirectory->getCStringNoCopy());
+    }
+
+    mUnwrittenCaches = OSDictionary::withCapacity(1);
+    if (!mUnwrittenCaches)
+        return false;
+
+    mPackedFirmwares = OSDictionary::withCapacity(1);
+    if (!mPackedFirmwares)
+        return false;
+
+    if (OSBoolean* compactCache = OSDynamicCast(OSBoolean, getProperty("CompactCache")))
+        mCompactCache = compactCache->isTrue();
+    if (PE_parse_boot_argn("bpr_compactcache", &value, sizeof value))
+        mCompactCache = value != 0;
+
+    buildIndexes();
+
+    if ((mFirmwareDirectory = OSDynamicCast(OSString, getProperty("FirmwareDirectory"))))
+    {
+        mFirmwareDirectory->retain();
+        AlwaysLog("Loading firmware from \"%s\" first.\n", mFirmwareDirectory->getCStringNoCopy());
+    }
     
     mCompletionLock = IOLockAlloc();
     if (!mCompletionLock)
@@ -324,6 +977,10 @@ bool BrcmFirmwareStore::start(IOService *provider)
     if (!mDataLock)
         return false;
 
+    IOLockLock(mInstanceLock);
+    mInstance = this;
+    IOLockUnlock(mInstanceLock);
+
     registerService();
 
     return true;
@@ -333,7 +990,32 @@ void BrcmFirmwareStore::stop(IOService *provider)
 {
     DebugLog("Firmware store stop\n");
     
+    IOLockLock(mInstanceLock);
+    if (mInstance == this)
+        mInstance = NULL;
+    IOLockUnlock(mInstanceLock);
+
+    // Decode threads still use the locks and dictionaries below
+    if (mDataLock && mDecoding)
+    {
+        IOLockLock(mDataLock);
+        while (mDecoding->getCount())
+            IOLockSleep(mDataLock, mDecoding, 0);
+        IOLockUnlock(mDataLock);
+    }
+
     OSSafeReleaseNULL(mFirmwares);
+    OSSafeReleaseNULL(mDecoding);
+    OSSafeReleaseNULL(mCacheDirectory);
+    OSSafeReleaseNULL(mUnwrittenCaches);
+    OSSafeReleaseNULL(mFirmwareDirectory);
+    OSSafeReleaseNULL(mPackedFirmwares);
+    mConfiguredIndex.free();
+#ifdef FIRMWAREDATA
+    mEmbeddedIndex.free();
+#endif
+    OSSafeReleaseNULL(mConfiguredFirmwares);
+    trackAllocation(kAllocInstructions, -allocationStats[kAllocInstructions].current);
     
     if (mCompletionLock)
     {
@@ -371,7 +1053,57 @@ void BrcmFirmwareStore::requestResourceCallback(OSKextRequestTag requestTag, OSR
     IOLockWakeup(context->me->mCompletionLock, context->me, true);
 }
 
-OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* suffix)
+/*
+ * Read a file from FirmwareDirectory directly, in a single read of the
+ * whole file. The file itself is not kept, the store caches the firmware
+ * once decoded.
+ * Called with mCompletionLock held.
+ */
+OSData* BrcmFirmwareStore::loadDirectoryFile(const char* path)
+{
+    char fullPath[PATH_MAX];
+    vnode_t vnode = NULLVP;
+    vfs_context_t context;
+    struct vnode_attr attributes;
+    OSData* result = NULL;
+    int residual;
+    
+    snprintf(fullPath, PATH_MAX, "%s/%s", mFirmwareDirectory->getCStringNoCopy(), path);
+    
+    if (!(context = vfs_context_create(NULL)))
+        return NULL;
+    
+    if (vnode_open(fullPath, FREAD, 0, 0, &vnode, context))
+    {
+        vfs_context_rele(context);
+        return NULL;
+    }
+    
+    VATTR_INIT(&attributes);
+    VATTR_WANTED(&attributes, va_data_size);
+    
+    if (!vnode_getattr(vnode, &attributes, context) && attributes.va_data_size && attributes.va_data_size <= kFirmwareCacheMaxBytes)
+    {
+        // Reading the whole file lets the file system read ahead all of it
+        vm_size_t size = (vm_size_t)attributes.va_data_size;
+        void* buffer = trackedMalloc(kAllocDecompress, size);
+        
+        if (buffer && !vn_rdwr(UIO_READ, vnode, (caddr_t)buffer, (int)size, 0, UIO_SYSSPACE, 0, vfs_context_ucred(context), &residual, vfs_context_proc(context)) && !residual)
+            result = OSData::withBytes(buffer, (unsigned int)size);
+        if (buffer)
+            trackedFree(kAllocDecompress, buffer, size);
+    }
+    
+    vnode_close(vnode, FREAD, context);
+    vfs_context_rele(context);
+    
+    if (result)
+        AlwaysLog("Loaded firmware \"%s\" from firmware directory.\n", fullPath);
+    
+    return result;
+}
+
+OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* suffix, bool direct)
 {
     IOLockLock(mCompletionLock);
 
@@ -380,6 +1112,13 @@ OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* su
     char path[PATH_MAX];
     snprintf(path, PATH_MAX, "%s.%s", filename, suffix);
     
+    if (direct)
+    {
+        OSData* result = loadDirectoryFile(path);
+        IOLockUnlock(mCompletionLock);
+        return result;
+    }
+    
 #ifdef DEBUG
     OSReturn ret = OSKextRequestResource(OSKextGetCurrentIdentifier(),
                           path,
@@ -409,31 +1148,44 @@ OSData* BrcmFirmwareStore::loadFirmwareFile(const char* filename, const char* su
     return NULL;
 }
 
-OSData* BrcmFirmwareStore::loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+OSData* BrcmFirmwareStore::loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool* direct)
 {
     char filename[PATH_MAX];
     snprintf(filename, PATH_MAX, "%04x_%04x", vendorId, productId);
 
-    OSData* result = loadFirmwareFile(filename, kBrcmFirmwareCompressed);
+    OSData* result = NULL;
 
-    if (!result)
-        result = loadFirmwareFile(filename, kBrmcmFirwareUncompressed);
+    // Try FirmwareDirectory first, it doesn't need a round trip to kextd
+    *direct = mFirmwareDirectory != NULL;
+    while (true)
+    {
+        result = loadFirmwareFile(filename, kBrcmFirmwareCompressed, *direct);
 
-    if (!result)
-        result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrcmFirmwareCompressed);
-    
-    if (!result)
-        result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrmcmFirwareUncompressed);
+        if (!result)
+            result = loadFirmwareFile(filename, kBrmcmFirwareUncompressed, *direct);
+
+        if (!result)
+            result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrcmFirmwareCompressed, *direct);
+        
+        if (!result)
+            result = loadFirmwareFile(firmwareKey->getCStringNoCopy(), kBrmcmFirwareUncompressed, *direct);
+
+        if (result || !*direct)
+            break;
+        *direct = false;
+    }
 
     return result;
 }
 
-OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+/*
+ * The source of a firmware as configured, compressed or not, from disk,
+ * embedded or the Firmwares property. The caller must release it.
+ */
+OSData* BrcmFirmwareStore::loadFirmwareSource(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool* direct)
 {
-    DebugLog("loadFirmware\n");
-    
     // First try to load firmware from disk
-    OSData* configuredData = loadFirmwareFiles(vendorId, productId, firmwareKey);
+    OSData* configuredData = loadFirmwareFiles(vendorId, productId, firmwareKey, direct);
 
 #ifdef FIRMWAREDATA
     char filename[PATH_MAX];
@@ -441,14 +1193,14 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
     if (!configuredData)
     {
         snprintf(filename, PATH_MAX, "%s.%s", firmwareKey->getCStringNoCopy(), kBrcmFirmwareCompressed);
-        configuredData = lookupFirmware(filename);
+        configuredData = lookupEmbeddedFirmware(filename);
         if (configuredData)
             AlwaysLog("Loaded compressed embedded firmware for key \"%s\".\n", firmwareKey->getCStringNoCopy());
     }
     if (!configuredData)
     {
         snprintf(filename, PATH_MAX, "%s.%s", firmwareKey->getCStringNoCopy(), kBrmcmFirwareUncompressed);
-        configuredData = lookupFirmware(filename);
+        configuredData = lookupEmbeddedFirmware(filename);
         if (configuredData)
             AlwaysLog("Loaded compressed embedded firmware for key \"%s\".\n", firmwareKey->getCStringNoCopy());
     }
@@ -457,15 +1209,16 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
     // Next try to load firmware from configuration
     if (!configuredData)
     {
-        OSDictionary* firmwares = OSDynamicCast(OSDictionary, this->getProperty("Firmwares"));
-    
-        if (!firmwares)
+        if (!mConfiguredFirmwares)
         {
             AlwaysLog("Unable to locate BrcmFirmwareStore configured firmwares.\n");
             return NULL;
         }
     
-        configuredData = OSDynamicCast(OSData, firmwares->getObject(firmwareKey));
+        if (mConfiguredIndex.getCount())
+            configuredData = (OSData*)mConfiguredIndex.lookup(firmwareKey->getCStringNoCopy());
+        else
+            configuredData = OSDynamicCast(OSData, mConfiguredFirmwares->getObject(firmwareKey));
         
         if (configuredData)
         {
@@ -475,9 +1228,46 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
     }
         
     if (!configuredData)
-    {
         AlwaysLog("No firmware available for firmware key \"%s\".\n", firmwareKey->getCStringNoCopy());
+    
+    return configuredData;
+}
+
+OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey, OSArray* stream)
+{
+    DebugLog("loadFirmware\n");
+    
+    bool direct;
+    OSData* configuredData = loadFirmwareSource(vendorId, productId, firmwareKey, &direct);
+    
+    if (!configuredData)
         return NULL;
+    
+    UInt32 sourceBytes = configuredData->getLength();
+    
+    // A disk cache decoded from the same source skips decompression and parsing
+    UInt32 sourceDigest = 0;
+    if (mCacheDirectory)
+    {
+        sourceDigest = firmwareCacheDigest((const UInt8*)configuredData->getBytesNoCopy(), configuredData->getLength());
+        
+        if (OSArray* cached = readFirmwareCache(firmwareKey, sourceDigest))
+        {
+            configuredData->release();
+            CategoryLog(kLogStore, kLogInfo, "Read %u records of \"%s\" from the disk cache.\n",
+                        cached->getCount(), firmwareKey->getCStringNoCopy());
+            
+            if (!stream)
+                return cached;
+            
+            IOLockLock(mDataLock);
+            stream->merge(cached);
+            IOLockUnlock(mDataLock);
+            IOLockWakeup(mDataLock, stream, false);
+            cached->release();
+            stream->retain();
+            return stream;
+        }
     }
     
     OSData* firmwareData = decompressFirmware(configuredData);
@@ -496,7 +1286,7 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
 
     configuredData->release();
     
-    OSArray* instructions = parseFirmware(firmwareData);
+    OSArray* instructions = parseFirmware(firmwareData, stream);
     firmwareData->release();
     
     if (!instructions)
@@ -506,6 +1296,23 @@ OSArray* BrcmFirmwareStore::loadFirmware(UInt16 vendorId, UInt16 productId, OSSt
     }
     
     AlwaysLog("Firmware is valid IntelHex firmware.\n");
+    CategoryLog(kLogDecode, kLogInfo, "Decoded %u records%s.\n", instructions->getCount(), direct ? " from directory" : "");
+    
+    // The caller writes the disk cache once it dropped mDataLock, taken here as parseFirmware
+    if (mCacheDirectory)
+    {
+        UnwrittenCache cache = { .sourceDigest = sourceDigest, .sourceBytes = sourceBytes };
+        
+        if (OSData* unwritten = OSData::withBytes(&cache, sizeof(cache)))
+        {
+            if (stream)
+                IOLockLock(mDataLock);
+            mUnwrittenCaches->setObject(firmwareKey, unwritten);
+            if (stream)
+                IOLockUnlock(mDataLock);
+            unwritten->release();
+        }
+    }
     
     return instructions;
 }
@@ -521,27 +1328,367 @@ OSArray* BrcmFirmwareStore::getFirmware(UInt16 vendorId, UInt16 productId, OSStr
     }
     
     IOLockLock(mDataLock);
+    
+    // Let a decode started by beginFirmware finish first, decodeThread wakes mDecoding
+    while (mDecoding->getObject(firmwareKey))
+        IOLockSleep(mDataLock, mDecoding, 0);
+    
     OSArray* instructions = OSDynamicCast(OSArray, mFirmwares->getObject(firmwareKey));
+    UnwrittenCache cache;
+    bool unwritten;
     
     // Cached instructions found for firmwareKey?
     if (!instructions)
     {
         // Load instructions for firmwareKey
-        instructions = loadFirmware(vendorId, productId, firmwareKey);
+        instructions = loadFirmware(vendorId, productId, firmwareKey, NULL);
         
         // Add instructions to the firmwares cache
+        finishDecode(firmwareKey, instructions);
         if (instructions)
-        {
-            mFirmwares->setObject(firmwareKey, instructions);
             instructions->release();
-        }
     }
     else
-        DebugLog("Retrieved cached firmware for \"%s\".\n", firmwareKey->getCStringNoCopy());
+        CategoryLog(kLogStore, kLogDebug, "Retrieved cached firmware for \"%s\".\n", firmwareKey->getCStringNoCopy());
+    
+    // Kept alive by mFirmwares, but that may change once unlocked
+    unwritten = instructions && takeUnwrittenCache(firmwareKey, &cache);
+    if (unwritten)
+        instructions->retain();
+
+    IOLockUnlock(mDataLock);
+    
+    if (unwritten)
+    {
+        flushFirmwareCache(firmwareKey, instructions, cache);
+        instructions->release();
+    }
+    
+    return instructions;
+}
+
+/*
+ * Add decoded instructions to the firmwares cache. Called with mDataLock held.
+ */
+void BrcmFirmwareStore::finishDecode(OSString* firmwareKey, OSArray* instructions)
+{
+    if (instructions)
+        mFirmwares->setObject(firmwareKey, instructions);
+    publishMemoryStats();
+}
+
+/*
+ * With CompactCache, return a stream over the firmware for the driver to
+ * read record by record during the upload, or NULL otherwise. Only the
+ * firmware packed by packFirmware stays cached, which is smaller than both
+ * its source and the instructions, and it is checked once as it is packed.
+ * The caller must release the result.
+ */
+BrcmFirmwareStream* BrcmFirmwareStore::openFirmwareStream(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+{
+    BrcmFirmwareStream* stream = NULL;
+    
+    if (!mCompactCache || !firmwareKey || firmwareKey->getLength() == 0)
+        return NULL;
+    
+    IOLockLock(mDataLock);
+    OSData* packed = OSDynamicCast(OSData, mPackedFirmwares->getObject(firmwareKey));
+    
+    if (packed)
+        packed->retain();
+    else
+    {
+        bool direct;
+        
+        if (OSData* source = loadFirmwareSource(vendorId, productId, firmwareKey, &direct))
+        {
+            UInt32 records;
+            
+            if ((packed = packFirmware(source, &records)))
+            {
+                mPackedFirmwares->setObject(firmwareKey, packed);
+                trackAllocation(kAllocInstructions, packed->getLength());
+                CategoryLog(kLogStore, kLogInfo, "Packed the %u byte source of \"%s\" to %u bytes for its %u records.\n",
+                            source->getLength(), firmwareKey->getCStringNoCopy(), packed->getLength(), records);
+            }
+            else
+                AlwaysLog("Firmware is not valid IntelHex firmware.\n");
+            source->release();
+        }
+        publishMemoryStats();
+    }
+    IOLockUnlock(mDataLock);
+    
+    if (packed)
+    {
+        stream = BrcmFirmwareStream::withSource(packed);
+        packed->release();
+    }
+    return stream;
+}
+
+/*
+ * Whether this store keeps firmwares packed only. A driver then has
+ * to use openFirmwareStream rather than getFirmware or beginFirmware, which
+ * would decode and keep the instructions as well.
+ */
+bool BrcmFirmwareStore::isCompactCache()
+{
+    return mCompactCache;
+}
 
+/*
+ * Like getFirmware, but a firmware that is not cached yet is decoded on a
+ * separate thread. The returned array, which the caller must release, is
+ * filled while the upload is already running and is read through
+ * waitForInstruction. This hides the decode behind the USB round trips of
+ * the first upload after boot.
+ */
+OSArray* BrcmFirmwareStore::beginFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+{
+    DebugLog("beginFirmware\n");
+    
+    if (!firmwareKey || firmwareKey->getLength() == 0)
+    {
+        AlwaysLog("Current device has no FirmwareKey configured.\n");
+        return NULL;
+    }
+    
+    IOLockLock(mDataLock);
+    UnwrittenCache cache;
+    bool unwritten = false;
+    OSArray* instructions = OSDynamicCast(OSArray, mDecoding->getObject(firmwareKey));
+    if (!instructions && (instructions = OSDynamicCast(OSArray, mFirmwares->getObject(firmwareKey))))
+        unwritten = takeUnwrittenCache(firmwareKey, &cache);
+    
+    if (instructions)
+    {
+        instructions->retain();
+        IOLockUnlock(mDataLock);
+        if (unwritten)
+            flushFirmwareCache(firmwareKey, instructions, cache);
+        return instructions;
+    }
+    
+    DecodeContext* context = (DecodeContext*)IOMalloc(sizeof(DecodeContext));
+    instructions = OSArray::withCapacity(1);
+    
+    if (context && instructions)
+    {
+        thread_t thread;
+        
+        context->me = this;
+        context->vendorId = vendorId;
+        context->productId = productId;
+        context->firmwareKey = firmwareKey;
+        context->instructions = instructions;
+        mDecoding->setObject(firmwareKey, instructions);
+        retain();
+        firmwareKey->retain();
+        instructions->retain();
+        
+        if (kernel_thread_start(&BrcmFirmwareStore::decodeThread, context, &thread) == KERN_SUCCESS)
+        {
+            thread_deallocate(thread);
+            IOLockUnlock(mDataLock);
+            return instructions;
+        }
+        
+        mDecoding->removeObject(firmwareKey);
+        instructions->release();
+        firmwareKey->release();
+        release();
+    }
+    
+    // Decode in place when no thread can be started
+    if (context)
+        IOFree(context, sizeof(DecodeContext));
+    OSSafeReleaseNULL(instructions);
     IOLockUnlock(mDataLock);
     
+    if ((instructions = getFirmware(vendorId, productId, firmwareKey)))
+        instructions->retain();
+    
     return instructions;
 }
 
+void BrcmFirmwareStore::decodeThread(void* arg, wait_result_t wait)
+{
+    DecodeContext* context = (DecodeContext*)arg;
+    BrcmFirmwareStore* me = context->me;
+    
+    OSArray* instructions = me->loadFirmware(context->vendorId, context->productId, context->firmwareKey, context->instructions);
+    
+    UnwrittenCache cache;
+    bool unwritten;
+    
+    IOLockLock(me->mDataLock);
+    me->finishDecode(context->firmwareKey, instructions);
+    me->mDecoding->removeObject(context->firmwareKey);
+    unwritten = instructions && me->takeUnwrittenCache(context->firmwareKey, &cache);
+    IOLockUnlock(me->mDataLock);
+    
+    // Wake readers of the instructions, getFirmware and stop
+    IOLockWakeup(me->mDataLock, context->instructions, false);
+    IOLockWakeup(me->mDataLock, me->mDecoding, false);
+    
+    if (unwritten)
+        me->flushFirmwareCache(context->firmwareKey, instructions, cache);
+    
+    OSSafeReleaseNULL(instructions);
+    context->instructions->release();
+    context->firmwareKey->release();
+    IOFree(context, sizeof(DecodeContext));
+    me->release();
+    
+    thread_terminate(current_thread());
+}
 
+/*
+ * Return instruction index of an array from beginFirmware, waiting for it
+ * to be decoded if needed. At the end of the firmware instruction is set
+ * to NULL. kIOReturnError means that the firmware failed to decode, after
+ * some of its instructions may have been returned already.
+ */
+IOReturn BrcmFirmwareStore::waitForInstruction(OSString* firmwareKey, OSArray* instructions, UInt32 index, OSData** instruction)
+{
+    IOReturn result = kIOReturnSuccess;
+    
+    IOLockLock(mDataLock);
+    while (index >= instructions->getCount() && mDecoding->getObject(firmwareKey) == instructions)
+    {
+        mStreamWaiters++;
+        IOLockSleep(mDataLock, instructions, 0);
+        mStreamWaiters--;
+    }
+    
+    *instruction = OSDynamicCast(OSData, instructions->getObject(index));
+    
+    // Past the end, only complete instructions make it into the cache
+    if (!*instruction && mFirmwares->getObject(firmwareKey) != instructions)
+        result = kIOReturnError;
+    IOLockUnlock(mDataLock);
+    
+    return result;
+}
+
+static void setNumberInDict(OSDictionary* dict, const char* key, UInt64 value)
+{
+    if (OSNumber* num = OSNumber::withNumber(value, 64))
+    {
+        dict->setObject(key, num);
+        num->release();
+    }
+}
+
+static void setIndexInDict(OSDictionary* dict, const char* key, const FirmwareIndex* index)
+{
+    if (OSDictionary* entry = OSDictionary::withCapacity(3))
+    {
+        setNumberInDict(entry, "Keys", index->getCount());
+        setNumberInDict(entry, "Slots", index->getCapacity());
+        setNumberInDict(entry, "MaxProbes", index->getMaxProbes());
+        dict->setObject(key, entry);
+        entry->release();
+    }
+}
+
+/*
+ * Index the Firmwares property and, in BrcmFirmwareData, the embedded
+ * firmwares once, and keep the Firmwares property rather than looking it
+ * up on every load. Without an index, loads fall back to a linear search.
+ * The result is published as RM,FirmwareIndex.
+ */
+void BrcmFirmwareStore::buildIndexes()
+{
+    uint64_t start_time, end_time, nano_secs;
+    
+    clock_get_uptime(&start_time);
+    
+    if ((mConfiguredFirmwares = OSDynamicCast(OSDictionary, getProperty("Firmwares"))))
+    {
+        mConfiguredFirmwares->retain();
+        
+        if (OSCollectionIterator* iterator = OSCollectionIterator::withCollection(mConfiguredFirmwares))
+        {
+            if (mConfiguredIndex.init(mConfiguredFirmwares->getCount()))
+            {
+                while (OSSymbol* key = OSDynamicCast(OSSymbol, iterator->getNextObject()))
+                {
+                    if (OSData* data = OSDynamicCast(OSData, mConfiguredFirmwares->getObject(key)))
+                        mConfiguredIndex.insert(key->getCStringNoCopy(), data);
+                }
+            }
+            iterator->release();
+        }
+    }
+    
+#ifdef FIRMWAREDATA
+    UInt32 count = 0;
+    const FirmwareEntry* entries = getFirmwareEntries();
+    
+    while (entries[count].filename)
+        count++;
+    
+    if (mEmbeddedIndex.init(count))
+    {
+        for (UInt32 i = 0; i < count; i++)
+            mEmbeddedIndex.insert(entries[i].filename, &entries[i]);
+    }
+#endif
+    
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - start_time, &nano_secs);
+    
+    if (OSDictionary* published = OSDictionary::withCapacity(3))
+    {
+        setIndexInDict(published, "Configured", &mConfiguredIndex);
+#ifdef FIRMWAREDATA
+        setIndexInDict(published, "Embedded", &mEmbeddedIndex);
+#endif
+        setNumberInDict(published, "BuildTime", nano_secs);
+        setProperty("RM,FirmwareIndex", published);
+        published->release();
+    }
+    CategoryLog(kLogStore, kLogInfo, "Indexed firmware keys in %llu us.\n", (unsigned long long)(nano_secs / 1000));
+}
+
+#ifdef FIRMWAREDATA
+OSData* BrcmFirmwareStore::lookupEmbeddedFirmware(const char* filename)
+{
+    if (!mEmbeddedIndex.getCount())
+        return lookupFirmware(filename);
+    
+    const FirmwareEntry* entry = (const FirmwareEntry*)mEmbeddedIndex.lookup(filename);
+    return entry ? OSData::withBytes(entry->firmwareData, (unsigned int)entry->firmwareSize) : NULL;
+}
+#endif
+
+/*
+ * Publish the bytes currently held, the high-water mark and the number
+ * of allocations of each allocation site as RM,MemoryStats.
+ */
+void BrcmFirmwareStore::publishMemoryStats()
+{
+    static const char* const names[] = { "Zlib", "Decompress", "Instructions", "Index" };
+
+    OSDictionary* published = OSDictionary::withCapacity(kAllocSiteCount);
+    if (!published)
+        return;
+
+    for (int i = 0; i < kAllocSiteCount; i++)
+    {
+        OSDictionary* entry = OSDictionary::withCapacity(3);
+        if (!entry)
+            continue;
+
+        setNumberInDict(entry, "Bytes", allocationStats[i].current);
+        setNumberInDict(entry, "Peak", allocationStats[i].peak);
+        setNumberInDict(entry, "Allocations", allocationStats[i].allocations);
+        published->setObject(names[i], entry);
+        entry->release();
+    }
+
+    setProperty("RM,MemoryStats", published);
+    published->release();
+}
@@ -26,9 +26,110 @@
 
 #define kBrcmFirmwareCompressed     "zhx"
 #define kBrmcmFirwareUncompressed   "hex"
+#define kBrcmFirmwareCache          "bpc"
 
 #define kBrcmFirmwareStoreService "BrcmFirmwareStore"
 
+/*
+ * Memory held by the store, counted per allocation site and published
+ * as RM,MemoryStats with the high-water mark of each.
+ */
+enum AllocationSite
+{
+    kAllocZlib,             // inflate state and window
+    kAllocDecompress,       // decompression output buffer
+    kAllocInstructions,     // parsed LAUNCH_RAM records, cached
+    kAllocIndex,            // firmware key indexes
+    kAllocSiteCount,
+};
+
+typedef struct AllocationStats
+{
+    volatile SInt64 current;
+    SInt64 peak;
+    volatile SInt32 allocations;
+} AllocationStats;
+
+/*
+ * Largest LAUNCH_RAM command of a firmware record, the opcode and parameter
+ * length followed by at most 255 bytes of address and data.
+ */
+#define kLaunchRamRecordMax (3 + 255)
+
+extern "C"
+{
+kern_return_t BrcmFirmwareStore_Start(kmod_info_t*, void*);
+kern_return_t BrcmFirmwareStore_Stop(kmod_info_t*, void*);
+}
+
+/*
+ * Open addressed hash index from a firmware key (or file name) to its
+ * entry, built once at start so that a lookup doesn't compare the key with
+ * every firmware in the catalogue. The keys must outlive the index.
+ */
+class FirmwareIndex
+{
+public:
+    bool init(UInt32 capacity);
+    void free();
+    bool insert(const char* key, const void* value);
+    const void* lookup(const char* key) const;
+    
+    UInt32 getCount() const { return mCount; }
+    UInt32 getCapacity() const { return mMask ? mMask + 1 : 0; }
+    UInt32 getMaxProbes() const { return mMaxProbes; }
+    
+private:
+    struct Slot
+    {
+        UInt32 hash;
+        const char* key;
+        const void* value;
+    };
+    
+    static UInt32 hashKey(const char* key);
+    
+    Slot* mSlots = NULL;
+    UInt32 mMask = 0;
+    UInt32 mCount = 0;
+    UInt32 mMaxProbes = 0;
+};
+
+struct z_stream_s;
+
+/*
+ * A firmware of CompactCache, read record by record during the upload. The
+ * store only keeps such a firmware packed by packFirmware, each record is
+ * inflated as it is read, straight into a buffer of the caller.
+ */
+class BrcmFirmwareStream : public OSObject
+{
+private:
+    typedef OSObject super;
+    OSDeclareDefaultStructors(BrcmFirmwareStream);
+    
+    OSData* mSource = NULL;
+    struct z_stream_s* mInflate = NULL;     // NULL once all of the source is inflated
+    UInt8* mPacked = NULL;                  // inflated and not read yet
+    const UInt8* mCursor = NULL;
+    const UInt8* mEnd = NULL;
+    UInt32 mAddress = 0;                    // just past the record read last
+    UInt32 mRecords = 0;
+    
+    bool initWithSource(OSData* source);
+    bool inflatePacked();
+    bool fillRecord();
+    
+protected:
+    virtual void free();
+    
+public:
+    static BrcmFirmwareStream* withSource(OSData* source);
+    
+    virtual IOReturn readRecord(UInt8* record, UInt16 capacity, UInt16* length);
+    UInt32 getRecordCount() const { return mRecords; }
+};
+
 class BrcmFirmwareStore : public IOService
 {
 private:
@@ -41,22 +142,80 @@ private:
         OSData* firmware;
     };
 
+    struct DecodeContext
+    {
+        BrcmFirmwareStore* me;
+        UInt16 vendorId;
+        UInt16 productId;
+        OSString* firmwareKey;
+        OSArray* instructions;
+    };
+
+    // Source of decoded instructions that are not in the disk cache yet
+    struct UnwrittenCache
+    {
+        UInt32 sourceDigest;
+        UInt32 sourceBytes;
+    };
+
     IOLock* mDataLock;
     OSDictionary* mFirmwares;
+    OSDictionary* mDecoding = NULL;     // instructions still being filled by decodeThread
+    UInt32 mStreamWaiters = 0;          // threads sleeping in waitForInstruction
+    OSDictionary* mPackedFirmwares = NULL;     // kept instead of instructions with CompactCache
+    bool mCompactCache = false;
+    OSString* mCacheDirectory = NULL;
+    OSDictionary* mUnwrittenCaches = NULL;     // UnwrittenCache of each firmware key, written outside mDataLock
+    OSString* mFirmwareDirectory = NULL;
+    OSDictionary* mConfiguredFirmwares = NULL;
+    FirmwareIndex mConfiguredIndex;
+#ifdef FIRMWAREDATA
+    FirmwareIndex mEmbeddedIndex;
+#endif
     IOLock* mCompletionLock = NULL;
 
+    // Started instance, for clients that link against this class directly
+    static IOLock* mInstanceLock;
+    static BrcmFirmwareStore* mInstance;
+    friend kern_return_t BrcmFirmwareStore_Start(kmod_info_t*, void*);
+    friend kern_return_t BrcmFirmwareStore_Stop(kmod_info_t*, void*);
+
+    // Host benchmark and tests, see host/
+    friend class StoreHarness;
+
     OSData* decompressFirmware(OSData* firmware);
-    OSArray* parseFirmware(OSData* firmwareData);
+    OSData* compressFirmware(OSData* firmware);
+    OSData* packFirmware(OSData* firmware, UInt32* records);
+    OSArray* parseFirmware(OSData* firmwareData, OSArray* stream);
+    OSArray* readFirmwareCache(OSString* firmwareIdentifier, UInt32 sourceDigest);
+    bool writeFirmwareCache(OSString* firmwareIdentifier, UInt32 sourceDigest, UInt32 sourceBytes, OSArray* instructions);
+    bool takeUnwrittenCache(OSString* firmwareIdentifier, UnwrittenCache* cache);
+    void flushFirmwareCache(OSString* firmwareIdentifier, OSArray* instructions, const UnwrittenCache& cache);
     static void requestResourceCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void* context);
-    OSData* loadFirmwareFile(const char* filename, const char* suffix);
-    OSData* loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
-    OSArray* loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    OSData* loadDirectoryFile(const char* path);
+    OSData* loadFirmwareFile(const char* filename, const char* suffix, bool direct);
+    OSData* loadFirmwareFiles(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, bool* direct);
+    OSData* loadFirmwareSource(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, bool* direct);
+    OSArray* loadFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier, OSArray* stream);
+    static void decodeThread(void* arg, wait_result_t wait);
+    void finishDecode(OSString* firmwareIdentifier, OSArray* instructions);
+    void publishMemoryStats();
+    void buildIndexes();
+#ifdef FIRMWAREDATA
+    OSData* lookupEmbeddedFirmware(const char* filename);
+#endif
 
 public:
     virtual bool start(IOService *provider);
     virtual void stop(IOService *provider);
 
     virtual OSArray* getFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    virtual OSArray* beginFirmware(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    virtual IOReturn waitForInstruction(OSString* firmwareIdentifier, OSArray* instructions, UInt32 index, OSData** instruction);
+    virtual BrcmFirmwareStream* openFirmwareStream(UInt16 vendorId, UInt16 productId, OSString* firmwareIdentifier);
+    virtual bool isCompactCache();
+
+    static BrcmFirmwareStore* copyInstance();
 };
 
 #endif /* defined(__BrcmPatchRAM__BrcmFirmwareStore__) */
@@ -88,9 +88,22 @@ OSString* BrcmPatchRAM::brcmIOClass = NULL;
 OSString* BrcmPatchRAM::brcmProviderClass = NULL;
 
 #ifndef NON_RESIDENT
-IOLock* BrcmPatchRAM::mLoadFirmwareLock = IOLockAlloc();
+IOLock* BrcmPatchRAM::mWorkLock = NULL;
+BrcmPatchRAM* BrcmPatchRAM::mWorkQueue[kMaxQueuedWork];
+UInt32 BrcmPatchRAM::mWorkQueueLength = 0;
+UInt32 BrcmPatchRAM::mWorkThreads = 0;
+
+IOLock* BrcmPatchRAM::mWakeLock = NULL;
+UInt32 BrcmPatchRAM::mWakeCount = 0;
+PendingWake BrcmPatchRAM::mPendingWakes[kMaxPendingWakes];
+WakeLatency BrcmPatchRAM::mWakeStats[kWakeEventCount];
+UInt32 BrcmPatchRAM::mReprobeSamples[kBlurpWaitSamples];
+UInt32 BrcmPatchRAM::mReprobeSampleCount = 0;
 #endif
 
+DeviceTopology BrcmPatchRAM::mTopologyCache[kMaxCachedTopologies];
+IOLock* BrcmPatchRAM::mTopologyLock = NULL;
+
 extern "C"
 {
 
@@ -98,10 +111,15 @@ __attribute__((visibility("hidden")))
 kern_return_t BrcmPatchRAM_Start(kmod_info_t* ki, void * d)
 {
 #ifndef NON_RESIDENT
-    if (!(BrcmPatchRAM::mLoadFirmwareLock = IOLockAlloc()))
+    if (!(BrcmPatchRAM::mWorkLock = IOLockAlloc()))
+        return KERN_FAILURE;
+    if (!(BrcmPatchRAM::mWakeLock = IOLockAlloc()))
         return KERN_FAILURE;
 #endif
 
+    if (!(BrcmPatchRAM::mTopologyLock = IOLockAlloc()))
+        return KERN_FAILURE;
+
     return KERN_SUCCESS;
 }
 
@@ -109,13 +127,24 @@ __attribute__((visibility("hidden")))
 kern_return_t BrcmPatchRAM_Stop(kmod_info_t* ki, void * d)
 {
 #ifndef NON_RESIDENT
-    if (BrcmPatchRAM::mLoadFirmwareLock)
+    if (BrcmPatchRAM::mWorkLock)
     {
-        IOLockFree(BrcmPatchRAM::mLoadFirmwareLock);
-        BrcmPatchRAM::mLoadFirmwareLock = NULL;
+        IOLockFree(BrcmPatchRAM::mWorkLock);
+        BrcmPatchRAM::mWorkLock = NULL;
+    }
+    if (BrcmPatchRAM::mWakeLock)
+    {
+        IOLockFree(BrcmPatchRAM::mWakeLock);
+        BrcmPatchRAM::mWakeLock = NULL;
     }
 #endif
 
+    if (BrcmPatchRAM::mTopologyLock)
+    {
+        IOLockFree(BrcmPatchRAM::mTopologyLock);
+        BrcmPatchRAM::mTopologyLock = NULL;
+    }
+
     return KERN_SUCCESS;
 }
 
@@ -175,6 +204,28 @@ void BrcmPatchRAM::initBrcmStrings()
     }
 }
 
+void BrcmPatchRAM::free()
+{
+    DebugLog("free\n");
+
+    OSSafeReleaseNULL(mDeviceMatching);
+    OSSafeReleaseNULL(mPublishMatching);
+    OSSafeReleaseNULL(mPersonality);
+    OSSafeReleaseNULL(mRemoveMatching);
+    OSSafeReleaseNULL(mGenericMatching);
+    OSSafeReleaseNULL(mReadBuffer);
+
+#ifndef NON_RESIDENT
+    if (mLoadFirmwareLock)
+    {
+        IOLockFree(mLoadFirmwareLock);
+        mLoadFirmwareLock = NULL;
+    }
+#endif
+
+    super::free();
+}
+
 IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
 {
     uint64_t start_time, end_time, nano_secs;
@@ -200,11 +251,11 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     clock_get_uptime(&start_time);
 
 #ifndef NON_RESIDENT
-    mWorkLock = IOLockAlloc();
+    // Note: mWorkLock is static (global), not instance data...
     if (!mWorkLock)
         return NULL;
 
-    // Note: mLoadFirmwareLock is static (global), not instance data...
+    mLoadFirmwareLock = IOLockAlloc();
     if (!mLoadFirmwareLock)
         return NULL;
 #endif
@@ -224,7 +275,8 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     initBrcmStrings();
 
 #ifndef NON_RESIDENT
-    // longest time seen in normal re-probe was ~200ms (400+ms on 10.11)
+    // longest time seen in normal re-probe was ~200ms (400+ms on 10.11),
+    // used until enough re-probes have been seen to adapt (getBlurpWait)
     if (version_major >= 15)
         mBlurpWait = 800;
     else
@@ -256,11 +308,44 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     if (PE_parse_boot_argn("bpr_preresetdelay", &delay, sizeof delay))
         mPreResetDelay = delay;
 
+    mTransport = kTransportBulk;
+    if (OSNumber* transport = OSDynamicCast(OSNumber, getProperty("FirmwareTransport")))
+        mTransport = transport->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_transport", &delay, sizeof delay))
+        mTransport = delay;
+    if (mTransport > kTransportAuto)
+        mTransport = kTransportBulk;
+
+    mResetPolicy = kResetAuto;
+    if (OSNumber* resetPolicy = OSDynamicCast(OSNumber, getProperty("ResetPolicy")))
+        mResetPolicy = resetPolicy->unsigned32BitValue();
+    if (PE_parse_boot_argn("bpr_resetpolicy", &delay, sizeof delay))
+        mResetPolicy = delay;
+
+    mTrace.enabled = false;
+    if (OSBoolean* trace = OSDynamicCast(OSBoolean, getProperty("Trace")))
+        mTrace.enabled = trace->isTrue();
+    if (PE_parse_boot_argn("bpr_trace", &delay, sizeof delay))
+        mTrace.enabled = delay != 0;
+
+    mPipelineDecode = false;
+    if (OSBoolean* pipelineDecode = OSDynamicCast(OSBoolean, getProperty("PipelineDecode")))
+        mPipelineDecode = pipelineDecode->isTrue();
+    if (PE_parse_boot_argn("bpr_pipeline", &delay, sizeof delay))
+        mPipelineDecode = delay != 0;
+
     if (OSString* displayName = OSDynamicCast(OSString, getProperty(kDisplayName)))
         provider->setProperty(kUSBProductString, displayName);
     
     mVendorId = mDevice.getVendorID();
     mProductId = mDevice.getProductID();
+#ifndef NON_RESIDENT
+    mLocationId = mDevice.getLocationID();
+    mInternal = isInternal();
+    recordWakeEvent(kWakeReprobe);
+#endif
+
+    buildMatchingDictionaries();
 
     // Check if device supports handshake.
     if (mPreResetDelay == 0) {
@@ -274,19 +359,36 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     // get firmware here to pre-cache for eventual use on wakeup or now
     if (OSString* firmwareKey = OSDynamicCast(OSString, getProperty(kFirmwareKey)))
     {
-        if (BrcmFirmwareStore* firmwareStore = getFirmwareStore())
+        // with the decode pipeline, decode during the probe delay
+        BrcmFirmwareStore* firmwareStore = getFirmwareStore();
+        if (firmwareStore && mPipelineDecode)
+        {
+            if (OSArray* instructions = firmwareStore->beginFirmware(mVendorId, mProductId, firmwareKey))
+                instructions->release();
+        }
+        else if (firmwareStore && firmwareStore->isCompactCache())
+        {
+            if (BrcmFirmwareStream* stream = firmwareStore->openFirmwareStream(mVendorId, mProductId, firmwareKey))
+                stream->release();
+        }
+        else if (firmwareStore)
             firmwareStore->getFirmware(mVendorId, mProductId, firmwareKey);
     }
 
     IOSleep(mProbeDelay);
 
+#ifndef NON_RESIDENT
+    if (uploadFirmware())
+        recordWakeEvent(kWakeReady);
+#else
     uploadFirmware();
+#endif
     publishPersonality();
 
     clock_get_uptime(&end_time);
     absolutetime_to_nanoseconds(end_time - start_time, &nano_secs);
     uint64_t milli_secs = nano_secs / 1000000;
-    AlwaysLog("Processing time %llu.%llu seconds.\n", milli_secs / 1000, milli_secs % 1000);
+    AlwaysLog("Processing time %llu.%llu seconds.\n", (unsigned long long)(milli_secs / 1000), (unsigned long long)(milli_secs % 1000));
 
 #ifdef NON_RESIDENT
     // maybe residency is not required for 10.11?
@@ -315,25 +417,14 @@ bool BrcmPatchRAM::start(IOService *provider)
     setProperty("RM,Build", "Release-" LOGNAME);
 #endif
 
-   // add interrupt source for delayed actions...
     IOWorkLoop* workLoop = getWorkLoop();
     if (!workLoop)
         return false;
-    mWorkSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &BrcmPatchRAM::processWorkQueue));
-    if (!mWorkSource)
-        return false;
-    workLoop->addEventSource(mWorkSource);
-    mWorkPending = 0;
 
     // add timer for firmware load in the case no re-probe after wake
     mTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &BrcmPatchRAM::onTimerEvent));
     if (!mTimer)
-    {
-        workLoop->removeEventSource(mWorkSource);
-        mWorkSource->release();
-        mWorkSource = NULL;
         return false;
-    }
     workLoop->addEventSource(mTimer);
 
     // register for power state notifications
@@ -344,18 +435,21 @@ bool BrcmPatchRAM::start(IOService *provider)
     return true;
 }
 
-#ifdef DEBUG
-static uint64_t wake_time;
-#endif
-
 void BrcmPatchRAM::stop(IOService* provider)
 {
 #ifdef DEBUG
-    uint64_t stop_time, nano_secs;
+    uint64_t stop_time, wake_time = 0, nano_secs;
     clock_get_uptime(&stop_time);
-    absolutetime_to_nanoseconds(stop_time - wake_time, &nano_secs);
-    uint64_t milli_secs = nano_secs / 1000000;
-    AlwaysLog("Time since wake %llu.%llu seconds.\n", milli_secs / 1000, milli_secs % 1000);
+    IOLockLock(mWakeLock);
+    if (PendingWake* wake = findPendingWake(false))
+        wake_time = wake->wakeTime;
+    IOLockUnlock(mWakeLock);
+    if (wake_time)
+    {
+        absolutetime_to_nanoseconds(stop_time - wake_time, &nano_secs);
+        uint64_t milli_secs = nano_secs / 1000000;
+        AlwaysLog("Time since wake %llu.%llu seconds.\n", (unsigned long long)(milli_secs / 1000), (unsigned long long)(milli_secs % 1000));
+    }
 #endif
 
     DebugLog("stop\n");
@@ -377,7 +471,8 @@ void BrcmPatchRAM::stop(IOService* provider)
 
     mStopping = true;
 
-    // allow firmware load already started to finish
+    // drop a firmware load still queued, allow one already started to finish
+    cancelWork();
     IOLockLock(mLoadFirmwareLock);
 
     OSSafeReleaseNULL(mFirmwareStore);
@@ -392,13 +487,6 @@ void BrcmPatchRAM::stop(IOService* provider)
             mTimer->release();
             mTimer = NULL;
         }
-        if (mWorkSource)
-        {
-            workLoop->removeEventSource(mWorkSource);
-            mWorkSource->release();
-            mWorkSource = NULL;
-            mWorkPending = 0;
-        }
     }
 
     PMstop();
@@ -409,12 +497,6 @@ void BrcmPatchRAM::stop(IOService* provider)
         mCompletionLock = NULL;
     }
 #ifndef NON_RESIDENT
-    if (mWorkLock)
-    {
-        IOLockFree(mWorkLock);
-        mWorkLock = NULL;
-    }
-
     IOLockUnlock(mLoadFirmwareLock);
 #endif // #ifndef NON_RESIDENT
 
@@ -427,74 +509,138 @@ void BrcmPatchRAM::stop(IOService* provider)
 
 IOReturn BrcmPatchRAM::onTimerEvent()
 {
-    DebugLog("onTimerEvent\n");
+    CategoryLog(kLogPower, kLogDebug, "onTimerEvent\n");
 
     if (!mDevice.getProperty(kFirmwareLoaded))
     {
         AlwaysLog("BLURP!! no firmware loaded and timer expiried (no re-probe)\n");
-        scheduleWork(kWorkLoadFirmware);
+        recordWakeEvent(kWakeTimer);
+        scheduleWork();
     }
 
     return kIOReturnSuccess;
 }
 
-void BrcmPatchRAM::scheduleWork(unsigned int newWork)
+void BrcmPatchRAM::scheduleWork()
 {
     IOLockLock(mWorkLock);
-    mWorkPending |= newWork;
-    mWorkSource->interruptOccurred(0, 0, 0);
-    IOLockUnlock(mWorkLock);
-}
 
-void BrcmPatchRAM::processWorkQueue(IOInterruptEventSource*, int)
-{
-    IOLockLock(mWorkLock);
+    // one outstanding firmware load per device is enough, whichever instance queued it
+    for (UInt32 i = 0; i < mWorkQueueLength; i++)
+    {
+        BrcmPatchRAM* queued = mWorkQueue[i];
+        if (queued->mVendorId == mVendorId && queued->mProductId == mProductId && queued->mLocationId == mLocationId)
+        {
+            DebugLog("[%04x:%04x]: firmware load already queued\n", mVendorId, mProductId);
+            IOLockUnlock(mWorkLock);
+            return;
+        }
+    }
+    if (mWorkQueueLength >= kMaxQueuedWork)
+    {
+        AlwaysLog("[%04x:%04x]: ERROR work queue full, firmware load dropped.\n", mVendorId, mProductId);
+        IOLockUnlock(mWorkLock);
+        return;
+    }
+
+    // internal controllers go ahead of dongles, otherwise first come first served
+    UInt32 position = mWorkQueueLength;
+    while (position > 0 && mInternal && !mWorkQueue[position - 1]->mInternal)
+    {
+        mWorkQueue[position] = mWorkQueue[position - 1];
+        position--;
+    }
+    retain();
+    mWorkQueue[position] = this;
+    mWorkQueueLength++;
+    DebugLog("[%04x:%04x]: firmware load queued at %u of %u\n", mVendorId, mProductId, position, mWorkQueueLength);
 
     // start firmware loading process in a non-workloop thread
-    if (mWorkPending & kWorkLoadFirmware)
+    if (mWorkThreads < kMaxWorkThreads)
     {
-        DebugLog("_workPending kWorkLoadFirmware\n");
-        mWorkPending &= ~kWorkLoadFirmware;
-        retain();
-        kern_return_t result = kernel_thread_start(&BrcmPatchRAM::uploadFirmwareThread, this, &mWorker);
+        thread_t thread;
+        kern_return_t result = kernel_thread_start(&BrcmPatchRAM::workQueueThread, NULL, &thread);
         if (KERN_SUCCESS == result)
+        {
+            mWorkThreads++;
+            thread_deallocate(thread);
             DebugLog("Success creating firmware uploader thread\n");
-        else
+        }
+        else if (!mWorkThreads)
         {
+            // nobody left to drain the queue
             AlwaysLog("ERROR creating firmware uploader thread.\n");
+            mWorkQueueLength--;
+            for (UInt32 i = position; i < mWorkQueueLength; i++)
+                mWorkQueue[i] = mWorkQueue[i + 1];
             release();
         }
     }
 
-    // firmware loading thread is finished
-    if (mWorkPending & kWorkFinished)
+    IOLockUnlock(mWorkLock);
+}
+
+void BrcmPatchRAM::cancelWork()
+{
+    IOLockLock(mWorkLock);
+    for (UInt32 i = 0; i < mWorkQueueLength; i++)
     {
-        DebugLog("_workPending kWorkFinished\n");
-        mWorkPending &= ~kWorkFinished;
-        thread_deallocate(mWorker);
-        mWorker = 0;
-        release();  // matching retain when thread created successfully
-    }
+        if (mWorkQueue[i] != this)
+            continue;
 
+        mWorkQueueLength--;
+        for (; i < mWorkQueueLength; i++)
+            mWorkQueue[i] = mWorkQueue[i + 1];
+        release();  // matching retain when queued
+        break;
+    }
     IOLockUnlock(mWorkLock);
 }
 
-void BrcmPatchRAM::uploadFirmwareThread(void *arg, wait_result_t wait)
+bool BrcmPatchRAM::isInternal()
+{
+    // the personality decides for ports that ACPI does not describe
+    if (OSBoolean* internal = OSDynamicCast(OSBoolean, getProperty("Internal")))
+        return internal->isTrue();
+
+    // ACPI marks the ports of built-in devices as non-removable
+    return mDevice.getProperty("non-removable") != NULL;
+}
+
+void BrcmPatchRAM::workQueueThread(void *arg, wait_result_t wait)
 {
     DebugLog("sendFirmwareThread enter\n");
 
-    // don't start firmware load when lock is held (instance is shutting down)
-    if (IOLockTryLock(mLoadFirmwareLock))
+    for (;;)
     {
-        BrcmPatchRAM* me = static_cast<BrcmPatchRAM*>(arg);
-        me->resetDevice();
-        IOSleep(me->mPostResetDelay);
-        me->uploadFirmware();
+        IOLockLock(mWorkLock);
+        if (!mWorkQueueLength)
+        {
+            mWorkThreads--;
+            IOLockUnlock(mWorkLock);
+            break;
+        }
+        BrcmPatchRAM* me = mWorkQueue[0];
+        mWorkQueueLength--;
+        for (UInt32 i = 0; i < mWorkQueueLength; i++)
+            mWorkQueue[i] = mWorkQueue[i + 1];
+
+        // don't start firmware load when lock is held (instance is shutting down),
+        // taken with mWorkLock held so cancelWork in stop can't miss it
+        bool locked = IOLockTryLock(me->mLoadFirmwareLock);
+        IOLockUnlock(mWorkLock);
+
+        if (locked)
+        {
+            me->resetBeforeUpload();
+            if (me->uploadFirmware())
+                me->recordWakeEvent(kWakeReady);
 #ifndef TARGET_ELCAPITAN
-        me->publishPersonality();
+            me->publishPersonality();
 #endif
-        me->scheduleWork(kWorkFinished);
-        IOLockUnlock(mLoadFirmwareLock);
+            IOLockUnlock(me->mLoadFirmwareLock);
+        }
+        me->release();  // matching retain when queued
     }
 
     DebugLog("sendFirmwareThread termination\n");
@@ -502,77 +648,266 @@ void BrcmPatchRAM::uploadFirmwareThread(void *arg, wait_result_t wait)
     DebugLog("!!! sendFirmwareThread post-terminate !!! should not be here\n");
 }
 
+/*
+ * Find the wake slot of this device, called with mWakeLock held. With
+ * create a free slot is taken, or the oldest one if all are in use.
+ */
+PendingWake* BrcmPatchRAM::findPendingWake(bool create)
+{
+    UInt32 locationId = mDevice.getLocationID();
+    PendingWake* slot = NULL;
+
+    for (int i = 0; i < kMaxPendingWakes; i++)
+    {
+        PendingWake* entry = &mPendingWakes[i];
+        if (entry->wakeTime && entry->vid == mVendorId && entry->did == mProductId && entry->locationId == locationId)
+            return entry;
+        if (create && (!slot || entry->wakeTime < slot->wakeTime))
+            slot = entry;
+    }
+    if (slot)
+    {
+        bzero(slot, sizeof(*slot));
+        slot->vid = mVendorId;
+        slot->did = mProductId;
+        slot->locationId = locationId;
+    }
+    return slot;
+}
+
+void BrcmPatchRAM::recordWakeEvent(WakeEvent event)
+{
+    uint64_t now_time, nano_secs;
+    PendingWake* wake;
+
+    IOLockLock(mWakeLock);
+    wake = findPendingWake(false);
+    if (!wake || (event == kWakeReprobe && wake->reprobed))
+    {
+        // not waiting on a wake of this device (initial probe, hot plug, the
+        // re-probe after the reset of an upload), or it was re-probed already
+        IOLockUnlock(mWakeLock);
+        return;
+    }
+    clock_get_uptime(&now_time);
+    absolutetime_to_nanoseconds(now_time - wake->wakeTime, &nano_secs);
+    uint64_t milli_secs = nano_secs / 1000000;
+
+    int bucket = 0;
+    while (bucket < kWakeLatencyBuckets - 1 && milli_secs >= (1ULL << bucket))
+        bucket++;
+    mWakeStats[event].count++;
+    mWakeStats[event].buckets[bucket]++;
+
+    if (event == kWakeReprobe)
+    {
+        // anything past the upper bound is more likely a hot plug than a re-probe
+        if (milli_secs <= kBlurpWaitMax)
+            mReprobeSamples[mReprobeSampleCount++ % kBlurpWaitSamples] = (UInt32)milli_secs;
+        wake->reprobed = true;
+    }
+
+    // the wake is complete once firmware is loaded
+    if (event == kWakeReady)
+        bzero(wake, sizeof(*wake));
+    IOLockUnlock(mWakeLock);
+
+    static const char* const names[] = { "re-probe", "timer", "firmware ready" };
+    CategoryLog(kLogPower, kLogInfo, "[%04x:%04x]: Wake to %s %llu ms.\n", mVendorId, mProductId, names[event], (unsigned long long)milli_secs);
+
+    publishWakeStats();
+}
+
+void BrcmPatchRAM::publishWakeStats()
+{
+    static const char* const names[] = { "Reprobe", "Timer", "Ready" };
+
+    OSDictionary* stats = OSDictionary::withCapacity(kWakeEventCount + 1);
+    if (!stats)
+        return;
+
+    IOLockLock(mWakeLock);
+    if (OSNumber* count = OSNumber::withNumber(mWakeCount, 32))
+    {
+        stats->setObject("Wakes", count);
+        count->release();
+    }
+    for (int i = 0; i < kWakeEventCount; i++)
+    {
+        OSArray* histogram = OSArray::withCapacity(kWakeLatencyBuckets + 1);
+        if (!histogram)
+            continue;
+
+        // count first, then one entry per power of two milliseconds
+        if (OSNumber* count = OSNumber::withNumber(mWakeStats[i].count, 32))
+        {
+            histogram->setObject(count);
+            count->release();
+        }
+        for (int bucket = 0; bucket < kWakeLatencyBuckets; bucket++)
+        {
+            if (OSNumber* value = OSNumber::withNumber(mWakeStats[i].buckets[bucket], 32))
+            {
+                histogram->setObject(value);
+                value->release();
+            }
+        }
+        stats->setObject(names[i], histogram);
+        histogram->release();
+    }
+    IOLockUnlock(mWakeLock);
+
+    setProperty("RM,WakeStats", stats);
+    stats->release();
+}
+
+UInt32 BrcmPatchRAM::getBlurpWait()
+{
+    UInt32 samples[kBlurpWaitSamples];
+    UInt32 count;
+
+    IOLockLock(mWakeLock);
+    count = mReprobeSampleCount < kBlurpWaitSamples ? mReprobeSampleCount : kBlurpWaitSamples;
+    memcpy(samples, mReprobeSamples, count * sizeof(samples[0]));
+    IOLockUnlock(mWakeLock);
+
+    if (count < kBlurpWaitMinSamples)
+        return mBlurpWait;
+
+    // insertion sort, there are only a handful of samples
+    for (UInt32 i = 1; i < count; i++)
+    {
+        UInt32 value = samples[i];
+        UInt32 j = i;
+        for (; j > 0 && samples[j - 1] > value; j--)
+            samples[j] = samples[j - 1];
+        samples[j] = value;
+    }
+
+    // nearest rank percentile, plus a quarter for headroom
+    UInt32 rank = (count * kBlurpWaitPercentile + 99) / 100;
+    UInt32 wait = samples[rank - 1] + samples[rank - 1] / 4;
+    if (wait < kBlurpWaitMin)
+        wait = kBlurpWaitMin;
+    if (wait > kBlurpWaitMax)
+        wait = kBlurpWaitMax;
+
+    DebugLog("[%04x:%04x]: Adaptive blurp wait %u ms from %u re-probes.\n", mVendorId, mProductId, wait, count);
+    return wait;
+}
+
 #endif // #ifndef NON_RESIDENT
 
-void BrcmPatchRAM::uploadFirmware()
+/*
+ * Returns true if the controller runs the firmware afterwards, whether it
+ * was uploaded now or was already loaded.
+ */
+bool BrcmPatchRAM::uploadFirmware()
 {
+    DeviceTopology topology;
+    uint64_t start_time, end_time, nano_secs;
+    bool cached, opened, upgraded = false;
+
     // signal to timer that firmware already loaded
     mDevice.setProperty(kFirmwareLoaded, true);
 
     // don't bother with devices that have no firmware
     if (!getProperty(kFirmwareKey))
-        return;
+        return false;
 
     if (!mDevice.open(this))
     {
         AlwaysLog("uploadFirmware could not open the device!\n");
-        return;
+        return false;
+    }
+
+    // Print out additional device information
+    printDeviceInfo();
+
+    clock_get_uptime(&start_time);
+
+    // Reuse the topology of a previous upload, fall back to the full walk on mismatch
+    cached = lookupTopology(&topology);
+    opened = cached && openTopology(&topology);
+
+    if (cached && !opened)
+    {
+        AlwaysLog("[%04x:%04x]: Cached USB topology does not match, rescanning.\n", mVendorId, mProductId);
+        closeTopology();
+        forgetTopology();
+        cached = false;
     }
+    if (!cached)
+        opened = openTopology(NULL);
+
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - start_time, &nano_secs);
+    CategoryLog(kLogUSB, kLogInfo, "[%04x:%04x]: USB setup time %llu us (%s topology).\n", mVendorId, mProductId, (unsigned long long)(nano_secs / 1000), cached ? "cached" : "full");
 
-    //REVIEW: this block to avoid merge conflicts (remove once merged)
-    ////if (mDevice.open(this))
+    // Setup failures leave the counters of the previous upload behind
+    bzero(mTransportStats, sizeof(mTransportStats));
+    bzero(mPhaseTime, sizeof(mPhaseTime));
+    mFirmwareVersion = 0xFFFF;
+    mFinalVersion = 0xFFFF;
+    mFailedState = kInitialize;
+    mSavedSettleTime = 0;
+
+    if (opened && prepareTransferBuffers())
     {
-        // Print out additional device information
-        printDeviceInfo();
-        
-        // Set device configuration to composite configuration index 0
-        // Obtain first interface
-        if (setConfiguration(0) && findInterface(&mInterface) && mInterface.open(this))
+        DebugLog("got pipes\n");
+        if ((upgraded = performUpgrade()))
         {
-            DebugLog("set configuration and interface opened\n");
-            mInterface.findPipe(&mInterruptPipe, kUSBInterrupt, kUSBIn);
-            mInterface.findPipe(&mBulkPipe, kUSBBulk, kUSBOut);
-            if (mInterruptPipe.getValidatedPipe() && mBulkPipe.getValidatedPipe())
+            if (mResetDeferred)
+                mSavedSettleTime = mPostResetDelay;
+
+            if (mDeviceState == kUpdateComplete)
             {
-                DebugLog("got pipes\n");
-                if (performUpgrade())
-                    if (mDeviceState == kUpdateComplete)
-                        AlwaysLog("[%04x:%04x]: Firmware upgrade completed successfully.\n", mVendorId, mProductId);
-                    else
-                        AlwaysLog("[%04x:%04x]: Firmware upgrade not needed.\n", mVendorId, mProductId);
-                else
-                    AlwaysLog("[%04x:%04x]: Firmware upgrade failed.\n", mVendorId, mProductId);
-                OSSafeReleaseNULL(mReadBuffer); // mReadBuffer is allocated by performUpgrade but not released
+                AlwaysLog("[%04x:%04x]: Firmware upgrade completed successfully.\n", mVendorId, mProductId);
+                publishUploadResult("Complete", cached, nano_secs, start_time);
             }
-            mInterface.close(this);
-        }
-        
-        // cleanup
-        if (mInterruptPipe.getValidatedPipe())
-        {
-            mInterruptPipe.abort();
-            mInterruptPipe.setPipe(NULL);
+            else
+            {
+                AlwaysLog("[%04x:%04x]: Firmware upgrade not needed.\n", mVendorId, mProductId);
+                publishUploadResult("NotNeeded", cached, nano_secs, start_time);
+            }
+            if (!cached)
+                storeTopology();
         }
-        if (mBulkPipe.getValidatedPipe())
+        else if (!mResetDeferred || !mResetRequired)
         {
-            mBulkPipe.abort();
-            mBulkPipe.setPipe(NULL);
+            AlwaysLog("[%04x:%04x]: Firmware upgrade failed.\n", mVendorId, mProductId);
+            publishUploadResult("Failed", cached, nano_secs, start_time);
         }
-        mInterface.setInterface(NULL);
-        mDevice.close(this);
     }
+    else
+        publishUploadResult("Failed", cached, nano_secs, start_time);
+
+    // cleanup
+    releaseTransferBuffers();
+    closeTopology();
+    mDevice.close(this);
+
+    if (mResetDeferred)
+        return completeDeferredReset(upgraded);
+    return upgraded;
 }
 
 #ifndef NON_RESIDENT
 IOReturn BrcmPatchRAM::setPowerState(unsigned long which, IOService *whom)
 {
-    DebugLog("setPowerState: which = 0x%lx\n", which);
+    CategoryLog(kLogPower, kLogDebug, "setPowerState: which = 0x%lx\n", which);
     
     if (which == kMyOffPowerState)
     {
         // consider firmware no longer loaded
         mDevice.removeProperty(kFirmwareLoaded);
 
+        // anything outstanding from the previous wake of this device is not coming
+        IOLockLock(mWakeLock);
+        if (PendingWake* wake = findPendingWake(false))
+            bzero(wake, sizeof(*wake));
+        IOLockUnlock(mWakeLock);
+
         // in the case the instance is shutting down, don't do anything
         if (!mStopping)
         {
@@ -591,12 +926,21 @@ IOReturn BrcmPatchRAM::setPowerState(unsigned long which, IOService *whom)
     }
     else if (which == kMyOnPowerState)
     {
-#ifdef DEBUG
-        clock_get_uptime(&wake_time);
-#endif
         // start a timer for loading firmware for case probe is never called after wake
         if (!mDevice.getProperty(kFirmwareLoaded))
-            mTimer->setTimeoutMS(mBlurpWait);
+        {
+            IOLockLock(mWakeLock);
+            // a wake before firmware was loaded for the previous one keeps its time
+            PendingWake* wake = findPendingWake(true);
+            if (wake && !wake->wakeTime)
+                clock_get_uptime(&wake->wakeTime);
+            mWakeCount++;
+            IOLockUnlock(mWakeLock);
+
+            UInt32 blurpWait = getBlurpWait();
+            setProperty("RM,BlurpWait", blurpWait, 32);
+            mTimer->setTimeoutMS(blurpWait);
+        }
     }
 
     return IOPMAckImplied;
@@ -623,18 +967,53 @@ static void setNumberInDict(OSDictionary* dict, const char* key, UInt16 value)
     }
 }
 
+/*
+ * Build the catalogue matching dictionaries for this device once, so that
+ * publishing and removing personalities on every upload and power-off
+ * does not allocate them again.
+ */
+void BrcmPatchRAM::buildMatchingDictionaries()
+{
+    // Matching dictionary for the current device
+    if ((mDeviceMatching = OSDictionary::withCapacity(3)))
+    {
+        mDeviceMatching->setObject(kIOProviderClassKey, brcmProviderClass);
+        setNumberInDict(mDeviceMatching, kUSBProductID, mProductId);
+        setNumberInDict(mDeviceMatching, kUSBVendorID, mVendorId);
+    }
+
+    // Native driver personality for the current device, with and without bundle
+    if ((mPublishMatching = OSDictionary::withDictionary(mDeviceMatching, 5)))
+        mPublishMatching->setObject(kIOClassKey, brcmIOClass);
+    if ((mPersonality = OSDictionary::withDictionary(mPublishMatching, 5)))
+        mPersonality->setObject(kBundleIdentifier, brcmBundleIdentifier);
+
+#ifndef NON_RESIDENT
+#ifndef TARGET_ELCAPITAN
+    // Broadcom matching personality
+    if ((mRemoveMatching = OSDictionary::withDictionary(mDeviceMatching, 4)))
+        mRemoveMatching->setObject(kBundleIdentifier, brcmBundleIdentifier);
+
+    // Generic matching personality
+    if ((mGenericMatching = OSDictionary::withCapacity(5)))
+    {
+        mGenericMatching->setObject(kIOProviderClassKey, brcmProviderClass);
+        setStringInDict(mGenericMatching, kBundleIdentifier, "com.apple.iokit.IOBluetoothHostControllerUSBTransport");
+        setNumberInDict(mGenericMatching, "bDeviceClass", 224);
+        setNumberInDict(mGenericMatching, "bDeviceProtocol", 1);
+        setNumberInDict(mGenericMatching, "bDeviceSubClass", 1);
+    }
+#endif
+#endif
+}
+
 #ifdef DEBUG
 void BrcmPatchRAM::printPersonalities()
 {
-    // Matching dictionary for the current device
-    OSDictionary* dict = OSDictionary::withCapacity(5);
-    if (!dict) return;
-    dict->setObject(kIOProviderClassKey, brcmProviderClass);
-    setNumberInDict(dict, kUSBProductID, mProductId);
-    setNumberInDict(dict, kUSBVendorID, mVendorId);
+    if (!mDeviceMatching) return;
     
     SInt32 generatonCount;
-    if (OSOrderedSet* set = gIOCatalogue->findDrivers(dict, &generatonCount))
+    if (OSOrderedSet* set = gIOCatalogue->findDrivers(mDeviceMatching, &generatonCount))
     {
         AlwaysLog("[%04x:%04x]: %d matching driver personalities.\n", mVendorId, mProductId, set->getCount());
         if (OSCollectionIterator* iterator = OSCollectionIterator::withCollection(set))
@@ -648,7 +1027,6 @@ void BrcmPatchRAM::printPersonalities()
         }
         set->release();
     }
-    dict->release();
 }
 #endif //DEBUG
 
@@ -663,24 +1041,12 @@ void BrcmPatchRAM::removePersonality()
 #endif
     
     // remove Broadcom matching personality
-    OSDictionary* dict = OSDictionary::withCapacity(4);
-    if (!dict) return;
-    dict->setObject(kIOProviderClassKey, brcmProviderClass);
-    setNumberInDict(dict, kUSBProductID, mProductId);
-    setNumberInDict(dict, kUSBVendorID, mVendorId);
-    dict->setObject(kBundleIdentifier, brcmBundleIdentifier);
-    gIOCatalogue->removeDrivers(dict, false); // no nub matching on removal
+    if (mRemoveMatching)
+        gIOCatalogue->removeDrivers(mRemoveMatching, false); // no nub matching on removal
 
     // remove generic matching personality
-    dict->removeObject(kUSBProductID);
-    dict->removeObject(kUSBVendorID);
-    setStringInDict(dict, kBundleIdentifier, "com.apple.iokit.IOBluetoothHostControllerUSBTransport");
-    setNumberInDict(dict, "bDeviceClass", 224);
-    setNumberInDict(dict, "bDeviceProtocol", 1);
-    setNumberInDict(dict, "bDeviceSubClass", 1);
-    gIOCatalogue->removeDrivers(dict, false); // no nub matching on removal
-
-    dict->release();
+    if (mGenericMatching)
+        gIOCatalogue->removeDrivers(mGenericMatching, false); // no nub matching on removal
     
 #ifdef DEBUG
     printPersonalities();
@@ -691,54 +1057,56 @@ void BrcmPatchRAM::removePersonality()
 
 void BrcmPatchRAM::publishPersonality()
 {
-    // Matching dictionary for the current device
-    OSDictionary* dict = OSDictionary::withCapacity(5);
-    if (!dict) return;
-    dict->setObject(kIOProviderClassKey, brcmProviderClass);
-    dict->setObject(kIOClassKey, brcmIOClass);
-    setNumberInDict(dict, kUSBProductID, mProductId);
-    setNumberInDict(dict, kUSBVendorID, mVendorId);
-
-    // Retrieve currently matching IOKit driver personalities
-    OSDictionary* personality = NULL;
-    SInt32 generationCount;
-    if (OSOrderedSet* set = gIOCatalogue->findDrivers(dict, &generationCount))
+    if (!mPublishMatching || !mPersonality) return;
+
+    // Retrieve currently matching IOKit driver personalities, unless the catalogue is unchanged
+    SInt32 generationCount = gIOCatalogue->getGenerationCount();
+    if (generationCount != mCatalogueGeneration)
     {
-        if (set->getCount())
-            DebugLog("[%04x:%04x]: %d matching driver personalities.\n", mVendorId, mProductId, set->getCount());
-        
-        if (OSCollectionIterator* iterator = OSCollectionIterator::withCollection(set))
+        mHasPersonality = false;
+        if (OSOrderedSet* set = gIOCatalogue->findDrivers(mPublishMatching, &generationCount))
         {
-            while ((personality = OSDynamicCast(OSDictionary, iterator->getNextObject())))
+            if (set->getCount())
+                DebugLog("[%04x:%04x]: %d matching driver personalities.\n", mVendorId, mProductId, set->getCount());
+            
+            if (OSCollectionIterator* iterator = OSCollectionIterator::withCollection(set))
             {
-                if (OSString* bundleId = OSDynamicCast(OSString, personality->getObject(kBundleIdentifier)))
-                    if (strncmp(bundleId->getCStringNoCopy(), kAppleBundlePrefix, strlen(kAppleBundlePrefix)) == 0)
-                    {
-                        AlwaysLog("[%04x:%04x]: Found existing IOKit personality \"%s\".\n", mVendorId, mProductId, bundleId->getCStringNoCopy());
-                        break;
-                    }
+                while (OSDictionary* personality = OSDynamicCast(OSDictionary, iterator->getNextObject()))
+                {
+                    if (OSString* bundleId = OSDynamicCast(OSString, personality->getObject(kBundleIdentifier)))
+                        if (strncmp(bundleId->getCStringNoCopy(), kAppleBundlePrefix, strlen(kAppleBundlePrefix)) == 0)
+                        {
+                            AlwaysLog("[%04x:%04x]: Found existing IOKit personality \"%s\".\n", mVendorId, mProductId, bundleId->getCStringNoCopy());
+                            mHasPersonality = true;
+                            break;
+                        }
+                }
+                iterator->release();
             }
-            iterator->release();
+            set->release();
         }
-        set->release();
+        mCatalogueGeneration = generationCount;
     }
+    else
+        DebugLog("[%04x:%04x]: IOCatalogue unchanged, skipping personality query.\n", mVendorId, mProductId);
     
-    if (!personality && brcmBundleIdentifier)
+    if (!mHasPersonality && brcmBundleIdentifier)
     {
         // OS X does not have a driver personality for this device yet, publish one
         DebugLog("brcmBundIdentifier: \"%s\"\n", brcmBundleIdentifier->getCStringNoCopy());
         DebugLog("brcmIOClass: \"%s\"\n", brcmIOClass->getCStringNoCopy());
         DebugLog("brcmProviderClass: \"%s\"\n", brcmProviderClass->getCStringNoCopy());
-        dict->setObject(kBundleIdentifier, brcmBundleIdentifier);
 
         // Add new personality into the kernel
         if (OSArray* array = OSArray::withCapacity(1))
         {
-            array->setObject(dict);
+            array->setObject(mPersonality);
             if (gIOCatalogue->addDrivers(array, false))
             {
                 AlwaysLog("[%04x:%04x]: Published new IOKit personality.\n", mVendorId, mProductId);
-                if (OSDictionary* dict1 = OSDynamicCast(OSDictionary, dict->copyCollection()))
+                mHasPersonality = true;
+                mCatalogueGeneration = gIOCatalogue->getGenerationCount();
+                if (OSDictionary* dict1 = OSDynamicCast(OSDictionary, mPersonality->copyCollection()))
                 {
                     //dict1->removeObject(kIOClassKey);
                     //dict1->removeObject(kIOProviderClassKey);
@@ -755,7 +1123,6 @@ void BrcmPatchRAM::publishPersonality()
             array->release();
         }
     }
-    dict->release();
 
 #ifdef DEBUG
     printPersonalities();
@@ -823,18 +1190,79 @@ bool BrcmPatchRAM::publishResourcePersonality(const char* classname)
     return true;
 }
 
+bool BrcmPatchRAM::firmwareStorePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier)
+{
+    FirmwareStoreRendezvous* rendezvous = (FirmwareStoreRendezvous*)target;
+
+    IOLockLock(rendezvous->lock);
+    if (!rendezvous->store && (rendezvous->store = OSDynamicCast(BrcmFirmwareStore, newService)))
+        rendezvous->store->retain();
+    IOLockUnlock(rendezvous->lock);
+
+    // wake waiting task in waitForFirmwareStore (in IOLockSleepDeadline)...
+    IOLockWakeup(rendezvous->lock, rendezvous, true);
+
+    return true;
+}
+
+/*
+ * Register for the publication of the firmware store and sleep until it
+ * shows up or the timeout (in ms) expires. The matching notification is
+ * also delivered for a store that has already been published.
+ */
+BrcmFirmwareStore* BrcmPatchRAM::waitForFirmwareStore(UInt32 timeout)
+{
+    FirmwareStoreRendezvous rendezvous = { IOLockAlloc(), NULL };
+    IONotifier* notifier = NULL;
+    uint64_t deadline;
+
+    if (!rendezvous.lock)
+        return NULL;
+
+    if (OSDictionary* matching = serviceMatching(kBrcmFirmwareStoreService))
+    {
+        notifier = addMatchingNotification(gIOPublishNotification, matching, firmwareStorePublished, &rendezvous);
+        matching->release();
+    }
+    if (notifier)
+    {
+        clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+
+        IOLockLock(rendezvous.lock);
+        while (!rendezvous.store)
+        {
+            if (IOLockSleepDeadline(rendezvous.lock, &rendezvous, deadline, 0) == THREAD_TIMED_OUT)
+                break;
+        }
+        IOLockUnlock(rendezvous.lock);
+
+        // waits for a handler still in progress
+        notifier->remove();
+    }
+    IOLockFree(rendezvous.lock);
+
+    return rendezvous.store;
+}
+
 BrcmFirmwareStore* BrcmPatchRAM::getFirmwareStore()
 {
     if (!mFirmwareStore)
     {
         // check to see if it already loaded
-        mFirmwareStore = OSDynamicCast(BrcmFirmwareStore, waitForMatchingService(serviceMatching(kBrcmFirmwareStoreService), 0));
+        mFirmwareStore = BrcmFirmwareStore::copyInstance();
         if (!mFirmwareStore)
         {
             // not loaded, so publish personality...
             publishResourcePersonality(kBrcmFirmwareStoreService);
-            // and wait...
-            mFirmwareStore = OSDynamicCast(BrcmFirmwareStore, waitForMatchingService(serviceMatching(kBrcmFirmwareStoreService), 2000UL*1000UL*1000UL));
+            // and wait for it to be published...
+            mFirmwareStore = waitForFirmwareStore(2000);
+        }
+
+        // CompactCache keeps no instructions to pipeline, so the store's setting wins
+        if (mFirmwareStore && mFirmwareStore->isCompactCache() && mPipelineDecode)
+        {
+            AlwaysLog("[%04x:%04x]: PipelineDecode is not used with the CompactCache of BrcmFirmwareStore.\n", mVendorId, mProductId);
+            mPipelineDecode = false;
         }
 
 #ifdef NON_RESIDENT
@@ -911,20 +1339,70 @@ bool BrcmPatchRAM::resetDevice()
     return true;
 }
 
-bool BrcmPatchRAM::setConfiguration(int configurationIndex)
+/*
+ * Apply the reset policy before an upload. With kResetAuto the reset and
+ * settle time are skipped here, performUpgrade then treats a controller
+ * that is not in its ROM state as a failure and the upload is repeated
+ * after the reset by completeDeferredReset.
+ */
+void BrcmPatchRAM::resetBeforeUpload()
 {
-    IOReturn result;
-    const USBCONFIGURATIONDESCRIPTOR* configurationDescriptor;
-    UInt8 currentConfiguration = 0xFF;
-    
-    // Find the first config/interface
-    UInt8 numconf = 0;
-    
-    if ((numconf = mDevice.getNumConfigurations()) < (configurationIndex + 1))
+    mResetDeferred = mResetPolicy == kResetAuto;
+    mResetRequired = false;
+    mUploadRetries = 0;
+    if (!mResetDeferred)
     {
-        AlwaysLog("[%04x:%04x]: Composite configuration index %d is not available, %d total composite configurations.\n",
-                  mVendorId, mProductId, configurationIndex, numconf);
-        return false;
+        resetDevice();
+        IOSleep(mPostResetDelay);
+    }
+}
+
+/*
+ * Finish an upload with the reset deferred. RM,SavedSettleTime adds up the
+ * settle time saved since boot, each RM,UploadResult has its own share.
+ * Only a controller that failed the ROM state probe is reset and retried,
+ * any other failure was reported by uploadFirmware already.
+ */
+bool BrcmPatchRAM::completeDeferredReset(bool upgraded)
+{
+    OSNumber* total = OSDynamicCast(OSNumber, mDevice.getProperty("RM,SavedSettleTime"));
+    UInt32 saved = (total ? total->unsigned32BitValue() : 0) + mSavedSettleTime;
+
+    mResetDeferred = false;
+
+    if (OSNumber* savedTime = OSNumber::withNumber(saved, 32))
+    {
+        mDevice.setProperty("RM,SavedSettleTime", savedTime);
+        savedTime->release();
+    }
+    if (upgraded)
+    {
+        AlwaysLog("[%04x:%04x]: Controller was in ROM state, skipped reset and %u ms settle time.\n", mVendorId, mProductId, mSavedSettleTime);
+        return true;
+    }
+    if (!mResetRequired)
+        return false;
+
+    AlwaysLog("[%04x:%04x]: Controller not in a clean ROM state, resetting and retrying.\n", mVendorId, mProductId);
+
+    mUploadRetries++;
+    resetDevice();
+    IOSleep(mPostResetDelay);
+    return uploadFirmware();
+}
+
+bool BrcmPatchRAM::setConfiguration(int configurationIndex)
+{
+    const USBCONFIGURATIONDESCRIPTOR* configurationDescriptor;
+    
+    // Find the first config/interface
+    UInt8 numconf = 0;
+    
+    if ((numconf = mDevice.getNumConfigurations()) < (configurationIndex + 1))
+    {
+        AlwaysLog("[%04x:%04x]: Composite configuration index %d is not available, %d total composite configurations.\n",
+                  mVendorId, mProductId, configurationIndex, numconf);
+        return false;
     }
     else
         DebugLog("[%04x:%04x]: Available composite configurations: %d.\n", mVendorId, mProductId, numconf);
@@ -938,6 +1416,22 @@ bool BrcmPatchRAM::setConfiguration(int configurationIndex)
         return false;
     }
     
+    mTopology.configurationValue = configurationDescriptor->bConfigurationValue;
+
+    if (!applyConfiguration(configurationDescriptor->bConfigurationValue))
+        return false;
+
+    DebugLog("[%04x:%04x]: Device configuration index %d is active.\n",
+             mVendorId, mProductId, configurationIndex);
+
+    return true;
+}
+
+bool BrcmPatchRAM::applyConfiguration(UInt8 configurationValue)
+{
+    IOReturn result;
+    UInt8 currentConfiguration = 0xFF;
+
     if ((result = mDevice.getConfiguration(this, &currentConfiguration)) != kIOReturnSuccess)
     {
         AlwaysLog("[%04x:%04x]: Unable to retrieve active configuration (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
@@ -947,20 +1441,20 @@ bool BrcmPatchRAM::setConfiguration(int configurationIndex)
     // Device is already configured
     if (currentConfiguration != 0)
     {
-        DebugLog("[%04x:%04x]: Device configuration is already set to configuration index %d.\n",
-                 mVendorId, mProductId, configurationIndex);
+        DebugLog("[%04x:%04x]: Device configuration is already set to configuration %d.\n",
+                 mVendorId, mProductId, currentConfiguration);
         return true;
     }
     
-    // Set the configuration to the first configuration
-    if ((result = mDevice.setConfiguration(this, configurationDescriptor->bConfigurationValue, true)) != kIOReturnSuccess)
+    // Set the configuration to the requested configuration
+    if ((result = mDevice.setConfiguration(this, configurationValue, true)) != kIOReturnSuccess)
     {
         AlwaysLog("[%04x:%04x]: Unable to (re-)configure device (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
         return false;
     }
     
-    DebugLog("[%04x:%04x]: Set device configuration to configuration index %d successfully.\n",
-             mVendorId, mProductId, configurationIndex);
+    DebugLog("[%04x:%04x]: Set device configuration to configuration %d successfully.\n",
+             mVendorId, mProductId, configurationValue);
     
     return true;
 }
@@ -968,7 +1462,7 @@ bool BrcmPatchRAM::setConfiguration(int configurationIndex)
 bool BrcmPatchRAM::findInterface(USBInterfaceShim* shim)
 {
     mDevice.findFirstInterface(shim);
-    if (IOService* interface = shim->getValidatedInterface())
+    if (shim->getValidatedInterface())
     {
         DebugLog("[%04x:%04x]: Interface %d (class %02x, subclass %02x, protocol %02x) located.\n",
                  mVendorId,
@@ -1005,11 +1499,186 @@ bool BrcmPatchRAM::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
     return true;
 }
 
+bool BrcmPatchRAM::lookupTopology(DeviceTopology* topology)
+{
+    bool found = false;
+
+    mTopology.vid = mVendorId;
+    mTopology.did = mProductId;
+    mTopology.locationId = mDevice.getLocationID();
+
+    IOLockLock(mTopologyLock);
+    for (int i = 0; i < kMaxCachedTopologies; i++)
+    {
+        DeviceTopology* entry = &mTopologyCache[i];
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId)
+        {
+            *topology = *entry;
+            found = true;
+            break;
+        }
+    }
+    IOLockUnlock(mTopologyLock);
+
+    return found;
+}
+
+void BrcmPatchRAM::storeTopology()
+{
+    DeviceTopology* slot = NULL;
+
+    IOLockLock(mTopologyLock);
+    // Replace an existing entry for this device, otherwise take the first free slot
+    for (int i = 0; i < kMaxCachedTopologies; i++)
+    {
+        DeviceTopology* entry = &mTopologyCache[i];
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId)
+        {
+            slot = entry;
+            break;
+        }
+        if (!slot && entry->vid == 0)
+            slot = entry;
+    }
+    if (slot)
+        *slot = mTopology;
+    IOLockUnlock(mTopologyLock);
+
+    DebugLog("[%04x:%04x]: Cached USB topology (configuration %d, interface %d, endpoints 0x%02x/0x%02x).\n",
+             mVendorId, mProductId, mTopology.configurationValue, mTopology.interfaceNumber,
+             mTopology.interruptEndpoint, mTopology.bulkEndpoint);
+}
+
+void BrcmPatchRAM::forgetTopology()
+{
+    IOLockLock(mTopologyLock);
+    for (int i = 0; i < kMaxCachedTopologies; i++)
+    {
+        DeviceTopology* entry = &mTopologyCache[i];
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId)
+            bzero(entry, sizeof(DeviceTopology));
+    }
+    IOLockUnlock(mTopologyLock);
+}
+
+/*
+ * Set the configuration, open the interface and locate both pipes.
+ * With a cached topology the configuration, interface and endpoint
+ * descriptor walks are skipped. Returns true when the interface is
+ * open and both pipes are valid.
+ */
+bool BrcmPatchRAM::openTopology(const DeviceTopology* topology)
+{
+    if (topology)
+    {
+        mTopology.configurationValue = topology->configurationValue;
+        if (!applyConfiguration(topology->configurationValue) ||
+            !mDevice.findInterfaceByNumber(&mInterface, topology->interfaceNumber))
+            return false;
+    }
+    else
+    {
+        // Set device configuration to composite configuration index 0
+        // Obtain first interface
+        if (!setConfiguration(0) || !findInterface(&mInterface))
+            return false;
+    }
+    if (!mInterface.open(this))
+    {
+        mInterface.setInterface(NULL);
+        return false;
+    }
+    DebugLog("set configuration and interface opened\n");
+
+    if (topology)
+    {
+        mInterface.findPipeByAddress(&mInterruptPipe, topology->interruptEndpoint);
+        mInterface.findPipeByAddress(&mBulkPipe, topology->bulkEndpoint);
+    }
+    else
+    {
+        mInterface.findPipe(&mInterruptPipe, kUSBInterrupt, kUSBIn);
+        mInterface.findPipe(&mBulkPipe, kUSBBulk, kUSBOut);
+    }
+    if (!mInterruptPipe.getValidatedPipe() || !mBulkPipe.getValidatedPipe())
+        return false;
+
+    mTopology.interfaceNumber = mInterface.getInterfaceNumber();
+    mTopology.interruptEndpoint = mInterruptPipe.getEndpointAddress();
+    mTopology.bulkEndpoint = mBulkPipe.getEndpointAddress();
+
+    return true;
+}
+
+void BrcmPatchRAM::closeTopology()
+{
+    if (mInterruptPipe.getValidatedPipe())
+    {
+        mInterruptPipe.abort();
+        mInterruptPipe.setPipe(NULL);
+    }
+    if (mBulkPipe.getValidatedPipe())
+    {
+        mBulkPipe.abort();
+        mBulkPipe.setPipe(NULL);
+    }
+    if (mInterface.getValidatedInterface())
+    {
+        mInterface.close(this);
+        mInterface.setInterface(NULL);
+    }
+}
+
+/*
+ * Size the bulk write buffer to the largest HCI command rounded up to
+ * whole max size packets of the bulk pipe. The read buffer is sized to
+ * the interrupt pipe the same way by continuousRead.
+ */
+bool BrcmPatchRAM::prepareTransferBuffers()
+{
+    IOReturn result;
+    UInt32 writeSize = mBulkPipe.getTransferSize(kMaxHciCommandSize);
+    
+    DebugLog("[%04x:%04x]: Interrupt pipe %d bytes/%d interval, bulk pipe %d bytes, transfer sizes %d/%d.\n",
+             mVendorId, mProductId, mInterruptPipe.getMaxPacketSize(), mInterruptPipe.getInterval(),
+             mBulkPipe.getMaxPacketSize(), mInterruptPipe.getTransferSize(kMaxHciEventSize), writeSize);
+    
+    mWriteBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, writeSize);
+    if (!mWriteBuffer)
+    {
+        AlwaysLog("[%04x:%04x]: Unable to allocate bulk write buffer.\n", mVendorId, mProductId);
+        return false;
+    }
+    if ((result = mWriteBuffer->prepare()) != kIOReturnSuccess)
+    {
+        AlwaysLog("[%04x:%04x]: Failed to prepare bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        OSSafeReleaseNULL(mWriteBuffer);
+        return false;
+    }
+    return true;
+}
+
+void BrcmPatchRAM::releaseTransferBuffers()
+{
+    if (mWriteBuffer)
+    {
+        mWriteBuffer->complete();
+        OSSafeReleaseNULL(mWriteBuffer);
+    }
+}
+
 bool BrcmPatchRAM::continuousRead()
 {
+    // Largest HCI event rounded up to whole interrupt packets
+    UInt32 readSize = mInterruptPipe.getTransferSize(kMaxHciEventSize);
+
+    // The read buffer outlives the upload, only replace it if the endpoint changed
+    if (mReadBuffer && mReadBuffer->getLength() != readSize)
+        OSSafeReleaseNULL(mReadBuffer);
+
     if (!mReadBuffer)
     {
-        mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, 0x200);
+        mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, readSize);
         if (!mReadBuffer)
         {
             AlwaysLog("[%04x:%04x]: continuousRead - failed to allocate read buffer.\n", mVendorId, mProductId);
@@ -1061,6 +1730,8 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
 
     IOLockLock(me->mCompletionLock);
 
+    me->mReadPending = false;
+
     IOReturn result = me->mReadBuffer->complete();
     if (result != kIOReturnSuccess)
         DebugLog("[%04x:%04x]: ReadCompletion failed to complete read buffer (\"%s\" 0x%08x).\n", me->mVendorId, me->mProductId, me->stringFromReturn(result), result);
@@ -1083,10 +1754,14 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
             me->mDeviceState = kUpdateAborted;
             break;
         case kIOUSBTransactionTimeout:
-            AlwaysLog("[%04x:%04x]: readCompletion - Transaction timeout (0x%08x)\n", me->mVendorId, me->mProductId, status);
+            if (me->firstError(kLoggedReadTimeout))
+                AlwaysLog("[%04x:%04x]: readCompletion - Transaction timeout (0x%08x)\n", me->mVendorId, me->mProductId, status);
+            me->trace(kTraceReadError, 0, status);
             break;
         case kIOReturnNotResponding:
-            AlwaysLog("[%04x:%04x]: Not responding - Delaying next read.\n", me->mVendorId, me->mProductId);
+            if (me->firstError(kLoggedNotResponding))
+                AlwaysLog("[%04x:%04x]: Not responding - Delaying next read.\n", me->mVendorId, me->mProductId);
+            me->trace(kTraceReadError, 0, status);
             me->mInterruptPipe.clearStall();
             me->mDeviceState = kUpdateAborted;
             break;
@@ -1102,20 +1777,66 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
     IOLockWakeup(me->mCompletionLock, me, true);
 }
 
+/*
+ * Commands are sent asynchronously so that the control transfer is in
+ * flight together with the interrupt read for its response. performUpgrade
+ * waits for both completions before it moves on.
+ */
 IOReturn BrcmPatchRAM::hciCommand(void * command, UInt16 length)
 {
     IOReturn result;
-    if ((result = mInterface.hciCommand(command, length)) != kIOReturnSuccess)
+
+#ifndef TARGET_ELCAPITAN
+    mCommandCompletion.target = this;
+#else
+    mCommandCompletion.owner = this;
+#endif
+    mCommandCompletion.action = commandCompletion;
+    mCommandCompletion.parameter = NULL;
+
+    trace(kTraceCommand, length, *(UInt16*)command);
+    mCommandPending = true;
+    if ((result = mInterface.hciCommand(command, length, &mCommandCompletion)) != kIOReturnSuccess)
+    {
+        mCommandPending = false;
+        trace(kTraceCommandError, 0, result);
         AlwaysLog("[%04x:%04x]: device request failed (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+    }
     
     return result;
 }
 
+#ifndef TARGET_ELCAPITAN
+void BrcmPatchRAM::commandCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining)
+#else
+void BrcmPatchRAM::commandCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred)
+#endif
+{
+    BrcmPatchRAM *me = (BrcmPatchRAM*)target;
+
+    IOLockLock(me->mCompletionLock);
+
+    me->mCommandPending = false;
+
+    if (status != kIOReturnSuccess)
+    {
+        AlwaysLog("[%04x:%04x]: device request failed (\"%s\" 0x%08x).\n", me->mVendorId, me->mProductId, me->stringFromReturn(status), status);
+        me->mDeviceState = kUpdateAborted;
+    }
+
+    IOLockUnlock(me->mCompletionLock);
+
+    // wake waiting task in performUpgrade (in IOLockSleep)...
+    IOLockWakeup(me->mCompletionLock, me, true);
+}
+
 IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* output, UInt8* outputLength)
 {
     HCI_RESPONSE* header = (HCI_RESPONSE*)response;
     IOReturn result = kIOReturnSuccess;
 
+    trace(kTraceRead, length, header->eventCode);
+
     switch (header->eventCode)
     {
         case HCI_EVENT_COMMAND_COMPLETE:
@@ -1125,46 +1846,62 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             switch (event->opcode)
             {
                 case HCI_OPCODE_READ_VERBOSE_CONFIG:
-                    DebugLog("[%04x:%04x]: READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
+                    // Read back after the reset, see kResetComplete
+                    if (mDeviceState == kResetComplete)
+                    {
+                        mFinalVersion = *(UInt16*)(((char*)response) + 10);
+                        CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Firmware version after upload: v%d.\n",
+                                 mVendorId, mProductId, mFinalVersion + 0x1000);
+                        mDeviceState = kFinalVersion;
+                        break;
+                    }
+                    
                     mFirmwareVersion = *(UInt16*)(((char*)response) + 10);
                     
-                    DebugLog("[%04x:%04x]: Firmware version: v%d.\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Firmware version: v%d.\n",
                              mVendorId, mProductId, mFirmwareVersion + 0x1000);
                     
+                    // Without the reset the controller may still run firmware loaded before
+                    if (mFirmwareVersion > 0 && mResetDeferred)
+                    {
+                        mResetRequired = true;
+                        mDeviceState = kUpdateAborted;
+                    }
                     // Device does not require a firmware patch at this time
-                    if (mFirmwareVersion > 0)
+                    else if (mFirmwareVersion > 0)
                         mDeviceState = kUpdateNotNeeded;
                     else
                         mDeviceState = kFirmwareVersion;
                     break;
                 case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
-                    DebugLog("[%04x:%04x]: DOWNLOAD MINIDRIVER complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: DOWNLOAD MINIDRIVER complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kMiniDriverComplete;
                     break;
                 case HCI_OPCODE_LAUNCH_RAM:
-                    //DebugLog("[%04x:%04x]: LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n",
-                    //          mVendorId, mProductId, event->status, header->length);
+                    CategoryLog(kLogUSB, kLogVerbose, "[%04x:%04x]: LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n",
+                                mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kInstructionWritten;
                     break;
                 case HCI_OPCODE_END_OF_RECORD:
-                    DebugLog("[%04x:%04x]: END OF RECORD complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: END OF RECORD complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kFirmwareWritten;
                     break;
                 case HCI_OPCODE_RESET:
-                    DebugLog("[%04x:%04x]: RESET complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: RESET complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kResetComplete;
                     break;
                 default:
-                    DebugLog("[%04x:%04x]: Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->opcode, event->status, header->length);
                     break;
             }
@@ -1176,7 +1913,7 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
                 // Return the received data
                 if (*outputLength >= length)
                 {
-                    DebugLog("[%04x:%04x]: Returning output data %d bytes.\n", mVendorId, mProductId, length);
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Returning output data %d bytes.\n", mVendorId, mProductId, length);
                     
                     *outputLength = length;
                     memcpy(output, response, length);
@@ -1188,32 +1925,32 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             break;
         }
         case HCI_EVENT_NUM_COMPLETED_PACKETS:
-            DebugLog("[%04x:%04x]: Number of completed packets.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Number of completed packets.\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_CONN_COMPLETE:
-            DebugLog("[%04x:%04x]: Connection complete event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Connection complete event.\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_DISCONN_COMPLETE:
-            DebugLog("[%04x:%04x]: Disconnection complete. event\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Disconnection complete. event\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_HARDWARE_ERROR:
-            DebugLog("[%04x:%04x]: Hardware error\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Hardware error\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_MODE_CHANGE:
-            DebugLog("[%04x:%04x]: Mode change event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Mode change event.\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_LE_META:
-            DebugLog("[%04x:%04x]: Low-Energy meta event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Low-Energy meta event.\n", mVendorId, mProductId);
             break;
         case HCI_EVENT_VENDOR:
-            DebugLog("[%04x:%04x]: Vendor specific event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Vendor specific event.\n", mVendorId, mProductId);
             if (mSupportsHandshake) {
                 // Device is ready for reset.
                 mDeviceState = kResetWrite;
             }
             break;
         default:
-            DebugLog("[%04x:%04x]: Unknown event code (0x%02x).\n", mVendorId, mProductId, header->eventCode);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Unknown event code (0x%02x).\n", mVendorId, mProductId, header->eventCode);
             break;
     }
     
@@ -1224,31 +1961,356 @@ IOReturn BrcmPatchRAM::bulkWrite(const void* data, UInt16 length)
 {
     IOReturn result;
     
-    if (IOMemoryDescriptor* buffer = IOMemoryDescriptor::withAddress((void*)data, length, kIODirectionIn))
+    /*
+     * The write buffer has been prepared once per upload and holds a whole
+     * number of bulk packets, so only the record needs to be copied in,
+     * unless it was read from a firmware stream straight into the buffer.
+     */
+    if (!mWriteBuffer || length > mWriteBuffer->getLength())
+    {
+        AlwaysLog("[%04x:%04x]: Bulk write of %d bytes exceeds write buffer.\n", mVendorId, mProductId, length);
+        return kIOReturnOverrun;
+    }
+    if (data != mWriteBuffer->getBytesNoCopy())
+        mWriteBuffer->writeBytes(0, data, length);
+    
+    if ((result = mBulkPipe.write(mWriteBuffer, 0, 0, length, NULL)) == kIOReturnSuccess)
+    {
+        //DEBUG_LOG("%s: Wrote %d bytes to bulk pipe.\n", getName(), length);
+    }
+    else
+    {
+        if (firstError(kLoggedWriteError))
+            AlwaysLog("[%04x:%04x]: Failed to write to bulk pipe (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        trace(kTraceWriteError, length, result);
+    }
+    
+    return result;
+}
+
+/*
+ * Send one LAUNCH_RAM record, either as a bulk transfer or as an ordinary
+ * HCI command on the control endpoint. In auto mode the first records are
+ * split between both transports before the faster one is locked in.
+ */
+UInt32 BrcmPatchRAM::nextRecordTransport()
+{
+    if (mTransport != kTransportAuto)
+        return mTransport;
+
+    if (mTransportStats[kTransportBulk].records < kTransportProbeRecords)
+        return kTransportBulk;
+    return kTransportControl;
+}
+
+IOReturn BrcmPatchRAM::writeRecord(const void* record, UInt16 length)
+{
+    mRecordTransport = nextRecordTransport();
+    mRecordLength = length;
+    mRecordAddress = OSReadLittleInt32(record, 3);
+    clock_get_uptime(&mRecordStart);
+    trace(kTraceRecord, mRecordLength, mRecordTransport);
+
+    if (mRecordTransport == kTransportControl)
+        return hciCommand((void*)record, length);
+
+    return bulkWrite(record, length);
+}
+
+void BrcmPatchRAM::recordWritten()
+{
+    TransportStats* stats = &mTransportStats[mRecordTransport];
+    TransportStats* bulk = &mTransportStats[kTransportBulk];
+    TransportStats* control = &mTransportStats[kTransportControl];
+    uint64_t end_time, nano_secs;
+
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - mRecordStart, &nano_secs);
+
+    stats->records++;
+    stats->bytes += mRecordLength;
+    stats->nanoseconds += nano_secs;
+    trace(kTraceRecordWritten, mRecordLength, (UInt32)nano_secs);
+
+    // Group by address region, the last entry collects regions that don't fit
+    static const UInt32 sizeLimits[kLatencySizes] = { 32, 64, 128, 0xFFFF };
+    UInt32 region = mRecordAddress & 0xFFFF0000;
+    UInt32 i;
+
+    for (i = 0; i < mRegionCount && mRegionLatency[i].key != region; i++);
+    if (i == mRegionCount)
+    {
+        if (mRegionCount < kLatencyRegions - 1)
+        {
+            mRegionCount++;
+        }
+        else
+        {
+            i = kLatencyRegions - 1;
+            region = 0xFFFFFFFF;
+            mRegionCount = kLatencyRegions;
+        }
+        mRegionLatency[i].key = region;
+    }
+    addRecordLatency(&mRegionLatency[i], mRecordLength, nano_secs);
+
+    for (i = 0; mRecordLength > sizeLimits[i] && i < kLatencySizes - 1; i++);
+    mSizeLatency[i].key = sizeLimits[i];
+    addRecordLatency(&mSizeLatency[i], mRecordLength, nano_secs);
+
+    if (mTransport == kTransportAuto && control->records == kTransportProbeRecords)
+    {
+        // Compare bytes per nanosecond without dividing
+        if (control->bytes * bulk->nanoseconds > bulk->bytes * control->nanoseconds)
+            mTransport = kTransportControl;
+        else
+            mTransport = kTransportBulk;
+
+        AlwaysLog("[%04x:%04x]: Using %s transport for firmware records.\n", mVendorId, mProductId,
+                  mTransport == kTransportControl ? "control" : "bulk");
+    }
+}
+
+/*
+ * Publish the measured firmware record throughput of each transport used
+ * in bytes per second, and the transport selected, in the device registry.
+ */
+void BrcmPatchRAM::publishTransportStats()
+{
+    static const char* const names[] = { "RM,BulkThroughput", "RM,ControlThroughput" };
+
+    for (int i = kTransportBulk; i <= kTransportControl; i++)
+    {
+        TransportStats* stats = &mTransportStats[i];
+        if (!stats->records || !stats->nanoseconds)
+            continue;
+
+        if (OSNumber* throughput = OSNumber::withNumber(stats->bytes * 1000000000ULL / stats->nanoseconds, 64))
+        {
+            mDevice.setProperty(names[i], throughput);
+            throughput->release();
+        }
+        DebugLog("[%04x:%04x]: %s %u records, %llu bytes in %llu us.\n", mVendorId, mProductId,
+                 names[i], stats->records, (unsigned long long)stats->bytes, (unsigned long long)(stats->nanoseconds / 1000));
+    }
+    if (OSString* transport = OSString::withCString(mTransport == kTransportControl ? "Control" : mTransport == kTransportBulk ? "Bulk" : "Auto"))
+    {
+        mDevice.setProperty("RM,FirmwareTransport", transport);
+        transport->release();
+    }
+
+    // Wired memory held for the upload, the read buffer stays with the instance
+    UInt64 bufferBytes = (mReadBuffer ? mReadBuffer->getCapacity() : 0) + (mWriteBuffer ? mWriteBuffer->getCapacity() : 0);
+    if (OSNumber* bytes = OSNumber::withNumber(bufferBytes, 64))
+    {
+        mDevice.setProperty("RM,TransferBufferBytes", bytes);
+        bytes->release();
+    }
+}
+
+void BrcmPatchRAM::addRecordLatency(RecordLatency* latency, UInt16 length, uint64_t nanoseconds)
+{
+    latency->records++;
+    latency->bytes += length;
+    latency->nanoseconds += nanoseconds;
+
+    if (nanoseconds > latency->maxNanoseconds)
+        latency->maxNanoseconds = nanoseconds;
+}
+
+/*
+ * Publish the record latency by address region and by record size, with
+ * times in microseconds, to show which parts of an image upload slowly.
+ */
+void BrcmPatchRAM::publishRecordLatency()
+{
+    OSDictionary* latency = OSDictionary::withCapacity(2);
+
+    if (!latency)
+        return;
+
+    for (int table = 0; table < 2; table++)
     {
-        if ((result = buffer->prepare()) == kIOReturnSuccess)
+        RecordLatency* entries = table ? mSizeLatency : mRegionLatency;
+        UInt32 count = table ? kLatencySizes : mRegionCount;
+        OSArray* array = OSArray::withCapacity(count);
+
+        if (!array)
+            continue;
+
+        for (UInt32 i = 0; i < count; i++)
         {
-            if ((result = mBulkPipe.write(buffer, 0, 0, buffer->getLength(), NULL)) == kIOReturnSuccess)
+            OSDictionary* entry = OSDictionary::withCapacity(5);
+            uint64_t values[] = { entries[i].key, entries[i].records, entries[i].bytes,
+                                  entries[i].nanoseconds / 1000, entries[i].maxNanoseconds / 1000 };
+            static const char* const names[] = { "Key", "Records", "Bytes", "Time", "MaxTime" };
+
+            if (!entry || !entries[i].records)
             {
-                //DEBUG_LOG("%s: Wrote %d bytes to bulk pipe.\n", getName(), length);
+                OSSafeReleaseNULL(entry);
+                continue;
             }
-            else
-                AlwaysLog("[%04x:%04x]: Failed to write to bulk pipe (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+            for (int j = 0; j < 5; j++)
+            {
+                if (OSNumber* number = OSNumber::withNumber(values[j], 64))
+                {
+                    entry->setObject(names[j], number);
+                    number->release();
+                }
+            }
+            array->setObject(entry);
+            entry->release();
+        }
+        latency->setObject(table ? "Sizes" : "Regions", array);
+        array->release();
+    }
+    mDevice.setProperty("RM,RecordLatency", latency);
+    latency->release();
+}
+
+/*
+ * Publish the outcome of the upload as one RM,UploadResult dictionary on
+ * the device, so it can be collected without scraping the kernel log.
+ * Times are in microseconds, versions as logged (v + 0x1000).
+ */
+void BrcmPatchRAM::publishUploadResult(const char* outcome, bool cached, uint64_t setupTime, uint64_t startTime)
+{
+    uint64_t end_time, nano_secs;
+    OSDictionary* result = OSDictionary::withCapacity(20);
+
+    if (!result)
+        return;
+
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - startTime, &nano_secs);
+
+    bool known = mFirmwareVersion != 0xFFFF;
+    UInt16 versionAfter = mFinalVersion != 0xFFFF ? mFinalVersion : mFirmwareVersion;
+    OSString* firmwareKey = OSDynamicCast(OSString, getProperty(kFirmwareKey));
+    UploadOutcome uploadOutcome =
+    {
+        outcome,
+        cached ? "Cached" : "Full",
+        mFailedState != kUnknown ? getState(mFailedState) : NULL,
+        firmwareKey ? firmwareKey->getCStringNoCopy() : NULL,
+        mTransportStats[kTransportBulk].records + mTransportStats[kTransportControl].records,
+        mTransportStats[kTransportBulk].bytes + mTransportStats[kTransportControl].bytes,
+        mUploadRetries,
+        setupTime / 1000,
+        nano_secs / 1000,
+        mPhaseTime[kPhaseVersion] / 1000,
+        mPhaseTime[kPhaseMiniDriver] / 1000,
+        mPhaseTime[kPhaseRecords] / 1000,
+        mPhaseTime[kPhaseEndOfRecord] / 1000,
+        mPhaseTime[kPhaseReset] / 1000,
+        known ? mFirmwareVersion + 0x1000U : 0,
+        (versionAfter != 0xFFFF && versionAfter) ? versionAfter + 0x1000U : 0,
+        mSavedSettleTime,
+    };
+    setUploadOutcome(result, &uploadOutcome);
+
+    // Fold in what the upload published on its own
+    static const char* const folded[][2] = {
+        { "Transport", "RM,FirmwareTransport" },
+        { "RecordLatency", "RM,RecordLatency" },
+    };
+    for (unsigned i = 0; i < sizeof(folded) / sizeof(folded[0]); i++)
+    {
+        if (OSObject* object = mDevice.getProperty(folded[i][1]))
+            result->setObject(folded[i][0], object);
+    }
+
+    mDevice.setProperty(kUploadResult, result);
+    result->release();
+}
+
+/*
+ * Export the trace of the last upload as RM,Trace on the device, laid out
+ * as described in BrcmPatchRAM.h. Debug builds also print it.
+ */
+void BrcmPatchRAM::publishTrace()
+{
+    if (!mTrace.enabled)
+        return;
+
+    UInt32 head = mTrace.head;
+    UInt32 count = head < kTraceEntries ? head : kTraceEntries;
+    OSData* data = OSData::withCapacity(count * sizeof(TraceEntry));
+
+    if (!data)
+        return;
+
+    for (UInt32 i = head - count; i != head; i++)
+    {
+        TraceEntry* entry = &mTrace.entries[i & (kTraceEntries - 1)];
+
+        data->appendBytes(entry, sizeof(TraceEntry));
+#ifdef DEBUG
+        uint64_t nano_secs;
+
+        absolutetime_to_nanoseconds(entry->timestamp - mTrace.entries[(head - count) & (kTraceEntries - 1)].timestamp, &nano_secs);
+        DebugLog("[%04x:%04x]: trace %llu us event %u (0x%04x, 0x%08x)\n", mVendorId, mProductId,
+                 (unsigned long long)(nano_secs / 1000), entry->event, entry->arg0, entry->arg1);
+#endif
+    }
+    mDevice.setProperty("RM,Trace", data);
+    data->release();
+}
+
+/*
+ * Get the next record of the firmware, NULL at its end. With the decode
+ * pipeline, records are sent while the firmware store is still decoding
+ * the rest and this waits until the next one is available. A firmware
+ * stream is read straight into the buffer that writeRecord sends from.
+ */
+IOReturn BrcmPatchRAM::nextInstruction(OSArray* instructions, const void** record, UInt16* length)
+{
+    OSData* instruction;
+    IOReturn result = kIOReturnSuccess;
+
+    if (mFirmwareStream)
+    {
+        UInt8* buffer;
+        UInt16 capacity;
+
+        if (nextRecordTransport() == kTransportControl)
+        {
+            buffer = (UInt8*)mInterface.getCommandBuffer();
+            capacity = kMaxHciCommandSize;
         }
         else
-            AlwaysLog("[%04x:%04x]: Failed to prepare bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
-        
-        if ((result = buffer->complete()) != kIOReturnSuccess)
-            AlwaysLog("[%04x:%04x]: Failed to complete bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
-        
-        buffer->release();
+        {
+            buffer = mWriteBuffer ? (UInt8*)mWriteBuffer->getBytesNoCopy() : NULL;
+            capacity = mWriteBuffer ? mWriteBuffer->getLength() : 0;
+        }
+        if (!buffer)
+            return kIOReturnNoMemory;
+
+        result = mFirmwareStream->readRecord(buffer, capacity, length);
+        *record = *length ? buffer : NULL;
+
+        if (result != kIOReturnSuccess)
+            AlwaysLog("[%04x:%04x]: Firmware failed to decode after %u records, aborting.\n", mVendorId, mProductId, mFirmwareStream->getRecordCount());
+        return result;
+    }
+
+    // should never happen, but would cause a crash
+    if (!instructions)
+        return kIOReturnNotReady;
+
+    if (!mPipelineDecode)
+    {
+        instruction = OSDynamicCast(OSData, instructions->getObject(mInstructionIndex++));
     }
     else
     {
-        AlwaysLog("[%04x:%04x]: Unable to allocate bulk write buffer.\n", mVendorId, mProductId);
-        result = kIOReturnNoMemory;
+        result = mFirmwareStore->waitForInstruction(OSDynamicCast(OSString, getProperty(kFirmwareKey)), instructions, mInstructionIndex++, &instruction);
+
+        if (result != kIOReturnSuccess)
+            AlwaysLog("[%04x:%04x]: Firmware failed to decode after %u records, aborting.\n", mVendorId, mProductId, mInstructionIndex - 1);
     }
-    
+    *record = instruction ? instruction->getBytesNoCopy() : NULL;
+    *length = instruction ? instruction->getLength() : 0;
     return result;
 }
 
@@ -1256,22 +2318,38 @@ bool BrcmPatchRAM::performUpgrade()
 {
     BrcmFirmwareStore* firmwareStore;
     OSArray* instructions = NULL;
-    OSCollectionIterator* iterator = NULL;
-    OSData* data;
-#ifdef DEBUG
+    const void* record;
+    UInt16 length;
+    bool aborting;
+    uint64_t deadline;
     DeviceState previousState = kUnknown;
-#endif
+
+    bzero(mTransportStats, sizeof(mTransportStats));
+    mTrace.head = 0;
+    mLoggedErrors = 0;
+    clock_get_uptime(&mPhaseStart);
+    bzero(mRegionLatency, sizeof(mRegionLatency));
+    bzero(mSizeLatency, sizeof(mSizeLatency));
+    mRegionCount = 0;
+    mInstructionIndex = 0;
+
+    mFailedState = kUnknown;
 
     IOLockLock(mCompletionLock);
     mDeviceState = kInitialize;
 
     while (true)
     {
-#ifdef DEBUG
         if (mDeviceState != kInstructionWrite && mDeviceState != kInstructionWritten)
-            DebugLog("[%04x:%04x]: State \"%s\" --> \"%s\".\n", mVendorId, mProductId, getState(previousState), getState(mDeviceState));
+        {
+            CategoryLog(kLogState, kLogDebug, "[%04x:%04x]: State \"%s\" --> \"%s\".\n", mVendorId, mProductId, getState(previousState), getState(mDeviceState));
+            trace(kTraceState, previousState, mDeviceState);
+        }
+
+        if (mDeviceState == kUpdateAborted && mFailedState == kUnknown)
+            mFailedState = previousState;
+
         previousState = mDeviceState;
-#endif
 
         // Break out when done
         if (mDeviceState == kUpdateAborted || mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded)
@@ -1284,36 +2362,47 @@ bool BrcmPatchRAM::performUpgrade()
         switch (mDeviceState)
         {
             case kInitialize:
-                hciCommand(&HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG));
+                if (hciCommand(&HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG)) != kIOReturnSuccess)
+                {
+                    DebugLog("HCI_VSC_READ_VERBOSE_CONFIG failed, aborting.");
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
                 break;
 
             case kFirmwareVersion:
+                endPhase(kPhaseVersion);
+
                 // Unable to retrieve firmware store
                 if (!(firmwareStore = getFirmwareStore()))
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
-                instructions = firmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                if (mPipelineDecode)
+                    instructions = firmwareStore->beginFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                else if (firmwareStore->isCompactCache())
+                    mFirmwareStream = firmwareStore->openFirmwareStream(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                else if ((instructions = firmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)))))
+                    instructions->retain();
                 // Unable to retrieve firmware instructions
-                if (!instructions)
+                if (!instructions && !mFirmwareStream)
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
 
                 // Initiate firmware upgrade
-                hciCommand(&HCI_VSC_DOWNLOAD_MINIDRIVER, sizeof(HCI_VSC_DOWNLOAD_MINIDRIVER));
-                break;
-
-            case kMiniDriverComplete:
-                // Write firmware data to bulk pipe
-                iterator = OSCollectionIterator::withCollection(instructions);
-                if (!iterator)
+                if (hciCommand(&HCI_VSC_DOWNLOAD_MINIDRIVER, sizeof(HCI_VSC_DOWNLOAD_MINIDRIVER)) != kIOReturnSuccess)
                 {
+                    DebugLog("HCI_VSC_DOWNLOAD_MINIDRIVER failed, aborting.");
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
+                break;
+
+            case kMiniDriverComplete:
+                endPhase(kPhaseMiniDriver);
 
                 // If this IOSleep is not issued, the device is not ready to receive
                 // the firmware instructions and we will deadlock due to lack of
@@ -1321,43 +2410,92 @@ bool BrcmPatchRAM::performUpgrade()
                 IOSleep(mInitialDelay);
 
                 // Write first instruction to trigger response
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject())))
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
+                if (nextInstruction(instructions, &record, &length) != kIOReturnSuccess)
+                {
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
+                if (record && writeRecord(record, length) != kIOReturnSuccess)
+                {
+                    DebugLog("Writing the first record failed, aborting.");
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
                 break;
 
             case kInstructionWrite:
                 // should never happen, but would cause a crash
-                if (!iterator)
+                if (nextInstruction(instructions, &record, &length) != kIOReturnSuccess)
                 {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
 
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject())))
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
+                if (record)
+                {
+                    if (writeRecord(record, length) != kIOReturnSuccess)
+                    {
+                        DebugLog("Writing a record failed, aborting.");
+                        mDeviceState = kUpdateAborted;
+                        continue;
+                    }
+                }
                 else
+                {
                     // Firmware data fully written
-                    hciCommand(&HCI_VSC_END_OF_RECORD, sizeof(HCI_VSC_END_OF_RECORD));
+                    endPhase(kPhaseRecords);
+                    if (hciCommand(&HCI_VSC_END_OF_RECORD, sizeof(HCI_VSC_END_OF_RECORD)) != kIOReturnSuccess)
+                    {
+                        DebugLog("HCI_VSC_END_OF_RECORD failed, aborting.");
+                        mDeviceState = kUpdateAborted;
+                        continue;
+                    }
+                }
                 break;
 
             case kInstructionWritten:
+                recordWritten();
                 mDeviceState = kInstructionWrite;
                 continue;
 
             case kFirmwareWritten:
+                endPhase(kPhaseEndOfRecord);
+
                 if (!mSupportsHandshake) {
                     IOSleep(mPreResetDelay);
-                    hciCommand(&HCI_RESET, sizeof(HCI_RESET));
+
+                    if (hciCommand(&HCI_RESET, sizeof(HCI_RESET)) != kIOReturnSuccess)
+                    {
+                        DebugLog("HCI_RESET failed, aborting.");
+                        mDeviceState = kUpdateAborted;
+                        continue;
+                    }
                 }
                 break;
                 
             case kResetWrite:
-                hciCommand(&HCI_RESET, sizeof(HCI_RESET));
+                if (hciCommand(&HCI_RESET, sizeof(HCI_RESET)) != kIOReturnSuccess)
+                {
+                    DebugLog("HCI_RESET failed, aborting.");
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
                 break;
 
             case kResetComplete:
+                // Read back the version the controller runs now, for RM,UploadResult
+                if (hciCommand(&HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG)) != kIOReturnSuccess)
+                {
+                    DebugLog("HCI_VSC_READ_VERBOSE_CONFIG after reset failed.");
+                    mDeviceState = kFinalVersion;
+                    continue;
+                }
+                break;
+
+            case kFinalVersion:
                 resetDevice();
                 getDeviceStatus();
+                endPhase(kPhaseReset);
                 mDeviceState = kUpdateComplete;
                 continue;
 
@@ -1370,17 +2508,48 @@ bool BrcmPatchRAM::performUpgrade()
         }
 
         // queue async read
-        if (!continuousRead())
-        {
+        if (continuousRead())
+            mReadPending = true;
+        else
             mDeviceState = kUpdateAborted;
-            continue;
+
+        // wait for completion of the async read and of a pending command
+        aborting = false;
+        if (mResetDeferred && mDeviceState == kInitialize)
+            clock_interval_to_deadline(kResetProbeTimeout, kMillisecondScale, &deadline);
+        while (mReadPending || mCommandPending)
+        {
+            // Don't block on a controller that may need the deferred reset to respond
+            if (mResetDeferred && mDeviceState == kInitialize)
+            {
+                if (IOLockSleepDeadline(mCompletionLock, this, deadline, 0) == THREAD_TIMED_OUT)
+                {
+                    DebugLog("[%04x:%04x]: No response without reset.\n", mVendorId, mProductId);
+                    mResetRequired = true;
+                    mDeviceState = kUpdateAborted;
+                }
+            }
+            else
+                IOLockSleep(mCompletionLock, this, 0);
+
+            // A failed command won't get a response, cancel the read
+            if (mDeviceState == kUpdateAborted && mReadPending && !aborting)
+            {
+                aborting = true;
+                IOLockUnlock(mCompletionLock);
+                mInterruptPipe.abort();
+                IOLockLock(mCompletionLock);
+            }
         }
-        // wait for completion of the async read
-        IOLockSleep(mCompletionLock, this, 0);
     }
 
     IOLockUnlock(mCompletionLock);
-    OSSafeReleaseNULL(iterator);
+    OSSafeReleaseNULL(instructions);
+    OSSafeReleaseNULL(mFirmwareStream);
+
+    publishTransportStats();
+    publishRecordLatency();
+    publishTrace();
 
     return mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded;
 }
@@ -1396,7 +2565,6 @@ bool BrcmPatchRAM::supportsHandshake(UInt16 vid, UInt16 did)
     return false;
 }
 
-#ifdef DEBUG
 const char* BrcmPatchRAM::getState(DeviceState deviceState)
 {
     static const IONamedValue state_values[] = {
@@ -1409,6 +2577,7 @@ const char* BrcmPatchRAM::getState(DeviceState deviceState)
         {kFirmwareWritten,    "Firmware written"     },
         {kResetWrite,         "Perform reset"        },
         {kResetComplete,      "Reset complete"       },
+        {kFinalVersion,       "Final version"        },
         {kUpdateComplete,     "Update complete"      },
         {kUpdateNotNeeded,    "Update not needed"    },
         {0,                   NULL                   }
@@ -1416,7 +2585,6 @@ const char* BrcmPatchRAM::getState(DeviceState deviceState)
     
     return IOFindNameForValue(deviceState, state_values);
 }
-#endif //DEBUG
 
 #ifndef kIOUSBClearPipeStallNotRecursive
 // from 10.7 SDK
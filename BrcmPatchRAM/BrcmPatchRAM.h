@@ -24,10 +24,12 @@
 #define NON_RESIDENT 1
 #endif
 
-#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
 
 #include "BrcmFirmwareStore.h"
+#include "UploadOutcome.h"
 #include "USBDeviceShim.h"
 
 #define kDisplayName "DisplayName"
@@ -51,6 +53,7 @@ enum DeviceState
     kFirmwareWritten,
     kResetWrite,
     kResetComplete,
+    kFinalVersion,
     kUpdateComplete,
     kUpdateNotNeeded,
     kUpdateAborted,
@@ -62,6 +65,195 @@ typedef struct DeviceHskSupport
     UInt16 did;
 } DeviceHskSupport;
 
+/*
+ * USB topology resolved by a successful upload, so that later uploads
+ * (wake, timer retry, re-probe) can skip the descriptor walks.
+ */
+typedef struct DeviceTopology
+{
+    UInt16 vid;
+    UInt16 did;
+    UInt32 locationId;
+    UInt8 configurationValue;
+    UInt8 interfaceNumber;
+    UInt8 interruptEndpoint;
+    UInt8 bulkEndpoint;
+} DeviceTopology;
+
+#define kMaxCachedTopologies 8
+
+/*
+ * Transport used for the LAUNCH_RAM firmware records, selected by the
+ * FirmwareTransport property or bpr_transport boot-arg. Auto sends the
+ * first kTransportProbeRecords records over each and keeps the faster.
+ */
+enum FirmwareTransport
+{
+    kTransportBulk,
+    kTransportControl,
+    kTransportAuto,
+};
+
+#define kTransportProbeRecords 8
+
+/*
+ * Reset before upload, selected by the ResetPolicy property or the
+ * bpr_resetpolicy boot-arg. Auto defers the reset and settle time until
+ * READ_VERBOSE_CONFIG shows the controller is not in a clean ROM state.
+ */
+enum ResetPolicy
+{
+    kResetAlways,
+    kResetAuto,
+};
+
+// Time to wait for the READ_VERBOSE_CONFIG response without a prior reset
+#define kResetProbeTimeout 500
+
+/*
+ * LAUNCH_RAM round trip times, grouped by the 64KB region of the target
+ * address and by record size, published as RM,RecordLatency. Regions
+ * past the first kLatencyRegions - 1 share the last entry.
+ */
+#define kLatencyRegions 16
+#define kLatencySizes 4
+
+typedef struct RecordLatency
+{
+    UInt32 key;             // region address, or largest record size
+    UInt32 records;
+    UInt32 bytes;
+    UInt64 nanoseconds;
+    UInt64 maxNanoseconds;
+} RecordLatency;
+
+/*
+ * Phases of an upload, each timed from the end of the one before and
+ * published in RM,UploadResult.
+ */
+enum UploadPhase
+{
+    kPhaseVersion,          // READ_VERBOSE_CONFIG
+    kPhaseMiniDriver,       // DOWNLOAD_MINIDRIVER
+    kPhaseRecords,          // LAUNCH_RAM records
+    kPhaseEndOfRecord,      // END_OF_RECORD
+    kPhaseReset,            // HCI reset, version read back and USB reset
+    kPhaseCount,
+};
+
+typedef struct TransportStats
+{
+    UInt32 records;
+    UInt64 bytes;
+    UInt64 nanoseconds;
+} TransportStats;
+
+/*
+ * Binary trace of an upload, enabled by the Trace property or bpr_trace
+ * boot-arg. Events are claimed with an atomic increment, so completion
+ * callbacks never wait on a lock, and only formatted when exported.
+ * RM,Trace holds the entries oldest first: 8 bytes mach absolute time,
+ * then 2 bytes event, 2 bytes arg0 and 4 bytes arg1, host endian.
+ */
+enum TraceEvent
+{
+    kTraceState,            // arg0 previous state, arg1 new state
+    kTraceCommand,          // arg0 length, arg1 opcode
+    kTraceCommandError,     // arg1 IOReturn
+    kTraceRead,             // arg0 length, arg1 event code
+    kTraceReadError,        // arg1 IOReturn
+    kTraceRecord,           // arg0 length, arg1 transport
+    kTraceRecordWritten,    // arg0 length, arg1 nanoseconds
+    kTraceWriteError,       // arg0 length, arg1 IOReturn
+};
+
+/*
+ * Errors of the hot paths that are logged once per upload, their repeats
+ * only go to the trace.
+ */
+enum LoggedError
+{
+    kLoggedReadTimeout      = 1 << 0,
+    kLoggedNotResponding    = 1 << 1,
+    kLoggedWriteError       = 1 << 2,
+};
+
+// Must be a power of two
+#define kTraceEntries 256
+
+typedef struct TraceEntry
+{
+    UInt64 timestamp;
+    UInt16 event;
+    UInt16 arg0;
+    UInt32 arg1;
+} TraceEntry;
+
+typedef struct TraceRing
+{
+    bool enabled;
+    volatile SInt32 head;
+    TraceEntry entries[kTraceEntries];
+} TraceRing;
+
+#ifndef NON_RESIDENT
+/*
+ * Wake-to-ready telemetry for the resident driver, published as
+ * RM,WakeStats. Bucket n counts latencies below 2^n ms, the last
+ * bucket everything longer.
+ */
+enum WakeEvent
+{
+    kWakeReprobe,
+    kWakeTimer,
+    kWakeReady,
+    kWakeEventCount,
+};
+
+#define kWakeLatencyBuckets 13
+
+typedef struct WakeLatency
+{
+    UInt32 count;
+    UInt32 buckets[kWakeLatencyBuckets];
+} WakeLatency;
+
+/*
+ * Wake of one device, keyed like the topology cache since the re-probe
+ * after wake is a new instance. A wakeTime of 0 marks a free slot, the
+ * slot is freed once firmware is loaded.
+ */
+typedef struct PendingWake
+{
+    UInt16 vid;
+    UInt16 did;
+    UInt32 locationId;
+    uint64_t wakeTime;
+    bool reprobed;      // only the first re-probe of a wake is sampled
+} PendingWake;
+
+#define kMaxPendingWakes 8
+
+/*
+ * The timer fallback after wake waits for a high percentile of the
+ * recent re-probe latencies plus headroom, clamped to these bounds.
+ * Until kBlurpWaitMinSamples are seen the fixed 400/800ms is used.
+ */
+#define kBlurpWaitSamples 16
+#define kBlurpWaitMinSamples 4
+#define kBlurpWaitPercentile 95
+#define kBlurpWaitMin 100
+#define kBlurpWaitMax 2000
+
+/*
+ * Firmware loads after wake go through one queue shared by all
+ * instances. Internal controllers are served before dongles, and
+ * at most kMaxWorkThreads uploads run at once.
+ */
+#define kMaxQueuedWork 8
+#define kMaxWorkThreads 2
+#endif // #ifndef NON_RESIDENT
+
 #if defined(TARGET_CATALINA)
 #define BrcmPatchRAM BrcmPatchRAM3
 #elif defined(TARGET_ELCAPITAN)
@@ -94,11 +286,20 @@ private:
     UInt32 mPreResetDelay;
     UInt32 mPostResetDelay;
     UInt32 mInitialDelay;
+    UInt32 mTransport;
+    UInt32 mResetPolicy;
+    bool mPipelineDecode;
+    bool mResetDeferred = false;
+    bool mResetRequired = false;        // the ROM state probe failed without the reset
+    UInt32 mSavedSettleTime = 0;        // ms, of this upload
+    UInt32 mUploadRetries = 0;
+    DeviceState mFailedState = kUnknown;
 
     USBDeviceShim mDevice;
     USBInterfaceShim mInterface;
     USBPipeShim mInterruptPipe;
     USBPipeShim mBulkPipe;
+    DeviceTopology mTopology;
     BrcmFirmwareStore* mFirmwareStore = NULL;
 #ifndef NON_RESIDENT
     bool mStopping = false;
@@ -106,21 +307,89 @@ private:
     bool mSupportsHandshake;
 
     USBCOMPLETION mInterruptCompletion;
+    USBCOMPLETION mCommandCompletion;
     IOBufferMemoryDescriptor* mReadBuffer;
+    IOBufferMemoryDescriptor* mWriteBuffer = NULL;
     
     volatile DeviceState mDeviceState = kInitialize;
     volatile uint16_t mFirmwareVersion = 0xFFFF;
+    volatile uint16_t mFinalVersion = 0xFFFF;     // read back after the reset
+    volatile bool mReadPending = false;
+    volatile bool mCommandPending = false;
+    
+    TraceRing mTrace;
+    inline void trace(TraceEvent event, UInt16 arg0, UInt32 arg1)
+    {
+        if (__builtin_expect(!mTrace.enabled, 1))
+            return;
+        
+        TraceEntry* entry = &mTrace.entries[OSIncrementAtomic(&mTrace.head) & (kTraceEntries - 1)];
+        entry->timestamp = mach_absolute_time();
+        entry->event = event;
+        entry->arg0 = arg0;
+        entry->arg1 = arg1;
+    }
+    void publishTrace();
+    
+    volatile UInt32 mLoggedErrors = 0;
+    // Whether error is the first of its kind in this upload
+    inline bool firstError(LoggedError error)
+    {
+        return !(OSBitOrAtomic(error, &mLoggedErrors) & error);
+    }
+    
+    uint64_t mPhaseStart;
+    uint64_t mPhaseTime[kPhaseCount];   // ns
+    inline void endPhase(UploadPhase phase)
+    {
+        uint64_t now;
+        
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - mPhaseStart, &mPhaseTime[phase]);
+        mPhaseStart = now;
+    }
+    
+    TransportStats mTransportStats[kTransportAuto];
+    UInt32 mRecordTransport;
+    UInt16 mRecordLength;
+    UInt32 mRecordAddress;
+    RecordLatency mRegionLatency[kLatencyRegions];
+    UInt32 mRegionCount;
+    RecordLatency mSizeLatency[kLatencySizes];
+    uint64_t mRecordStart;
     IOLock* mCompletionLock = NULL;
+    UInt32 mInstructionIndex;
+    BrcmFirmwareStream* mFirmwareStream = NULL;
+    IOReturn nextInstruction(OSArray* instructions, const void** record, UInt16* length);
     
-#ifdef DEBUG
     static const char* getState(DeviceState deviceState);
-#endif
+
+    static DeviceTopology mTopologyCache[kMaxCachedTopologies];
+    static IOLock* mTopologyLock;
+    friend kern_return_t BrcmPatchRAM_Start(kmod_info_t*, void*);
+    friend kern_return_t BrcmPatchRAM_Stop(kmod_info_t*, void*);
+
+    // Host simulator and tests, see host/
+    friend class DriverHarness;
+    friend class ResidentHarness;
 
 #ifndef TARGET_CATALINA
     static OSString* brcmBundleIdentifier;
     static OSString* brcmIOClass;
     static OSString* brcmProviderClass;
     static void initBrcmStrings();
+
+    // Matching dictionaries for this device, built once in probe
+    OSDictionary* mDeviceMatching = NULL;
+    OSDictionary* mPublishMatching = NULL;
+    OSDictionary* mPersonality = NULL;
+    OSDictionary* mRemoveMatching = NULL;
+    OSDictionary* mGenericMatching = NULL;
+    void buildMatchingDictionaries();
+
+    // Result of the last personality query, valid for this catalogue generation
+    SInt32 mCatalogueGeneration = -1;
+    bool mHasPersonality = false;
 #endif
     
 #ifdef DEBUG
@@ -132,23 +401,31 @@ private:
     IOTimerEventSource* mTimer = NULL;
     IOReturn onTimerEvent(void);
 
-    static void uploadFirmwareThread(void* arg, wait_result_t wait);
-    thread_t mWorker = 0;
+    static void workQueueThread(void* arg, wait_result_t wait);
+    IOLock* mLoadFirmwareLock = NULL;
+    UInt32 mLocationId = 0;
+    bool mInternal = false;
 
-    IOInterruptEventSource* mWorkSource = NULL;
-    IOLock* mWorkLock = NULL;
-    static IOLock* mLoadFirmwareLock;
-    friend kern_return_t BrcmPatchRAM_Start(kmod_info_t*, void*);
-    friend kern_return_t BrcmPatchRAM_Stop(kmod_info_t*, void*);
+    static IOLock* mWorkLock;
+    static BrcmPatchRAM* mWorkQueue[kMaxQueuedWork];
+    static UInt32 mWorkQueueLength;
+    static UInt32 mWorkThreads;
 
-    enum WorkPending
-    {
-        kWorkLoadFirmware = 0x01,
-        kWorkFinished = 0x02,
-    };
-    unsigned mWorkPending = 0;
-    void scheduleWork(unsigned newWork);
-    void processWorkQueue(IOInterruptEventSource*, int);
+    void scheduleWork();
+    void cancelWork();
+    bool isInternal();
+
+    // Shared by all instances, since a re-probe after wake is a new instance
+    static IOLock* mWakeLock;
+    static UInt32 mWakeCount;
+    static PendingWake mPendingWakes[kMaxPendingWakes];
+    static WakeLatency mWakeStats[kWakeEventCount];
+    static UInt32 mReprobeSamples[kBlurpWaitSamples];
+    static UInt32 mReprobeSampleCount;
+    UInt32 getBlurpWait();
+    PendingWake* findPendingWake(bool create);
+    void recordWakeEvent(WakeEvent event);
+    void publishWakeStats();
 #endif // #ifndef NON_RESIDENT
 
 #ifndef TARGET_CATALINA
@@ -164,28 +441,58 @@ private:
     bool publishResourcePersonality(const char* classname);
 #endif
     BrcmFirmwareStore* getFirmwareStore();
-    void uploadFirmware();
+    
+    struct FirmwareStoreRendezvous
+    {
+        IOLock* lock;
+        BrcmFirmwareStore* store;
+    };
+    static bool firmwareStorePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+    BrcmFirmwareStore* waitForFirmwareStore(UInt32 timeout);
+    bool uploadFirmware();
     
     void printDeviceInfo();
     int getDeviceStatus();
     
     bool resetDevice();
+    void resetBeforeUpload();
+    bool completeDeferredReset(bool upgraded);
     bool setConfiguration(int configurationIndex);
+    bool applyConfiguration(UInt8 configurationValue);
     
     bool findInterface(USBInterfaceShim* interface);
     bool findPipe(USBPipeShim* pipe, uint8_t type, uint8_t direction);
     
+    bool lookupTopology(DeviceTopology* topology);
+    void storeTopology();
+    void forgetTopology();
+    bool openTopology(const DeviceTopology* topology);
+    void closeTopology();
+    
+    bool prepareTransferBuffers();
+    void releaseTransferBuffers();
+    
     bool continuousRead();
 #if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
     static void readCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred);
+    static void commandCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred);
 #else
     static void readCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+    static void commandCompletion(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
 #endif
     
     IOReturn hciCommand(void * command, uint16_t length);
     IOReturn hciParseResponse(void* response, uint16_t length, void* output, uint8_t* outputLength);
     
     IOReturn bulkWrite(const void* data, uint16_t length);
+    UInt32 nextRecordTransport();
+    IOReturn writeRecord(const void* record, UInt16 length);
+    void recordWritten();
+    void publishTransportStats();
+    
+    static void addRecordLatency(RecordLatency* latency, UInt16 length, uint64_t nanoseconds);
+    void publishRecordLatency();
+    void publishUploadResult(const char* outcome, bool cached, uint64_t setupTime, uint64_t startTime);
     
     uint16_t getFirmwareVersion();
     
@@ -199,16 +506,12 @@ public:
     virtual IOReturn setPowerState(unsigned long which, IOService *whom);
 #endif
     
-#ifndef NON_RESIDENT
-    virtual IOReturn setPowerState(unsigned long which, IOService *whom);
-#endif
-    
     virtual const char* stringFromReturn(IOReturn rtn);
     
 #ifdef TARGET_CATALINA
     virtual bool init(OSDictionary *properties);
-    virtual void free();
 #endif
+    virtual void free();
 };
 
 #if defined(NON_RESIDENT) && (!defined(TARGET_CATALINA))
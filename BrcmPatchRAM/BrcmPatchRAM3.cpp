@@ -80,6 +80,34 @@ static DeviceHskSupport hskSupport[] =
 
 OSDefineMetaClassAndStructors(BrcmPatchRAM3, IOService)
 
+DeviceTopology BrcmPatchRAM::mTopologyCache[kMaxCachedTopologies];
+IOLock* BrcmPatchRAM::mTopologyLock = NULL;
+
+extern "C"
+{
+
+__attribute__((visibility("hidden")))
+kern_return_t BrcmPatchRAM_Start(kmod_info_t* ki, void * d)
+{
+    if (!(BrcmPatchRAM::mTopologyLock = IOLockAlloc()))
+        return KERN_FAILURE;
+    
+    return KERN_SUCCESS;
+}
+
+__attribute__((visibility("hidden")))
+kern_return_t BrcmPatchRAM_Stop(kmod_info_t* ki, void * d)
+{
+    if (BrcmPatchRAM::mTopologyLock) {
+        IOLockFree(BrcmPatchRAM::mTopologyLock);
+        BrcmPatchRAM::mTopologyLock = NULL;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+} // extern "C"
+
 bool BrcmPatchRAM::init(OSDictionary *properties)
 {
     bool result;
@@ -114,6 +142,41 @@ bool BrcmPatchRAM::init(OSDictionary *properties)
         
         if (PE_parse_boot_argn("bpr_preresetdelay", &delay, sizeof delay))
             mPreResetDelay = delay;
+        
+        mTransport = kTransportBulk;
+        
+        if (OSNumber* transport = OSDynamicCast(OSNumber, getProperty("FirmwareTransport")))
+            mTransport = transport->unsigned32BitValue();
+        
+        if (PE_parse_boot_argn("bpr_transport", &delay, sizeof delay))
+            mTransport = delay;
+        
+        if (mTransport > kTransportAuto)
+            mTransport = kTransportBulk;
+        
+        mResetPolicy = kResetAuto;
+        
+        if (OSNumber* resetPolicy = OSDynamicCast(OSNumber, getProperty("ResetPolicy")))
+            mResetPolicy = resetPolicy->unsigned32BitValue();
+        
+        if (PE_parse_boot_argn("bpr_resetpolicy", &delay, sizeof delay))
+            mResetPolicy = delay;
+        
+        mTrace.enabled = false;
+        
+        if (OSBoolean* trace = OSDynamicCast(OSBoolean, getProperty("Trace")))
+            mTrace.enabled = trace->isTrue();
+        
+        if (PE_parse_boot_argn("bpr_trace", &delay, sizeof delay))
+            mTrace.enabled = delay != 0;
+        
+        mPipelineDecode = false;
+        
+        if (OSBoolean* pipelineDecode = OSDynamicCast(OSBoolean, getProperty("PipelineDecode")))
+            mPipelineDecode = pipelineDecode->isTrue();
+        
+        if (PE_parse_boot_argn("bpr_pipeline", &delay, sizeof delay))
+            mPipelineDecode = delay != 0;
     }
     return result;
 }
@@ -173,8 +236,16 @@ IOService* BrcmPatchRAM::probe(IOService *provider, SInt32 *probeScore)
     if (firmwareKey) {
         firmwareStore = getFirmwareStore();
         
-        if (firmwareStore)
+        // With the decode pipeline, decode while the device is being set up
+        if (firmwareStore && mPipelineDecode) {
+            if (OSArray* instructions = firmwareStore->beginFirmware(mVendorId, mProductId, firmwareKey))
+                instructions->release();
+        } else if (firmwareStore && firmwareStore->isCompactCache()) {
+            if (BrcmFirmwareStream* stream = firmwareStore->openFirmwareStream(mVendorId, mProductId, firmwareKey))
+                stream->release();
+        } else if (firmwareStore) {
             firmwareStore->getFirmware(mVendorId, mProductId, firmwareKey);
+        }
     }
     /* Release device again as probe() shouldn't alter it's state. */
     mDevice.setDevice(NULL);
@@ -216,6 +287,7 @@ bool BrcmPatchRAM::start(IOService *provider)
     /*
      * Setup and prepare read buffer now as it can be reused and
      * it would be inefficient to call prepare() over and over again.
+     * It is resized to the interrupt endpoint once the pipe is known.
      */
     mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, kReadBufferSize);
     
@@ -230,10 +302,11 @@ bool BrcmPatchRAM::start(IOService *provider)
     mInterruptCompletion.owner = this;
     mInterruptCompletion.action = readCompletion;
     mInterruptCompletion.parameter = NULL;
+    mCommandCompletion.owner = this;
+    mCommandCompletion.action = commandCompletion;
+    mCommandCompletion.parameter = NULL;
 
-    /* Reset the device to put it in a defined state. */
     mDevice.setDevice(provider);
-    mDevice.resetDevice();
     
     /*
      * Place version/build info in ioreg properties RM,Build and RM,Version.
@@ -246,8 +319,11 @@ bool BrcmPatchRAM::start(IOService *provider)
     setProperty("RM,Build", "Release-" LOGNAME);
 #endif
     
-    /* Wait for device to become ready after reset. */
-    IOSleep(mPostResetDelay);
+    /*
+     * Apply the reset policy. With the default kResetAuto the device is not
+     * reset here, the upload then resets it only if it is not in its ROM state.
+     */
+    resetBeforeUpload();
     
     uploadFirmware();
     
@@ -278,7 +354,7 @@ done:
     clock_get_uptime(&end_time);
     absolutetime_to_nanoseconds(end_time - start_time, &nano_secs);
     uint64_t milli_secs = nano_secs / 1000000;
-    AlwaysLog("Processing time %llu.%llu seconds.\n", milli_secs / 1000, milli_secs % 1000);
+    AlwaysLog("Processing time %llu.%llu seconds.\n", (unsigned long long)(milli_secs / 1000), (unsigned long long)(milli_secs % 1000));
 
     return success;
 }
@@ -296,6 +372,8 @@ void BrcmPatchRAM::stop(IOService* provider)
 
         mInterruptCompletion.owner = NULL;
         mInterruptCompletion.action = NULL;
+        mCommandCompletion.owner = NULL;
+        mCommandCompletion.action = NULL;
 
         OSSafeReleaseNULL(mReadBuffer);
     }
@@ -326,69 +404,162 @@ IOReturn BrcmPatchRAM::setPowerState(unsigned long which, IOService *whom)
     return IOPMAckImplied;
 }
 
-void BrcmPatchRAM::uploadFirmware()
+/*
+ * Returns true if the controller runs the firmware afterwards, whether it
+ * was uploaded now or was already loaded.
+ */
+bool BrcmPatchRAM::uploadFirmware()
 {
+    DeviceTopology topology;
+    uint64_t start_time, end_time, nano_secs;
+    bool cached, opened, upgraded = false;
+    
     // signal to timer that firmware already loaded
     mDevice.setProperty(kFirmwareLoaded, true);
     
     // don't bother with devices that have no firmware
     if (!getProperty(kFirmwareKey))
-        return;
+        return false;
     
     if (!mDevice.open(this)) {
         AlwaysLog("uploadFirmware could not open the device!\n");
-        return;
+        return false;
     }
     
     // Print out additional device information
     printDeviceInfo();
     
-    // Set device configuration to composite configuration index 0
-    // Obtain first interface
-    if (setConfiguration(0) && findInterface(&mInterface) && mInterface.open(this)) {
-        DebugLog("set configuration and interface opened\n");
-        mInterface.findPipe(&mInterruptPipe, kUSBInterrupt, kUSBIn);
-        mInterface.findPipe(&mBulkPipe, kUSBBulk, kUSBOut);
+    clock_get_uptime(&start_time);
+    
+    // Reuse the topology of a previous upload, fall back to the full walk on mismatch
+    cached = lookupTopology(&topology);
+    opened = cached && openTopology(&topology);
+    
+    if (cached && !opened) {
+        AlwaysLog("[%04x:%04x]: Cached USB topology does not match, rescanning.\n", mVendorId, mProductId);
+        closeTopology();
+        forgetTopology();
+        cached = false;
+    }
+    if (!cached)
+        opened = openTopology(NULL);
+    
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - start_time, &nano_secs);
+    CategoryLog(kLogUSB, kLogInfo, "[%04x:%04x]: USB setup time %llu us (%s topology).\n", mVendorId, mProductId, (unsigned long long)(nano_secs / 1000), cached ? "cached" : "full");
+    
+    // Setup failures leave the counters of the previous upload behind
+    bzero(mTransportStats, sizeof(mTransportStats));
+    bzero(mPhaseTime, sizeof(mPhaseTime));
+    mFirmwareVersion = 0xFFFF;
+    mFinalVersion = 0xFFFF;
+    mFailedState = kInitialize;
+    mSavedSettleTime = 0;
+    
+    if (opened && prepareTransferBuffers()) {
+        DebugLog("got pipes\n");
         
-        if (mInterruptPipe.getValidatedPipe() && mBulkPipe.getValidatedPipe()) {
-            DebugLog("got pipes\n");
+        if ((upgraded = performUpgrade())) {
+            if (mResetDeferred)
+                mSavedSettleTime = mPostResetDelay;
             
-            if (performUpgrade()) {
-                if (mDeviceState == kUpdateComplete) {
-                    AlwaysLog("[%04x:%04x]: Firmware upgrade completed successfully.\n", mVendorId, mProductId);
-                } else {
-                    AlwaysLog("[%04x:%04x]: Firmware upgrade not needed.\n", mVendorId, mProductId);
-                }
+            if (mDeviceState == kUpdateComplete) {
+                AlwaysLog("[%04x:%04x]: Firmware upgrade completed successfully.\n", mVendorId, mProductId);
+                publishUploadResult("Complete", cached, nano_secs, start_time);
             } else {
-                AlwaysLog("[%04x:%04x]: Firmware upgrade failed.\n", mVendorId, mProductId);
+                AlwaysLog("[%04x:%04x]: Firmware upgrade not needed.\n", mVendorId, mProductId);
+                publishUploadResult("NotNeeded", cached, nano_secs, start_time);
             }
+            if (!cached)
+                storeTopology();
+        } else if (!mResetDeferred || !mResetRequired) {
+            AlwaysLog("[%04x:%04x]: Firmware upgrade failed.\n", mVendorId, mProductId);
+            publishUploadResult("Failed", cached, nano_secs, start_time);
         }
-        mInterface.close(this);
+    } else {
+        publishUploadResult("Failed", cached, nano_secs, start_time);
     }
     
     // cleanup
-    if (mInterruptPipe.getValidatedPipe()) {
-        mInterruptPipe.abort();
-        mInterruptPipe.setPipe(NULL);
+    releaseTransferBuffers();
+    closeTopology();
+    mDevice.close(this);
+    
+    if (mResetDeferred)
+        return completeDeferredReset(upgraded);
+    return upgraded;
+}
+
+bool BrcmPatchRAM::firmwareStorePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier)
+{
+    FirmwareStoreRendezvous* rendezvous = (FirmwareStoreRendezvous*)target;
+    
+    IOLockLock(rendezvous->lock);
+    
+    if (!rendezvous->store && (rendezvous->store = OSDynamicCast(BrcmFirmwareStore, newService)))
+        rendezvous->store->retain();
+    
+    IOLockUnlock(rendezvous->lock);
+    
+    // wake waiting task in waitForFirmwareStore (in IOLockSleepDeadline)...
+    IOLockWakeup(rendezvous->lock, rendezvous, true);
+    
+    return true;
+}
+
+/*
+ * Register for the publication of the firmware store and sleep until it
+ * shows up or the timeout (in ms) expires. The matching notification is
+ * also delivered for a store that has already been published.
+ */
+BrcmFirmwareStore* BrcmPatchRAM::waitForFirmwareStore(UInt32 timeout)
+{
+    FirmwareStoreRendezvous rendezvous = { IOLockAlloc(), NULL };
+    OSDictionary* matching;
+    IONotifier* notifier = NULL;
+    uint64_t deadline;
+    
+    if (!rendezvous.lock)
+        return NULL;
+    
+    if ((matching = serviceMatching(kBrcmFirmwareStoreService))) {
+        notifier = addMatchingNotification(gIOPublishNotification, matching, firmwareStorePublished, &rendezvous);
+        matching->release();
     }
-    if (mBulkPipe.getValidatedPipe()) {
-        mBulkPipe.abort();
-        mBulkPipe.setPipe(NULL);
+    if (notifier) {
+        clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+        
+        IOLockLock(rendezvous.lock);
+        
+        while (!rendezvous.store) {
+            if (IOLockSleepDeadline(rendezvous.lock, &rendezvous, deadline, 0) == THREAD_TIMED_OUT)
+                break;
+        }
+        IOLockUnlock(rendezvous.lock);
+        
+        // waits for a handler still in progress
+        notifier->remove();
     }
-    mInterface.setInterface(NULL);
-    mDevice.close(this);
+    IOLockFree(rendezvous.lock);
+    
+    return rendezvous.store;
 }
 
 BrcmFirmwareStore* BrcmPatchRAM::getFirmwareStore()
 {
     if (!mFirmwareStore) {
         // check to see if it already loaded
-        mFirmwareStore = OSDynamicCast(BrcmFirmwareStore, waitForMatchingService(serviceMatching(kBrcmFirmwareStoreService), 0));
+        mFirmwareStore = BrcmFirmwareStore::copyInstance();
         
         if (!mFirmwareStore) {
-            // not loaded, so publish personality...
-            // and wait...
-            mFirmwareStore = OSDynamicCast(BrcmFirmwareStore, waitForMatchingService(serviceMatching(kBrcmFirmwareStoreService), 2000UL*1000UL*1000UL));
+            // not loaded, so wait for it to be published...
+            mFirmwareStore = waitForFirmwareStore(2000);
+        }
+        
+        // CompactCache keeps no instructions to pipeline, so the store's setting wins
+        if (mFirmwareStore && mFirmwareStore->isCompactCache() && mPipelineDecode) {
+            AlwaysLog("[%04x:%04x]: PipelineDecode is not used with the CompactCache of BrcmFirmwareStore.\n", mVendorId, mProductId);
+            mPipelineDecode = false;
         }
     }
     if (!mFirmwareStore)
@@ -444,11 +615,59 @@ bool BrcmPatchRAM::resetDevice()
     return true;
 }
 
+/*
+ * Apply the reset policy before an upload. With kResetAuto the reset and
+ * settle time are skipped here, performUpgrade then treats a controller
+ * that is not in its ROM state as a failure and the upload is repeated
+ * after the reset by completeDeferredReset.
+ */
+void BrcmPatchRAM::resetBeforeUpload()
+{
+    mResetDeferred = mResetPolicy == kResetAuto;
+    mResetRequired = false;
+    mUploadRetries = 0;
+    
+    if (!mResetDeferred) {
+        resetDevice();
+        IOSleep(mPostResetDelay);
+    }
+}
+
+/*
+ * Finish an upload with the reset deferred. RM,SavedSettleTime adds up the
+ * settle time saved since boot, each RM,UploadResult has its own share.
+ * Only a controller that failed the ROM state probe is reset and retried,
+ * any other failure was reported by uploadFirmware already.
+ */
+bool BrcmPatchRAM::completeDeferredReset(bool upgraded)
+{
+    OSNumber* total = OSDynamicCast(OSNumber, mDevice.getProperty("RM,SavedSettleTime"));
+    UInt32 saved = (total ? total->unsigned32BitValue() : 0) + mSavedSettleTime;
+    
+    mResetDeferred = false;
+    
+    if (OSNumber* savedTime = OSNumber::withNumber(saved, 32)) {
+        mDevice.setProperty("RM,SavedSettleTime", savedTime);
+        savedTime->release();
+    }
+    if (upgraded) {
+        AlwaysLog("[%04x:%04x]: Controller was in ROM state, skipped reset and %u ms settle time.\n", mVendorId, mProductId, mSavedSettleTime);
+        return true;
+    }
+    if (!mResetRequired)
+        return false;
+    
+    AlwaysLog("[%04x:%04x]: Controller not in a clean ROM state, resetting and retrying.\n", mVendorId, mProductId);
+    
+    mUploadRetries++;
+    resetDevice();
+    IOSleep(mPostResetDelay);
+    return uploadFirmware();
+}
+
 bool BrcmPatchRAM::setConfiguration(int configurationIndex)
 {
-    IOReturn result;
     const USBCONFIGURATIONDESCRIPTOR* configurationDescriptor;
-    UInt8 currentConfiguration = 0xFF;
     
     // Find the first config/interface
     UInt8 numconf = 0;
@@ -468,6 +687,22 @@ bool BrcmPatchRAM::setConfiguration(int configurationIndex)
         return false;
     }
     
+    mTopology.configurationValue = configurationDescriptor->bConfigurationValue;
+    
+    if (!applyConfiguration(configurationDescriptor->bConfigurationValue))
+        return false;
+    
+    DebugLog("[%04x:%04x]: Device configuration index %d is active.\n",
+             mVendorId, mProductId, configurationIndex);
+    
+    return true;
+}
+
+bool BrcmPatchRAM::applyConfiguration(UInt8 configurationValue)
+{
+    IOReturn result;
+    UInt8 currentConfiguration = 0xFF;
+    
     if ((result = mDevice.getConfiguration(this, &currentConfiguration)) != kIOReturnSuccess) {
         AlwaysLog("[%04x:%04x]: Unable to retrieve active configuration (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
         return false;
@@ -475,19 +710,19 @@ bool BrcmPatchRAM::setConfiguration(int configurationIndex)
     
     // Device is already configured
     if (currentConfiguration != 0) {
-        DebugLog("[%04x:%04x]: Device configuration is already set to configuration index %d.\n",
-                 mVendorId, mProductId, configurationIndex);
+        DebugLog("[%04x:%04x]: Device configuration is already set to configuration %d.\n",
+                 mVendorId, mProductId, currentConfiguration);
         return true;
     }
     
-    // Set the configuration to the first configuration
-    if ((result = mDevice.setConfiguration(this, configurationDescriptor->bConfigurationValue, true)) != kIOReturnSuccess) {
+    // Set the configuration to the requested configuration
+    if ((result = mDevice.setConfiguration(this, configurationValue, true)) != kIOReturnSuccess) {
         AlwaysLog("[%04x:%04x]: Unable to (re-)configure device (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
         return false;
     }
     
-    DebugLog("[%04x:%04x]: Set device configuration to configuration index %d successfully.\n",
-             mVendorId, mProductId, configurationIndex);
+    DebugLog("[%04x:%04x]: Set device configuration to configuration %d successfully.\n",
+             mVendorId, mProductId, configurationValue);
     
     return true;
 }
@@ -496,7 +731,7 @@ bool BrcmPatchRAM::findInterface(USBInterfaceShim* shim)
 {
     mDevice.findFirstInterface(shim);
     
-    if (IOService* interface = shim->getValidatedInterface()) {
+    if (shim->getValidatedInterface()) {
         DebugLog("[%04x:%04x]: Interface %d (class %02x, subclass %02x, protocol %02x) located.\n",
                  mVendorId,
                  mProductId,
@@ -531,6 +766,186 @@ bool BrcmPatchRAM::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
     return true;
 }
 
+bool BrcmPatchRAM::lookupTopology(DeviceTopology* topology)
+{
+    bool found = false;
+    
+    mTopology.vid = mVendorId;
+    mTopology.did = mProductId;
+    mTopology.locationId = mDevice.getLocationID();
+    
+    IOLockLock(mTopologyLock);
+    
+    for (int i = 0; i < kMaxCachedTopologies; i++) {
+        DeviceTopology* entry = &mTopologyCache[i];
+        
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId) {
+            *topology = *entry;
+            found = true;
+            break;
+        }
+    }
+    IOLockUnlock(mTopologyLock);
+    
+    return found;
+}
+
+void BrcmPatchRAM::storeTopology()
+{
+    DeviceTopology* slot = NULL;
+    
+    IOLockLock(mTopologyLock);
+    
+    // Replace an existing entry for this device, otherwise take the first free slot
+    for (int i = 0; i < kMaxCachedTopologies; i++) {
+        DeviceTopology* entry = &mTopologyCache[i];
+        
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId) {
+            slot = entry;
+            break;
+        }
+        if (!slot && entry->vid == 0)
+            slot = entry;
+    }
+    if (slot)
+        *slot = mTopology;
+    
+    IOLockUnlock(mTopologyLock);
+    
+    DebugLog("[%04x:%04x]: Cached USB topology (configuration %d, interface %d, endpoints 0x%02x/0x%02x).\n",
+             mVendorId, mProductId, mTopology.configurationValue, mTopology.interfaceNumber,
+             mTopology.interruptEndpoint, mTopology.bulkEndpoint);
+}
+
+void BrcmPatchRAM::forgetTopology()
+{
+    IOLockLock(mTopologyLock);
+    
+    for (int i = 0; i < kMaxCachedTopologies; i++) {
+        DeviceTopology* entry = &mTopologyCache[i];
+        
+        if (entry->vid == mTopology.vid && entry->did == mTopology.did && entry->locationId == mTopology.locationId)
+            bzero(entry, sizeof(DeviceTopology));
+    }
+    IOLockUnlock(mTopologyLock);
+}
+
+/*
+ * Set the configuration, open the interface and locate both pipes.
+ * With a cached topology the configuration, interface and endpoint
+ * descriptor walks are skipped. Returns true when the interface is
+ * open and both pipes are valid.
+ */
+bool BrcmPatchRAM::openTopology(const DeviceTopology* topology)
+{
+    if (topology) {
+        mTopology.configurationValue = topology->configurationValue;
+        
+        if (!applyConfiguration(topology->configurationValue) ||
+            !mDevice.findInterfaceByNumber(&mInterface, topology->interfaceNumber))
+            return false;
+    } else {
+        // Set device configuration to composite configuration index 0
+        // Obtain first interface
+        if (!setConfiguration(0) || !findInterface(&mInterface))
+            return false;
+    }
+    if (!mInterface.open(this)) {
+        mInterface.setInterface(NULL);
+        return false;
+    }
+    DebugLog("set configuration and interface opened\n");
+    
+    if (topology) {
+        mInterface.findPipeByAddress(&mInterruptPipe, topology->interruptEndpoint);
+        mInterface.findPipeByAddress(&mBulkPipe, topology->bulkEndpoint);
+    } else {
+        mInterface.findPipe(&mInterruptPipe, kUSBInterrupt, kUSBIn);
+        mInterface.findPipe(&mBulkPipe, kUSBBulk, kUSBOut);
+    }
+    if (!mInterruptPipe.getValidatedPipe() || !mBulkPipe.getValidatedPipe())
+        return false;
+    
+    mTopology.interfaceNumber = mInterface.getInterfaceNumber();
+    mTopology.interruptEndpoint = mInterruptPipe.getEndpointAddress();
+    mTopology.bulkEndpoint = mBulkPipe.getEndpointAddress();
+    
+    return true;
+}
+
+void BrcmPatchRAM::closeTopology()
+{
+    if (mInterruptPipe.getValidatedPipe()) {
+        mInterruptPipe.abort();
+        mInterruptPipe.setPipe(NULL);
+    }
+    if (mBulkPipe.getValidatedPipe()) {
+        mBulkPipe.abort();
+        mBulkPipe.setPipe(NULL);
+    }
+    if (mInterface.getValidatedInterface()) {
+        mInterface.close(this);
+        mInterface.setInterface(NULL);
+    }
+}
+
+/*
+ * Size the transfer buffers to the endpoints in use: the read buffer
+ * holds the largest HCI event and the write buffer the largest HCI
+ * command, both rounded up to whole max size packets of their pipe.
+ */
+bool BrcmPatchRAM::prepareTransferBuffers()
+{
+    IOReturn result;
+    UInt32 readSize = mInterruptPipe.getTransferSize(kMaxHciEventSize);
+    UInt32 writeSize = mBulkPipe.getTransferSize(kMaxHciCommandSize);
+    
+    DebugLog("[%04x:%04x]: Interrupt pipe %d bytes/%d interval, bulk pipe %d bytes, transfer sizes %d/%d.\n",
+             mVendorId, mProductId, mInterruptPipe.getMaxPacketSize(), mInterruptPipe.getInterval(),
+             mBulkPipe.getMaxPacketSize(), readSize, writeSize);
+    
+    // The read buffer outlives the upload, only replace it if the endpoint changed
+    if (!mReadBuffer || mReadBuffer->getLength() != readSize) {
+        if (mReadBuffer) {
+            mReadBuffer->complete(kIODirectionIn);
+            OSSafeReleaseNULL(mReadBuffer);
+        }
+        
+        mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, readSize);
+        
+        if (!mReadBuffer) {
+            AlwaysLog("[%04x:%04x]: Failed to allocate read buffer.\n", mVendorId, mProductId);
+            return false;
+        }
+        if ((result = mReadBuffer->prepare(kIODirectionIn)) != kIOReturnSuccess) {
+            AlwaysLog("[%04x:%04x]: Failed to prepare read buffer (0x%08x)\n", mVendorId, mProductId, result);
+            OSSafeReleaseNULL(mReadBuffer);
+            return false;
+        }
+    }
+    
+    mWriteBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, writeSize);
+    
+    if (!mWriteBuffer) {
+        AlwaysLog("[%04x:%04x]: Unable to allocate bulk write buffer.\n", mVendorId, mProductId);
+        return false;
+    }
+    if ((result = mWriteBuffer->prepare(kIODirectionOut)) != kIOReturnSuccess) {
+        AlwaysLog("[%04x:%04x]: Failed to prepare bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        OSSafeReleaseNULL(mWriteBuffer);
+        return false;
+    }
+    return true;
+}
+
+void BrcmPatchRAM::releaseTransferBuffers()
+{
+    if (mWriteBuffer) {
+        mWriteBuffer->complete(kIODirectionOut);
+        OSSafeReleaseNULL(mWriteBuffer);
+    }
+}
+
 bool BrcmPatchRAM::continuousRead()
 {
     IOReturn result;
@@ -562,6 +977,8 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
     
     IOLockLock(me->mCompletionLock);
     
+    me->mReadPending = false;
+    
     switch (status)
     {
         case kIOReturnSuccess:
@@ -579,11 +996,15 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
             break;
             
         case kIOUSBTransactionTimeout:
-            AlwaysLog("[%04x:%04x]: readCompletion - Transaction timeout (0x%08x)\n", me->mVendorId, me->mProductId, status);
+            if (me->firstError(kLoggedReadTimeout))
+                AlwaysLog("[%04x:%04x]: readCompletion - Transaction timeout (0x%08x)\n", me->mVendorId, me->mProductId, status);
+            me->trace(kTraceReadError, 0, status);
             break;
             
         case kIOReturnNotResponding:
-            AlwaysLog("[%04x:%04x]: Not responding - Delaying next read.\n", me->mVendorId, me->mProductId);
+            if (me->firstError(kLoggedNotResponding))
+                AlwaysLog("[%04x:%04x]: Not responding - Delaying next read.\n", me->mVendorId, me->mProductId);
+            me->trace(kTraceReadError, 0, status);
             me->mInterruptPipe.clearStall();
             break;
             
@@ -599,21 +1020,52 @@ void BrcmPatchRAM::readCompletion(void* target, void* parameter, IOReturn status
     IOLockWakeup(me->mCompletionLock, me, true);
 }
 
+/*
+ * Commands are sent asynchronously so that the control transfer is in
+ * flight together with the interrupt read for its response. performUpgrade
+ * waits for both completions before it moves on.
+ */
 IOReturn BrcmPatchRAM::hciCommand(void * command, UInt16 length)
 {
     IOReturn result;
     
-    if ((result = mInterface.hciCommand(command, length)) != kIOReturnSuccess)
-        AlwaysLog("[%04x:%04x]: device request failed (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+    trace(kTraceCommand, length, *(UInt16*)command);
+    mCommandPending = true;
     
+    if ((result = mInterface.hciCommand(command, length, &mCommandCompletion)) != kIOReturnSuccess) {
+        mCommandPending = false;
+        trace(kTraceCommandError, 0, result);
+        AlwaysLog("[%04x:%04x]: device request failed (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+    }
     return result;
 }
 
+void BrcmPatchRAM::commandCompletion(void* target, void* parameter, IOReturn status, uint32_t bytesTransferred)
+{
+    BrcmPatchRAM *me = (BrcmPatchRAM*)target;
+    
+    IOLockLock(me->mCompletionLock);
+    
+    me->mCommandPending = false;
+    
+    if (status != kIOReturnSuccess) {
+        AlwaysLog("[%04x:%04x]: device request failed (\"%s\" 0x%08x).\n", me->mVendorId, me->mProductId, me->stringFromReturn(status), status);
+        me->mDeviceState = kUpdateAborted;
+    }
+    
+    IOLockUnlock(me->mCompletionLock);
+    
+    // wake waiting task in performUpgrade (in IOLockSleep)...
+    IOLockWakeup(me->mCompletionLock, me, true);
+}
+
 IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* output, UInt8* outputLength)
 {
     HCI_RESPONSE* header = (HCI_RESPONSE*)response;
     IOReturn result = kIOReturnSuccess;
     
+    trace(kTraceRead, length, header->eventCode);
+    
     switch (header->eventCode) {
         case HCI_EVENT_COMMAND_COMPLETE:
         {
@@ -621,51 +1073,65 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             
             switch (event->opcode) {
                 case HCI_OPCODE_READ_VERBOSE_CONFIG:
-                    DebugLog("[%04x:%04x]: READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
+                    // Read back after the reset, see kResetComplete
+                    if (mDeviceState == kResetComplete) {
+                        mFinalVersion = *(UInt16*)(((char*)response) + 10);
+                        CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Firmware version after upload: v%d.\n",
+                                 mVendorId, mProductId, mFinalVersion + 0x1000);
+                        mDeviceState = kFinalVersion;
+                        break;
+                    }
+                    
                     mFirmwareVersion = *(UInt16*)(((char*)response) + 10);
                     
-                    DebugLog("[%04x:%04x]: Firmware version: v%d.\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Firmware version: v%d.\n",
                              mVendorId, mProductId, mFirmwareVersion + 0x1000);
                     
+                    // Without the reset the controller may still run firmware loaded before
+                    if (mFirmwareVersion > 0 && mResetDeferred) {
+                        mResetRequired = true;
+                        mDeviceState = kUpdateAborted;
+                    }
                     // Device does not require a firmware patch at this time
-                    if (mFirmwareVersion > 0)
+                    else if (mFirmwareVersion > 0)
                         mDeviceState = kUpdateNotNeeded;
                     else
                         mDeviceState = kFirmwareVersion;
                     break;
                     
                 case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
-                    DebugLog("[%04x:%04x]: DOWNLOAD MINIDRIVER complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: DOWNLOAD MINIDRIVER complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kMiniDriverComplete;
                     break;
                     
                 case HCI_OPCODE_LAUNCH_RAM:
-                    //DebugLog("[%04x:%04x]: LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n",
-                    //          mVendorId, mProductId, event->status, header->length);
+                    CategoryLog(kLogUSB, kLogVerbose, "[%04x:%04x]: LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n",
+                                mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kInstructionWritten;
                     break;
                     
                 case HCI_OPCODE_END_OF_RECORD:
-                    DebugLog("[%04x:%04x]: END OF RECORD complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: END OF RECORD complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kFirmwareWritten;
                     break;
                     
                 case HCI_OPCODE_RESET:
-                    DebugLog("[%04x:%04x]: RESET complete (status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: RESET complete (status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->status, header->length);
                     
                     mDeviceState = kResetComplete;
                     break;
                     
                 default:
-                    DebugLog("[%04x:%04x]: Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n",
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n",
                              mVendorId, mProductId, event->opcode, event->status, header->length);
                     break;
             }
@@ -675,7 +1141,7 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
                 
                 // Return the received data
                 if (*outputLength >= length) {
-                    DebugLog("[%04x:%04x]: Returning output data %d bytes.\n", mVendorId, mProductId, length);
+                    CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Returning output data %d bytes.\n", mVendorId, mProductId, length);
                     
                     *outputLength = length;
                     memcpy(output, response, length);
@@ -688,31 +1154,31 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
         }
             
         case HCI_EVENT_NUM_COMPLETED_PACKETS:
-            DebugLog("[%04x:%04x]: Number of completed packets.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Number of completed packets.\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_CONN_COMPLETE:
-            DebugLog("[%04x:%04x]: Connection complete event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Connection complete event.\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_DISCONN_COMPLETE:
-            DebugLog("[%04x:%04x]: Disconnection complete. event\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Disconnection complete. event\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_HARDWARE_ERROR:
-            DebugLog("[%04x:%04x]: Hardware error\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Hardware error\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_MODE_CHANGE:
-            DebugLog("[%04x:%04x]: Mode change event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Mode change event.\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_LE_META:
-            DebugLog("[%04x:%04x]: Low-Energy meta event.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Low-Energy meta event.\n", mVendorId, mProductId);
             break;
             
         case HCI_EVENT_VENDOR:
-            DebugLog("[%04x:%04x]: Vendor specific event. Ready to reset device.\n", mVendorId, mProductId);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Vendor specific event. Ready to reset device.\n", mVendorId, mProductId);
             
             if (mSupportsHandshake) {
                 // Device is ready for reset.
@@ -721,7 +1187,7 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
             break;
             
         default:
-            DebugLog("[%04x:%04x]: Unknown event code (0x%02x).\n", mVendorId, mProductId, header->eventCode);
+            CategoryLog(kLogUSB, kLogDebug, "[%04x:%04x]: Unknown event code (0x%02x).\n", mVendorId, mProductId, header->eventCode);
             break;
     }
     
@@ -730,30 +1196,329 @@ IOReturn BrcmPatchRAM::hciParseResponse(void* response, UInt16 length, void* out
 
 IOReturn BrcmPatchRAM::bulkWrite(const void* data, UInt16 length)
 {
-    IOMemoryDescriptor* buffer;
-    IOReturn result = kIOReturnNoMemory;
+    IOReturn result;
     
-    buffer = IOMemoryDescriptor::withAddress((void*)data, length, kIODirectionOut);
+    /*
+     * The write buffer has been prepared once per upload and holds a whole
+     * number of bulk packets, so only the record needs to be copied in,
+     * unless it was read from a firmware stream straight into the buffer.
+     */
+    if (!mWriteBuffer || length > mWriteBuffer->getLength()) {
+        AlwaysLog("[%04x:%04x]: Bulk write of %d bytes exceeds write buffer.\n", mVendorId, mProductId, length);
+        return kIOReturnOverrun;
+    }
+    if (data != mWriteBuffer->getBytesNoCopy())
+        mWriteBuffer->writeBytes(0, data, length);
     
-    if (!buffer) {
-        AlwaysLog("[%04x:%04x]: Unable to allocate bulk write buffer.\n", mVendorId, mProductId);
-        goto done;
+    if ((result = mBulkPipe.write(mWriteBuffer, 0, 0, length, NULL)) != kIOReturnSuccess) {
+        if (firstError(kLoggedWriteError))
+            AlwaysLog("[%04x:%04x]: Failed to write to bulk pipe (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+        trace(kTraceWriteError, length, result);
     }
-    if ((result = buffer->prepare(kIODirectionOut)) != kIOReturnSuccess) {
-        AlwaysLog("[%04x:%04x]: Failed to prepare bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
-        goto cleanup;
+    return result;
+}
+
+/*
+ * Send one LAUNCH_RAM record, either as a bulk transfer or as an ordinary
+ * HCI command on the control endpoint. In auto mode the first records are
+ * split between both transports before the faster one is locked in.
+ */
+UInt32 BrcmPatchRAM::nextRecordTransport()
+{
+    if (mTransport != kTransportAuto)
+        return mTransport;
+    
+    if (mTransportStats[kTransportBulk].records < kTransportProbeRecords)
+        return kTransportBulk;
+    return kTransportControl;
+}
+
+IOReturn BrcmPatchRAM::writeRecord(const void* record, UInt16 length)
+{
+    mRecordTransport = nextRecordTransport();
+    mRecordLength = length;
+    mRecordAddress = OSReadLittleInt32(record, 3);
+    clock_get_uptime(&mRecordStart);
+    trace(kTraceRecord, mRecordLength, mRecordTransport);
+    
+    if (mRecordTransport == kTransportControl)
+        return hciCommand((void*)record, length);
+    
+    return bulkWrite(record, length);
+}
+
+void BrcmPatchRAM::recordWritten()
+{
+    TransportStats* stats = &mTransportStats[mRecordTransport];
+    TransportStats* bulk = &mTransportStats[kTransportBulk];
+    TransportStats* control = &mTransportStats[kTransportControl];
+    uint64_t end_time, nano_secs;
+    
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - mRecordStart, &nano_secs);
+    
+    stats->records++;
+    stats->bytes += mRecordLength;
+    stats->nanoseconds += nano_secs;
+    trace(kTraceRecordWritten, mRecordLength, (UInt32)nano_secs);
+    
+    // Group by address region, the last entry collects regions that don't fit
+    static const UInt32 sizeLimits[kLatencySizes] = { 32, 64, 128, 0xFFFF };
+    UInt32 region = mRecordAddress & 0xFFFF0000;
+    UInt32 i;
+    
+    for (i = 0; i < mRegionCount && mRegionLatency[i].key != region; i++);
+    if (i == mRegionCount) {
+        if (mRegionCount < kLatencyRegions - 1) {
+            mRegionCount++;
+        } else {
+            i = kLatencyRegions - 1;
+            region = 0xFFFFFFFF;
+            mRegionCount = kLatencyRegions;
+        }
+        mRegionLatency[i].key = region;
+    }
+    addRecordLatency(&mRegionLatency[i], mRecordLength, nano_secs);
+    
+    for (i = 0; mRecordLength > sizeLimits[i] && i < kLatencySizes - 1; i++);
+    mSizeLatency[i].key = sizeLimits[i];
+    addRecordLatency(&mSizeLatency[i], mRecordLength, nano_secs);
+    
+    if (mTransport == kTransportAuto && control->records == kTransportProbeRecords) {
+        // Compare bytes per nanosecond without dividing
+        if (control->bytes * bulk->nanoseconds > bulk->bytes * control->nanoseconds)
+            mTransport = kTransportControl;
+        else
+            mTransport = kTransportBulk;
+        
+        AlwaysLog("[%04x:%04x]: Using %s transport for firmware records.\n", mVendorId, mProductId,
+                  mTransport == kTransportControl ? "control" : "bulk");
     }
-    if ((result = mBulkPipe.write(buffer, 0, 0, buffer->getLength(), NULL)) != kIOReturnSuccess) {
-        AlwaysLog("[%04x:%04x]: Failed to write to bulk pipe (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+}
+
+/*
+ * Publish the measured firmware record throughput of each transport used
+ * in bytes per second, and the transport selected, in the device registry.
+ */
+void BrcmPatchRAM::publishTransportStats()
+{
+    static const char* const names[] = { "RM,BulkThroughput", "RM,ControlThroughput" };
+    
+    for (int i = kTransportBulk; i <= kTransportControl; i++) {
+        TransportStats* stats = &mTransportStats[i];
+        
+        if (!stats->records || !stats->nanoseconds)
+            continue;
+        
+        if (OSNumber* throughput = OSNumber::withNumber(stats->bytes * 1000000000ULL / stats->nanoseconds, 64)) {
+            mDevice.setProperty(names[i], throughput);
+            throughput->release();
+        }
+        DebugLog("[%04x:%04x]: %s %u records, %llu bytes in %llu us.\n", mVendorId, mProductId,
+                 names[i], stats->records, (unsigned long long)stats->bytes, (unsigned long long)(stats->nanoseconds / 1000));
     }
-    if ((result = buffer->complete(kIODirectionOut)) != kIOReturnSuccess) {
-        AlwaysLog("[%04x:%04x]: Failed to complete bulk write memory buffer (\"%s\" 0x%08x).\n", mVendorId, mProductId, stringFromReturn(result), result);
+    if (OSString* transport = OSString::withCString(mTransport == kTransportControl ? "Control" : mTransport == kTransportBulk ? "Bulk" : "Auto")) {
+        mDevice.setProperty("RM,FirmwareTransport", transport);
+        transport->release();
     }
     
-cleanup:
-    buffer->release();
+    // Wired memory held for the upload, the read buffer stays with the instance
+    UInt64 bufferBytes = (mReadBuffer ? mReadBuffer->getCapacity() : 0) + (mWriteBuffer ? mWriteBuffer->getCapacity() : 0);
     
-done:
+    if (OSNumber* bytes = OSNumber::withNumber(bufferBytes, 64)) {
+        mDevice.setProperty("RM,TransferBufferBytes", bytes);
+        bytes->release();
+    }
+}
+
+void BrcmPatchRAM::addRecordLatency(RecordLatency* latency, UInt16 length, uint64_t nanoseconds)
+{
+    latency->records++;
+    latency->bytes += length;
+    latency->nanoseconds += nanoseconds;
+    
+    if (nanoseconds > latency->maxNanoseconds)
+        latency->maxNanoseconds = nanoseconds;
+}
+
+/*
+ * Publish the record latency by address region and by record size, with
+ * times in microseconds, to show which parts of an image upload slowly.
+ */
+void BrcmPatchRAM::publishRecordLatency()
+{
+    OSDictionary* latency = OSDictionary::withCapacity(2);
+    
+    if (!latency)
+        return;
+    
+    for (int table = 0; table < 2; table++) {
+        RecordLatency* entries = table ? mSizeLatency : mRegionLatency;
+        UInt32 count = table ? kLatencySizes : mRegionCount;
+        OSArray* array = OSArray::withCapacity(count);
+        
+        if (!array)
+            continue;
+        
+        for (UInt32 i = 0; i < count; i++) {
+            OSDictionary* entry = OSDictionary::withCapacity(5);
+            uint64_t values[] = { entries[i].key, entries[i].records, entries[i].bytes,
+                                  entries[i].nanoseconds / 1000, entries[i].maxNanoseconds / 1000 };
+            static const char* const names[] = { "Key", "Records", "Bytes", "Time", "MaxTime" };
+            
+            if (!entry || !entries[i].records) {
+                OSSafeReleaseNULL(entry);
+                continue;
+            }
+            for (int j = 0; j < 5; j++) {
+                if (OSNumber* number = OSNumber::withNumber(values[j], 64)) {
+                    entry->setObject(names[j], number);
+                    number->release();
+                }
+            }
+            array->setObject(entry);
+            entry->release();
+        }
+        latency->setObject(table ? "Sizes" : "Regions", array);
+        array->release();
+    }
+    mDevice.setProperty("RM,RecordLatency", latency);
+    latency->release();
+}
+
+/*
+ * Publish the outcome of the upload as one RM,UploadResult dictionary on
+ * the device, so it can be collected without scraping the kernel log.
+ * Times are in microseconds, versions as logged (v + 0x1000).
+ */
+void BrcmPatchRAM::publishUploadResult(const char* outcome, bool cached, uint64_t setupTime, uint64_t startTime)
+{
+    uint64_t end_time, nano_secs;
+    OSDictionary* result = OSDictionary::withCapacity(20);
+    
+    if (!result)
+        return;
+    
+    clock_get_uptime(&end_time);
+    absolutetime_to_nanoseconds(end_time - startTime, &nano_secs);
+    
+    bool known = mFirmwareVersion != 0xFFFF;
+    UInt16 versionAfter = mFinalVersion != 0xFFFF ? mFinalVersion : mFirmwareVersion;
+    OSString* firmwareKey = OSDynamicCast(OSString, getProperty(kFirmwareKey));
+    UploadOutcome uploadOutcome = {
+        outcome,
+        cached ? "Cached" : "Full",
+        mFailedState != kUnknown ? getState(mFailedState) : NULL,
+        firmwareKey ? firmwareKey->getCStringNoCopy() : NULL,
+        mTransportStats[kTransportBulk].records + mTransportStats[kTransportControl].records,
+        mTransportStats[kTransportBulk].bytes + mTransportStats[kTransportControl].bytes,
+        mUploadRetries,
+        setupTime / 1000,
+        nano_secs / 1000,
+        mPhaseTime[kPhaseVersion] / 1000,
+        mPhaseTime[kPhaseMiniDriver] / 1000,
+        mPhaseTime[kPhaseRecords] / 1000,
+        mPhaseTime[kPhaseEndOfRecord] / 1000,
+        mPhaseTime[kPhaseReset] / 1000,
+        known ? mFirmwareVersion + 0x1000U : 0,
+        (versionAfter != 0xFFFF && versionAfter) ? versionAfter + 0x1000U : 0,
+        mSavedSettleTime,
+    };
+    setUploadOutcome(result, &uploadOutcome);
+    
+    // Fold in what the upload published on its own
+    static const char* const folded[][2] = {
+        { "Transport", "RM,FirmwareTransport" },
+        { "RecordLatency", "RM,RecordLatency" },
+    };
+    for (unsigned i = 0; i < sizeof(folded) / sizeof(folded[0]); i++) {
+        if (OSObject* object = mDevice.getProperty(folded[i][1]))
+            result->setObject(folded[i][0], object);
+    }
+    
+    mDevice.setProperty(kUploadResult, result);
+    result->release();
+}
+
+/*
+ * Export the trace of the last upload as RM,Trace on the device, laid out
+ * as described in BrcmPatchRAM.h. Debug builds also print it.
+ */
+void BrcmPatchRAM::publishTrace()
+{
+    if (!mTrace.enabled)
+        return;
+    
+    UInt32 head = mTrace.head;
+    UInt32 count = head < kTraceEntries ? head : kTraceEntries;
+    OSData* data = OSData::withCapacity(count * sizeof(TraceEntry));
+    
+    if (!data)
+        return;
+    
+    for (UInt32 i = head - count; i != head; i++) {
+        TraceEntry* entry = &mTrace.entries[i & (kTraceEntries - 1)];
+        
+        data->appendBytes(entry, sizeof(TraceEntry));
+#ifdef DEBUG
+        uint64_t nano_secs;
+        
+        absolutetime_to_nanoseconds(entry->timestamp - mTrace.entries[(head - count) & (kTraceEntries - 1)].timestamp, &nano_secs);
+        DebugLog("[%04x:%04x]: trace %llu us event %u (0x%04x, 0x%08x)\n", mVendorId, mProductId,
+                 (unsigned long long)(nano_secs / 1000), entry->event, entry->arg0, entry->arg1);
+#endif
+    }
+    mDevice.setProperty("RM,Trace", data);
+    data->release();
+}
+
+/*
+ * Get the next record of the firmware, NULL at its end. With the decode
+ * pipeline, records are sent while the firmware store is still decoding
+ * the rest and this waits until the next one is available. A firmware
+ * stream is read straight into the buffer that writeRecord sends from.
+ */
+IOReturn BrcmPatchRAM::nextInstruction(OSArray* instructions, const void** record, UInt16* length)
+{
+    OSData* instruction;
+    IOReturn result = kIOReturnSuccess;
+    
+    if (mFirmwareStream) {
+        UInt8* buffer;
+        UInt16 capacity;
+        
+        if (nextRecordTransport() == kTransportControl) {
+            buffer = (UInt8*)mInterface.getCommandBuffer();
+            capacity = kMaxHciCommandSize;
+        } else {
+            buffer = mWriteBuffer ? (UInt8*)mWriteBuffer->getBytesNoCopy() : NULL;
+            capacity = mWriteBuffer ? mWriteBuffer->getLength() : 0;
+        }
+        if (!buffer)
+            return kIOReturnNoMemory;
+        
+        result = mFirmwareStream->readRecord(buffer, capacity, length);
+        *record = *length ? buffer : NULL;
+        
+        if (result != kIOReturnSuccess)
+            AlwaysLog("[%04x:%04x]: Firmware failed to decode after %u records, aborting.\n", mVendorId, mProductId, mFirmwareStream->getRecordCount());
+        return result;
+    }
+    
+    // should never happen, but would cause a crash
+    if (!instructions)
+        return kIOReturnNotReady;
+    
+    if (!mPipelineDecode) {
+        instruction = OSDynamicCast(OSData, instructions->getObject(mInstructionIndex++));
+    } else {
+        result = mFirmwareStore->waitForInstruction(OSDynamicCast(OSString, getProperty(kFirmwareKey)), instructions, mInstructionIndex++, &instruction);
+        
+        if (result != kIOReturnSuccess)
+            AlwaysLog("[%04x:%04x]: Firmware failed to decode after %u records, aborting.\n", mVendorId, mProductId, mInstructionIndex - 1);
+    }
+    *record = instruction ? instruction->getBytesNoCopy() : NULL;
+    *length = instruction ? instruction->getLength() : 0;
     return result;
 }
 
@@ -761,23 +1526,37 @@ bool BrcmPatchRAM::performUpgrade()
 {
     BrcmFirmwareStore* firmwareStore;
     OSArray* instructions = NULL;
-    OSCollectionIterator* iterator = NULL;
-    OSData* data;
-#ifdef DEBUG
+    const void* record;
+    UInt16 length;
+    bool aborting;
+    uint64_t deadline;
     DeviceState previousState = kUnknown;
-#endif
+    
+    bzero(mTransportStats, sizeof(mTransportStats));
+    mTrace.head = 0;
+    mLoggedErrors = 0;
+    clock_get_uptime(&mPhaseStart);
+    bzero(mRegionLatency, sizeof(mRegionLatency));
+    bzero(mSizeLatency, sizeof(mSizeLatency));
+    mRegionCount = 0;
+    mInstructionIndex = 0;
+    
+    mFailedState = kUnknown;
     
     IOLockLock(mCompletionLock);
     mDeviceState = kInitialize;
     
     while (true)
     {
-#ifdef DEBUG
-        if (mDeviceState != kInstructionWrite && mDeviceState != kInstructionWritten)
-            DebugLog("[%04x:%04x]: State \"%s\" --> \"%s\".\n", mVendorId, mProductId, getState(previousState), getState(mDeviceState));
+        if (mDeviceState != kInstructionWrite && mDeviceState != kInstructionWritten) {
+            CategoryLog(kLogState, kLogDebug, "[%04x:%04x]: State \"%s\" --> \"%s\".\n", mVendorId, mProductId, getState(previousState), getState(mDeviceState));
+            trace(kTraceState, previousState, mDeviceState);
+        }
+        
+        if (mDeviceState == kUpdateAborted && mFailedState == kUnknown)
+            mFailedState = previousState;
         
         previousState = mDeviceState;
-#endif
         
         // Break out when done
         if (mDeviceState == kUpdateAborted || mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded)
@@ -798,15 +1577,22 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
                 
             case kFirmwareVersion:
+                endPhase(kPhaseVersion);
+                
                 // Unable to retrieve firmware store
                 if (!(firmwareStore = getFirmwareStore())) {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
-                instructions = firmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                if (mPipelineDecode)
+                    instructions = firmwareStore->beginFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                else if (firmwareStore->isCompactCache())
+                    mFirmwareStream = firmwareStore->openFirmwareStream(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)));
+                else if ((instructions = firmwareStore->getFirmware(mVendorId, mProductId, OSDynamicCast(OSString, getProperty(kFirmwareKey)))))
+                    instructions->retain();
                 
                 // Unable to retrieve firmware instructions
-                if (!instructions) {
+                if (!instructions && !mFirmwareStream) {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
@@ -820,34 +1606,41 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
                 
             case kMiniDriverComplete:
-                // Write firmware data to bulk pipe
-                iterator = OSCollectionIterator::withCollection(instructions);
+                endPhase(kPhaseMiniDriver);
                 
-                if (!iterator) {
-                    mDeviceState = kUpdateAborted;
-                    continue;
-                }
                 // If this IOSleep is not issued, the device is not ready to receive
                 // the firmware instructions and we will deadlock due to lack of
                 // responses.
                 IOSleep(mInitialDelay);
                 
                 // Write first instruction to trigger response
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject())))
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
+                if (nextInstruction(instructions, &record, &length) != kIOReturnSuccess) {
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
+                if (record && writeRecord(record, length) != kIOReturnSuccess) {
+                    DebugLog("Writing the first record failed, aborting.");
+                    mDeviceState = kUpdateAborted;
+                    continue;
+                }
                 break;
                 
             case kInstructionWrite:
                 // should never happen, but would cause a crash
-                if (!iterator) {
+                if (nextInstruction(instructions, &record, &length) != kIOReturnSuccess) {
                     mDeviceState = kUpdateAborted;
                     continue;
                 }
                 
-                if ((data = OSDynamicCast(OSData, iterator->getNextObject()))) {
-                    bulkWrite(data->getBytesNoCopy(), data->getLength());
+                if (record) {
+                    if (writeRecord(record, length) != kIOReturnSuccess) {
+                        DebugLog("Writing a record failed, aborting.");
+                        mDeviceState = kUpdateAborted;
+                        continue;
+                    }
                 } else {
                     // Firmware data fully written
+                    endPhase(kPhaseRecords);
                     if (hciCommand(&HCI_VSC_END_OF_RECORD, sizeof(HCI_VSC_END_OF_RECORD)) != kIOReturnSuccess) {
                         DebugLog("HCI_VSC_END_OF_RECORD failed, aborting.");
                         mDeviceState = kUpdateAborted;
@@ -857,10 +1650,13 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
                 
             case kInstructionWritten:
+                recordWritten();
                 mDeviceState = kInstructionWrite;
                 continue;
                 
             case kFirmwareWritten:
+                endPhase(kPhaseEndOfRecord);
+                
                 if (!mSupportsHandshake) {
                     IOSleep(mPreResetDelay);
                     
@@ -881,8 +1677,18 @@ bool BrcmPatchRAM::performUpgrade()
                 break;
                 
             case kResetComplete:
+                // Read back the version the controller runs now, for RM,UploadResult
+                if (hciCommand(&HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG)) != kIOReturnSuccess) {
+                    DebugLog("HCI_VSC_READ_VERBOSE_CONFIG after reset failed.");
+                    mDeviceState = kFinalVersion;
+                    continue;
+                }
+                break;
+                
+            case kFinalVersion:
                 resetDevice();
                 getDeviceStatus();
+                endPhase(kPhaseReset);
                 mDeviceState = kUpdateComplete;
                 continue;
                 
@@ -895,16 +1701,46 @@ bool BrcmPatchRAM::performUpgrade()
         }
         
         // queue async read
-        if (!continuousRead()) {
+        if (continuousRead())
+            mReadPending = true;
+        else
             mDeviceState = kUpdateAborted;
-            continue;
+        
+        // wait for completion of the async read and of a pending command
+        aborting = false;
+        
+        if (mResetDeferred && mDeviceState == kInitialize)
+            clock_interval_to_deadline(kResetProbeTimeout, kMillisecondScale, &deadline);
+        
+        while (mReadPending || mCommandPending) {
+            // Don't block on a controller that may need the deferred reset to respond
+            if (mResetDeferred && mDeviceState == kInitialize) {
+                if (IOLockSleepDeadline(mCompletionLock, this, deadline, 0) == THREAD_TIMED_OUT) {
+                    DebugLog("[%04x:%04x]: No response without reset.\n", mVendorId, mProductId);
+                    mResetRequired = true;
+                    mDeviceState = kUpdateAborted;
+                }
+            } else {
+                IOLockSleep(mCompletionLock, this, 0);
+            }
+            
+            // A failed command won't get a response, cancel the read
+            if (mDeviceState == kUpdateAborted && mReadPending && !aborting) {
+                aborting = true;
+                IOLockUnlock(mCompletionLock);
+                mInterruptPipe.abort();
+                IOLockLock(mCompletionLock);
+            }
         }
-        // wait for completion of the async read
-        IOLockSleep(mCompletionLock, this, 0);
     }
     
     IOLockUnlock(mCompletionLock);
-    OSSafeReleaseNULL(iterator);
+    OSSafeReleaseNULL(instructions);
+    OSSafeReleaseNULL(mFirmwareStream);
+    
+    publishTransportStats();
+    publishRecordLatency();
+    publishTrace();
     
     return mDeviceState == kUpdateComplete || mDeviceState == kUpdateNotNeeded;
 }
@@ -920,7 +1756,6 @@ bool BrcmPatchRAM::supportsHandshake(UInt16 vid, UInt16 did)
     return false;
 }
 
-#ifdef DEBUG
 const char* BrcmPatchRAM::getState(DeviceState deviceState)
 {
     static const IONamedValue state_values[] = {
@@ -933,6 +1768,7 @@ const char* BrcmPatchRAM::getState(DeviceState deviceState)
         {kFirmwareWritten,    "Firmware written"     },
         {kResetWrite,         "Reset write"          },
         {kResetComplete,      "Reset complete"       },
+        {kFinalVersion,       "Final version"        },
         {kUpdateComplete,     "Update complete"      },
         {kUpdateNotNeeded,    "Update not needed"    },
         {kUpdateAborted,      "Update aborted"       },
@@ -941,7 +1777,6 @@ const char* BrcmPatchRAM::getState(DeviceState deviceState)
     
     return IOFindNameForValue(deviceState, state_values);
 }
-#endif //DEBUG
 
 const char* BrcmPatchRAM::stringFromReturn(IOReturn rtn)
 {
@@ -33,4 +33,42 @@
 #endif
 #define AlwaysLog(args...) do { IOLog(BRCMPATCHRAM_NAME ": " args); } while (0)
 
+/*
+ * Runtime selectable logging: a message is printed when its category is in
+ * gLogCategories (LogCategories property, bpr_log boot-arg) and its level is
+ * at most gLogLevel (LogLevel property, bpr_loglevel boot-arg). Debug builds
+ * default to kLogDebug, release builds to kLogOff.
+ *
+ * Both are defined in the firmware store, which every driver links against,
+ * and set from the store's properties when it starts.
+ */
+enum LogCategory
+{
+    kLogStore   = 0x01,
+    kLogDecode  = 0x02,
+    kLogUSB     = 0x04,
+    kLogState   = 0x08,
+    kLogPower   = 0x10,
+    kLogAll     = 0x1f,
+};
+
+enum LogLevel
+{
+    kLogOff,
+    kLogInfo,
+    kLogDebug,
+    kLogVerbose,    // per firmware record
+};
+
+#ifdef DEBUG
+#define kLogDefaultLevel kLogDebug
+#else
+#define kLogDefaultLevel kLogOff
+#endif
+
+extern unsigned gLogCategories;
+extern unsigned gLogLevel;
+
+#define CategoryLog(category, level, args...) do { if (__builtin_expect(gLogLevel >= (level) && (gLogCategories & (category)), 0)) IOLog(BRCMPATCHRAM_NAME ": " args); } while (0)
+
 #endif
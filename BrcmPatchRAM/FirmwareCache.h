@@ -0,0 +1,159 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __BrcmPatchRAM__FirmwareCache__
+#define __BrcmPatchRAM__FirmwareCache__
+
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSContainers.h>
+
+/*
+ * Layout of a firmware in the disk cache, <key>.bpc in CacheDirectory: this
+ * header followed by the LAUNCH_RAM records back to back, each as sent.
+ * The cache is only used while the source digest matches the firmware it
+ * was decoded from, the payload digest matches the records and each of
+ * them is a LAUNCH_RAM with at least its address. The store does the file
+ * I/O, the format lives here so that the host tests can check it.
+ */
+#define kFirmwareCacheMagic     0x43525042  // 'BPRC'
+#define kFirmwareCacheVersion   1
+#define kFirmwareCacheMaxBytes  (1024 * 1024)
+#define kFirmwareCacheLaunchRam 0xfc4c
+
+typedef struct FirmwareCacheHeader
+{
+    UInt32 magic;
+    UInt32 version;
+    UInt32 sourceDigest;    // FNV-1a of the .zhx or .hex
+    UInt32 sourceBytes;
+    UInt32 records;
+    UInt32 bytes;           // of the records following the header
+    UInt32 payloadDigest;   // FNV-1a of the records
+} FirmwareCacheHeader;
+
+static inline UInt32 firmwareCacheDigest(const UInt8* data, UInt32 length)
+{
+    UInt32 digest = 0x811C9DC5;
+
+    for (UInt32 i = 0; i < length; i++)
+        digest = (digest ^ data[i]) * 0x01000193;
+    return digest;
+}
+
+/*
+ * Opcode, parameter length and parameters, of which the first four are the
+ * address, all within the available bytes.
+ */
+static inline bool firmwareCacheRecordValid(const UInt8* record, UInt32 available)
+{
+    return available >= 3 && (record[0] | record[1] << 8) == kFirmwareCacheLaunchRam &&
+           record[2] >= 4 && 3U + record[2] <= available;
+}
+
+// Size of the cache file for instructions, 0 if they cannot be cached
+static inline UInt32 firmwareCacheSize(OSArray* instructions)
+{
+    UInt32 size = sizeof(FirmwareCacheHeader);
+
+    for (unsigned int i = 0; i < instructions->getCount(); i++)
+    {
+        OSData* instruction = OSDynamicCast(OSData, instructions->getObject(i));
+
+        if (!instruction || !firmwareCacheRecordValid((const UInt8*)instruction->getBytesNoCopy(), instruction->getLength()) ||
+            instruction->getLength() != 3U + ((const UInt8*)instruction->getBytesNoCopy())[2])
+            return 0;
+        size += instruction->getLength();
+    }
+    return size <= kFirmwareCacheMaxBytes ? size : 0;
+}
+
+/*
+ * Write the cache file of instructions to buffer, of firmwareCacheSize
+ * bytes.
+ */
+static inline void buildFirmwareCache(UInt8* buffer, UInt32 sourceDigest, UInt32 sourceBytes, OSArray* instructions)
+{
+    FirmwareCacheHeader* header = (FirmwareCacheHeader*)buffer;
+    UInt8* record = buffer + sizeof(FirmwareCacheHeader);
+
+    header->magic = kFirmwareCacheMagic;
+    header->version = kFirmwareCacheVersion;
+    header->sourceDigest = sourceDigest;
+    header->sourceBytes = sourceBytes;
+    header->records = instructions->getCount();
+    header->bytes = 0;
+
+    for (unsigned int i = 0; i < instructions->getCount(); i++)
+    {
+        OSData* instruction = (OSData*)instructions->getObject(i);
+
+        memcpy(record, instruction->getBytesNoCopy(), instruction->getLength());
+        record += instruction->getLength();
+        header->bytes += instruction->getLength();
+    }
+    header->payloadDigest = firmwareCacheDigest(buffer + sizeof(FirmwareCacheHeader), header->bytes);
+}
+
+/*
+ * A cache file of this version, decoded from the source with sourceDigest.
+ * One that is not is stale rather than damaged.
+ */
+static inline bool firmwareCacheCurrent(const UInt8* buffer, UInt32 size, UInt32 sourceDigest)
+{
+    const FirmwareCacheHeader* header = (const FirmwareCacheHeader*)buffer;
+
+    return size >= sizeof(FirmwareCacheHeader) && header->magic == kFirmwareCacheMagic &&
+           header->version == kFirmwareCacheVersion && header->sourceDigest == sourceDigest;
+}
+
+/*
+ * Records of a current cache file as instructions, NULL if the file is
+ * damaged: a payload that does not match its digest or record count, or a
+ * record that is not a complete LAUNCH_RAM.
+ */
+static inline OSArray* readFirmwareCacheRecords(const UInt8* buffer, UInt32 size)
+{
+    const FirmwareCacheHeader* header = (const FirmwareCacheHeader*)buffer;
+    const UInt8* record = buffer + sizeof(FirmwareCacheHeader);
+    const UInt8* end = buffer + size;
+    OSArray* instructions;
+
+    // A record takes at least 7 bytes, a larger count is damage and no capacity to allocate
+    if (header->bytes != size - sizeof(FirmwareCacheHeader) || header->records > header->bytes / 7 ||
+        header->payloadDigest != firmwareCacheDigest(record, header->bytes) ||
+        !(instructions = OSArray::withCapacity(header->records)))
+        return NULL;
+
+    while (record < end && firmwareCacheRecordValid(record, (UInt32)(end - record)))
+    {
+        OSData* instruction = OSData::withBytes(record, 3 + record[2]);
+        if (!instruction)
+            break;
+
+        instructions->setObject(instruction);
+        instruction->release();
+        record += 3 + record[2];
+    }
+
+    if (record != end || instructions->getCount() != header->records)
+        OSSafeReleaseNULL(instructions);
+    return instructions;
+}
+
+#endif /* defined(__BrcmPatchRAM__FirmwareCache__) */
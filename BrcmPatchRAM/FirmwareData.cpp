@@ -37,3 +37,8 @@ OSData* lookupFirmware(const char* filename)
     return result;
 }
 
+const FirmwareEntry* getFirmwareEntries()
+{
+    return firmwares;
+}
+
@@ -30,5 +30,6 @@ struct FirmwareEntry
 };
 
 OSData* lookupFirmware(const char* filename);
+const FirmwareEntry* getFirmwareEntries();
 
 #endif//_FIRMWAREDATA_H
\ No newline at end of file
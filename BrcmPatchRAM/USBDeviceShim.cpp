@@ -60,6 +60,11 @@ void USBDeviceShim::setProperty(const char* name, bool value)
     m_pDevice->setProperty(name, value);
 }
 
+void USBDeviceShim::setProperty(const char* name, OSObject* value)
+{
+    m_pDevice->setProperty(name, value);
+}
+
 void USBDeviceShim::removeProperty(const char* name)
 {
     m_pDevice->removeProperty(name);
@@ -70,6 +75,11 @@ IOReturn USBDeviceShim::getStringDescriptor(UInt8 index, char *buf, int maxLen,
     return m_pDevice->GetStringDescriptor(index, buf, maxLen, lang);
 }
 
+UInt32 USBDeviceShim::getLocationID()
+{
+    return m_pDevice->GetLocationID();
+}
+
 UInt16 USBDeviceShim::getDeviceRelease()
 {
     return m_pDevice->GetDeviceRelease();
@@ -122,6 +132,28 @@ bool USBDeviceShim::findFirstInterface(USBInterfaceShim* shim)
     return shim->getValidatedInterface() != NULL;
 }
 
+bool USBDeviceShim::findInterfaceByNumber(USBInterfaceShim* shim, UInt8 interfaceNumber)
+{
+    DebugLog("USBDeviceShim::findInterfaceByNumber %d\n", interfaceNumber);
+
+    IOUSBFindInterfaceRequest request;
+    request.bAlternateSetting  = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceClass    = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+    IOUSBInterface* interface = NULL;
+    while ((interface = m_pDevice->FindNextInterface(interface, &request)))
+    {
+        if (interface->GetInterfaceNumber() == interfaceNumber)
+        {
+            shim->setInterface(interface);
+            break;
+        }
+    }
+
+    return shim->getValidatedInterface() != NULL;
+}
+
 bool USBDeviceShim::open(IOService *forClient, IOOptionBits options, void *arg)
 {
     return m_pDevice->open(forClient, options, arg);
@@ -149,6 +181,7 @@ UInt8 USBDeviceShim::getSerialNumberStringIndex()
 USBInterfaceShim::USBInterfaceShim()
 {
     m_pInterface = NULL;
+    m_pCommandBuffer = NULL;
 }
 
 void USBInterfaceShim::setInterface(IOService* interface)
@@ -159,6 +192,8 @@ void USBInterfaceShim::setInterface(IOService* interface)
     
     if (m_pInterface)
         m_pInterface->retain();
+    else
+        OSSafeReleaseNULL(m_pCommandBuffer);
     if (prev)
         prev->release();
 }
@@ -176,12 +211,12 @@ void USBInterfaceShim::close(IOService *forClient, IOOptionBits options)
     m_pInterface->close(forClient, options);
 }
 
-#ifdef DEBUG
 UInt8 USBInterfaceShim::getInterfaceNumber()
 {
     return m_pInterface->GetInterfaceNumber();
 }
 
+#ifdef DEBUG
 UInt8 USBInterfaceShim::getInterfaceClass()
 {
     return m_pInterface->GetInterfaceClass();
@@ -211,6 +246,23 @@ bool USBInterfaceShim::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
     return false;
 }
 
+bool USBInterfaceShim::findPipeByAddress(USBPipeShim* shim, uint8_t address)
+{
+    IOUSBFindEndpointRequest findEndpointRequest;
+    findEndpointRequest.type = kUSBAnyType;
+    findEndpointRequest.direction = kUSBAnyDirn;
+    IOUSBPipe* pipe = NULL;
+    while ((pipe = m_pInterface->FindNextPipe(pipe, &findEndpointRequest)))
+    {
+        if (pipe->GetEndpointDescriptor()->bEndpointAddress == address)
+        {
+            shim->setPipe(pipe);
+            return true;
+        }
+    }
+    return false;
+}
+
 IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
 {
     IOUSBDevRequest request =
@@ -225,6 +277,38 @@ IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
     return m_pInterface->DeviceRequest(&request);
 }
 
+/*
+ * The buffer that the asynchronous hciCommand sends from, of
+ * kMaxHciCommandSize bytes, so that a command can be built in place.
+ */
+void* USBInterfaceShim::getCommandBuffer()
+{
+    if (!m_pCommandBuffer)
+        m_pCommandBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, kMaxHciCommandSize);
+    return m_pCommandBuffer ? m_pCommandBuffer->getBytesNoCopy() : NULL;
+}
+
+IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length, USBCOMPLETION* completion)
+{
+    if (!getCommandBuffer())
+        return kIOReturnNoMemory;
+    if (length > m_pCommandBuffer->getCapacity())
+        return kIOReturnOverrun;
+
+    // The request and its data have to stay valid until completion is called
+    if (command != m_pCommandBuffer->getBytesNoCopy())
+        bcopy(command, m_pCommandBuffer->getBytesNoCopy(), length);
+
+    m_request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBDevice);
+    m_request.bRequest = 0;
+    m_request.wValue = 0;
+    m_request.wIndex = 0;
+    m_request.wLength = length;
+    m_request.pData = m_pCommandBuffer->getBytesNoCopy();
+
+    return m_pInterface->DeviceRequest(&m_request, completion);
+}
+
 USBPipeShim::USBPipeShim()
 {
     m_pPipe = NULL;
@@ -288,6 +372,22 @@ const USBENDPOINTDESCRIPTOR* USBPipeShim::getEndpointDescriptor()
     return m_pPipe->GetEndpointDescriptor();
 }
 
+UInt8 USBPipeShim::getEndpointAddress()
+{
+    return m_pPipe->GetEndpointDescriptor()->bEndpointAddress;
+}
+
+UInt16 USBPipeShim::getMaxPacketSize()
+{
+    // bits 12:11 hold the additional transactions per microframe
+    return USBToHost16(m_pPipe->GetEndpointDescriptor()->wMaxPacketSize) & 0x7FF;
+}
+
+UInt8 USBPipeShim::getInterval()
+{
+    return m_pPipe->GetEndpointDescriptor()->bInterval;
+}
+
 IOReturn USBPipeShim::clearStall()
 {
     return m_pPipe->Reset();
@@ -20,6 +20,7 @@
 #ifndef __USBDeviceShim__
 #define __USBDeviceShim__
 
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
 #include <IOKit/usb/IOUSBHostDevice.h>
 #else
@@ -37,6 +38,10 @@
 #define USBENDPOINTDESCRIPTOR IOUSBEndpointDescriptor
 #endif
 
+// Largest HCI event (2 byte header) and HCI command (3 byte header)
+#define kMaxHciEventSize (2 + 0xFF)
+#define kMaxHciCommandSize (3 + 0xFF)
+
 class USBPipeShim;
 class USBInterfaceShim;
 
@@ -58,8 +63,10 @@ public:
     UInt16 getProductID();
     OSObject* getProperty(const char* name);
     void setProperty(const char* name, bool value);
+    void setProperty(const char* name, OSObject* value);
     void removeProperty(const char* name);
     IOReturn getStringDescriptor(UInt8 index, char *buf, int maxLen, UInt16 lang=0x409);
+    UInt32 getLocationID();
     UInt16 getDeviceRelease();
     IOReturn getDeviceStatus(IOService* forClient, USBStatus *status);
     IOReturn resetDevice();
@@ -68,6 +75,7 @@ public:
     IOReturn getConfiguration(IOService* forClient, UInt8 *configNumber);
     IOReturn setConfiguration(IOService *forClient, UInt8 configValue, bool startInterfaceMatching=true);
     bool findFirstInterface(USBInterfaceShim* shim);
+    bool findInterfaceByNumber(USBInterfaceShim* shim, UInt8 interfaceNumber);
     bool open(IOService *forClient, IOOptionBits options = 0, void *arg = 0 );
     void close(IOService *forClient, IOOptionBits options = 0);
     UInt8 getManufacturerStringIndex();
@@ -80,9 +88,13 @@ class USBInterfaceShim
 private:
 #if defined(TARGET_ELCAPITAN) || defined(TARGET_CATALINA)
     IOUSBHostInterface* m_pInterface;  // 10.11+
+    StandardUSB::DeviceRequest m_request;
 #else
     IOUSBInterface* m_pInterface;
+    IOUSBDevRequest m_request;
 #endif
+    // request and data of an async HCI command, valid until its completion
+    IOBufferMemoryDescriptor* m_pCommandBuffer;
     
 public:
     USBInterfaceShim();
@@ -92,16 +104,19 @@ public:
     bool open(IOService *forClient, IOOptionBits options = 0, void *arg = 0 );
     void close(IOService *forClient, IOOptionBits options = 0);
     
-#ifdef DEBUG
     UInt8 getInterfaceNumber();
+#ifdef DEBUG
     UInt8 getInterfaceClass();
     UInt8 getInterfaceSubClass();
     UInt8 getInterfaceProtocol();
 #endif
     
     bool findPipe(USBPipeShim* shim, uint8_t type, uint8_t direction);
+    bool findPipeByAddress(USBPipeShim* shim, uint8_t address);
     
     IOReturn hciCommand(void * command, UInt16 length);
+    IOReturn hciCommand(void * command, UInt16 length, USBCOMPLETION * completion);
+    void* getCommandBuffer();
 };
 
 class USBPipeShim
@@ -132,6 +147,15 @@ public:
                    IOByteCount		reqCount,
                    USBCOMPLETION *	completion = 0);
     const USBENDPOINTDESCRIPTOR* getEndpointDescriptor();
+    UInt8 getEndpointAddress();
+    UInt16 getMaxPacketSize();
+    UInt8 getInterval();
+    // Round a transfer length up to a whole number of max size packets
+    inline UInt32 getTransferSize(UInt32 length)
+    {
+        UInt16 size = getMaxPacketSize();
+        return size ? (length + size - 1) / size * size : length;
+    }
     IOReturn clearStall(void);
 };
 
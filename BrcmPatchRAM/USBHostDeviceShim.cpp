@@ -61,6 +61,11 @@ void USBDeviceShim::setProperty(const char* name, bool value)
     m_pDevice->setProperty(name, value);
 }
 
+void USBDeviceShim::setProperty(const char* name, OSObject* value)
+{
+    m_pDevice->setProperty(name, value);
+}
+
 void USBDeviceShim::removeProperty(const char* name)
 {
     m_pDevice->removeProperty(name);
@@ -84,6 +89,13 @@ IOReturn USBDeviceShim::getStringDescriptor(UInt8 index, char *buf, int maxLen,
     return kIOReturnSuccess;
 }
 
+UInt32 USBDeviceShim::getLocationID()
+{
+    if (OSNumber* locationId = OSDynamicCast(OSNumber, m_pDevice->getProperty(kUSBHostDevicePropertyLocationID)))
+        return locationId->unsigned32BitValue();
+    return 0;
+}
+
 UInt16 USBDeviceShim::getDeviceRelease()
 {
     return USBToHost16(m_pDevice->getDeviceDescriptor()->bcdDevice);
@@ -169,6 +181,32 @@ bool USBDeviceShim::findFirstInterface(USBInterfaceShim* shim)
     return shim->getValidatedInterface() != NULL;
 }
 
+bool USBDeviceShim::findInterfaceByNumber(USBInterfaceShim* shim, UInt8 interfaceNumber)
+{
+    DebugLog("USBDeviceShim::findInterfaceByNumber %d\n", interfaceNumber);
+    
+    OSIterator* iterator = m_pDevice->getChildIterator(gIOServicePlane);
+    
+    if (!iterator)
+        return false;
+    
+    while (OSObject* candidate = iterator->getNextObject())
+    {
+        if (IOUSBHostInterface* interface = OSDynamicCast(IOUSBHostInterface, candidate))
+        {
+            if (interface->getInterfaceDescriptor()->bInterfaceNumber == interfaceNumber)
+            {
+                shim->setInterface(interface);
+                break;
+            }
+        }
+    }
+    
+    iterator->release();
+    
+    return shim->getValidatedInterface() != NULL;
+}
+
 bool USBDeviceShim::open(IOService *forClient, IOOptionBits options, void *arg)
 {
     return m_pDevice->open(forClient, options, arg);
@@ -197,6 +235,7 @@ UInt8 USBDeviceShim::getSerialNumberStringIndex()
 USBInterfaceShim::USBInterfaceShim()
 {
     m_pInterface = NULL;
+    m_pCommandBuffer = NULL;
 }
 
 void USBInterfaceShim::setInterface(IOService* interface)
@@ -207,6 +246,8 @@ void USBInterfaceShim::setInterface(IOService* interface)
 
     if (m_pInterface)
         m_pInterface->retain();
+    else
+        OSSafeReleaseNULL(m_pCommandBuffer);
     if (prev)
         prev->release();
 }
@@ -224,12 +265,12 @@ void USBInterfaceShim::close(IOService *forClient, IOOptionBits options)
     m_pInterface->close(forClient, options);
 }
 
-#ifdef DEBUG
 UInt8 USBInterfaceShim::getInterfaceNumber()
 {
     return m_pInterface->getInterfaceDescriptor()->bInterfaceNumber;
 }
 
+#ifdef DEBUG
 UInt8 USBInterfaceShim::getInterfaceClass()
 {
     return m_pInterface->getInterfaceDescriptor()->bInterfaceClass;
@@ -347,6 +388,21 @@ bool USBInterfaceShim::findPipe(USBPipeShim* shim, UInt8 type, UInt8 direction)
     return false;
 }
 
+bool USBInterfaceShim::findPipeByAddress(USBPipeShim* shim, uint8_t address)
+{
+    // copyPipe creates the pipe directly, no need to walk the endpoint descriptors
+    IOUSBHostPipe* pipe = m_pInterface->copyPipe(address);
+    if (pipe == NULL)
+    {
+        DebugLog("findPipeByAddress: copyPipe(0x%02x) failed\n", address);
+        return false;
+    }
+    
+    shim->setPipe(pipe);
+    pipe->release();
+    return true;
+}
+
 IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
 {
     StandardUSB::DeviceRequest request =
@@ -362,6 +418,38 @@ IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length)
     return m_pInterface->deviceRequest(request, command, bytesTransfered, 0);
 }
 
+/*
+ * The buffer that the asynchronous hciCommand sends from, of
+ * kMaxHciCommandSize bytes, so that a command can be built in place.
+ */
+void* USBInterfaceShim::getCommandBuffer()
+{
+    if (!m_pCommandBuffer)
+        m_pCommandBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, kMaxHciCommandSize);
+    return m_pCommandBuffer ? m_pCommandBuffer->getBytesNoCopy() : NULL;
+}
+
+IOReturn USBInterfaceShim::hciCommand(void* command, UInt16 length, USBCOMPLETION* completion)
+{
+    if (!getCommandBuffer())
+        return kIOReturnNoMemory;
+    if (length > m_pCommandBuffer->getCapacity())
+        return kIOReturnOverrun;
+
+    // The request and its data have to stay valid until completion is called
+    m_pCommandBuffer->setLength(length);
+    if (command != m_pCommandBuffer->getBytesNoCopy())
+        m_pCommandBuffer->writeBytes(0, command, length);
+
+    m_request.bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeClass, kRequestRecipientDevice);
+    m_request.bRequest = 0;
+    m_request.wValue = 0;
+    m_request.wIndex = 0;
+    m_request.wLength = length;
+
+    return m_pInterface->deviceRequest(m_request, m_pCommandBuffer, completion);
+}
+
 USBPipeShim::USBPipeShim()
 {
     m_pPipe = NULL;
@@ -442,6 +530,22 @@ const USBENDPOINTDESCRIPTOR* USBPipeShim::getEndpointDescriptor()
     return m_pPipe->getEndpointDescriptor();
 }
 
+UInt8 USBPipeShim::getEndpointAddress()
+{
+    return StandardUSB::getEndpointAddress(m_pPipe->getEndpointDescriptor());
+}
+
+UInt16 USBPipeShim::getMaxPacketSize()
+{
+    // bits 12:11 hold the additional transactions per microframe
+    return USBToHost16(m_pPipe->getEndpointDescriptor()->wMaxPacketSize) & 0x7FF;
+}
+
+UInt8 USBPipeShim::getInterval()
+{
+    return m_pPipe->getEndpointDescriptor()->bInterval;
+}
+
 IOReturn USBPipeShim::clearStall()
 {
     return m_pPipe->clearStall(false);
@@ -0,0 +1,141 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef __BrcmPatchRAM__UploadOutcome__
+#define __BrcmPatchRAM__UploadOutcome__
+
+#include <IOKit/IOLib.h>
+#include <libkern/c++/OSContainers.h>
+
+#define kUploadResult "RM,UploadResult"
+
+/*
+ * Outcome of an upload attempt, published on the device as RM,UploadResult.
+ * The drivers write it with setUploadOutcome and the host harness reads it
+ * back with getUploadOutcome, so both agree on the keys.
+ *
+ * Read back, the strings point into the dictionary and are valid as long
+ * as it is.
+ */
+struct UploadOutcome
+{
+    const char* result;         // "Complete", "NotNeeded" or "Failed"
+    const char* topology;       // "Cached" or "Full"
+    const char* failedState;    // state of an aborted upload, NULL otherwise
+    const char* firmwareKey;    // NULL without one
+    UInt32 records;
+    UInt64 bytes;
+    UInt32 retries;
+    UInt64 setupTime;           // us
+    UInt64 time;                // us
+    UInt64 versionTime;         // us, of each phase
+    UInt64 miniDriverTime;
+    UInt64 recordsTime;
+    UInt64 endOfRecordTime;
+    UInt64 resetTime;
+    UInt32 versionBefore;       // 0 before the controller reported one
+    UInt32 versionAfter;        // 0 unless the controller runs a firmware afterwards
+    UInt32 savedSettleTime;     // ms, skipped with the deferred reset
+};
+
+static inline void setOutcomeNumber(OSDictionary* dictionary, const char* key, UInt64 value)
+{
+    if (OSNumber* number = OSNumber::withNumber(value, 64)) {
+        dictionary->setObject(key, number);
+        number->release();
+    }
+}
+
+static inline void setOutcomeString(OSDictionary* dictionary, const char* key, const char* value)
+{
+    if (!value)
+        return;
+
+    if (OSString* string = OSString::withCString(value)) {
+        dictionary->setObject(key, string);
+        string->release();
+    }
+}
+
+static inline void setUploadOutcome(OSDictionary* dictionary, const UploadOutcome* outcome)
+{
+    setOutcomeNumber(dictionary, "Records", outcome->records);
+    setOutcomeNumber(dictionary, "Bytes", outcome->bytes);
+    setOutcomeNumber(dictionary, "Retries", outcome->retries);
+    setOutcomeNumber(dictionary, "SetupTime", outcome->setupTime);
+    setOutcomeNumber(dictionary, "Time", outcome->time);
+    setOutcomeNumber(dictionary, "VersionTime", outcome->versionTime);
+    setOutcomeNumber(dictionary, "MiniDriverTime", outcome->miniDriverTime);
+    setOutcomeNumber(dictionary, "RecordsTime", outcome->recordsTime);
+    setOutcomeNumber(dictionary, "EndOfRecordTime", outcome->endOfRecordTime);
+    setOutcomeNumber(dictionary, "ResetTime", outcome->resetTime);
+    setOutcomeNumber(dictionary, "SavedSettleTime", outcome->savedSettleTime);
+
+    // Without a version the firmware did not get far enough to report one
+    if (outcome->versionBefore)
+        setOutcomeNumber(dictionary, "VersionBefore", outcome->versionBefore);
+    if (outcome->versionAfter)
+        setOutcomeNumber(dictionary, "VersionAfter", outcome->versionAfter);
+
+    setOutcomeString(dictionary, "Result", outcome->result);
+    setOutcomeString(dictionary, "Topology", outcome->topology);
+    setOutcomeString(dictionary, "FailedState", outcome->failedState);
+    setOutcomeString(dictionary, "FirmwareKey", outcome->firmwareKey);
+}
+
+static inline UInt64 getOutcomeNumber(OSDictionary* dictionary, const char* key)
+{
+    OSNumber* number = OSDynamicCast(OSNumber, dictionary->getObject(key));
+    return number ? number->unsigned64BitValue() : 0;
+}
+
+static inline const char* getOutcomeString(OSDictionary* dictionary, const char* key)
+{
+    OSString* string = OSDynamicCast(OSString, dictionary->getObject(key));
+    return string ? string->getCStringNoCopy() : NULL;
+}
+
+/*
+ * Read an RM,UploadResult back, false for anything that is not one.
+ */
+static inline bool getUploadOutcome(OSDictionary* dictionary, UploadOutcome* outcome)
+{
+    if (!dictionary || !(outcome->result = getOutcomeString(dictionary, "Result")))
+        return false;
+
+    outcome->topology = getOutcomeString(dictionary, "Topology");
+    outcome->failedState = getOutcomeString(dictionary, "FailedState");
+    outcome->firmwareKey = getOutcomeString(dictionary, "FirmwareKey");
+    outcome->records = (UInt32)getOutcomeNumber(dictionary, "Records");
+    outcome->bytes = getOutcomeNumber(dictionary, "Bytes");
+    outcome->retries = (UInt32)getOutcomeNumber(dictionary, "Retries");
+    outcome->setupTime = getOutcomeNumber(dictionary, "SetupTime");
+    outcome->time = getOutcomeNumber(dictionary, "Time");
+    outcome->versionTime = getOutcomeNumber(dictionary, "VersionTime");
+    outcome->miniDriverTime = getOutcomeNumber(dictionary, "MiniDriverTime");
+    outcome->recordsTime = getOutcomeNumber(dictionary, "RecordsTime");
+    outcome->endOfRecordTime = getOutcomeNumber(dictionary, "EndOfRecordTime");
+    outcome->resetTime = getOutcomeNumber(dictionary, "ResetTime");
+    outcome->versionBefore = (UInt32)getOutcomeNumber(dictionary, "VersionBefore");
+    outcome->versionAfter = (UInt32)getOutcomeNumber(dictionary, "VersionAfter");
+    outcome->savedSettleTime = (UInt32)getOutcomeNumber(dictionary, "SavedSettleTime");
+    return true;
+}
+
+#endif /* defined(__BrcmPatchRAM__UploadOutcome__) */
@@ -0,0 +1,592 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Decode benchmark over the firmwares/ corpus. Each repetition runs a stage
+ * over every firmware, so that a sample is the cost of the whole corpus and
+ * stays well above the timer resolution. Warm-up repetitions are not
+ * sampled. Throughput is taken from the fastest repetition, which noise
+ * can only slow down.
+ *
+ * The cost of a stage is that time over the time of a fixed calibration
+ * loop, so that it compares across machines, reported with its spread over
+ * the repetitions. Neither is gated: with other load on the host both move
+ * by more than any tolerance that would still catch a regression.
+ *
+ * Memory is counted once per stage, after the warm-up: the allocations it
+ * makes and the high-water mark of what it holds on top of what was held
+ * before. The store's own allocation sites are reported at the end.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Harness.h"
+#include "../BrcmPatchRAM/BrcmFirmwareStore.h"
+#include "../BrcmPatchRAM/FirmwareData.h"
+
+struct CorpusEntry
+{
+    FirmwareFile file;
+    OSData* source;
+    OSData* hex;
+    OSData* packed;                         // as CompactCache keeps it
+    std::vector<std::vector<UInt8>> lines;  // binary of each hex line, as check_sum sees it
+};
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static void splitLines(OSData* hex, std::vector<std::vector<UInt8>>* lines)
+{
+    const char* text = (const char*)hex->getBytesNoCopy();
+    const char* end = text + hex->getLength();
+
+    while (text < end)
+    {
+        if (*text++ != ':')
+            continue;
+
+        std::vector<UInt8> line;
+        while (text + 1 < end && hexValue(text[0]) >= 0 && hexValue(text[1]) >= 0)
+        {
+            line.push_back((UInt8)(hexValue(text[0]) << 4 | hexValue(text[1])));
+            text += 2;
+        }
+        // check_sum covers everything but the checksum byte
+        if (line.size() > 1)
+        {
+            line.pop_back();
+            lines->push_back(line);
+        }
+    }
+}
+
+/*
+ * Run stage once per warm-up and repetition and sample its real time.
+ */
+template <typename Stage>
+static Samples measure(const BenchOptions& options, Stage stage)
+{
+    Samples samples;
+
+    for (int i = 0; i < options.warmup; i++)
+        stage();
+
+    for (int i = 0; i < options.repetitions; i++)
+    {
+        double start = nowMicroseconds();
+        stage();
+        samples.add(nowMicroseconds() - start);
+    }
+    return samples;
+}
+
+template <typename Stage>
+static void measureMemory(Report* report, const std::string& name, Stage stage)
+{
+    HostResetAllocPeak();
+    HostAllocStats before = HostGetAllocStats();
+    stage();
+    HostAllocStats after = HostGetAllocStats();
+
+    report->set(name + "_allocs", after.allocations - before.allocations);
+    report->set(name + "_peak_bytes", after.peak - before.current);
+}
+
+static double megabytesPerSecond(UInt64 bytes, double microseconds)
+{
+    return microseconds > 0 ? bytes / microseconds : 0;
+}
+
+/*
+ * A fixed loop of byte loads, multiplies and branches, like the decoder's
+ * own, and of loads that miss the cache, like its walks over records, that
+ * the cost of a stage is measured in.
+ */
+class Calibration
+{
+public:
+    Calibration() : mBuffer(1 << 20), mNext(1 << 20)
+    {
+        for (size_t i = 0; i < mBuffer.size(); i++)
+            mBuffer[i] = (UInt8)((i * 2654435761U) >> 24);
+
+        // One cycle through every slot, in a fixed scattered order
+        std::vector<UInt32> order(mNext.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = (UInt32)i;
+        UInt32 seed = 1;
+        for (size_t i = order.size() - 1; i > 0; i--)
+        {
+            seed = seed * 1664525 + 1013904223;
+            std::swap(order[i], order[seed % (i + 1)]);
+        }
+        for (size_t i = 0; i < order.size(); i++)
+            mNext[order[i]] = order[(i + 1) % order.size()];
+    }
+
+    double run()
+    {
+        double start = nowMicroseconds();
+        UInt32 digest = 0x811C9DC5;
+        UInt32 hex = 0;
+
+        for (size_t i = 0; i < mBuffer.size(); i++)
+        {
+            digest = (digest ^ mBuffer[i]) * 0x01000193;
+            if ((mBuffer[i] & 0x0F) < 10)
+                hex++;
+        }
+        UInt32 slot = 0;
+        for (size_t i = 0; i < mNext.size() / 16; i++)
+            slot = mNext[slot];
+        mSink = digest ^ hex ^ slot;
+        return nowMicroseconds() - start;
+    }
+
+private:
+    std::vector<UInt8> mBuffer;
+    std::vector<UInt32> mNext;
+    volatile UInt32 mSink = 0;
+};
+
+/*
+ * Like measure, with the calibration loop run right before each repetition
+ * so that both see the same clock speed. Each cost sample is the time of
+ * the repetition in calibration loops.
+ */
+template <typename Stage>
+static Samples measureCost(const BenchOptions& options, Calibration* calibration, Stage stage, Samples* cost)
+{
+    Samples samples;
+
+    for (int i = 0; i < options.warmup; i++)
+        stage();
+
+    for (int i = 0; i < options.repetitions; i++)
+    {
+        double loop = calibration->run();
+        double start = nowMicroseconds();
+        stage();
+        double time = nowMicroseconds() - start;
+        samples.add(time);
+        cost->add(time / loop);
+    }
+    return samples;
+}
+
+/*
+ * Throughput of a stage over bytes, its median cost in calibration loops
+ * and how far that moved between repetitions, p10 to p90 in percent of it.
+ */
+static void setThroughput(Report* report, const std::string& name, const Samples& samples, const Samples& cost, UInt64 bytes)
+{
+    double median = cost.percentile(50);
+
+    report->set(name + "_mbps", megabytesPerSecond(bytes, samples.min()));
+    report->set(name + "_cost", median);
+    report->set(name + "_cost_spread_pct", median > 0 ? (cost.percentile(90) - cost.percentile(10)) * 100 / median : 0);
+}
+
+/*
+ * Time to firmware of every device through FirmwareDirectory and through
+ * the resource request it falls back to, both reading firmwares/: the load
+ * of the file alone, and the load with the decode into instructions. The
+ * host delivers resources from a thread rather than a round trip to kextd,
+ * so the difference it shows is the least the directory saves.
+ */
+static int measureFirmwarePaths(const BenchOptions& options, Report* report, const std::vector<DeviceEntry>& devices,
+                                const std::vector<OSString*>& keys)
+{
+    static const char* const paths[] = { "directory", "resource" };
+    BrcmFirmwareStore* stores[2];
+    int failures = 0;
+
+    for (int p = 0; p < 2; p++)
+    {
+        OSDictionary* properties = OSDictionary::withCapacity(1);
+        if (p == 0)
+        {
+            OSString* directory = OSString::withCString(gFirmwareDirectory.c_str());
+            properties->setObject("FirmwareDirectory", directory);
+            directory->release();
+        }
+        stores[p] = StoreHarness::startStore(properties);
+        properties->release();
+    }
+
+    for (int p = 0; p < 2 && stores[0] && stores[1]; p++)
+    {
+        BrcmFirmwareStore* store = stores[p];
+        UInt64 bytes = 0;
+
+        // Each path has to find every firmware on its own
+        for (size_t i = 0; i < devices.size(); i++)
+        {
+            bool direct = false;
+            OSData* data = StoreHarness::loadFirmwareFiles(store, devices[i].vendorId, devices[i].productId, keys[i], &direct);
+
+            if (!data || direct != (p == 0))
+            {
+                fprintf(stderr, "No %s firmware for %s.\n", paths[p], devices[i].name.c_str());
+                failures++;
+            }
+            else
+                bytes += data->getLength();
+            OSSafeReleaseNULL(data);
+        }
+
+        auto loadAll = [&]
+        {
+            for (size_t i = 0; i < devices.size(); i++)
+            {
+                bool direct;
+                OSData* data = StoreHarness::loadFirmwareFiles(store, devices[i].vendorId, devices[i].productId, keys[i], &direct);
+                OSSafeReleaseNULL(data);
+            }
+        };
+        Samples load = measure(options, loadAll);
+        measureMemory(report, std::string("load_") + paths[p], loadAll);
+        report->setSamples(std::string("load_") + paths[p], load);
+        report->set(std::string("load_") + paths[p] + "_mbps", megabytesPerSecond(bytes, load.min()));
+
+        auto firmwareAll = [&]
+        {
+            for (size_t i = 0; i < devices.size(); i++)
+            {
+                if (OSArray* instructions = StoreHarness::loadFirmware(store, devices[i].vendorId, devices[i].productId, keys[i]))
+                    StoreHarness::releaseInstructions(instructions);
+            }
+        };
+        Samples firmware = measure(options, firmwareAll);
+        measureMemory(report, std::string("firmware_") + paths[p], firmwareAll);
+        report->setSamples(std::string("firmware_") + paths[p], firmware);
+    }
+
+    for (int p = 0; p < 2; p++)
+    {
+        if (stores[p])
+            StoreHarness::stopStore(stores[p]);
+        else
+            failures++;
+    }
+    HostWaitThreads();
+    return failures;
+}
+
+/*
+ * Lookup of every one of count synthetic firmware names, by comparing with
+ * each name in turn like the catalogue did and through a FirmwareIndex, to
+ * show how both scale with the catalogue. Time per key is from the median.
+ */
+static int measureLookupScaling(const BenchOptions& options, Report* report, UInt32 count)
+{
+    std::vector<std::string> names;
+    FirmwareIndex index;
+    char name[32];
+    int failures = 0;
+
+    for (UInt32 i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "BCM%05u_v%04u.zhx", i * 7919 % 100000, 4096 + i);
+        names.push_back(name);
+    }
+    if (!index.init(count))
+        return 1;
+    for (UInt32 i = 0; i < count; i++)
+        index.insert(names[i].c_str(), &names[i]);
+
+    volatile size_t found = 0;
+    Samples linear = measure(options, [&]
+    {
+        for (UInt32 i = 0; i < count; i++)
+        {
+            for (UInt32 j = 0; j < count; j++)
+            {
+                if (!strcmp(names[j].c_str(), names[i].c_str()))
+                {
+                    found += j;
+                    break;
+                }
+            }
+        }
+    });
+    Samples indexed = measure(options, [&]
+    {
+        for (UInt32 i = 0; i < count; i++)
+        {
+            if (index.lookup(names[i].c_str()) != &names[i])
+                failures++;
+        }
+    });
+
+    std::string prefix = "lookup_scale_" + std::to_string(count) + "_";
+    report->setSamples(prefix + "linear", linear);
+    report->setSamples(prefix + "index", indexed);
+    report->set(prefix + "linear_per_key_ns", linear.percentile(50) * 1000 / count);
+    report->set(prefix + "index_per_key_ns", indexed.percentile(50) * 1000 / count);
+    report->set(prefix + "index_max_probes", index.getMaxProbes());
+
+    index.free();
+    return failures;
+}
+
+int runBench(const BenchOptions& options, Report* report)
+{
+    std::vector<CorpusEntry> corpus;
+    UInt64 sourceBytes = 0, hexBytes = 0, lineBytes = 0;
+    int failures = 0;
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    if (!store)
+    {
+        fprintf(stderr, "Unable to start the firmware store.\n");
+        return 1;
+    }
+
+    std::vector<FirmwareFile> files = listFirmwareFiles();
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        CorpusEntry entry = CorpusEntry();
+        entry.file = files[i];
+
+        if (!(entry.source = readFirmwareData(files[i].path)) ||
+            !(entry.hex = StoreHarness::decompressFirmware(store, entry.source)))
+        {
+            fprintf(stderr, "Unable to decompress \"%s\".\n", files[i].name.c_str());
+            OSSafeReleaseNULL(entry.source);
+            failures++;
+            continue;
+        }
+
+        splitLines(entry.hex, &entry.lines);
+        for (size_t j = 0; j < entry.lines.size(); j++)
+            lineBytes += entry.lines[j].size();
+        sourceBytes += entry.source->getLength();
+        hexBytes += entry.hex->getLength();
+        corpus.push_back(entry);
+    }
+
+    if (corpus.empty())
+    {
+        fprintf(stderr, "No firmware found in \"%s\".\n", gFirmwareDirectory.c_str());
+        StoreHarness::stopStore(store);
+        return 1;
+    }
+
+    report->set("corpus_files", corpus.size());
+    report->set("corpus_source_bytes", sourceBytes);
+    report->set("corpus_hex_bytes", hexBytes);
+
+    Calibration calibration;
+    Samples loops = measure(options, [&] { calibration.run(); });
+    report->setSamples("calibration", loops);
+
+    // Inflate every .zhx
+    auto decompressAll = [&]
+    {
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            OSData* hex = StoreHarness::decompressFirmware(store, corpus[i].source);
+            OSSafeReleaseNULL(hex);
+        }
+    };
+    Samples decompressCost;
+    Samples decompress = measureCost(options, &calibration, decompressAll, &decompressCost);
+    measureMemory(report, "decompress", decompressAll);
+    report->setSamples("decompress", decompress);
+    setThroughput(report, "decompress", decompress, decompressCost, hexBytes);
+
+    // Parse every .hex into LAUNCH_RAM records
+    auto parseAll = [&]
+    {
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            OSArray* instructions = StoreHarness::parseFirmware(store, corpus[i].hex, NULL);
+            if (instructions)
+                StoreHarness::releaseInstructions(instructions);
+            else
+                failures++;
+        }
+    };
+    Samples parseCost;
+    Samples parse = measureCost(options, &calibration, parseAll, &parseCost);
+    measureMemory(report, "parse", parseAll);
+    report->setSamples("parse", parse);
+    setThroughput(report, "parse", parse, parseCost, hexBytes);
+
+    // Pack every firmware once, as CompactCache does when it first loads one
+    UInt64 packedBytes = 0;
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        UInt32 records;
+
+        if ((corpus[i].packed = StoreHarness::packFirmware(store, corpus[i].source, &records)))
+            packedBytes += corpus[i].packed->getLength();
+        else
+            failures++;
+    }
+    report->set("corpus_packed_bytes", packedBytes);
+
+    /*
+     * Read every firmware record by record from its packed form, as an
+     * upload with CompactCache does, which keeps nothing else in between.
+     */
+    UInt64 recordBytes = 0;
+    auto streamAll = [&]
+    {
+        UInt8 record[kLaunchRamRecordMax];
+        UInt16 length;
+
+        recordBytes = 0;
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            BrcmFirmwareStream* stream = corpus[i].packed ? BrcmFirmwareStream::withSource(corpus[i].packed) : NULL;
+            IOReturn result = stream ? kIOReturnSuccess : kIOReturnNoMemory;
+
+            while (result == kIOReturnSuccess && (result = stream->readRecord(record, sizeof(record), &length)) == kIOReturnSuccess && length)
+                recordBytes += length;
+            if (result != kIOReturnSuccess)
+                failures++;
+            OSSafeReleaseNULL(stream);
+        }
+    };
+    Samples stream = measure(options, streamAll);
+    measureMemory(report, "stream", streamAll);
+    report->set("corpus_record_bytes", recordBytes);
+    report->setSamples("stream", stream);
+    report->set("stream_mbps", megabytesPerSecond(recordBytes, stream.percentile(50)));
+
+    /*
+     * Checksum every line, as parseFirmware does. One pass is quick enough
+     * that a preemption swamps it, so each sample makes several.
+     */
+    static const int kCheckSumPasses = 16;
+    volatile UInt8 sink = 0;
+    Samples checksumCost;
+    Samples checksum = measureCost(options, &calibration, [&]
+    {
+        for (int pass = 0; pass < kCheckSumPasses; pass++)
+        {
+            for (size_t i = 0; i < corpus.size(); i++)
+            {
+                for (size_t j = 0; j < corpus[i].lines.size(); j++)
+                    sink ^= StoreHarness::checkSum(corpus[i].lines[j].data(), (UInt16)corpus[i].lines[j].size());
+            }
+        }
+    }, &checksumCost);
+    report->setSamples("check_sum", checksum);
+    setThroughput(report, "check_sum", checksum, checksumCost, lineBytes * kCheckSumPasses);
+
+    // Look every embedded firmware up, with the linear search and the index
+    auto lookupAll = [&]
+    {
+        for (const FirmwareEntry* entry = getFirmwareEntries(); entry->filename; entry++)
+        {
+            OSData* data = lookupFirmware(entry->filename);
+            OSSafeReleaseNULL(data);
+        }
+    };
+    Samples lookup = measure(options, lookupAll);
+    measureMemory(report, "lookup_linear", lookupAll);
+    report->setSamples("lookup_linear", lookup);
+
+    auto indexAll = [&]
+    {
+        for (const FirmwareEntry* entry = getFirmwareEntries(); entry->filename; entry++)
+        {
+            OSData* data = StoreHarness::lookupEmbeddedFirmware(store, entry->filename);
+            OSSafeReleaseNULL(data);
+        }
+    };
+    Samples indexed = measure(options, indexAll);
+    measureMemory(report, "lookup_index", indexAll);
+    report->setSamples("lookup_index", indexed);
+
+    // getFirmware of every device once decoded, the path of every wake
+    std::vector<DeviceEntry> devices = loadDevices();
+    std::vector<OSString*> keys;
+    for (size_t i = 0; i < devices.size(); i++)
+        keys.push_back(OSString::withCString(devices[i].firmwareKey.c_str()));
+
+    // The first getFirmware decodes and caches, that is what stays wired
+    measureMemory(report, "getfirmware_cold", [&]
+    {
+        for (size_t i = 0; i < devices.size(); i++)
+        {
+            if (!store->getFirmware(devices[i].vendorId, devices[i].productId, keys[i]))
+            {
+                fprintf(stderr, "No firmware for %s.\n", devices[i].name.c_str());
+                failures++;
+            }
+        }
+    });
+
+    auto cachedAll = [&]
+    {
+        for (size_t i = 0; i < devices.size(); i++)
+            store->getFirmware(devices[i].vendorId, devices[i].productId, keys[i]);
+    };
+    Samples cached = measure(options, cachedAll);
+    measureMemory(report, "getfirmware_cached", cachedAll);
+    report->setSamples("getfirmware_cached", cached);
+    report->set("devices", devices.size());
+
+    // What each allocation site of the store has held at most, as RM,MemoryStats
+    static const char* const sites[kAllocSiteCount] = { "zlib", "decompress", "instructions", "index" };
+    for (int i = 0; i < kAllocSiteCount; i++)
+    {
+        AllocationStats stats = StoreHarness::getAllocationStats((AllocationSite)i);
+        report->set(std::string("store_") + sites[i] + "_allocs", stats.allocations);
+        report->set(std::string("store_") + sites[i] + "_peak_bytes", stats.peak);
+    }
+
+    // After the store's sites are read, the index counts its slots there
+    static const UInt32 scales[] = { 10, 100, 1000 };
+    for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]); i++)
+        failures += measureLookupScaling(options, report, scales[i]);
+
+    // Also after the sites are read, these stores load every firmware again
+    failures += measureFirmwarePaths(options, report, devices, keys);
+
+    for (size_t i = 0; i < keys.size(); i++)
+        keys[i]->release();
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        corpus[i].source->release();
+        corpus[i].hex->release();
+        OSSafeReleaseNULL(corpus[i].packed);
+    }
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+
+    report->set("failures", failures);
+    return failures ? 1 : 0;
+}
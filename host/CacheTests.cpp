@@ -0,0 +1,261 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The disk cache of decoded firmware in a plain directory: what one store
+ * writes the next reads instead of decoding, and a file that is damaged,
+ * or holds anything but LAUNCH_RAM records, is decoded again.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Harness.h"
+#include "HostTest.h"
+#include "../BrcmPatchRAM/FirmwareCache.h"
+
+// The cache file of the first device's firmware in directory
+static std::string cacheFile(TemporaryDirectory* directory)
+{
+    return directory->file(loadDevices().at(0).firmwareKey + ".bpc");
+}
+
+// The first device's firmware from a new store on directory, and the inflates it took
+static OSArray* copyFirmware(const std::string& directory, UInt64* decodes)
+{
+    UInt64 inflates = StoreHarness::getAllocationStats(kAllocZlib).allocations;
+    OSArray* copy = copyStoreFirmware(loadDevices().at(0), "CacheDirectory", directory, NULL);
+
+    if (decodes)
+        *decodes = StoreHarness::getAllocationStats(kAllocZlib).allocations - inflates;
+    return copy;
+}
+
+/*
+ * Write a cache file for the decoded instructions after change, with a
+ * correct header and payload digest, and check that a store rejects it.
+ */
+template <typename Change>
+static void expectRejected(Change change)
+{
+    TemporaryDirectory directory("bprcache");
+    std::string contents;
+    UInt64 decodes = 0;
+
+    OSArray* decoded = copyFirmware(directory.path(), NULL);
+    EXPECT(decoded != NULL);
+    EXPECT(readFile(cacheFile(&directory), &contents));
+    if (!decoded || contents.size() < sizeof(FirmwareCacheHeader))
+    {
+        OSSafeReleaseNULL(decoded);
+        return;
+    }
+
+    FirmwareCacheHeader header = *(const FirmwareCacheHeader*)contents.data();
+    std::string records = contents.substr(sizeof(FirmwareCacheHeader));
+    change(&header, &records);
+    header.payloadDigest = firmwareCacheDigest((const UInt8*)records.data(), (UInt32)records.size());
+    EXPECT(writeFile(cacheFile(&directory), std::string((const char*)&header, sizeof(header)) + records));
+
+    OSArray* reread = copyFirmware(directory.path(), &decodes);
+    EXPECT(decodes > 0);
+    EXPECT(sameInstructions(reread, decoded));
+
+    OSSafeReleaseNULL(reread);
+    decoded->release();
+}
+
+HOST_TEST(cacheIsReadBack)
+{
+    TemporaryDirectory directory("bprcache");
+    std::string contents;
+    UInt64 decodes = 0;
+
+    EXPECT(!directory.path().empty());
+
+    OSArray* uncached = copyFirmware("", NULL);
+    OSArray* written = copyFirmware(directory.path(), &decodes);
+    EXPECT(decodes > 0);
+    EXPECT(readFile(cacheFile(&directory), &contents));
+
+    const FirmwareCacheHeader* header = (const FirmwareCacheHeader*)contents.data();
+    EXPECT(contents.size() > sizeof(FirmwareCacheHeader));
+    EXPECT_EQ(header->version, kFirmwareCacheVersion);
+    EXPECT_EQ(header->records, uncached ? uncached->getCount() : 0);
+    EXPECT_EQ(header->bytes, contents.size() - sizeof(FirmwareCacheHeader));
+    EXPECT_EQ(header->payloadDigest, firmwareCacheDigest((const UInt8*)contents.data() + sizeof(FirmwareCacheHeader), header->bytes));
+
+    OSArray* cached = copyFirmware(directory.path(), &decodes);
+    EXPECT_EQ(decodes, 0);
+    EXPECT(sameInstructions(written, uncached));
+    EXPECT(sameInstructions(cached, uncached));
+
+    OSSafeReleaseNULL(uncached);
+    OSSafeReleaseNULL(written);
+    OSSafeReleaseNULL(cached);
+}
+
+HOST_TEST(cacheWithDamagedPayloadIsDecodedAgain)
+{
+    TemporaryDirectory directory("bprcache");
+    std::string contents;
+    UInt64 decodes = 0;
+
+    OSArray* decoded = copyFirmware(directory.path(), NULL);
+    EXPECT(readFile(cacheFile(&directory), &contents));
+
+    // One bit of the last record's payload, the digest left as it was
+    contents[contents.size() - 1] ^= 1;
+    EXPECT(writeFile(cacheFile(&directory), contents));
+
+    OSArray* reread = copyFirmware(directory.path(), &decodes);
+    EXPECT(decodes > 0);
+    EXPECT(sameInstructions(reread, decoded));
+
+    OSSafeReleaseNULL(decoded);
+    OSSafeReleaseNULL(reread);
+}
+
+HOST_TEST(cacheWithOtherOpcodeIsDecodedAgain)
+{
+    expectRejected([](FirmwareCacheHeader* header, std::string* records)
+    {
+        // END_OF_RECORD in place of the first LAUNCH_RAM
+        (*records)[0] = 0x4e;
+    });
+}
+
+HOST_TEST(cacheWithRecordShorterThanAddressIsDecodedAgain)
+{
+    expectRejected([](FirmwareCacheHeader* header, std::string* records)
+    {
+        // The first record cut to three address bytes
+        UInt8 length = (UInt8)(*records)[2];
+        records->replace(2, 1 + length, std::string("\x03\x00\x00\x09", 4));
+        header->bytes = (UInt32)records->size();
+    });
+}
+
+HOST_TEST(cacheWithMissingRecordIsDecodedAgain)
+{
+    expectRejected([](FirmwareCacheHeader* header, std::string* records)
+    {
+        // The first record gone, the count still includes it
+        records->erase(0, 3 + (UInt8)(*records)[2]);
+        header->bytes = (UInt32)records->size();
+    });
+}
+
+HOST_TEST(cacheWithTooManyRecordsIsDecodedAgain)
+{
+    expectRejected([](FirmwareCacheHeader* header, std::string* records)
+    {
+        // More records than the payload can hold
+        header->records = 0xffffffff;
+    });
+}
+
+HOST_TEST(cacheIsWrittenOnLaterHit)
+{
+    TemporaryDirectory directory("bprcache");
+    const DeviceEntry device = loadDevices().at(0);
+    std::string later = directory.path() + "/later";
+    std::string file = later + "/" + device.firmwareKey + ".bpc";
+    std::string contents;
+
+    // CacheDirectory only appears after the first decode, as at boot
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSString* path = OSString::withCString(later.c_str());
+    properties->setObject("CacheDirectory", path);
+    path->release();
+
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    EXPECT(store != NULL);
+    if (!store)
+        return;
+
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+    UInt64 lockedWrites = HostLockedFileWrites();
+    EXPECT(store->getFirmware(device.vendorId, device.productId, firmwareKey) != NULL);
+    EXPECT(!readFile(file, &contents));
+
+    EXPECT_EQ(mkdir(later.c_str(), 0755), 0);
+    OSArray* instructions = store->beginFirmware(device.vendorId, device.productId, firmwareKey);
+    EXPECT(instructions != NULL);
+    EXPECT(readFile(file, &contents));
+    EXPECT_EQ(((const FirmwareCacheHeader*)contents.data())->records, instructions ? instructions->getCount() : 0);
+    EXPECT_EQ(HostLockedFileWrites(), lockedWrites);
+
+    OSSafeReleaseNULL(instructions);
+    firmwareKey->release();
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+
+    unlink(file.c_str());
+    rmdir(later.c_str());
+}
+
+/*
+ * The cache is written once mDataLock is dropped, whether getFirmware
+ * decoded the firmware or decodeThread did for beginFirmware.
+ */
+HOST_TEST(cacheIsWrittenOutsideDataLock)
+{
+    TemporaryDirectory directory("bprcache");
+    std::vector<DeviceEntry> devices = loadDevices();
+    std::string contents;
+
+    // Two firmwares, one for each way of decoding
+    size_t other = 1;
+    while (other < devices.size() && devices[other].firmwareKey == devices[0].firmwareKey)
+        other++;
+    EXPECT(other < devices.size());
+    if (other >= devices.size())
+        return;
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSString* path = OSString::withCString(directory.path().c_str());
+    properties->setObject("CacheDirectory", path);
+    path->release();
+
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    EXPECT(store != NULL);
+    if (!store)
+        return;
+
+    UInt64 lockedWrites = HostLockedFileWrites();
+    OSString* firmwareKey = OSString::withCString(devices[0].firmwareKey.c_str());
+    EXPECT(store->getFirmware(devices[0].vendorId, devices[0].productId, firmwareKey) != NULL);
+    EXPECT(readFile(cacheFile(&directory), &contents));
+    firmwareKey->release();
+
+    firmwareKey = OSString::withCString(devices[other].firmwareKey.c_str());
+    OSArray* instructions = store->beginFirmware(devices[other].vendorId, devices[other].productId, firmwareKey);
+    EXPECT(instructions != NULL);
+    HostWaitThreads();
+    EXPECT(readFile(directory.file(devices[other].firmwareKey + ".bpc"), &contents));
+    EXPECT_EQ(HostLockedFileWrites(), lockedWrites);
+
+    OSSafeReleaseNULL(instructions);
+    firmwareKey->release();
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+}
@@ -0,0 +1,165 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Regression check of a run against a checked-in baseline. Only metrics
+ * whose name ends in one of the gated suffixes fail the check, the others
+ * (percentiles, corpus sizes) are there to read. Gated metrics are the
+ * ones that do not depend on the machine or its load: modelled times,
+ * counts and byte totals. Decode costs are printed next to the baseline
+ * with their spread over the run, for a reader to judge.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Harness.h"
+#include "SimController.h"
+
+struct GatedMetric
+{
+    const char* suffix;
+    bool higherIsBetter;
+};
+
+static const GatedMetric gatedMetrics[] =
+{
+    { "_allocs", false },           // allocations
+    { "_peak_bytes", false },       // peak memory
+    { "_model_us", false },         // modelled upload time
+};
+
+static bool hasSuffix(const std::string& name, const char* suffix)
+{
+    size_t length = strlen(suffix);
+
+    return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+}
+
+static const GatedMetric* findGate(const std::string& name)
+{
+    for (size_t i = 0; i < sizeof(gatedMetrics) / sizeof(gatedMetrics[0]); i++)
+    {
+        if (hasSuffix(name, gatedMetrics[i].suffix))
+            return &gatedMetrics[i];
+    }
+    return NULL;
+}
+
+/*
+ * Each decode cost of the run against the baseline, with the spread of
+ * both, so that a change can be told from noise by eye.
+ */
+static void printCosts(const Report& baseline, const Report& current)
+{
+    const std::map<std::string, double>& metrics = current.metrics();
+
+    for (std::map<std::string, double>::const_iterator it = metrics.begin(); it != metrics.end(); ++it)
+    {
+        if (!hasSuffix(it->first, "_cost"))
+            continue;
+
+        std::map<std::string, double>::const_iterator spread = metrics.find(it->first + "_spread_pct");
+        std::map<std::string, double>::const_iterator before = baseline.metrics().find(it->first);
+        std::map<std::string, double>::const_iterator beforeSpread = baseline.metrics().find(it->first + "_spread_pct");
+
+        printf("cost %s: %.3f spread %.1f%%", it->first.c_str(), it->second, spread != metrics.end() ? spread->second : 0.0);
+        if (before != baseline.metrics().end() && before->second)
+            printf(", baseline %.3f spread %.1f%% (%+.1f%%)", before->second,
+                   beforeSpread != baseline.metrics().end() ? beforeSpread->second : 0.0,
+                   (it->second - before->second) * 100 / before->second);
+        printf("\n");
+    }
+}
+
+/*
+ * Bench and simulation in one report, the form of the baseline.
+ */
+int runReport(const BenchOptions& options, const SimTiming& timing, Report* report)
+{
+    int result = runBench(options, report);
+
+    // The simulation's table is not part of the report
+    if (runSimulate(timing, report, NULL))
+        result = 1;
+    return result;
+}
+
+/*
+ * Number of gated metrics that got worse than the baseline by more than
+ * tolerance percent, or went missing.
+ */
+int compareReports(const Report& baseline, const Report& current, double tolerance)
+{
+    int regressions = 0;
+    int gated = 0;
+
+    for (std::map<std::string, double>::const_iterator it = baseline.metrics().begin(); it != baseline.metrics().end(); ++it)
+    {
+        const GatedMetric* gate = findGate(it->first);
+        if (!gate)
+            continue;
+
+        gated++;
+        std::map<std::string, double>::const_iterator found = current.metrics().find(it->first);
+        if (found == current.metrics().end())
+        {
+            printf("REGRESSION %s: missing, baseline %.3f\n", it->first.c_str(), it->second);
+            regressions++;
+            continue;
+        }
+
+        double value = found->second;
+        bool regressed = gate->higherIsBetter ? value < it->second * (1 - tolerance / 100) :
+                                                value > it->second * (1 + tolerance / 100);
+        if (regressed)
+        {
+            printf("REGRESSION %s: %.3f, baseline %.3f (%+.1f%%)\n", it->first.c_str(), value, it->second,
+                   it->second ? (value - it->second) * 100 / it->second : 100.0);
+            regressions++;
+        }
+    }
+
+    for (std::map<std::string, double>::const_iterator it = current.metrics().begin(); it != current.metrics().end(); ++it)
+    {
+        if (findGate(it->first) && !baseline.metrics().count(it->first))
+            printf("new %s: %.3f, not in the baseline\n", it->first.c_str(), it->second);
+    }
+
+    printCosts(baseline, current);
+    printf("%d of %d gated metrics regressed by more than %.1f%%.\n", regressions, gated, tolerance);
+    return regressions;
+}
+
+int runCheck(const BenchOptions& options, const SimTiming& timing, const std::string& baselinePath, double tolerance, Report* report)
+{
+    std::string json;
+    Report baseline;
+
+    if (!readFile(baselinePath, &json) || !Report::fromJson(json, &baseline))
+    {
+        fprintf(stderr, "Unable to read the baseline \"%s\".\n", baselinePath.c_str());
+        return 1;
+    }
+
+    int result = runReport(options, timing, report);
+    if (compareReports(baseline, *report, tolerance))
+        result = 1;
+    return result;
+}
@@ -0,0 +1,145 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * FirmwareDirectory in a plain directory: a firmware found there is used
+ * before the kext resource of the same name, and the store falls back to
+ * the resource when the directory lacks the file or does not exist.
+ */
+
+#include "Harness.h"
+#include "HostTest.h"
+
+// Put the .zhx of firmwareKey in firmwares/ into directory as name
+static bool addFirmware(TemporaryDirectory* directory, const std::string& firmwareKey, const std::string& name)
+{
+    std::string contents;
+
+    return readFile(gFirmwareDirectory + "/" + firmwareKey + ".zhx", &contents) && writeFile(directory->file(name), contents);
+}
+
+// The firmware of device from a new store, with FirmwareDirectory set unless empty
+static OSArray* copyFirmware(const DeviceEntry& device, const std::string& directory, bool* direct)
+{
+    return copyStoreFirmware(device, "FirmwareDirectory", directory, direct);
+}
+
+// Two devices with different firmware, to tell which file a store loaded
+static bool findTwoFirmwares(DeviceEntry* first, DeviceEntry* second)
+{
+    std::vector<DeviceEntry> devices = loadDevices();
+
+    for (size_t i = 1; i < devices.size(); i++)
+    {
+        if (devices[i].firmwareKey != devices[0].firmwareKey)
+        {
+            *first = devices[0];
+            *second = devices[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+HOST_TEST(directoryFirmwareIsUsedBeforeResource)
+{
+    TemporaryDirectory directory("bprfirmware");
+    DeviceEntry device, other;
+    bool direct = false;
+
+    EXPECT(!directory.path().empty());
+    EXPECT(findTwoFirmwares(&device, &other));
+
+    // The directory holds the other firmware under the device's key
+    EXPECT(addFirmware(&directory, other.firmwareKey, device.firmwareKey + ".zhx"));
+
+    OSArray* resource = copyFirmware(device, "", NULL);
+    OSArray* expected = copyFirmware(other, "", NULL);
+    OSArray* loaded = copyFirmware(device, directory.path(), &direct);
+
+    EXPECT(direct);
+    EXPECT(sameInstructions(loaded, expected));
+    EXPECT(!sameInstructions(loaded, resource));
+
+    OSSafeReleaseNULL(resource);
+    OSSafeReleaseNULL(expected);
+    OSSafeReleaseNULL(loaded);
+}
+
+HOST_TEST(directoryVendorProductNameIsUsedFirst)
+{
+    TemporaryDirectory directory("bprfirmware");
+    DeviceEntry device, other;
+    char name[32];
+    bool direct = false;
+
+    EXPECT(findTwoFirmwares(&device, &other));
+
+    // <vid>_<pid>.zhx wins over <key>.zhx, as for resources
+    snprintf(name, sizeof(name), "%04x_%04x.zhx", device.vendorId, device.productId);
+    EXPECT(addFirmware(&directory, other.firmwareKey, name));
+    EXPECT(addFirmware(&directory, device.firmwareKey, device.firmwareKey + ".zhx"));
+
+    OSArray* expected = copyFirmware(other, "", NULL);
+    OSArray* loaded = copyFirmware(device, directory.path(), &direct);
+
+    EXPECT(direct);
+    EXPECT(sameInstructions(loaded, expected));
+
+    OSSafeReleaseNULL(expected);
+    OSSafeReleaseNULL(loaded);
+}
+
+HOST_TEST(directoryWithoutFirmwareFallsBackToResource)
+{
+    TemporaryDirectory directory("bprfirmware");
+    DeviceEntry device, other;
+    bool direct = true;
+
+    EXPECT(findTwoFirmwares(&device, &other));
+
+    // Only another device's firmware is there
+    EXPECT(addFirmware(&directory, other.firmwareKey, other.firmwareKey + ".zhx"));
+
+    OSArray* resource = copyFirmware(device, "", NULL);
+    OSArray* loaded = copyFirmware(device, directory.path(), &direct);
+
+    EXPECT(!direct);
+    EXPECT(resource != NULL);
+    EXPECT(sameInstructions(loaded, resource));
+
+    OSSafeReleaseNULL(resource);
+    OSSafeReleaseNULL(loaded);
+}
+
+HOST_TEST(missingDirectoryFallsBackToResource)
+{
+    DeviceEntry device = loadDevices().at(0);
+    bool direct = true;
+
+    OSArray* resource = copyFirmware(device, "", NULL);
+    OSArray* loaded = copyFirmware(device, "/nonexistent/bprfirmware", &direct);
+
+    EXPECT(!direct);
+    EXPECT(resource != NULL);
+    EXPECT(sameInstructions(loaded, resource));
+
+    OSSafeReleaseNULL(resource);
+    OSSafeReleaseNULL(loaded);
+}
@@ -0,0 +1,91 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The Catalina driver is built as part of this file, like the store in
+ * StoreHarness.cpp, so that the harness reaches the handshake list.
+ */
+
+#include "../BrcmPatchRAM/BrcmPatchRAM3.cpp"
+
+#include "Harness.h"
+
+bool DriverHarness::startModule()
+{
+    return BrcmPatchRAM_Start(NULL, NULL) == KERN_SUCCESS;
+}
+
+bool DriverHarness::supportsHandshake(UInt16 vendorId, UInt16 productId)
+{
+    for (int i = 0; hskSupport[i].vid; i++)
+    {
+        if (hskSupport[i].vid == vendorId && hskSupport[i].did == productId)
+            return true;
+    }
+    return false;
+}
+
+// Topologies cached by earlier runs, so that a test starts from none
+void DriverHarness::forgetTopologies()
+{
+    IOLockLock(BrcmPatchRAM::mTopologyLock);
+    bzero(BrcmPatchRAM::mTopologyCache, sizeof(BrcmPatchRAM::mTopologyCache));
+    IOLockUnlock(BrcmPatchRAM::mTopologyLock);
+}
+
+/*
+ * Match, probe and start the driver on provider like IOKit does, then stop
+ * it again. The upload happens in start.
+ */
+bool DriverHarness::runDriver(IOService* provider, OSDictionary* properties)
+{
+    BrcmPatchRAM* driver = new BrcmPatchRAM;
+    SInt32 score = 0;
+    bool started = false;
+
+    if (driver->init(properties) && driver->probe(provider, &score) == driver)
+    {
+        if ((started = driver->start(provider)))
+            driver->stop(provider);
+    }
+    driver->release();
+    return started;
+}
+
+/*
+ * Push count events through the trace ring of a driver on provider and
+ * publish it as RM,Trace. Event i is kTraceRecord with arg0 i and arg1 the
+ * complement of i, so that a decoder can tell which entries survived.
+ */
+void DriverHarness::publishTrace(IOService* provider, UInt32 count)
+{
+    BrcmPatchRAM* driver = new BrcmPatchRAM;
+
+    if (driver->init(NULL))
+    {
+        bzero(&driver->mTrace, sizeof(driver->mTrace));
+        driver->mTrace.enabled = true;
+        driver->mDevice.setDevice(provider);
+        for (UInt32 i = 0; i < count; i++)
+            driver->trace(kTraceRecord, (UInt16)i, ~i);
+        driver->publishTrace();
+        driver->mDevice.setDevice(NULL);
+    }
+    driver->release();
+}
@@ -0,0 +1,188 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * What the driver sends to every device of firmwares.plist, one command per
+ * line, compared with the checked-in golden/<vid>_<pid>.txt. A change to
+ * how the firmware is sent that also changes what is sent shows up as the
+ * first line that differs. golden/patched.txt has the same for controllers
+ * that already run their patch, along with the resets they took.
+ */
+
+#include <stdio.h>
+
+#include "Harness.h"
+#include "SimController.h"
+
+static std::string formatTranscript(const std::vector<SimCommand>& transcript)
+{
+    std::string text;
+    char line[64];
+
+    for (size_t i = 0; i < transcript.size(); i++)
+    {
+        const SimCommand& command = transcript[i];
+        snprintf(line, sizeof(line), "%04x %08x %u %08x\n", command.opcode, command.address, command.length, command.hash);
+        text += line;
+    }
+    return text;
+}
+
+// Line number and both lines of the first difference, false without one
+static bool firstDifference(const std::string& expected, const std::string& actual, size_t* number, std::string* expectedLine, std::string* actualLine)
+{
+    size_t e = 0, a = 0;
+
+    for (*number = 1; e < expected.size() || a < actual.size(); (*number)++)
+    {
+        size_t eEnd = expected.find('\n', e);
+        size_t aEnd = actual.find('\n', a);
+        *expectedLine = e < expected.size() ? expected.substr(e, eEnd - e) : "<end>";
+        *actualLine = a < actual.size() ? actual.substr(a, aEnd - a) : "<end>";
+
+        if (*expectedLine != *actualLine)
+            return true;
+        e = eEnd == std::string::npos ? expected.size() : eEnd + 1;
+        a = aEnd == std::string::npos ? actual.size() : aEnd + 1;
+    }
+    return false;
+}
+
+/*
+ * Diff actual with the golden at path, or write it anew with update.
+ * Returns false on a difference or when the file can't be read or written.
+ */
+static bool compareGolden(const std::string& path, const std::string& actual, bool update)
+{
+    if (update)
+    {
+        if (writeFile(path, actual))
+            return true;
+        fprintf(stderr, "Unable to write \"%s\".\n", path.c_str());
+        return false;
+    }
+
+    std::string expected;
+    size_t number;
+    std::string expectedLine, actualLine;
+
+    if (!readFile(path, &expected))
+    {
+        printf("%s: no golden\n", path.c_str());
+        return false;
+    }
+    if (firstDifference(expected, actual, &number, &expectedLine, &actualLine))
+    {
+        printf("%s:%zu: expected \"%s\", sent \"%s\"\n", path.c_str(), number, expectedLine.c_str(), actualLine.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Upload to every device whose controller still runs the patch, as after a
+ * warm restart, with each ResetPolicy. All go to one golden, each with its
+ * result and how often the device was reset: once with either policy, to
+ * rule out stale firmware before NotNeeded, and never after it.
+ */
+static std::string patchedTranscripts(const std::vector<DeviceEntry>& devices)
+{
+    static const char* const policies[] = { "Always", "Auto" };
+    std::string text = "# device policy result usbresets, then opcode address length fnv1a\n";
+    char line[80];
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        const DeviceEntry& device = devices[i];
+
+        for (UInt32 policy = 0; policy < sizeof(policies) / sizeof(policies[0]); policy++)
+        {
+            UploadOutcome outcome = UploadOutcome();
+            OSDictionary* properties = OSDictionary::withCapacity(1);
+            OSNumber* number = OSNumber::withNumber(policy, 32);
+
+            properties->setObject("ResetPolicy", number);
+            number->release();
+
+            HostClearEvents();
+            HostResetClock();
+
+            SimConfig config = simConfig(device, SimTiming());
+            config.patched = true;
+            SimController controller(config);
+            bool uploaded = simulateUpload(&controller, device, properties, &outcome);
+            properties->release();
+
+            snprintf(line, sizeof(line), "%s %s %s %u\n", device.name.c_str(), policies[policy],
+                     uploaded ? outcome.result : "None", controller.getStats().usbResets);
+            text += line;
+            text += formatTranscript(controller.getTranscript());
+        }
+    }
+    return text;
+}
+
+/*
+ * Upload to every device and diff its transcript with the golden, or
+ * write the goldens anew with update.
+ */
+int runGolden(const std::string& directory, bool update)
+{
+    std::vector<DeviceEntry> devices = loadDevices();
+    int failures = 0;
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    if (!store)
+    {
+        fprintf(stderr, "Unable to start the firmware store.\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        const DeviceEntry& device = devices[i];
+        UploadOutcome outcome = UploadOutcome();
+        std::string path = directory + "/" + device.name + ".txt";
+
+        HostClearEvents();
+        HostResetClock();
+
+        SimController controller(simConfig(device, SimTiming()));
+        simulateUpload(&controller, device, NULL, &outcome);
+        std::string actual = "# opcode address length fnv1a\n" + formatTranscript(controller.getTranscript());
+
+        if (!compareGolden(path, actual, update))
+            failures++;
+    }
+
+    // Already patched, one golden for all
+    if (!compareGolden(directory + "/patched.txt", patchedTranscripts(devices), update))
+        failures++;
+
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+
+    if (update)
+        printf("Wrote %zu goldens to %s.\n", devices.size() + 1 - failures, directory.c_str());
+    else
+        printf("%d of %zu transcripts differ from the goldens.\n", failures, devices.size() + 1);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,424 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Host harness for the firmware store and the driver, see the Makefile
+ * for its targets.
+ *
+ *   bprhost bench [--warmup N] [--reps N] [--json FILE]
+ *   bprhost simulate [--speed full|high] [--latency US] [--jitter US] [--seed N] [--json FILE]
+ *   bprhost report [bench and simulate options] --json FILE
+ *   bprhost check --baseline FILE [--tolerance PCT] [bench and simulate options] [--json FILE]
+ *   bprhost test [NAME]
+ *   bprhost golden [--update] [--golden DIR]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Harness.h"
+#include "SimController.h"
+#include "../BrcmPatchRAM/BrcmFirmwareStore.h"
+
+std::string gFirmwareDirectory = "../firmwares";
+
+bool readFile(const std::string& path, std::string* contents)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    *contents = buffer.str();
+    return true;
+}
+
+bool writeFile(const std::string& path, const std::string& contents)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    file << contents;
+    return (bool)file;
+}
+
+OSData* readFirmwareData(const std::string& path)
+{
+    std::string contents;
+
+    if (!readFile(path, &contents))
+        return NULL;
+    return OSData::withBytes(contents.data(), (unsigned int)contents.size());
+}
+
+std::vector<FirmwareFile> listFirmwareFiles()
+{
+    std::vector<FirmwareFile> files;
+
+    if (DIR* dir = opendir(gFirmwareDirectory.c_str()))
+    {
+        while (struct dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".zhx") == 0)
+                files.push_back(FirmwareFile { name, gFirmwareDirectory + "/" + name });
+        }
+        closedir(dir);
+    }
+
+    std::sort(files.begin(), files.end(), [](const FirmwareFile& a, const FirmwareFile& b) { return a.name < b.name; });
+    return files;
+}
+
+/*
+ * Read the personalities of firmwares.plist. Only the tags it uses are
+ * understood: a dictionary of dictionaries of strings and integers.
+ */
+std::vector<DeviceEntry> loadDevices()
+{
+    std::vector<DeviceEntry> devices;
+    std::string plist;
+
+    if (!readFile(gFirmwareDirectory + "/firmwares.plist", &plist))
+        return devices;
+
+    int depth = 0;
+    std::string key;
+    DeviceEntry device = DeviceEntry();
+    size_t position = 0;
+
+    while ((position = plist.find('<', position)) != std::string::npos)
+    {
+        size_t end = plist.find('>', position);
+        if (end == std::string::npos)
+            break;
+
+        std::string tag = plist.substr(position + 1, end - position - 1);
+        size_t close = plist.find('<', end);
+        std::string text = close == std::string::npos ? "" : plist.substr(end + 1, close - end - 1);
+        position = end + 1;
+
+        if (tag == "dict")
+        {
+            if (++depth == 2)
+            {
+                device = DeviceEntry();
+                device.name = key;
+            }
+        }
+        else if (tag == "/dict")
+        {
+            if (depth-- == 2 && device.vendorId)
+                devices.push_back(device);
+        }
+        else if (tag == "key")
+            key = text;
+        else if (depth == 2 && tag == "string")
+        {
+            if (key == "FirmwareKey")
+                device.firmwareKey = text;
+            else if (key == "DisplayName")
+                device.displayName = text;
+        }
+        else if (depth == 2 && tag == "integer")
+        {
+            if (key == "idVendor")
+                device.vendorId = (UInt16)strtoul(text.c_str(), NULL, 0);
+            else if (key == "idProduct")
+                device.productId = (UInt16)strtoul(text.c_str(), NULL, 0);
+        }
+    }
+
+    std::sort(devices.begin(), devices.end(), [](const DeviceEntry& a, const DeviceEntry& b) { return a.name < b.name; });
+    return devices;
+}
+
+double nowMicroseconds()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TemporaryDirectory::TemporaryDirectory(const char* prefix)
+{
+    std::string pattern = std::string("/tmp/") + prefix + "XXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+
+    path.push_back(0);
+    mPath = mkdtemp(path.data()) ? path.data() : "";
+}
+
+TemporaryDirectory::~TemporaryDirectory()
+{
+    for (size_t i = 0; i < mFiles.size(); i++)
+        unlink(mFiles[i].c_str());
+    if (!mPath.empty())
+        rmdir(mPath.c_str());
+}
+
+std::string TemporaryDirectory::file(const std::string& name)
+{
+    std::string path = mPath + "/" + name;
+
+    if (std::find(mFiles.begin(), mFiles.end(), path) == mFiles.end())
+        mFiles.push_back(path);
+    return path;
+}
+
+OSArray* copyStoreFirmware(const DeviceEntry& device, const char* property, const std::string& value, bool* direct)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSArray* copy = NULL;
+
+    if (!value.empty())
+    {
+        OSString* string = OSString::withCString(value.c_str());
+        properties->setObject(property, string);
+        string->release();
+    }
+
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    if (!store)
+        return NULL;
+
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+    if (direct)
+    {
+        OSData* data = StoreHarness::loadFirmwareFiles(store, device.vendorId, device.productId, firmwareKey, direct);
+        OSSafeReleaseNULL(data);
+    }
+    if ((copy = store->getFirmware(device.vendorId, device.productId, firmwareKey)))
+        copy->retain();
+    firmwareKey->release();
+
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+    return copy;
+}
+
+bool sameInstructions(OSArray* a, OSArray* b)
+{
+    if (!a || !b || a->getCount() != b->getCount())
+        return false;
+
+    for (unsigned int i = 0; i < a->getCount(); i++)
+    {
+        if (!((OSData*)a->getObject(i))->isEqualTo((OSData*)b->getObject(i)))
+            return false;
+    }
+    return true;
+}
+
+double Samples::percentile(double p) const
+{
+    if (mValues.empty())
+        return 0;
+
+    std::vector<double> sorted = mValues;
+    std::sort(sorted.begin(), sorted.end());
+
+    // Nearest rank
+    size_t rank = (size_t)(p / 100 * sorted.size() + 0.999999);
+    return sorted[rank ? std::min(rank, sorted.size()) - 1 : 0];
+}
+
+double Samples::min() const
+{
+    return mValues.empty() ? 0 : *std::min_element(mValues.begin(), mValues.end());
+}
+
+void Report::setSamples(const std::string& name, const Samples& samples)
+{
+    set(name + "_min_us", samples.min());
+    set(name + "_p50_us", samples.percentile(50));
+    set(name + "_p90_us", samples.percentile(90));
+    set(name + "_p99_us", samples.percentile(99));
+}
+
+std::string Report::toJson() const
+{
+    std::string json = "{\n";
+    char line[256];
+    size_t count = 0;
+
+    for (std::map<std::string, double>::const_iterator it = mMetrics.begin(); it != mMetrics.end(); ++it)
+    {
+        snprintf(line, sizeof(line), "  \"%s\": %.3f%s\n", it->first.c_str(), it->second, ++count < mMetrics.size() ? "," : "");
+        json += line;
+    }
+    return json + "}\n";
+}
+
+/*
+ * Read back what toJson wrote, a flat object of numbers.
+ */
+bool Report::fromJson(const std::string& json, Report* report)
+{
+    size_t position = json.find('{');
+    if (position == std::string::npos)
+        return false;
+
+    while ((position = json.find('"', position + 1)) != std::string::npos)
+    {
+        size_t end = json.find('"', position + 1);
+        size_t colon = json.find(':', end);
+        if (end == std::string::npos || colon == std::string::npos)
+            return false;
+
+        char* last;
+        double value = strtod(json.c_str() + colon + 1, &last);
+        if (last == json.c_str() + colon + 1)
+            return false;
+
+        report->set(json.substr(position + 1, end - position - 1), value);
+        position = last - json.c_str();
+    }
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: bprhost [--firmwares DIR] [--verbose] command [options]\n"
+            "  bench [--warmup N] [--reps N] [--json FILE]\n"
+            "  simulate [--speed full|high] [--latency US] [--jitter US] [--seed N] [--trace] [--json FILE]\n"
+            "  report [bench and simulate options] --json FILE\n"
+            "  check --baseline FILE [--tolerance PCT] [bench and simulate options] [--json FILE]\n"
+            "  test [NAME]\n"
+            "  golden [--update] [--golden DIR]\n");
+}
+
+int main(int argc, char** argv)
+{
+    int arg = 1;
+
+    HostSetSimThread();
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (!strcmp(argv[arg], "--firmwares") && arg + 1 < argc)
+            gFirmwareDirectory = argv[++arg];
+        else if (!strcmp(argv[arg], "--verbose"))
+            HostSetVerbose(true);
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (arg >= argc)
+    {
+        usage();
+        return 2;
+    }
+
+    HostSetResourceDirectory(gFirmwareDirectory.c_str());
+    if (BrcmFirmwareStore_Start(NULL, NULL) != KERN_SUCCESS || !DriverHarness::startModule() || !ResidentHarness::startModule())
+        return 1;
+
+    std::string command = argv[arg++];
+
+    // Tests by name only
+    if (command == "test")
+        return arg + 1 < argc ? (usage(), 2) : runTests(arg < argc ? argv[arg] : NULL);
+
+    BenchOptions options;
+    SimTiming timing;
+    std::string jsonPath;
+    std::string baselinePath;
+    double tolerance = 10;
+    std::string goldenDirectory = "golden";
+    bool update = false;
+    bool trace = false;
+
+    for (; arg < argc; arg++)
+    {
+        if (!strcmp(argv[arg], "--warmup") && arg + 1 < argc)
+            options.warmup = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--reps") && arg + 1 < argc)
+            options.repetitions = std::max(1, atoi(argv[++arg]));
+        else if (!strcmp(argv[arg], "--json") && arg + 1 < argc)
+            jsonPath = argv[++arg];
+        else if (!strcmp(argv[arg], "--speed") && arg + 1 < argc)
+            timing.highSpeed = strcmp(argv[++arg], "full") != 0;
+        else if (!strcmp(argv[arg], "--latency") && arg + 1 < argc)
+            timing.latency = strtoull(argv[++arg], NULL, 0) * 1000;
+        else if (!strcmp(argv[arg], "--jitter") && arg + 1 < argc)
+            timing.jitter = strtoull(argv[++arg], NULL, 0) * 1000;
+        else if (!strcmp(argv[arg], "--seed") && arg + 1 < argc)
+            timing.seed = (UInt32)strtoul(argv[++arg], NULL, 0);
+        else if (!strcmp(argv[arg], "--baseline") && arg + 1 < argc)
+            baselinePath = argv[++arg];
+        else if (!strcmp(argv[arg], "--tolerance") && arg + 1 < argc)
+            tolerance = strtod(argv[++arg], NULL);
+        else if (!strcmp(argv[arg], "--golden") && arg + 1 < argc)
+            goldenDirectory = argv[++arg];
+        else if (!strcmp(argv[arg], "--update"))
+            update = true;
+        else if (!strcmp(argv[arg], "--trace"))
+            trace = true;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    Report report;
+    int result;
+
+    if (command == "bench")
+        result = runBench(options, &report);
+    else if (command == "simulate")
+        result = runSimulate(timing, &report, stdout, trace ? stdout : NULL);
+    else if (command == "report" && !jsonPath.empty())
+        result = runReport(options, timing, &report);
+    else if (command == "check" && !baselinePath.empty())
+        result = runCheck(options, timing, baselinePath, tolerance, &report);
+    else if (command == "golden")
+        result = runGolden(goldenDirectory, update);
+    else
+    {
+        usage();
+        return 2;
+    }
+
+    if (jsonPath.empty())
+    {
+        if (command == "bench")
+            fputs(report.toJson().c_str(), stdout);
+    }
+    else if (!writeFile(jsonPath, report.toJson()))
+    {
+        fprintf(stderr, "Unable to write \"%s\".\n", jsonPath.c_str());
+        return 1;
+    }
+    return result;
+}
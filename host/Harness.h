@@ -0,0 +1,221 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Shared by the host benchmark, simulator and tests: the firmwares/ corpus,
+ * the metrics report, a friend of BrcmFirmwareStore to reach its decoder
+ * and the driver entry points.
+ */
+
+#ifndef __Harness__
+#define __Harness__
+
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "HostControl.h"
+#include "../BrcmPatchRAM/BrcmFirmwareStore.h"
+#include "../BrcmPatchRAM/UploadOutcome.h"
+
+struct SimTiming;
+struct SimConfig;
+class SimController;
+
+/*
+ * A personality of firmwares/firmwares.plist, the devices the driver
+ * ships with.
+ */
+struct DeviceEntry
+{
+    std::string name;           // <vid>_<pid>
+    UInt16 vendorId;
+    UInt16 productId;
+    std::string firmwareKey;
+    std::string displayName;
+};
+
+struct FirmwareFile
+{
+    std::string name;           // file name in firmwares/
+    std::string path;
+};
+
+extern std::string gFirmwareDirectory;
+
+std::vector<DeviceEntry> loadDevices();
+std::vector<FirmwareFile> listFirmwareFiles();
+bool readFile(const std::string& path, std::string* contents);
+bool writeFile(const std::string& path, const std::string& contents);
+OSData* readFirmwareData(const std::string& path);
+
+/*
+ * Real time samples of one measurement, in microseconds.
+ */
+class Samples
+{
+public:
+    void add(double value) { mValues.push_back(value); }
+    double percentile(double p) const;
+    double min() const;
+    size_t size() const { return mValues.size(); }
+
+private:
+    std::vector<double> mValues;
+};
+
+/*
+ * Flat map of metric name to value, written as JSON with one metric per
+ * line so that baselines diff well.
+ */
+class Report
+{
+public:
+    void set(const std::string& name, double value) { mMetrics[name] = value; }
+    void setSamples(const std::string& name, const Samples& samples);
+    const std::map<std::string, double>& metrics() const { return mMetrics; }
+
+    std::string toJson() const;
+    static bool fromJson(const std::string& json, Report* report);
+
+private:
+    std::map<std::string, double> mMetrics;
+};
+
+struct BenchOptions
+{
+    int warmup = 3;
+    int repetitions = 25;
+};
+
+double nowMicroseconds();
+
+/*
+ * A new directory in /tmp for the length of a test, removed together with
+ * the files named through file().
+ */
+class TemporaryDirectory
+{
+public:
+    TemporaryDirectory(const char* prefix);
+    ~TemporaryDirectory();
+
+    const std::string& path() const { return mPath; }
+    std::string file(const std::string& name);
+
+private:
+    std::string mPath;
+    std::vector<std::string> mFiles;
+};
+
+/*
+ * The firmware of device from a new store started with property set to
+ * value, or with no properties when value is empty. With direct, whether
+ * the store loaded the file from FirmwareDirectory.
+ */
+OSArray* copyStoreFirmware(const DeviceEntry& device, const char* property, const std::string& value, bool* direct);
+
+// Whether a and b hold the same records in the same order
+bool sameInstructions(OSArray* a, OSArray* b);
+
+/*
+ * Entry points into BrcmFirmwareStore, which are private to it. Defined
+ * in StoreHarness.cpp together with the store itself.
+ */
+class StoreHarness
+{
+public:
+    static BrcmFirmwareStore* startStore(OSDictionary* properties);
+    static void stopStore(BrcmFirmwareStore* store);
+
+    static OSData* decompressFirmware(BrcmFirmwareStore* store, OSData* firmware);
+    static OSArray* parseFirmware(BrcmFirmwareStore* store, OSData* firmwareData, OSArray* stream);
+    static OSData* packFirmware(BrcmFirmwareStore* store, OSData* firmware, UInt32* records);
+    static UInt8 checkSum(const UInt8* data, UInt16 length);
+    static OSData* loadFirmwareFiles(BrcmFirmwareStore* store, UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool* direct);
+    static OSArray* loadFirmware(BrcmFirmwareStore* store, UInt16 vendorId, UInt16 productId, OSString* firmwareKey);
+    static OSData* lookupEmbeddedFirmware(BrcmFirmwareStore* store, const char* filename);
+    static AllocationStats getAllocationStats(AllocationSite site);
+    static void releaseInstructions(OSArray* instructions);
+    static const void* getDecodingEvent(BrcmFirmwareStore* store);
+};
+
+/*
+ * Entry points into the Catalina driver, defined in DriverHarness.cpp
+ * together with the driver itself.
+ */
+class DriverHarness
+{
+public:
+    static bool startModule();
+    static bool supportsHandshake(UInt16 vendorId, UInt16 productId);
+    static bool runDriver(IOService* provider, OSDictionary* properties);
+    static void forgetTopologies();
+    static void publishTrace(IOService* provider, UInt32 count);
+};
+
+/*
+ * Entry points into the resident driver, defined in ResidentHarness.cpp
+ * together with the driver itself. Its provider is an IOUSBDevice over
+ * the simulated controller, see LegacyUSB.cpp.
+ */
+class ResidentHarness
+{
+public:
+    static bool startModule();
+    static void forgetWakes();
+    static IOService* startDriver(IOService* provider, OSDictionary* properties);
+    static void stopDriver(IOService* driver);
+    static void setPowerState(IOService* driver, bool on);
+    static bool isInternal(IOService* driver);
+    static void scheduleWork(IOService* driver);
+    static void holdWorkThreads(bool held);
+    static IOService* getQueuedWork(UInt32 position);
+    static UInt32 getReprobeSampleCount();
+    static UInt32 getReprobeSample(UInt32 index);
+};
+
+SimConfig simConfig(const DeviceEntry& device, const SimTiming& timing);
+bool simulateUpload(SimController* controller, const DeviceEntry& device, OSDictionary* properties, UploadOutcome* outcome);
+
+/*
+ * An entry of the RM,Trace a driver leaves with Trace enabled, its time
+ * relative to the first entry. See TraceEvent in BrcmPatchRAM.h.
+ */
+struct TraceRecord
+{
+    UInt64 nanoseconds;
+    UInt16 event;
+    UInt16 arg0;
+    UInt32 arg1;
+};
+
+bool decodeTrace(OSData* trace, std::vector<TraceRecord>* records);
+std::string formatTrace(const std::vector<TraceRecord>& records);
+
+int runBench(const BenchOptions& options, Report* report);
+int runSimulate(const SimTiming& timing, Report* report, FILE* table, FILE* trace = NULL);
+int runReport(const BenchOptions& options, const SimTiming& timing, Report* report);
+int compareReports(const Report& baseline, const Report& current, double tolerance);
+int runCheck(const BenchOptions& options, const SimTiming& timing, const std::string& baselinePath, double tolerance, Report* report);
+int runTests(const char* filter);
+int runGolden(const std::string& directory, bool update);
+
+#endif /* __Harness__ */
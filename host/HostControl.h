@@ -0,0 +1,82 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Harness side of KernelShim.cpp: the virtual clock, the event queue of the
+ * simulated controller and the counters the benchmark reports.
+ *
+ * Kernel time only moves on the simulation thread. When it sleeps on a lock
+ * without holding another one, queued events run in time order and the clock
+ * jumps to each; IOSleep and IODelay advance it by their delay. Every other
+ * thread (decode, resource requests) runs in real time and takes no
+ * modelled time.
+ */
+
+#ifndef __HostControl__
+#define __HostControl__
+
+#include <functional>
+#include <string>
+
+#include "include/HostKernel.h"
+
+typedef struct HostAllocStats
+{
+    UInt64 allocations;     // IOMalloc and OSObject allocations
+    UInt64 bytes;
+    SInt64 current;
+    SInt64 peak;
+} HostAllocStats;
+
+// Thread whose sleeps run the event queue, the harness main thread
+void HostSetSimThread();
+
+UInt64 HostNow();
+void HostResetClock();
+// Like IOSleep in nanoseconds, for the time a modelled transfer blocks
+void HostAdvanceClock(UInt64 delay);
+void HostSchedule(UInt64 time, std::function<void()> event);
+void HostClearEvents();
+UInt32 HostPendingEvents();
+
+// Calls of IOLockWakeup for an event, to bound wakeups in tests
+UInt64 HostWakeups(const void* event);
+void HostResetWakeups();
+
+HostAllocStats HostGetAllocStats();
+void HostResetAllocPeak();
+
+// Directory OSKextRequestResource reads resources from
+void HostSetResourceDirectory(const char* path);
+void HostSetBootArg(const char* name, UInt64 value);
+void HostClearBootArgs();
+void HostSetVerbose(bool verbose);
+
+// Writes through vn_rdwr made with an IOLock held, which would stall the
+// other threads waiting for that lock on the disk
+UInt64 HostLockedFileWrites();
+
+// Wait until every thread started by kernel_thread_start has returned
+void HostWaitThreads();
+
+// Unregister every published service and drop the personalities added to
+// the catalogue, between scenarios
+void HostResetRegistry();
+
+#endif /* __HostControl__ */
@@ -0,0 +1,49 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Minimal test registry of the host harness. A test is a function declared
+ * with HOST_TEST in any of the *Tests.cpp files; EXPECT records a failure
+ * and lets the test go on, so one run reports every mismatch.
+ */
+
+#ifndef __HostTest__
+#define __HostTest__
+
+typedef void (*HostTestFunction)();
+
+struct HostTestRegistration
+{
+    HostTestRegistration(const char* name, HostTestFunction function);
+};
+
+void hostExpect(bool condition, const char* expression, const char* file, int line);
+void hostExpectEqual(unsigned long long actual, unsigned long long expected, const char* expression, const char* file, int line);
+void hostExpectString(const char* actual, const char* expected, const char* expression, const char* file, int line);
+
+#define HOST_TEST(name) \
+    static void name(); \
+    static HostTestRegistration name##Registration(#name, name); \
+    static void name()
+
+#define EXPECT(condition) hostExpect((condition), #condition, __FILE__, __LINE__)
+#define EXPECT_EQ(actual, expected) hostExpectEqual((actual), (expected), #actual, __FILE__, __LINE__)
+#define EXPECT_STR(actual, expected) hostExpectString((actual), (expected), #actual, __FILE__, __LINE__)
+
+#endif /* __HostTest__ */
@@ -0,0 +1,1893 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <cxxabi.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HostControl.h"
+#include "include/IOKit/usb/IOUSBHostDevice.h"
+#include "include/sys/utfconv.h"
+#include "include/sys/vnode.h"
+
+task_t kernel_task = (task_t)1;
+int version_major = 19;
+int version_minor = 0;
+
+/***************************************
+ * Allocation counters
+ ***************************************/
+static std::mutex gAllocMutex;
+static HostAllocStats gAllocStats;
+
+static void countAllocation(SInt64 bytes)
+{
+    std::lock_guard<std::mutex> guard(gAllocMutex);
+
+    if (bytes > 0)
+    {
+        gAllocStats.allocations++;
+        gAllocStats.bytes += bytes;
+    }
+    gAllocStats.current += bytes;
+    if (gAllocStats.current > gAllocStats.peak)
+        gAllocStats.peak = gAllocStats.current;
+}
+
+HostAllocStats HostGetAllocStats()
+{
+    std::lock_guard<std::mutex> guard(gAllocMutex);
+    return gAllocStats;
+}
+
+void HostResetAllocPeak()
+{
+    std::lock_guard<std::mutex> guard(gAllocMutex);
+    gAllocStats.peak = gAllocStats.current;
+}
+
+/***************************************
+ * IOLib
+ ***************************************/
+static std::atomic<bool> gVerbose(false);
+
+void HostSetVerbose(bool verbose)
+{
+    gVerbose = verbose;
+}
+
+void IOLog(const char* format, ...)
+{
+    if (!gVerbose)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void* IOMalloc(vm_size_t size)
+{
+    void* memory = malloc(size ? size : 1);
+
+    if (memory)
+        countAllocation(size);
+    return memory;
+}
+
+void IOFree(void* address, vm_size_t size)
+{
+    if (!address)
+        return;
+
+    countAllocation(-(SInt64)size);
+    free(address);
+}
+
+const char* IOFindNameForValue(int value, const IONamedValue* table)
+{
+    for (; table->name; table++)
+        if (table->value == value)
+            return table->name;
+    return NULL;
+}
+
+/***************************************
+ * Virtual clock and event queue
+ ***************************************/
+struct IOLock
+{
+    pthread_mutex_t mutex;
+};
+
+struct HostEvent
+{
+    UInt64 time;
+    UInt64 sequence;
+    std::function<void()> run;
+
+    bool operator>(const HostEvent& other) const
+    {
+        return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+};
+
+struct HostWaiter
+{
+    IOLock* lock;
+    void* event;
+    bool woken;
+};
+
+// Guards the clock, the event queue and the waiters
+static std::mutex gSleepMutex;
+static std::condition_variable gSleepCondition;
+static std::atomic<UInt64> gNow(0);
+static UInt64 gSequence;
+static std::priority_queue<HostEvent, std::vector<HostEvent>, std::greater<HostEvent>> gEvents;
+static std::vector<HostWaiter*> gWaiters;
+static std::map<const void*, UInt64> gWakeups;
+static pthread_t gSimThread;
+static bool gSimThreadSet;
+
+// IOLocks held by this thread, events only run when none is
+static thread_local int tHeldLocks;
+
+void HostSetSimThread()
+{
+    gSimThread = pthread_self();
+    gSimThreadSet = true;
+}
+
+static bool onSimThread()
+{
+    return gSimThreadSet && pthread_equal(gSimThread, pthread_self());
+}
+
+UInt64 HostNow()
+{
+    return gNow;
+}
+
+void HostResetClock()
+{
+    std::lock_guard<std::mutex> guard(gSleepMutex);
+    gNow = 0;
+}
+
+void HostSchedule(UInt64 time, std::function<void()> event)
+{
+    {
+        std::lock_guard<std::mutex> guard(gSleepMutex);
+        gEvents.push(HostEvent { time, gSequence++, event });
+    }
+    gSleepCondition.notify_all();
+}
+
+void HostClearEvents()
+{
+    std::lock_guard<std::mutex> guard(gSleepMutex);
+    while (!gEvents.empty())
+        gEvents.pop();
+}
+
+UInt32 HostPendingEvents()
+{
+    std::lock_guard<std::mutex> guard(gSleepMutex);
+    return (UInt32)gEvents.size();
+}
+
+UInt64 HostWakeups(const void* event)
+{
+    std::lock_guard<std::mutex> guard(gSleepMutex);
+    std::map<const void*, UInt64>::iterator found = gWakeups.find(event);
+    return found == gWakeups.end() ? 0 : found->second;
+}
+
+void HostResetWakeups()
+{
+    std::lock_guard<std::mutex> guard(gSleepMutex);
+    gWakeups.clear();
+}
+
+/*
+ * Run the next event due at or before limit, with gSleepMutex held by the
+ * caller through guard. The event itself runs unlocked.
+ */
+static bool runNextEvent(std::unique_lock<std::mutex>& guard, UInt64 limit)
+{
+    if (gEvents.empty() || gEvents.top().time > limit)
+        return false;
+
+    HostEvent event = gEvents.top();
+    gEvents.pop();
+    if (event.time > gNow)
+        gNow = event.time;
+
+    guard.unlock();
+    event.run();
+    guard.lock();
+    return true;
+}
+
+// Advance the clock by delay, running the events due on the way
+static void advanceClock(UInt64 delay)
+{
+    if (!onSimThread())
+        return;
+
+    std::unique_lock<std::mutex> guard(gSleepMutex);
+    UInt64 target = gNow + delay;
+
+    if (!tHeldLocks)
+        while (runNextEvent(guard, target));
+    if (target > gNow)
+        gNow = target;
+}
+
+void HostAdvanceClock(UInt64 delay)
+{
+    advanceClock(delay);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    advanceClock((UInt64)milliseconds * NSEC_PER_MSEC);
+}
+
+void IODelay(unsigned microseconds)
+{
+    advanceClock((UInt64)microseconds * NSEC_PER_USEC);
+}
+
+void clock_get_uptime(uint64_t* result)
+{
+    *result = gNow;
+}
+
+uint64_t mach_absolute_time()
+{
+    return gNow;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale_factor, uint64_t* result)
+{
+    *result = gNow + (uint64_t)interval * scale_factor;
+}
+
+IOLock* IOLockAlloc()
+{
+    IOLock* lock = (IOLock*)malloc(sizeof(IOLock));
+
+    if (lock)
+        pthread_mutex_init(&lock->mutex, NULL);
+    return lock;
+}
+
+void IOLockFree(IOLock* lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    free(lock);
+}
+
+void IOLockLock(IOLock* lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+    tHeldLocks++;
+}
+
+void IOLockUnlock(IOLock* lock)
+{
+    tHeldLocks--;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+bool IOLockTryLock(IOLock* lock)
+{
+    if (pthread_mutex_trylock(&lock->mutex))
+        return false;
+    tHeldLocks++;
+    return true;
+}
+
+/*
+ * Sleep on event with lock held. On the simulation thread, with no other
+ * lock held, queued events run while nothing woke the sleeper. A deadline
+ * that comes before the next event times out on the virtual clock, after
+ * giving the real threads a moment to wake the sleeper.
+ */
+static int sleepOnLock(IOLock* lock, void* event, uint64_t deadline)
+{
+    HostWaiter waiter = { lock, event, false };
+    bool simulate = onSimThread() && tHeldLocks == 1;
+    int result = THREAD_AWAKENED;
+
+    std::unique_lock<std::mutex> guard(gSleepMutex);
+    gWaiters.push_back(&waiter);
+    IOLockUnlock(lock);
+
+    while (!waiter.woken)
+    {
+        if (simulate && runNextEvent(guard, deadline))
+            continue;
+
+        if (deadline == UINT64_MAX)
+        {
+            gSleepCondition.wait(guard);
+            continue;
+        }
+
+        if (simulate && gSleepCondition.wait_for(guard, std::chrono::milliseconds(50)) == std::cv_status::timeout &&
+            !waiter.woken && (gEvents.empty() || gEvents.top().time > deadline))
+        {
+            if (deadline > gNow)
+                gNow = deadline;
+            result = THREAD_TIMED_OUT;
+            break;
+        }
+
+        // A real thread has no virtual deadline, bound its wait in real time
+        if (!simulate && (deadline <= gNow || gSleepCondition.wait_for(guard, std::chrono::nanoseconds(deadline - gNow)) == std::cv_status::timeout) && !waiter.woken)
+        {
+            result = THREAD_TIMED_OUT;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < gWaiters.size(); i++)
+    {
+        if (gWaiters[i] == &waiter)
+        {
+            gWaiters.erase(gWaiters.begin() + i);
+            break;
+        }
+    }
+    guard.unlock();
+
+    IOLockLock(lock);
+    return result;
+}
+
+int IOLockSleep(IOLock* lock, void* event, int interruptible)
+{
+    return sleepOnLock(lock, event, UINT64_MAX);
+}
+
+int IOLockSleepDeadline(IOLock* lock, void* event, uint64_t deadline, int interruptible)
+{
+    return sleepOnLock(lock, event, deadline);
+}
+
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread)
+{
+    {
+        std::lock_guard<std::mutex> guard(gSleepMutex);
+
+        gWakeups[event]++;
+        for (size_t i = 0; i < gWaiters.size(); i++)
+        {
+            if (gWaiters[i]->lock == lock && gWaiters[i]->event == event && !gWaiters[i]->woken)
+            {
+                gWaiters[i]->woken = true;
+                if (oneThread)
+                    break;
+            }
+        }
+    }
+    gSleepCondition.notify_all();
+}
+
+/***************************************
+ * Threads
+ ***************************************/
+static std::mutex gThreadMutex;
+static std::condition_variable gThreadCondition;
+static int gThreads;
+
+kern_return_t kernel_thread_start(thread_continue_t continuation, void* parameter, thread_t* new_thread)
+{
+    {
+        std::lock_guard<std::mutex> guard(gThreadMutex);
+        gThreads++;
+    }
+
+    std::thread thread([continuation, parameter]
+    {
+        continuation(parameter, THREAD_AWAKENED);
+
+        std::lock_guard<std::mutex> guard(gThreadMutex);
+        gThreads--;
+        gThreadCondition.notify_all();
+    });
+
+    *new_thread = (thread_t)(uintptr_t)thread.native_handle();
+    thread.detach();
+    return KERN_SUCCESS;
+}
+
+void HostWaitThreads()
+{
+    std::unique_lock<std::mutex> guard(gThreadMutex);
+    gThreadCondition.wait(guard, [] { return gThreads == 0; });
+}
+
+void thread_deallocate(thread_t thread)
+{
+}
+
+void thread_terminate(thread_t thread)
+{
+}
+
+thread_t current_thread()
+{
+    return (thread_t)(uintptr_t)pthread_self();
+}
+
+/***************************************
+ * Boot arguments and kext resources
+ ***************************************/
+static std::mutex gBootArgMutex;
+static std::map<std::string, UInt64> gBootArgs;
+static std::string gResourceDirectory = ".";
+
+void HostSetBootArg(const char* name, UInt64 value)
+{
+    std::lock_guard<std::mutex> guard(gBootArgMutex);
+    gBootArgs[name] = value;
+}
+
+void HostClearBootArgs()
+{
+    std::lock_guard<std::mutex> guard(gBootArgMutex);
+    gBootArgs.clear();
+}
+
+bool PE_parse_boot_argn(const char* name, void* value, int size)
+{
+    std::lock_guard<std::mutex> guard(gBootArgMutex);
+    std::map<std::string, UInt64>::iterator found = gBootArgs.find(name);
+
+    if (found == gBootArgs.end())
+        return false;
+
+    // little endian, the low bytes of the value fit any size
+    memcpy(value, &found->second, size < (int)sizeof(UInt64) ? size : sizeof(UInt64));
+    return true;
+}
+
+void HostSetResourceDirectory(const char* path)
+{
+    gResourceDirectory = path;
+}
+
+const char* OSKextGetCurrentIdentifier()
+{
+    return "as.acidanthera.BrcmPatchRAM3";
+}
+
+const char* OSKextGetCurrentVersionString()
+{
+    return "host";
+}
+
+// Resources are delivered on another thread, like kextd does
+OSReturn OSKextRequestResource(const char* kextIdentifier, const char* resourceName, OSKextRequestResourceCallback callback, void* context, OSKextRequestTag* requestTagOut)
+{
+    std::string path = gResourceDirectory + "/" + resourceName;
+
+    {
+        std::lock_guard<std::mutex> guard(gThreadMutex);
+        gThreads++;
+    }
+
+    std::thread thread([path, callback, context]
+    {
+        std::vector<UInt8> data;
+        int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd >= 0)
+        {
+            struct stat info;
+
+            if (!fstat(fd, &info) && info.st_size > 0)
+            {
+                data.resize(info.st_size);
+                if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+                    data.clear();
+            }
+            close(fd);
+        }
+
+        if (data.empty())
+            callback(0, kOSKextReturnNotFound, NULL, 0, context);
+        else
+            callback(0, kOSReturnSuccess, data.data(), (uint32_t)data.size(), context);
+
+        std::lock_guard<std::mutex> guard(gThreadMutex);
+        gThreads--;
+        gThreadCondition.notify_all();
+    });
+
+    thread.detach();
+    if (requestTagOut)
+        *requestTagOut = 0;
+    return kOSReturnSuccess;
+}
+
+/***************************************
+ * Atomics
+ ***************************************/
+SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+    return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+    return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32* address)
+{
+    return __atomic_fetch_or(address, mask, __ATOMIC_SEQ_CST);
+}
+
+/***************************************
+ * vnode, on POSIX file descriptors
+ ***************************************/
+vfs_context_t vfs_context_create(vfs_context_t context)
+{
+    return (vfs_context_t)1;
+}
+
+int vfs_context_rele(vfs_context_t context)
+{
+    return 0;
+}
+
+void* vfs_context_ucred(vfs_context_t context)
+{
+    return NULL;
+}
+
+void* vfs_context_proc(vfs_context_t context)
+{
+    return NULL;
+}
+
+int vnode_open(const char* path, int fmode, int cmode, int flags, vnode_t* vpp, vfs_context_t context)
+{
+    int mode = (fmode & FWRITE) ? ((fmode & FREAD) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    int fd = open(path, mode | (fmode & ~(FREAD | FWRITE)), cmode);
+
+    if (fd < 0)
+        return errno;
+
+    // offset by one so that descriptor 0 is not NULLVP
+    *vpp = (vnode_t)(uintptr_t)(fd + 1);
+    return 0;
+}
+
+static int vnodeDescriptor(vnode_t vp)
+{
+    return (int)(uintptr_t)vp - 1;
+}
+
+int vnode_close(vnode_t vp, int flags, vfs_context_t context)
+{
+    return close(vnodeDescriptor(vp)) ? errno : 0;
+}
+
+int vnode_getattr(vnode_t vp, struct vnode_attr* vap, vfs_context_t context)
+{
+    struct stat info;
+
+    if (fstat(vnodeDescriptor(vp), &info))
+        return errno;
+
+    vap->va_data_size = info.st_size;
+    vap->va_modify_time.tv_sec = info.st_mtim.tv_sec;
+    vap->va_modify_time.tv_nsec = info.st_mtim.tv_nsec;
+    vap->va_fileid = info.st_ino;
+    return 0;
+}
+
+static std::atomic<UInt64> gLockedFileWrites(0);
+
+UInt64 HostLockedFileWrites()
+{
+    return gLockedFileWrites;
+}
+
+int vn_rdwr(enum uio_rw rw, vnode_t vp, caddr_t base, int len, long long offset, enum uio_seg segflg, int ioflg, void* cred, int* aresid, void* p)
+{
+    int fd = vnodeDescriptor(vp);
+    ssize_t done = 0;
+
+    if (rw == UIO_WRITE && tHeldLocks)
+        gLockedFileWrites++;
+
+    while (done < len)
+    {
+        ssize_t count = rw == UIO_READ ? pread(fd, base + done, len - done, offset + done) : pwrite(fd, base + done, len - done, offset + done);
+
+        if (count < 0)
+            return errno;
+        if (!count)
+            break;
+        done += count;
+    }
+
+    if (aresid)
+        *aresid = (int)(len - done);
+    else if (done != len)
+        return EIO;
+    return 0;
+}
+
+int utf8_encodestr(const u_int16_t* ucsp, size_t ucslen, u_int8_t* utf8p, size_t* utf8len, size_t buflen, u_int16_t altslash, int flags)
+{
+    size_t length = 0;
+
+    // String descriptors of the simulated devices are ASCII
+    for (size_t i = 0; i < ucslen / 2 && length + 1 < buflen; i++)
+    {
+        u_int16_t c = ucsp[i];
+        utf8p[length++] = c == '/' ? (u_int8_t)altslash : (c < 0x80 ? (u_int8_t)c : '?');
+    }
+
+    utf8p[length] = 0;
+    *utf8len = length;
+    return 0;
+}
+
+/***************************************
+ * OSObject and containers
+ ***************************************/
+OSObject::OSObject() : mRetainCount(1)
+{
+}
+
+void* OSObject::operator new(size_t size)
+{
+    // zero filled like kernel allocations
+    void* memory = calloc(1, size);
+
+    countAllocation(size);
+    return memory;
+}
+
+void OSObject::operator delete(void* memory, size_t size)
+{
+    countAllocation(-(SInt64)size);
+    ::free(memory);
+}
+
+bool OSObject::init()
+{
+    return true;
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    __atomic_fetch_add(&mRetainCount, 1, __ATOMIC_SEQ_CST);
+}
+
+void OSObject::release() const
+{
+    if (__atomic_sub_fetch(&mRetainCount, 1, __ATOMIC_SEQ_CST) == 0)
+        const_cast<OSObject*>(this)->free();
+}
+
+int OSObject::getRetainCount() const
+{
+    return mRetainCount;
+}
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* collection)
+{
+    OSCollectionIterator* iterator = new OSCollectionIterator;
+
+    collection->retain();
+    iterator->mCollection = collection;
+    iterator->mIndex = 0;
+    return iterator;
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+    if (mIndex >= mCollection->getCount())
+        return NULL;
+    return mCollection->iteratorObject(mIndex++);
+}
+
+void OSCollectionIterator::reset()
+{
+    mIndex = 0;
+}
+
+void OSCollectionIterator::free()
+{
+    OSSafeReleaseNULL(mCollection);
+    OSIterator::free();
+}
+
+bool OSString::initWithCString(const char* cString)
+{
+    mLength = (unsigned int)strlen(cString);
+    mString = (char*)IOMalloc(mLength + 1);
+    memcpy(mString, cString, mLength + 1);
+    return true;
+}
+
+OSString* OSString::withCString(const char* cString)
+{
+    OSString* string = new OSString;
+
+    string->initWithCString(cString);
+    return string;
+}
+
+OSString* OSString::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+const char* OSString::getCStringNoCopy() const
+{
+    return mString;
+}
+
+unsigned int OSString::getLength() const
+{
+    return mLength;
+}
+
+bool OSString::isEqualTo(const char* cString) const
+{
+    return !strcmp(mString, cString);
+}
+
+bool OSString::isEqualTo(const OSString* string) const
+{
+    return string && !strcmp(mString, string->mString);
+}
+
+void OSString::free()
+{
+    IOFree(mString, mLength + 1);
+    OSObject::free();
+}
+
+const OSSymbol* OSSymbol::withCString(const char* cString)
+{
+    OSSymbol* symbol = new OSSymbol;
+
+    symbol->initWithCString(cString);
+    return symbol;
+}
+
+const OSSymbol* OSSymbol::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+const OSSymbol* OSSymbol::withString(const OSString* string)
+{
+    return withCString(string->getCStringNoCopy());
+}
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber* number = new OSNumber;
+
+    number->mSize = numberOfBits;
+    number->setValue(value);
+    return number;
+}
+
+unsigned short OSNumber::unsigned16BitValue() const
+{
+    return (unsigned short)mValue;
+}
+
+unsigned int OSNumber::unsigned32BitValue() const
+{
+    return (unsigned int)mValue;
+}
+
+unsigned long long OSNumber::unsigned64BitValue() const
+{
+    return mValue;
+}
+
+unsigned int OSNumber::numberOfBits() const
+{
+    return mSize;
+}
+
+void OSNumber::setValue(unsigned long long value)
+{
+    mValue = mSize < 64 ? value & ((1ULL << mSize) - 1) : value;
+}
+
+void OSNumber::addValue(signed long long value)
+{
+    setValue(mValue + value);
+}
+
+bool OSBoolean::isTrue() const
+{
+    return mValue;
+}
+
+bool OSBoolean::isFalse() const
+{
+    return !mValue;
+}
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+    OSBoolean* result = value ? kOSBooleanTrue : kOSBooleanFalse;
+
+    result->retain();
+    return result;
+}
+
+static OSBoolean* makeBoolean(bool value)
+{
+    OSBoolean* boolean = new OSBoolean;
+
+    boolean->mValue = value;
+    return boolean;
+}
+
+OSBoolean* kOSBooleanTrue = makeBoolean(true);
+OSBoolean* kOSBooleanFalse = makeBoolean(false);
+
+bool OSData::ensureCapacity(unsigned int capacity)
+{
+    if (capacity <= mCapacity)
+        return true;
+
+    unsigned int grown = mCapacity * 2 > capacity ? mCapacity * 2 : capacity;
+    UInt8* data = (UInt8*)IOMalloc(grown);
+
+    if (!data)
+        return false;
+    if (mData)
+    {
+        memcpy(data, mData, mLength);
+        IOFree(mData, mCapacity);
+    }
+    mData = data;
+    mCapacity = grown;
+    return true;
+}
+
+OSData* OSData::withCapacity(unsigned int capacity)
+{
+    OSData* data = new OSData;
+
+    if (capacity && !data->ensureCapacity(capacity))
+    {
+        data->release();
+        return NULL;
+    }
+    return data;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned int numBytes)
+{
+    OSData* data = withCapacity(numBytes);
+
+    if (data)
+        data->appendBytes(bytes, numBytes);
+    return data;
+}
+
+OSData* OSData::withData(const OSData* other)
+{
+    return withBytes(other->mData, other->mLength);
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned int numBytes)
+{
+    if (!ensureCapacity(mLength + numBytes))
+        return false;
+
+    if (bytes)
+        memcpy(mData + mLength, bytes, numBytes);
+    else
+        bzero(mData + mLength, numBytes);
+    mLength += numBytes;
+    return true;
+}
+
+bool OSData::appendBytes(const OSData* other)
+{
+    return appendBytes(other->mData, other->mLength);
+}
+
+const void* OSData::getBytesNoCopy() const
+{
+    return mLength ? mData : NULL;
+}
+
+const void* OSData::getBytesNoCopy(unsigned int start, unsigned int numBytes) const
+{
+    if (!numBytes || start + numBytes > mLength || start + numBytes < start)
+        return NULL;
+    return mData + start;
+}
+
+unsigned int OSData::getLength() const
+{
+    return mLength;
+}
+
+unsigned int OSData::getCapacity() const
+{
+    return mCapacity;
+}
+
+bool OSData::isEqualTo(const OSData* other) const
+{
+    return other && isEqualTo(other->mData, other->mLength);
+}
+
+bool OSData::isEqualTo(const void* bytes, unsigned int numBytes) const
+{
+    return numBytes == mLength && (!mLength || !memcmp(mData, bytes, mLength));
+}
+
+void OSData::free()
+{
+    if (mData)
+        IOFree(mData, mCapacity);
+    OSObject::free();
+}
+
+OSArray* OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray* array = new OSArray;
+
+    array->mCapacity = capacity ? capacity : 1;
+    array->mArray = (const OSObject**)IOMalloc(array->mCapacity * sizeof(OSObject*));
+    return array;
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+    return setObject(mCount, object);
+}
+
+bool OSArray::setObject(unsigned int index, const OSObject* object)
+{
+    if (!object || index > mCount)
+        return false;
+
+    if (mCount == mCapacity)
+    {
+        const OSObject** array = (const OSObject**)IOMalloc(mCapacity * 2 * sizeof(OSObject*));
+
+        if (!array)
+            return false;
+        memcpy(array, mArray, mCount * sizeof(OSObject*));
+        IOFree(mArray, mCapacity * sizeof(OSObject*));
+        mArray = array;
+        mCapacity *= 2;
+    }
+
+    memmove(&mArray[index + 1], &mArray[index], (mCount - index) * sizeof(OSObject*));
+    object->retain();
+    mArray[index] = object;
+    mCount++;
+    return true;
+}
+
+OSObject* OSArray::getObject(unsigned int index) const
+{
+    return index < mCount ? const_cast<OSObject*>(mArray[index]) : NULL;
+}
+
+unsigned int OSArray::getCount() const
+{
+    return mCount;
+}
+
+void OSArray::removeObject(unsigned int index)
+{
+    if (index >= mCount)
+        return;
+
+    const OSObject* object = mArray[index];
+
+    memmove(&mArray[index], &mArray[index + 1], (mCount - index - 1) * sizeof(OSObject*));
+    mCount--;
+    object->release();
+}
+
+void OSArray::flushCollection()
+{
+    while (mCount)
+        removeObject(mCount - 1);
+}
+
+bool OSArray::merge(const OSArray* other)
+{
+    for (unsigned int i = 0; i < other->mCount; i++)
+        if (!setObject(other->mArray[i]))
+            return false;
+    return true;
+}
+
+OSObject* OSArray::iteratorObject(unsigned int index) const
+{
+    return getObject(index);
+}
+
+void OSArray::free()
+{
+    flushCollection();
+    IOFree(mArray, mCapacity * sizeof(OSObject*));
+    OSCollection::free();
+}
+
+OSDictionary* OSDictionary::withCapacity(unsigned int capacity)
+{
+    OSDictionary* dictionary = new OSDictionary;
+
+    dictionary->mCapacity = capacity ? capacity : 1;
+    dictionary->mEntries = (Entry*)IOMalloc(dictionary->mCapacity * sizeof(Entry));
+    return dictionary;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* dict, unsigned int capacity)
+{
+    OSDictionary* dictionary = withCapacity(capacity > dict->mCount ? capacity : dict->mCount);
+
+    for (unsigned int i = 0; i < dict->mCount; i++)
+        dictionary->setObject(dict->mEntries[i].key, dict->mEntries[i].value);
+    return dictionary;
+}
+
+int OSDictionary::find(const char* key) const
+{
+    for (unsigned int i = 0; i < mCount; i++)
+        if (mEntries[i].key->isEqualTo(key))
+            return i;
+    return -1;
+}
+
+bool OSDictionary::setObject(const OSSymbol* key, const OSObject* object)
+{
+    if (!key || !object)
+        return false;
+
+    int index = find(key->getCStringNoCopy());
+
+    object->retain();
+    if (index >= 0)
+    {
+        mEntries[index].value->release();
+        mEntries[index].value = object;
+        return true;
+    }
+
+    if (mCount == mCapacity)
+    {
+        Entry* entries = (Entry*)IOMalloc(mCapacity * 2 * sizeof(Entry));
+
+        memcpy(entries, mEntries, mCount * sizeof(Entry));
+        IOFree(mEntries, mCapacity * sizeof(Entry));
+        mEntries = entries;
+        mCapacity *= 2;
+    }
+
+    key->retain();
+    mEntries[mCount].key = key;
+    mEntries[mCount].value = object;
+    mCount++;
+    return true;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+    const OSSymbol* symbol = OSSymbol::withCString(key);
+    bool result = setObject(symbol, object);
+
+    symbol->release();
+    return result;
+}
+
+bool OSDictionary::setObject(const OSString* key, const OSObject* object)
+{
+    return setObject(key->getCStringNoCopy(), object);
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    int index = find(key);
+    return index >= 0 ? const_cast<OSObject*>(mEntries[index].value) : NULL;
+}
+
+OSObject* OSDictionary::getObject(const OSString* key) const
+{
+    return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+OSObject* OSDictionary::getObject(const OSSymbol* key) const
+{
+    return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+    int index = find(key);
+
+    if (index < 0)
+        return;
+
+    Entry entry = mEntries[index];
+
+    memmove(&mEntries[index], &mEntries[index + 1], (mCount - index - 1) * sizeof(Entry));
+    mCount--;
+    entry.key->release();
+    entry.value->release();
+}
+
+void OSDictionary::removeObject(const OSString* key)
+{
+    removeObject(key->getCStringNoCopy());
+}
+
+void OSDictionary::removeObject(const OSSymbol* key)
+{
+    removeObject(key->getCStringNoCopy());
+}
+
+unsigned int OSDictionary::getCount() const
+{
+    return mCount;
+}
+
+void OSDictionary::flushCollection()
+{
+    while (mCount)
+        removeObject(mEntries[mCount - 1].key->getCStringNoCopy());
+}
+
+OSObject* OSDictionary::iteratorObject(unsigned int index) const
+{
+    return index < mCount ? const_cast<OSSymbol*>(mEntries[index].key) : NULL;
+}
+
+void OSDictionary::free()
+{
+    flushCollection();
+    IOFree(mEntries, mCapacity * sizeof(Entry));
+    OSCollection::free();
+}
+
+OSCollection* OSDictionary::copyCollection() const
+{
+    return OSDictionary::withDictionary(this);
+}
+
+OSOrderedSet* OSOrderedSet::withCapacity(unsigned int capacity)
+{
+    OSOrderedSet* set = new OSOrderedSet;
+
+    if (!(set->mArray = OSArray::withCapacity(capacity)))
+    {
+        set->release();
+        return NULL;
+    }
+    return set;
+}
+
+bool OSOrderedSet::setLastObject(const OSObject* object)
+{
+    for (unsigned int i = 0; i < mArray->getCount(); i++)
+    {
+        if (mArray->getObject(i) == object)
+            return false;
+    }
+    return mArray->setObject(object);
+}
+
+unsigned int OSOrderedSet::getCount() const
+{
+    return mArray->getCount();
+}
+
+OSObject* OSOrderedSet::iteratorObject(unsigned int index) const
+{
+    return mArray->iteratorObject(index);
+}
+
+void OSOrderedSet::free()
+{
+    OSSafeReleaseNULL(mArray);
+    OSCollection::free();
+}
+
+/***************************************
+ * Registry and services
+ ***************************************/
+const IORegistryPlane* gIOServicePlane = (const IORegistryPlane*)1;
+const OSSymbol* gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol* gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol* gIOMatchedNotification = OSSymbol::withCString("IOServiceMatched");
+const OSSymbol* gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+
+static std::recursive_mutex gRegistryMutex;
+static std::vector<IOService*> gServices;
+static std::vector<IONotifier*> gNotifiers;
+// Personalities added to gIOCatalogue, guarded by gRegistryMutex too
+static OSArray* gPersonalities;
+static SInt32 gCatalogueGeneration;
+
+bool IORegistryEntry::init(OSDictionary* dictionary)
+{
+    if (!OSObject::init())
+        return false;
+
+    mProperties = dictionary ? OSDictionary::withDictionary(dictionary) : OSDictionary::withCapacity(8);
+    mChildren = OSArray::withCapacity(2);
+    return mProperties && mChildren;
+}
+
+void IORegistryEntry::free()
+{
+    OSSafeReleaseNULL(mProperties);
+    OSSafeReleaseNULL(mChildren);
+    OSObject::free();
+}
+
+OSObject* IORegistryEntry::getProperty(const char* name) const
+{
+    return mProperties ? mProperties->getObject(name) : NULL;
+}
+
+OSObject* IORegistryEntry::getProperty(const OSString* name) const
+{
+    return getProperty(name->getCStringNoCopy());
+}
+
+OSObject* IORegistryEntry::getProperty(const OSSymbol* name) const
+{
+    return getProperty(name->getCStringNoCopy());
+}
+
+OSObject* IORegistryEntry::copyProperty(const char* name) const
+{
+    OSObject* property = getProperty(name);
+
+    if (property)
+        property->retain();
+    return property;
+}
+
+bool IORegistryEntry::setProperty(const char* name, OSObject* object)
+{
+    return mProperties->setObject(name, object);
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol* name, OSObject* object)
+{
+    return mProperties->setObject(name, object);
+}
+
+bool IORegistryEntry::setProperty(const OSString* name, OSObject* object)
+{
+    return mProperties->setObject(name, object);
+}
+
+bool IORegistryEntry::setProperty(const char* name, const char* string)
+{
+    OSString* value = OSString::withCString(string);
+    bool result = setProperty(name, value);
+
+    value->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* name, bool value)
+{
+    return setProperty(name, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char* name, unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber* number = OSNumber::withNumber(value, numberOfBits);
+    bool result = setProperty(name, number);
+
+    number->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* name, void* bytes, unsigned int length)
+{
+    OSData* data = OSData::withBytes(bytes, length);
+    bool result = setProperty(name, data);
+
+    data->release();
+    return result;
+}
+
+void IORegistryEntry::removeProperty(const char* name)
+{
+    mProperties->removeObject(name);
+}
+
+OSDictionary* IORegistryEntry::getPropertyTable() const
+{
+    return mProperties;
+}
+
+OSIterator* IORegistryEntry::getChildIterator(const IORegistryPlane* plane) const
+{
+    return OSCollectionIterator::withCollection(mChildren);
+}
+
+IORegistryEntry* IORegistryEntry::getParentEntry(const IORegistryPlane* plane) const
+{
+    return mParent;
+}
+
+bool IORegistryEntry::attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane)
+{
+    mParent = parent;
+    return parent->mChildren->setObject(this);
+}
+
+void IORegistryEntry::detachFromParent(IORegistryEntry* parent, const IORegistryPlane* plane)
+{
+    for (unsigned int i = 0; i < parent->mChildren->getCount(); i++)
+    {
+        if (parent->mChildren->getObject(i) == this)
+        {
+            mParent = NULL;
+            parent->mChildren->removeObject(i);
+            return;
+        }
+    }
+}
+
+const char* IORegistryEntry::getName(const IORegistryPlane* plane) const
+{
+    if (!mClassName[0])
+    {
+        int status;
+        char* name = abi::__cxa_demangle(typeid(*this).name(), NULL, NULL, &status);
+
+        snprintf(mClassName, sizeof(mClassName), "%s", name ? name : typeid(*this).name());
+        ::free(name);
+    }
+    return mClassName;
+}
+
+bool IOService::init(OSDictionary* dictionary)
+{
+    return IORegistryEntry::init(dictionary);
+}
+
+void IOService::free()
+{
+    IORegistryEntry::free();
+}
+
+IOService* IOService::probe(IOService* provider, SInt32* score)
+{
+    return this;
+}
+
+bool IOService::start(IOService* provider)
+{
+    mProvider = provider;
+    return true;
+}
+
+void IOService::stop(IOService* provider)
+{
+}
+
+bool IOService::open(IOService* forClient, IOOptionBits options, void* arg)
+{
+    if (mOpenClient && mOpenClient != forClient)
+        return false;
+    mOpenClient = forClient;
+    return true;
+}
+
+void IOService::close(IOService* forClient, IOOptionBits options)
+{
+    if (mOpenClient == forClient)
+        mOpenClient = NULL;
+}
+
+bool IOService::isOpen(const IOService* forClient) const
+{
+    return forClient ? mOpenClient == forClient : mOpenClient != NULL;
+}
+
+IOReturn IOService::setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice)
+{
+    return IOPMAckImplied;
+}
+
+const char* IOService::stringFromReturn(IOReturn rtn)
+{
+    static thread_local char buffer[32];
+
+    snprintf(buffer, sizeof(buffer), "IOReturn 0x%08x", rtn);
+    return buffer;
+}
+
+IOWorkLoop* IOService::getWorkLoop() const
+{
+    static IOWorkLoop* workLoop = new IOWorkLoop;
+
+    return workLoop;
+}
+
+IOService* IOService::getProvider() const
+{
+    return mProvider;
+}
+
+static bool serviceMatches(IOService* service, OSDictionary* matching)
+{
+    OSString* provider = OSDynamicCast(OSString, matching->getObject(kIOProviderClassKey));
+    return provider && provider->isEqualTo(service->getName());
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    std::vector<IONotifier*> notifiers;
+
+    {
+        std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+        if (mRegistered)
+            return;
+        mRegistered = true;
+        retain();
+        gServices.push_back(this);
+        notifiers = gNotifiers;
+    }
+
+    for (size_t i = 0; i < notifiers.size(); i++)
+        if (serviceMatches(this, notifiers[i]->mMatching))
+            notifiers[i]->mHandler(notifiers[i]->mTarget, notifiers[i]->mRefCon, this, notifiers[i]);
+}
+
+bool IOService::terminate(IOOptionBits options)
+{
+    std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+    for (size_t i = 0; i < gServices.size(); i++)
+    {
+        if (gServices[i] == this)
+        {
+            gServices.erase(gServices.begin() + i);
+            mRegistered = false;
+            release();
+            break;
+        }
+    }
+    return true;
+}
+
+bool IOService::isInactive() const
+{
+    return false;
+}
+
+void HostResetRegistry()
+{
+    std::vector<IOService*> services;
+    OSArray* personalities = NULL;
+
+    {
+        std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+        services.swap(gServices);
+        std::swap(personalities, gPersonalities);
+        gCatalogueGeneration++;
+    }
+    for (size_t i = 0; i < services.size(); i++)
+        services[i]->release();
+    OSSafeReleaseNULL(personalities);
+}
+
+OSDictionary* IOService::serviceMatching(const char* className, OSDictionary* table)
+{
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(1);
+    OSString* name = OSString::withCString(className);
+
+    matching->setObject(kIOProviderClassKey, name);
+    name->release();
+    return matching;
+}
+
+// The handler also runs for services published before, like in the kernel
+IONotifier* IOService::addMatchingNotification(const OSSymbol* type, OSDictionary* matching, IOServiceMatchingNotificationHandler handler, void* target, void* ref, SInt32 priority)
+{
+    IONotifier* notifier = new IONotifier;
+    std::vector<IOService*> services;
+
+    notifier->mType = type;
+    matching->retain();
+    notifier->mMatching = matching;
+    notifier->mHandler = handler;
+    notifier->mTarget = target;
+    notifier->mRefCon = ref;
+
+    {
+        std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+        gNotifiers.push_back(notifier);
+        services = gServices;
+    }
+
+    for (size_t i = 0; i < services.size(); i++)
+        if (serviceMatches(services[i], matching))
+            handler(target, ref, services[i], notifier);
+    return notifier;
+}
+
+void IONotifier::remove()
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+        for (size_t i = 0; i < gNotifiers.size(); i++)
+        {
+            if (gNotifiers[i] == this)
+            {
+                gNotifiers.erase(gNotifiers.begin() + i);
+                break;
+            }
+        }
+    }
+    OSSafeReleaseNULL(mMatching);
+    release();
+}
+
+void IONotifier::disable()
+{
+}
+
+void IONotifier::enable(bool was)
+{
+}
+
+void IOService::PMinit()
+{
+}
+
+void IOService::PMstop()
+{
+}
+
+IOReturn IOService::registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::joinPMtree(IOService* driver)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::makeUsable()
+{
+    return kIOReturnSuccess;
+}
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+    IOTimerEventSource* timer = new IOTimerEventSource;
+
+    timer->mOwner = owner;
+    timer->mAction = action;
+    timer->mGeneration = 0;
+    return timer;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    UInt32 generation = ++mGeneration;
+
+    // Held by the event, so that a timer released before it runs stays valid
+    retain();
+    HostSchedule(HostNow() + ms * NSEC_PER_MSEC, [this, generation]
+    {
+        if (generation == mGeneration && mAction)
+            mAction(mOwner, this);
+        release();
+    });
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+    mGeneration++;
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source)
+{
+    return kIOReturnSuccess;
+}
+
+/***************************************
+ * Catalogue
+ ***************************************/
+IOCatalogue* gIOCatalogue = new IOCatalogue;
+
+static bool sameValue(const OSObject* a, const OSObject* b)
+{
+    if (a == b)
+        return true;
+    if (const OSString* string = OSDynamicCast(OSString, a))
+        return OSDynamicCast(OSString, b) && string->isEqualTo(OSDynamicCast(OSString, b));
+    if (const OSNumber* number = OSDynamicCast(OSNumber, a))
+        return OSDynamicCast(OSNumber, b) && number->unsigned64BitValue() == OSDynamicCast(OSNumber, b)->unsigned64BitValue();
+    return false;
+}
+
+static bool personalityMatches(OSDictionary* personality, OSDictionary* matching)
+{
+    for (unsigned int i = 0; i < matching->getCount(); i++)
+    {
+        const OSString* key = OSDynamicCast(OSString, matching->iteratorObject(i));
+        if (!key || !sameValue(personality->getObject(key), matching->getObject(key)))
+            return false;
+    }
+    return true;
+}
+
+SInt32 IOCatalogue::getGenerationCount() const
+{
+    std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+    return gCatalogueGeneration;
+}
+
+OSOrderedSet* IOCatalogue::findDrivers(OSDictionary* matching, SInt32* generationCount)
+{
+    OSOrderedSet* set = OSOrderedSet::withCapacity(1);
+    std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+    for (unsigned int i = 0; set && gPersonalities && i < gPersonalities->getCount(); i++)
+    {
+        OSDictionary* personality = OSDynamicCast(OSDictionary, gPersonalities->getObject(i));
+        if (personality && personalityMatches(personality, matching))
+            set->setLastObject(personality);
+    }
+    *generationCount = gCatalogueGeneration;
+    return set;
+}
+
+bool IOCatalogue::addDrivers(OSArray* drivers, bool doNubMatching)
+{
+    std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+    if (!gPersonalities && !(gPersonalities = OSArray::withCapacity(drivers->getCount())))
+        return false;
+    gPersonalities->merge(drivers);
+    gCatalogueGeneration++;
+    return true;
+}
+
+bool IOCatalogue::removeDrivers(OSDictionary* matching, bool doNubMatching)
+{
+    std::lock_guard<std::recursive_mutex> guard(gRegistryMutex);
+
+    for (unsigned int i = gPersonalities ? gPersonalities->getCount() : 0; i > 0; i--)
+    {
+        OSDictionary* personality = OSDynamicCast(OSDictionary, gPersonalities->getObject(i - 1));
+        if (personality && personalityMatches(personality, matching))
+        {
+            gPersonalities->removeObject(i - 1);
+            gCatalogueGeneration++;
+        }
+    }
+    return true;
+}
+
+bool IOCatalogue::startMatching(OSDictionary* matching)
+{
+    return true;
+}
+
+IOReturn IOCatalogue::terminateDriversForModule(OSString* moduleName, bool unload)
+{
+    return kIOReturnSuccess;
+}
+
+/***************************************
+ * Memory descriptors
+ ***************************************/
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection)
+{
+    return kIOReturnSuccess;
+}
+
+IOByteCount IOMemoryDescriptor::getLength() const
+{
+    return mLength;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void* bytes, IOByteCount length)
+{
+    if (offset >= mLength)
+        return 0;
+    if (length > mLength - offset)
+        length = mLength - offset;
+    memcpy(mBuffer + offset, bytes, length);
+    return length;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void* bytes, IOByteCount length)
+{
+    if (offset >= mLength)
+        return 0;
+    if (length > mLength - offset)
+        length = mLength - offset;
+    memcpy(bytes, mBuffer + offset, length);
+    return length;
+}
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, vm_size_t capacity, vm_size_t alignment)
+{
+    IOBufferMemoryDescriptor* descriptor = new IOBufferMemoryDescriptor;
+
+    descriptor->mBuffer = (UInt8*)IOMalloc(capacity);
+    descriptor->mCapacity = capacity;
+    descriptor->mLength = capacity;
+    if (!descriptor->mBuffer)
+        OSSafeReleaseNULL(descriptor);
+    return descriptor;
+}
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withCapacity(vm_size_t capacity, IODirection withDirection, bool withContiguousMemory)
+{
+    IOBufferMemoryDescriptor* descriptor = inTaskWithOptions(kernel_task, withDirection, capacity);
+
+    if (descriptor)
+        descriptor->mLength = 0;
+    return descriptor;
+}
+
+void* IOBufferMemoryDescriptor::getBytesNoCopy()
+{
+    return mBuffer;
+}
+
+void IOBufferMemoryDescriptor::setLength(vm_size_t length)
+{
+    mLength = length <= mCapacity ? length : mCapacity;
+}
+
+vm_size_t IOBufferMemoryDescriptor::getCapacity() const
+{
+    return mCapacity;
+}
+
+bool IOBufferMemoryDescriptor::appendBytes(const void* bytes, vm_size_t withLength)
+{
+    if (mLength + withLength > mCapacity)
+        return false;
+    memcpy(mBuffer + mLength, bytes, withLength);
+    mLength += withLength;
+    return true;
+}
+
+void IOBufferMemoryDescriptor::free()
+{
+    if (mBuffer)
+        IOFree(mBuffer, mCapacity);
+    IOMemoryDescriptor::free();
+}
+
+/***************************************
+ * StandardUSB descriptor helpers
+ ***************************************/
+const StandardUSB::EndpointDescriptor* StandardUSB::getNextEndpointDescriptor(const ConfigurationDescriptor* configurationDescriptor, const InterfaceDescriptor* interfaceDescriptor, const Descriptor* currentDescriptor)
+{
+    const UInt8* end = (const UInt8*)configurationDescriptor + configurationDescriptor->wTotalLength;
+    const UInt8* next = currentDescriptor ? (const UInt8*)currentDescriptor : (const UInt8*)interfaceDescriptor;
+
+    for (next += ((const Descriptor*)next)->bLength; next + kDescriptorSize <= end; next += ((const Descriptor*)next)->bLength)
+    {
+        const Descriptor* descriptor = (const Descriptor*)next;
+
+        if (descriptor->bLength < kDescriptorSize || descriptor->bDescriptorType == kDescriptorTypeInterface)
+            break;
+        if (descriptor->bDescriptorType == kDescriptorTypeEndpoint)
+            return (const EndpointDescriptor*)descriptor;
+    }
+    return NULL;
+}
+
+uint8_t StandardUSB::getEndpointDirection(const EndpointDescriptor* descriptor)
+{
+    return (descriptor->bEndpointAddress & 0x80) ? kUSBIn : kUSBOut;
+}
+
+uint8_t StandardUSB::getEndpointType(const EndpointDescriptor* descriptor)
+{
+    return descriptor->bmAttributes & 0x03;
+}
+
+uint8_t StandardUSB::getEndpointAddress(const EndpointDescriptor* descriptor)
+{
+    return descriptor->bEndpointAddress;
+}
@@ -0,0 +1,394 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The IOUSBFamily objects of the resident driver on top of the IOUSBHost
+ * ones, see include/IOKit/usb/IOUSBDevice.h. A USB reset is a change to
+ * configuration 0 like in USBHostDeviceShim.cpp, the controller starts
+ * over in its ROM state either way.
+ */
+
+#include <IOKit/usb/IOUSBDevice.h>
+#include <sys/utfconv.h>
+
+/***************************************
+ * IOUSBPipe
+ ***************************************/
+IOUSBPipe* IOUSBPipe::withPipe(IOUSBHostPipe* pipe)
+{
+    IOUSBPipe* legacy = new IOUSBPipe;
+
+    if (!legacy->init())
+    {
+        legacy->release();
+        return NULL;
+    }
+    pipe->retain();
+    legacy->mPipe = pipe;
+    legacy->mRequested = 0;
+    return legacy;
+}
+
+void IOUSBPipe::free()
+{
+    OSSafeReleaseNULL(mPipe);
+    OSObject::free();
+}
+
+// The IOUSBFamily completion reports what is left of the request
+void IOUSBPipe::transferComplete(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred)
+{
+    IOUSBPipe* me = (IOUSBPipe*)owner;
+    IOUSBCompletion completion = me->mCompletion;
+
+    completion.action(completion.target, completion.parameter, status, me->mRequested - bytesTransferred);
+}
+
+IOReturn IOUSBPipe::Read(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion* completion, IOByteCount* bytesRead)
+{
+    if (completion)
+    {
+        mCompletion = *completion;
+        mRequested = (UInt32)reqCount;
+        mHostCompletion.owner = this;
+        mHostCompletion.action = transferComplete;
+        mHostCompletion.parameter = NULL;
+        return mPipe->io(buffer, (uint32_t)reqCount, &mHostCompletion, completionTimeout);
+    }
+
+    uint32_t transferred = 0;
+    IOReturn result = mPipe->io(buffer, (uint32_t)reqCount, transferred, completionTimeout);
+    if (bytesRead)
+        *bytesRead = transferred;
+    return result;
+}
+
+IOReturn IOUSBPipe::Write(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion* completion)
+{
+    if (completion)
+    {
+        mCompletion = *completion;
+        mRequested = (UInt32)reqCount;
+        mHostCompletion.owner = this;
+        mHostCompletion.action = transferComplete;
+        mHostCompletion.parameter = NULL;
+        return mPipe->io(buffer, (uint32_t)reqCount, &mHostCompletion, completionTimeout);
+    }
+
+    uint32_t transferred = 0;
+    return mPipe->io(buffer, (uint32_t)reqCount, transferred, completionTimeout);
+}
+
+IOReturn IOUSBPipe::Abort()
+{
+    return mPipe->abort();
+}
+
+IOReturn IOUSBPipe::Reset()
+{
+    return mPipe->clearStall(true);
+}
+
+const IOUSBEndpointDescriptor* IOUSBPipe::GetEndpointDescriptor()
+{
+    return mPipe->getEndpointDescriptor();
+}
+
+/***************************************
+ * IOUSBInterface
+ ***************************************/
+IOUSBInterface* IOUSBInterface::withInterface(IOUSBHostInterface* interface)
+{
+    IOUSBInterface* legacy = new IOUSBInterface;
+
+    if (!legacy->init(NULL))
+    {
+        legacy->release();
+        return NULL;
+    }
+    interface->retain();
+    legacy->mInterface = interface;
+    bzero(legacy->mPipes, sizeof(legacy->mPipes));
+    legacy->mPipeCount = 0;
+    legacy->mRequestBuffer = NULL;
+    return legacy;
+}
+
+void IOUSBInterface::free()
+{
+    for (UInt32 i = 0; i < mPipeCount; i++)
+        OSSafeReleaseNULL(mPipes[i]);
+    OSSafeReleaseNULL(mRequestBuffer);
+    OSSafeReleaseNULL(mInterface);
+    IOService::free();
+}
+
+UInt8 IOUSBInterface::GetInterfaceNumber()
+{
+    return mInterface->getInterfaceDescriptor()->bInterfaceNumber;
+}
+
+UInt8 IOUSBInterface::GetInterfaceClass()
+{
+    return mInterface->getInterfaceDescriptor()->bInterfaceClass;
+}
+
+UInt8 IOUSBInterface::GetInterfaceSubClass()
+{
+    return mInterface->getInterfaceDescriptor()->bInterfaceSubClass;
+}
+
+UInt8 IOUSBInterface::GetInterfaceProtocol()
+{
+    return mInterface->getInterfaceDescriptor()->bInterfaceProtocol;
+}
+
+// The pipes in endpoint order, created on the first search
+IOUSBPipe* IOUSBInterface::FindNextPipe(IOUSBPipe* current, IOUSBFindEndpointRequest* request)
+{
+    if (!mPipeCount)
+    {
+        const StandardUSB::ConfigurationDescriptor* configuration = mInterface->getConfigurationDescriptor();
+        const StandardUSB::InterfaceDescriptor* interface = mInterface->getInterfaceDescriptor();
+        const StandardUSB::EndpointDescriptor* endpoint = NULL;
+
+        while (mPipeCount < sizeof(mPipes) / sizeof(mPipes[0]) &&
+               (endpoint = StandardUSB::getNextEndpointDescriptor(configuration, interface, endpoint)))
+        {
+            if (IOUSBHostPipe* pipe = mInterface->copyPipe(endpoint->bEndpointAddress))
+            {
+                if ((mPipes[mPipeCount] = IOUSBPipe::withPipe(pipe)))
+                    mPipeCount++;
+                pipe->release();
+            }
+        }
+    }
+
+    UInt32 i = 0;
+    if (current)
+    {
+        while (i < mPipeCount && mPipes[i] != current)
+            i++;
+        i++;
+    }
+    for (; i < mPipeCount; i++)
+    {
+        const IOUSBEndpointDescriptor* endpoint = mPipes[i]->GetEndpointDescriptor();
+
+        if (request->type != kUSBAnyType && request->type != StandardUSB::getEndpointType(endpoint))
+            continue;
+        if (request->direction != kUSBAnyDirn && request->direction != StandardUSB::getEndpointDirection(endpoint))
+            continue;
+        return mPipes[i];
+    }
+    return NULL;
+}
+
+void IOUSBInterface::requestComplete(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred)
+{
+    IOUSBInterface* me = (IOUSBInterface*)owner;
+    IOUSBCompletion completion = me->mCompletion;
+
+    completion.action(completion.target, completion.parameter, status, me->mRequest.wLength - bytesTransferred);
+}
+
+IOReturn IOUSBInterface::DeviceRequest(IOUSBDevRequest* request, IOUSBCompletion* completion)
+{
+    mRequest.bmRequestType = request->bmRequestType;
+    mRequest.bRequest = request->bRequest;
+    mRequest.wValue = request->wValue;
+    mRequest.wIndex = request->wIndex;
+    mRequest.wLength = request->wLength;
+
+    if (!completion)
+    {
+        uint32_t transferred = 0;
+        IOReturn result = mInterface->deviceRequest(mRequest, request->pData, transferred, kUSBHostStandardRequestCompletionTimeout);
+        request->wLenDone = transferred;
+        return result;
+    }
+
+    // IOUSBHost takes the data of an asynchronous request in a descriptor
+    if (!mRequestBuffer)
+        mRequestBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, 3 + 0xFF);
+    if (!mRequestBuffer)
+        return kIOReturnNoMemory;
+    if (request->wLength > mRequestBuffer->getCapacity())
+        return kIOReturnOverrun;
+    mRequestBuffer->setLength(request->wLength);
+    mRequestBuffer->writeBytes(0, request->pData, request->wLength);
+
+    mCompletion = *completion;
+    mHostCompletion.owner = this;
+    mHostCompletion.action = requestComplete;
+    mHostCompletion.parameter = NULL;
+    return mInterface->deviceRequest(mRequest, mRequestBuffer, &mHostCompletion);
+}
+
+/***************************************
+ * IOUSBDevice
+ ***************************************/
+IOUSBDevice* IOUSBDevice::withDevice(IOUSBHostDevice* device)
+{
+    IOUSBDevice* legacy = new IOUSBDevice;
+
+    if (!legacy->init(NULL))
+    {
+        legacy->release();
+        return NULL;
+    }
+    device->retain();
+    legacy->mDevice = device;
+    legacy->mInterface = NULL;
+
+    if (OSObject* locationId = device->getProperty(kUSBHostDevicePropertyLocationID))
+        legacy->setProperty(kUSBHostDevicePropertyLocationID, locationId);
+    return legacy;
+}
+
+void IOUSBDevice::free()
+{
+    OSSafeReleaseNULL(mInterface);
+    OSSafeReleaseNULL(mDevice);
+    IOService::free();
+}
+
+UInt16 IOUSBDevice::GetVendorID()
+{
+    return USBToHost16(mDevice->getDeviceDescriptor()->idVendor);
+}
+
+UInt16 IOUSBDevice::GetProductID()
+{
+    return USBToHost16(mDevice->getDeviceDescriptor()->idProduct);
+}
+
+UInt16 IOUSBDevice::GetDeviceRelease()
+{
+    return USBToHost16(mDevice->getDeviceDescriptor()->bcdDevice);
+}
+
+UInt32 IOUSBDevice::GetLocationID()
+{
+    if (OSNumber* locationId = OSDynamicCast(OSNumber, getProperty(kUSBHostDevicePropertyLocationID)))
+        return locationId->unsigned32BitValue();
+    return 0;
+}
+
+UInt8 IOUSBDevice::GetNumConfigurations()
+{
+    return mDevice->getDeviceDescriptor()->bNumConfigurations;
+}
+
+UInt8 IOUSBDevice::GetManufacturerStringIndex()
+{
+    return mDevice->getDeviceDescriptor()->iManufacturer;
+}
+
+UInt8 IOUSBDevice::GetProductStringIndex()
+{
+    return mDevice->getDeviceDescriptor()->iProduct;
+}
+
+UInt8 IOUSBDevice::GetSerialNumberStringIndex()
+{
+    return mDevice->getDeviceDescriptor()->iSerialNumber;
+}
+
+IOReturn IOUSBDevice::GetStringDescriptor(UInt8 index, char* buf, int maxLen, UInt16 lang)
+{
+    const StandardUSB::StringDescriptor* descriptor = mDevice->getStringDescriptor(index, lang);
+    size_t length = 0;
+
+    bzero(buf, maxLen);
+    if (!descriptor || descriptor->bLength <= StandardUSB::kDescriptorSize)
+        return kIOReturnBadArgument;
+
+    utf8_encodestr((const u_int16_t*)descriptor->bString, descriptor->bLength - StandardUSB::kDescriptorSize, (u_int8_t*)buf, &length, maxLen, '/', UTF_LITTLE_ENDIAN);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOUSBDevice::GetDeviceStatus(USBStatus* status)
+{
+    StandardUSB::DeviceRequest request;
+    uint32_t transferred = 0;
+
+    request.bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionIn, kRequestTypeStandard, kRequestRecipientDevice);
+    request.bRequest = kDeviceRequestGetStatus;
+    request.wValue = 0;
+    request.wIndex = 0;
+    request.wLength = sizeof(*status);
+    *status = 0;
+    return mDevice->deviceRequest(this, request, status, transferred, kUSBHostStandardRequestCompletionTimeout);
+}
+
+IOReturn IOUSBDevice::ResetDevice()
+{
+    // The interfaces go away with the configuration
+    OSSafeReleaseNULL(mInterface);
+    return mDevice->setConfiguration(0);
+}
+
+const IOUSBConfigurationDescriptor* IOUSBDevice::GetFullConfigurationDescriptor(UInt8 configIndex)
+{
+    return mDevice->getConfigurationDescriptor(configIndex);
+}
+
+IOReturn IOUSBDevice::GetConfiguration(UInt8* configNumber)
+{
+    StandardUSB::DeviceRequest request;
+    uint32_t transferred = 0;
+
+    request.bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionIn, kRequestTypeStandard, kRequestRecipientDevice);
+    request.bRequest = kDeviceRequestGetConfiguration;
+    request.wValue = 0;
+    request.wIndex = 0;
+    request.wLength = sizeof(*configNumber);
+    *configNumber = 0;
+    return mDevice->deviceRequest(this, request, configNumber, transferred, kUSBHostStandardRequestCompletionTimeout);
+}
+
+IOReturn IOUSBDevice::SetConfiguration(IOService* forClient, UInt8 configValue, bool startMatchingInterfaces)
+{
+    OSSafeReleaseNULL(mInterface);
+    return mDevice->setConfiguration(configValue, startMatchingInterfaces);
+}
+
+// The one interface of the configuration, there is no second
+IOUSBInterface* IOUSBDevice::FindNextInterface(IOUSBInterface* current, IOUSBFindInterfaceRequest* request)
+{
+    if (current)
+        return NULL;
+    if (mInterface)
+        return mInterface;
+
+    OSIterator* iterator = mDevice->getChildIterator(gIOServicePlane);
+    if (!iterator)
+        return NULL;
+    while (OSObject* candidate = iterator->getNextObject())
+    {
+        if (IOUSBHostInterface* interface = OSDynamicCast(IOUSBHostInterface, candidate))
+        {
+            mInterface = IOUSBInterface::withInterface(interface);
+            break;
+        }
+    }
+    iterator->release();
+    return mInterface;
+}
@@ -0,0 +1,262 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Patch RAM of the simulated controller after an upload, byte for byte
+ * against the image the .zhx describes. The image is decoded here with
+ * zlib and an Intel HEX reader of its own, not with the store's decoder,
+ * so that both the store and the driver are under test.
+ */
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "Harness.h"
+#include "HostTest.h"
+#include "SimController.h"
+
+typedef std::map<UInt32, UInt8> PatchImage;
+
+static bool inflateFile(const std::string& path, std::string* text)
+{
+    std::string source;
+    z_stream stream = z_stream();
+    char buffer[16384];
+    int status = Z_OK;
+
+    if (!readFile(path, &source) || inflateInit(&stream) != Z_OK)
+        return false;
+
+    stream.next_in = (Bytef*)source.data();
+    stream.avail_in = (uInt)source.size();
+    while (status == Z_OK)
+    {
+        stream.next_out = (Bytef*)buffer;
+        stream.avail_out = sizeof(buffer);
+        status = inflate(&stream, Z_NO_FLUSH);
+        text->append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+/*
+ * Data records of an Intel HEX file into image, later records over earlier
+ * ones. Extended segment (02) and linear (04) addresses set the base; a
+ * record with a bad checksum fails the decode.
+ */
+static bool decodeHex(const std::string& text, PatchImage* image)
+{
+    UInt32 base = 0;
+    size_t position = 0;
+
+    while ((position = text.find(':', position)) != std::string::npos)
+    {
+        std::vector<UInt8> bytes;
+        position++;
+
+        while (position + 1 < text.size() && isxdigit(text[position]) && isxdigit(text[position + 1]))
+        {
+            bytes.push_back((UInt8)strtoul(text.substr(position, 2).c_str(), NULL, 16));
+            position += 2;
+        }
+        if (bytes.size() < 5 || bytes.size() != 5U + bytes[0])
+            return false;
+
+        UInt8 sum = 0;
+        for (size_t i = 0; i < bytes.size(); i++)
+            sum += bytes[i];
+        if (sum)
+            return false;
+
+        UInt32 offset = bytes[1] << 8 | bytes[2];
+        switch (bytes[3])
+        {
+            case 0x00:
+                for (UInt8 i = 0; i < bytes[0]; i++)
+                    (*image)[base + offset + i] = bytes[4 + i];
+                break;
+            case 0x01:
+                return true;
+            case 0x02:
+                base = (UInt32)(bytes[4] << 8 | bytes[5]) << 4;
+                break;
+            case 0x04:
+                base = (UInt32)(bytes[4] << 8 | bytes[5]) << 16;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Number of addresses that differ or are only in one image, the first in address
+static size_t compareImages(const PatchImage& expected, const PatchImage& actual, UInt32* address)
+{
+    PatchImage::const_iterator e = expected.begin(), a = actual.begin();
+    size_t differences = 0;
+
+    while (e != expected.end() || a != actual.end())
+    {
+        if (a == actual.end() || (e != expected.end() && e->first < a->first))
+        {
+            if (!differences++)
+                *address = e->first;
+            ++e;
+        }
+        else if (e == expected.end() || a->first < e->first)
+        {
+            if (!differences++)
+                *address = a->first;
+            ++a;
+        }
+        else
+        {
+            if (e->second != a->second && !differences++)
+                *address = e->first;
+            ++e;
+            ++a;
+        }
+    }
+    return differences;
+}
+
+/*
+ * Upload to every device with the driver's properties, from a store that
+ * keeps each firmware only packed with compactCache, and compare
+ * patch RAM.
+ */
+static void expectImagesOnEveryDevice(OSDictionary* properties, bool compactCache = false)
+{
+    OSDictionary* storeProperties = OSDictionary::withCapacity(1);
+    if (compactCache)
+        storeProperties->setObject("CompactCache", kOSBooleanTrue);
+    BrcmFirmwareStore* store = StoreHarness::startStore(storeProperties);
+    std::vector<DeviceEntry> devices = loadDevices();
+    std::set<std::string> cachedKeys;
+    SInt64 cachedBytes = 0;
+
+    storeProperties->release();
+    DriverHarness::forgetTopologies();
+    EXPECT(store != NULL);
+    EXPECT(!devices.empty());
+
+    for (size_t i = 0; store && i < devices.size(); i++)
+    {
+        const DeviceEntry& device = devices[i];
+        UploadOutcome outcome = UploadOutcome();
+        std::string text;
+        PatchImage expected;
+        UInt32 address = 0;
+
+        EXPECT(inflateFile(gFirmwareDirectory + "/" + device.firmwareKey + ".zhx", &text));
+        EXPECT(decodeHex(text, &expected));
+
+        HostClearEvents();
+        HostResetClock();
+
+        SimController controller(simConfig(device, SimTiming()));
+        EXPECT(simulateUpload(&controller, device, properties, &outcome));
+        EXPECT(controller.isPatched());
+
+        size_t differences = compareImages(expected, controller.getMemory(), &address);
+        if (differences)
+            printf("%s: %zu bytes of patch RAM differ from %s.zhx, the first at 0x%08x\n",
+                   device.name.c_str(), differences, device.firmwareKey.c_str(), address);
+        EXPECT_EQ(differences, 0);
+        EXPECT_EQ(controller.getMemory().size(), expected.size());
+
+        // The upload went through openFirmwareStream, which keeps just the packed firmwares
+        if (compactCache && cachedKeys.insert(device.firmwareKey).second)
+        {
+            OSData* source = readFirmwareData(gFirmwareDirectory + "/" + device.firmwareKey + ".zhx");
+            UInt32 records;
+            OSData* packed = source ? StoreHarness::packFirmware(store, source, &records) : NULL;
+
+            EXPECT(packed != NULL);
+            if (packed)
+                cachedBytes += packed->getLength();
+            OSSafeReleaseNULL(packed);
+            OSSafeReleaseNULL(source);
+        }
+        if (compactCache)
+            EXPECT_EQ(StoreHarness::getAllocationStats(kAllocInstructions).current, cachedBytes);
+    }
+
+    if (store)
+        StoreHarness::stopStore(store);
+    HostWaitThreads();
+}
+
+HOST_TEST(patchRamMatchesHexOverBulk)
+{
+    expectImagesOnEveryDevice(NULL);
+}
+
+HOST_TEST(patchRamMatchesHexOverControl)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSNumber* transport = OSNumber::withNumber(1, 32);      // kTransportControl of BrcmPatchRAM.h
+
+    properties->setObject("FirmwareTransport", transport);
+    transport->release();
+    expectImagesOnEveryDevice(properties);
+    properties->release();
+}
+
+HOST_TEST(patchRamMatchesHexWithPipelineDecode)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+
+    properties->setObject("PipelineDecode", kOSBooleanTrue);
+    expectImagesOnEveryDevice(properties);
+    properties->release();
+}
+
+HOST_TEST(patchRamMatchesHexWithCompactCache)
+{
+    expectImagesOnEveryDevice(NULL, true);
+}
+
+// Records are read straight into the command buffer of the interface
+HOST_TEST(patchRamMatchesHexWithCompactCacheOverControl)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSNumber* transport = OSNumber::withNumber(1, 32);      // kTransportControl of BrcmPatchRAM.h
+
+    properties->setObject("FirmwareTransport", transport);
+    transport->release();
+    expectImagesOnEveryDevice(properties, true);
+    properties->release();
+}
+
+// The store's CompactCache wins, the driver doesn't stream
+HOST_TEST(patchRamMatchesHexWithCompactCacheAndPipelineDecode)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+
+    properties->setObject("PipelineDecode", kOSBooleanTrue);
+    expectImagesOnEveryDevice(properties, true);
+    properties->release();
+}
@@ -0,0 +1,144 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The resident driver, BrcmPatchRAM.cpp without a TARGET_*, built as part
+ * of this file like the Catalina one in DriverHarness.cpp. It shares the
+ * class and shim names with that one, so they are renamed here to link
+ * both into the harness.
+ */
+
+#define BrcmPatchRAM BrcmPatchRAMResident
+#define BrcmPatchRAM_Start BrcmPatchRAMResident_Start
+#define BrcmPatchRAM_Stop BrcmPatchRAMResident_Stop
+#define USBDeviceShim LegacyUSBDeviceShim
+#define USBInterfaceShim LegacyUSBInterfaceShim
+#define USBPipeShim LegacyUSBPipeShim
+
+// hci.h defines its command arrays, DriverHarness.cpp has them as well
+#define HCI_LOCAL_VERSION ResidentHCI_LOCAL_VERSION
+#define HCI_READ_LOCAL_COMMANDS ResidentHCI_READ_LOCAL_COMMANDS
+#define HCI_READ_FEATURES ResidentHCI_READ_FEATURES
+#define HCI_READ_LOCAL_FEATURES ResidentHCI_READ_LOCAL_FEATURES
+#define HCI_RESET ResidentHCI_RESET
+#define HCI_VSC_READ_VERBOSE_CONFIG ResidentHCI_VSC_READ_VERBOSE_CONFIG
+#define HCI_VSC_DOWNLOAD_MINIDRIVER ResidentHCI_VSC_DOWNLOAD_MINIDRIVER
+#define HCI_VSC_END_OF_RECORD ResidentHCI_VSC_END_OF_RECORD
+#define HCI_VSC_WAKEUP ResidentHCI_VSC_WAKEUP
+
+#include "../BrcmPatchRAM/USBDeviceShim.cpp"
+#include "../BrcmPatchRAM/BrcmPatchRAM.cpp"
+
+#include "Harness.h"
+
+bool ResidentHarness::startModule()
+{
+    return BrcmPatchRAM_Start(NULL, NULL) == KERN_SUCCESS;
+}
+
+// Wakes, re-probe samples and queued work left by earlier tests
+void ResidentHarness::forgetWakes()
+{
+    IOLockLock(BrcmPatchRAM::mWakeLock);
+    BrcmPatchRAM::mWakeCount = 0;
+    bzero(BrcmPatchRAM::mPendingWakes, sizeof(BrcmPatchRAM::mPendingWakes));
+    bzero(BrcmPatchRAM::mWakeStats, sizeof(BrcmPatchRAM::mWakeStats));
+    BrcmPatchRAM::mReprobeSampleCount = 0;
+    IOLockUnlock(BrcmPatchRAM::mWakeLock);
+
+    IOLockLock(BrcmPatchRAM::mTopologyLock);
+    bzero(BrcmPatchRAM::mTopologyCache, sizeof(BrcmPatchRAM::mTopologyCache));
+    IOLockUnlock(BrcmPatchRAM::mTopologyLock);
+}
+
+/*
+ * Match, probe and start the driver on provider like IOKit does. The
+ * upload happens in probe, the driver stays resident until stopDriver.
+ */
+IOService* ResidentHarness::startDriver(IOService* provider, OSDictionary* properties)
+{
+    BrcmPatchRAM* driver = new BrcmPatchRAM;
+    SInt32 score = 0;
+
+    if (driver->init(properties) && driver->probe(provider, &score) == driver && driver->start(provider))
+        return driver;
+    driver->release();
+    return NULL;
+}
+
+// Terminate the driver, as when its device goes away
+void ResidentHarness::stopDriver(IOService* driver)
+{
+    driver->stop(driver->getProvider() ? driver->getProvider() : NULL);
+    driver->release();
+}
+
+void ResidentHarness::setPowerState(IOService* driver, bool on)
+{
+    driver->setPowerState(on ? kMyOnPowerState : kMyOffPowerState, driver);
+}
+
+bool ResidentHarness::isInternal(IOService* driver)
+{
+    return static_cast<BrcmPatchRAM*>(driver)->mInternal;
+}
+
+void ResidentHarness::scheduleWork(IOService* driver)
+{
+    static_cast<BrcmPatchRAM*>(driver)->scheduleWork();
+}
+
+/*
+ * With held, scheduleWork finds every uploader thread busy and only
+ * queues, so that a test sees the queue as it was left.
+ */
+void ResidentHarness::holdWorkThreads(bool held)
+{
+    IOLockLock(BrcmPatchRAM::mWorkLock);
+    BrcmPatchRAM::mWorkThreads = held ? kMaxWorkThreads : 0;
+    IOLockUnlock(BrcmPatchRAM::mWorkLock);
+}
+
+// The driver queued at position, NULL past the end
+IOService* ResidentHarness::getQueuedWork(UInt32 position)
+{
+    IOService* driver = NULL;
+
+    IOLockLock(BrcmPatchRAM::mWorkLock);
+    if (position < BrcmPatchRAM::mWorkQueueLength)
+        driver = BrcmPatchRAM::mWorkQueue[position];
+    IOLockUnlock(BrcmPatchRAM::mWorkLock);
+    return driver;
+}
+
+UInt32 ResidentHarness::getReprobeSampleCount()
+{
+    IOLockLock(BrcmPatchRAM::mWakeLock);
+    UInt32 count = BrcmPatchRAM::mReprobeSampleCount;
+    IOLockUnlock(BrcmPatchRAM::mWakeLock);
+    return count;
+}
+
+UInt32 ResidentHarness::getReprobeSample(UInt32 index)
+{
+    IOLockLock(BrcmPatchRAM::mWakeLock);
+    UInt32 sample = BrcmPatchRAM::mReprobeSamples[index % kBlurpWaitSamples];
+    IOLockUnlock(BrcmPatchRAM::mWakeLock);
+    return sample;
+}
@@ -0,0 +1,301 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The resident driver across sleep and wake: what RM,WakeStats counts and
+ * samples for the blurp wait when the device is re-probed, when the timer
+ * has to load the firmware, and the firmware loads it queues.
+ *
+ * A re-probe is a new instance on the same provider, the previous one is
+ * stopped first like it is when the device goes away.
+ */
+
+#include "Harness.h"
+#include "HostTest.h"
+#include "SimController.h"
+
+#include <IOKit/usb/IOUSBDevice.h>
+
+// Store of the firmwares/ corpus on a Darwin the resident driver runs on
+class ResidentScope
+{
+public:
+    ResidentScope() : mVersion(version_major)
+    {
+        OSDictionary* properties = OSDictionary::withCapacity(1);
+        mStore = StoreHarness::startStore(properties);
+        properties->release();
+
+        // Yosemite, the resident driver refuses to start on 10.11+
+        version_major = 14;
+        ResidentHarness::forgetWakes();
+        HostClearEvents();
+        HostResetClock();
+    }
+
+    ~ResidentScope()
+    {
+        HostClearEvents();
+        if (mStore)
+            StoreHarness::stopStore(mStore);
+        HostWaitThreads();
+        HostResetRegistry();
+        version_major = mVersion;
+    }
+
+    BrcmFirmwareStore* get() const { return mStore; }
+
+private:
+    BrcmFirmwareStore* mStore;
+    int mVersion;
+};
+
+// A device of the resident driver, the legacy IOUSBDevice over a controller
+class ResidentDevice
+{
+public:
+    ResidentDevice(const DeviceEntry& device) : mController(simConfig(device, SimTiming()))
+    {
+        mDevice = IOUSBDevice::withDevice(mController.getDevice());
+        mPersonality = OSDictionary::withCapacity(3);
+
+        OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+        OSString* displayName = OSString::withCString(device.displayName.c_str());
+        mPersonality->setObject("FirmwareKey", firmwareKey);
+        mPersonality->setObject("DisplayName", displayName);
+        firmwareKey->release();
+        displayName->release();
+    }
+
+    ~ResidentDevice()
+    {
+        mPersonality->release();
+        mDevice->release();
+    }
+
+    IOService* probe() { return ResidentHarness::startDriver(mDevice, mPersonality); }
+
+    IOUSBDevice* getDevice() { return mDevice; }
+    OSDictionary* getPersonality() { return mPersonality; }
+    SimController& getController() { return mController; }
+
+private:
+    SimController mController;
+    IOUSBDevice* mDevice;
+    OSDictionary* mPersonality;
+};
+
+// Count of event in the RM,WakeStats of driver, Reprobe, Timer or Ready
+static UInt32 wakeEvents(IOService* driver, const char* event)
+{
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty("RM,WakeStats"));
+    OSArray* histogram = stats ? OSDynamicCast(OSArray, stats->getObject(event)) : NULL;
+    OSNumber* count = histogram ? OSDynamicCast(OSNumber, histogram->getObject(0)) : NULL;
+
+    return count ? count->unsigned32BitValue() : 0;
+}
+
+// Sleep and wake of device, the timer of driver is armed on wake
+static void sleepAndWake(ResidentDevice& device, IOService* driver)
+{
+    ResidentHarness::setPowerState(driver, false);
+    device.getController().powerCycle();
+    ResidentHarness::setPowerState(driver, true);
+}
+
+/*
+ * The upload after wake resets the controller and the device is probed
+ * once more. That re-probe belongs to no wake, only the one before the
+ * upload is sampled.
+ */
+HOST_TEST(residentPostUploadResetIsNotAReprobe)
+{
+    ResidentScope scope;
+    ResidentDevice device(loadDevices().at(0));
+
+    IOService* first = device.probe();
+    EXPECT(first != NULL);
+    if (!first)
+        return;
+    EXPECT(device.getController().isPatched());
+
+    sleepAndWake(device, first);
+    HostAdvanceClock(150 * NSEC_PER_MSEC);
+    ResidentHarness::stopDriver(first);
+
+    UInt32 resets = device.getController().getStats().usbResets;
+    IOService* second = device.probe();
+    EXPECT(second != NULL);
+    if (!second)
+        return;
+    EXPECT(device.getController().isPatched());
+    EXPECT(device.getController().getStats().usbResets > resets);
+    EXPECT_EQ(wakeEvents(second, "Reprobe"), 1);
+    EXPECT_EQ(wakeEvents(second, "Ready"), 1);
+    EXPECT_EQ(ResidentHarness::getReprobeSampleCount(), 1);
+    EXPECT_EQ(ResidentHarness::getReprobeSample(0), 150);
+
+    // The re-probe that follows the reset of the upload
+    HostAdvanceClock(150 * NSEC_PER_MSEC);
+    ResidentHarness::stopDriver(second);
+    IOService* third = device.probe();
+    EXPECT(third != NULL);
+    EXPECT_EQ(ResidentHarness::getReprobeSampleCount(), 1);
+    if (third)
+    {
+        EXPECT(!third->getProperty("RM,WakeStats"));
+        ResidentHarness::stopDriver(third);
+    }
+}
+
+/*
+ * A re-probe that does not get the firmware loaded leaves the wake
+ * pending, the next re-probe of the same wake is neither counted nor
+ * sampled again.
+ */
+HOST_TEST(residentWakeIsSampledOnce)
+{
+    ResidentScope scope;
+    ResidentDevice device(loadDevices().at(0));
+
+    IOService* first = device.probe();
+    EXPECT(first != NULL);
+    if (!first)
+        return;
+
+    sleepAndWake(device, first);
+    HostAdvanceClock(120 * NSEC_PER_MSEC);
+    ResidentHarness::stopDriver(first);
+
+    // Without a firmware there is no upload to complete the wake
+    OSDictionary* personality = OSDictionary::withDictionary(device.getPersonality());
+    personality->removeObject("FirmwareKey");
+    IOService* second = ResidentHarness::startDriver(device.getDevice(), personality);
+    personality->release();
+    EXPECT(second != NULL);
+    if (!second)
+        return;
+    EXPECT_EQ(wakeEvents(second, "Reprobe"), 1);
+    EXPECT_EQ(wakeEvents(second, "Ready"), 0);
+
+    HostAdvanceClock(300 * NSEC_PER_MSEC);
+    ResidentHarness::stopDriver(second);
+    IOService* third = device.probe();
+    EXPECT(third != NULL);
+    if (!third)
+        return;
+    EXPECT_EQ(wakeEvents(third, "Reprobe"), 1);
+    EXPECT_EQ(wakeEvents(third, "Ready"), 1);
+    EXPECT_EQ(ResidentHarness::getReprobeSampleCount(), 1);
+    EXPECT_EQ(ResidentHarness::getReprobeSample(0), 120);
+    ResidentHarness::stopDriver(third);
+}
+
+/*
+ * Without a re-probe the timer fires after the blurp wait and queues the
+ * firmware load. A second instance of the same device queues nothing.
+ */
+HOST_TEST(residentTimerQueuesOneLoadPerDevice)
+{
+    ResidentScope scope;
+    ResidentDevice device(loadDevices().at(0));
+
+    IOService* first = device.probe();
+    IOService* second = device.probe();
+    EXPECT(first != NULL && second != NULL);
+    if (!first || !second)
+        return;
+
+    ResidentHarness::holdWorkThreads(true);
+    sleepAndWake(device, first);
+    OSNumber* blurpWait = OSDynamicCast(OSNumber, first->getProperty("RM,BlurpWait"));
+    EXPECT_EQ(blurpWait ? blurpWait->unsigned32BitValue() : 0, 400);
+
+    HostAdvanceClock(399 * NSEC_PER_MSEC);
+    EXPECT(ResidentHarness::getQueuedWork(0) == NULL);
+    HostAdvanceClock(1 * NSEC_PER_MSEC);
+    EXPECT(ResidentHarness::getQueuedWork(0) == first);
+    EXPECT_EQ(wakeEvents(first, "Timer"), 1);
+
+    ResidentHarness::scheduleWork(second);
+    EXPECT(ResidentHarness::getQueuedWork(1) == NULL);
+
+    // Stopping drops the queued load, then the other instance may queue one
+    ResidentHarness::stopDriver(first);
+    EXPECT(ResidentHarness::getQueuedWork(0) == NULL);
+    ResidentHarness::scheduleWork(second);
+    EXPECT(ResidentHarness::getQueuedWork(0) == second);
+
+    ResidentHarness::stopDriver(second);
+    ResidentHarness::holdWorkThreads(false);
+}
+
+/*
+ * Internal controllers are loaded before dongles. ACPI tells through
+ * non-removable, a personality with Internal decides either way.
+ */
+HOST_TEST(residentInternalDevicesQueueFirst)
+{
+    ResidentScope scope;
+    std::vector<DeviceEntry> devices = loadDevices();
+    EXPECT(devices.size() >= 3);
+    if (devices.size() < 3)
+        return;
+
+    ResidentDevice dongle(devices[0]);
+    ResidentDevice acpi(devices[1]);
+    ResidentDevice configured(devices[2]);
+
+    acpi.getDevice()->setProperty("non-removable", "yes");
+    configured.getPersonality()->setObject("Internal", kOSBooleanTrue);
+
+    IOService* dongleDriver = dongle.probe();
+    IOService* acpiDriver = acpi.probe();
+    IOService* configuredDriver = configured.probe();
+    EXPECT(dongleDriver != NULL && acpiDriver != NULL && configuredDriver != NULL);
+    if (!dongleDriver || !acpiDriver || !configuredDriver)
+        return;
+
+    EXPECT(!ResidentHarness::isInternal(dongleDriver));
+    EXPECT(ResidentHarness::isInternal(acpiDriver));
+    EXPECT(ResidentHarness::isInternal(configuredDriver));
+
+    ResidentHarness::holdWorkThreads(true);
+    ResidentHarness::scheduleWork(dongleDriver);
+    ResidentHarness::scheduleWork(acpiDriver);
+    ResidentHarness::scheduleWork(configuredDriver);
+    EXPECT(ResidentHarness::getQueuedWork(0) == acpiDriver);
+    EXPECT(ResidentHarness::getQueuedWork(1) == configuredDriver);
+    EXPECT(ResidentHarness::getQueuedWork(2) == dongleDriver);
+
+    ResidentHarness::stopDriver(dongleDriver);
+    ResidentHarness::stopDriver(acpiDriver);
+    ResidentHarness::stopDriver(configuredDriver);
+    ResidentHarness::holdWorkThreads(false);
+
+    // Internal set to false overrides ACPI
+    acpi.getPersonality()->setObject("Internal", kOSBooleanFalse);
+    acpiDriver = acpi.probe();
+    EXPECT(acpiDriver != NULL);
+    if (acpiDriver)
+    {
+        EXPECT(!ResidentHarness::isInternal(acpiDriver));
+        ResidentHarness::stopDriver(acpiDriver);
+    }
+}
@@ -0,0 +1,723 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <algorithm>
+
+#include <string.h>
+
+#include "SimController.h"
+
+// Bus time of a byte with bit stuffing and protocol overhead, in ns
+#define kFullSpeedByteTime 833
+#define kHighSpeedByteTime 21
+
+// Token, PIDs, CRC and handshake of each packet, in byte times
+#define kPacketOverhead 13
+
+#define kControlPacketSize 64
+#define kInterruptPacketSize 16
+
+// Controller side of the model, in ns
+#define kVersionTime (100 * NSEC_PER_USEC)
+#define kMiniDriverTime (5 * NSEC_PER_MSEC)
+#define kLaunchRamTime (30 * NSEC_PER_USEC)
+#define kLaunchRamByteTime 40
+#define kEndOfRecordTime (1 * NSEC_PER_MSEC)
+#define kHandshakeTime (10 * NSEC_PER_MSEC)
+#define kResetTime (30 * NSEC_PER_MSEC)
+#define kCommandTime (50 * NSEC_PER_USEC)
+
+#define kOpcodeReset 0x0c03
+#define kOpcodeReadVerboseConfig 0xfc79
+#define kOpcodeDownloadMiniDriver 0xfc2e
+#define kOpcodeLaunchRam 0xfc4c
+#define kOpcodeEndOfRecord 0xfc4e
+
+#define kEventCommandComplete 0x0e
+#define kEventVendor 0xff
+
+#define kStatusSuccess 0x00
+#define kStatusDisallowed 0x0c
+
+static void setString(UInt8* descriptor, const char* string)
+{
+    size_t length = std::min(strlen(string), (size_t)31);
+
+    descriptor[0] = (UInt8)(2 + length * 2);
+    descriptor[1] = kDescriptorTypeString;
+    for (size_t i = 0; i < length; i++)
+    {
+        descriptor[2 + i * 2] = (UInt8)string[i];
+        descriptor[3 + i * 2] = 0;
+    }
+}
+
+SimController::SimController(const SimConfig& config)
+{
+    mConfig = config;
+    mState = config.patched ? kPatched : kRom;
+    mBusyUntil = 0;
+    mBusFreeAt = 0;
+    mRandom = (config.timing.seed * 2654435761U) ^ ((UInt32)config.vendorId << 16 | config.productId);
+    if (!mRandom)
+        mRandom = 1;
+    mReadPending = false;
+    mDeliveryScheduled = false;
+    mGeneration = 0;
+    mUploadStart = 0;
+    mVersionDone = 0;
+    mMiniDriverDone = 0;
+    mRecordsDone = 0;
+    mResetDone = false;
+    bzero(&mRead, sizeof(mRead));
+    bzero(&mPhases, sizeof(mPhases));
+    bzero(&mStats, sizeof(mStats));
+
+    UInt16 bulkPacketSize = config.timing.highSpeed ? 512 : 64;
+
+    bzero(&mDeviceDescriptor, sizeof(mDeviceDescriptor));
+    mDeviceDescriptor.bLength = sizeof(mDeviceDescriptor);
+    mDeviceDescriptor.bDescriptorType = kDescriptorTypeDevice;
+    mDeviceDescriptor.bcdUSB = config.timing.highSpeed ? 0x0200 : 0x0110;
+    mDeviceDescriptor.bDeviceClass = 0xFF;
+    mDeviceDescriptor.bDeviceSubClass = 0x01;
+    mDeviceDescriptor.bDeviceProtocol = 0x01;
+    mDeviceDescriptor.bMaxPacketSize0 = kControlPacketSize;
+    mDeviceDescriptor.idVendor = config.vendorId;
+    mDeviceDescriptor.idProduct = config.productId;
+    mDeviceDescriptor.bcdDevice = 0x0112;
+    mDeviceDescriptor.iManufacturer = 1;
+    mDeviceDescriptor.iProduct = 2;
+    mDeviceDescriptor.iSerialNumber = 3;
+    mDeviceDescriptor.bNumConfigurations = 1;
+
+    const UInt8 configuration[sizeof(mConfigurationBytes)] =
+    {
+        // Configuration 1, one interface
+        9, kDescriptorTypeConfiguration, sizeof(mConfigurationBytes), 0, 1, 1, 0, 0xE0, 0x32,
+        // Bluetooth interface with its three endpoints
+        9, kDescriptorTypeInterface, 0, 0, 3, 0xE0, 0x01, 0x01, 0,
+        7, kDescriptorTypeEndpoint, 0x81, kUSBInterrupt, kInterruptPacketSize, 0, 1,
+        7, kDescriptorTypeEndpoint, 0x82, kUSBBulk, (UInt8)bulkPacketSize, (UInt8)(bulkPacketSize >> 8), 0,
+        7, kDescriptorTypeEndpoint, 0x02, kUSBBulk, (UInt8)bulkPacketSize, (UInt8)(bulkPacketSize >> 8), 0,
+    };
+    memcpy(mConfigurationBytes, configuration, sizeof(mConfigurationBytes));
+
+    bzero(mStrings, sizeof(mStrings));
+    mStrings[0][0] = 4;
+    mStrings[0][1] = kDescriptorTypeString;
+    mStrings[0][2] = 0x09;
+    mStrings[0][3] = 0x04;
+    setString(mStrings[1], "Broadcom Corp");
+    setString(mStrings[2], config.productName ? config.productName : "BCM20702A0");
+    setString(mStrings[3], "5CF3709BCDEF");
+
+    mDevice = SimDevice::withController(this);
+}
+
+SimController::~SimController()
+{
+    HostClearEvents();
+    if (mDevice)
+        mDevice->release();
+}
+
+UInt64 SimController::nextJitter()
+{
+    // xorshift32, seeded per device so that runs repeat
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+    return mConfig.timing.jitter ? mRandom % (mConfig.timing.jitter + 1) : 0;
+}
+
+UInt64 SimController::busTime(UInt32 length, UInt16 packetSize, bool setup) const
+{
+    UInt32 packets = length ? (length + packetSize - 1) / packetSize : 1;
+    UInt32 bytes = length;
+
+    // Setup and status stages of a control transfer
+    if (setup)
+    {
+        packets += 2;
+        bytes += 8;
+    }
+    bytes += packets * kPacketOverhead;
+    return (UInt64)bytes * (mConfig.timing.highSpeed ? kHighSpeedByteTime : kFullSpeedByteTime);
+}
+
+/*
+ * End of a control or bulk transfer submitted at start. Transfers on the
+ * asynchronous schedule follow each other on the bus.
+ */
+UInt64 SimController::transferTime(UInt64 start, UInt32 length, UInt16 packetSize, bool setup)
+{
+    UInt64 begin = std::max(start + mConfig.timing.latency + nextJitter(), mBusFreeAt);
+
+    mBusFreeAt = begin + busTime(length, packetSize, setup);
+    mStats.busBytes += length;
+    return mBusFreeAt;
+}
+
+UInt64 SimController::pollInterval() const
+{
+    UInt8 interval = mConfigurationBytes[18 + 6];
+
+    // Frames at full speed, 2^(bInterval-1) microframes at high speed
+    if (mConfig.timing.highSpeed)
+        return (125 * NSEC_PER_USEC) << (interval ? interval - 1 : 0);
+    return (UInt64)(interval ? interval : 1) * NSEC_PER_MSEC;
+}
+
+void SimController::syncControl(UInt32 length)
+{
+    UInt64 now = HostNow();
+
+    mStats.controlTransfers++;
+    HostAdvanceClock(transferTime(now, length, kControlPacketSize, true) - now);
+}
+
+IOReturn SimController::controlTransfer(const void* command, UInt32 length, IOUSBHostCompletion* completion)
+{
+    if (!mDevice->isConfigured())
+        return kIOReturnNoDevice;
+
+    UInt64 now = HostNow();
+    UInt64 end = transferTime(now, length, kControlPacketSize, true);
+    IOUSBHostCompletion done = *completion;
+
+    mStats.controlTransfers++;
+    receiveCommand((const UInt8*)command, length, now, end);
+
+    HostSchedule(end, [done, length]
+    {
+        done.action(done.owner, done.parameter, kIOReturnSuccess, length);
+    });
+    return kIOReturnSuccess;
+}
+
+IOReturn SimController::bulkWrite(const void* command, UInt32 length)
+{
+    if (!mDevice->isConfigured())
+        return kIOReturnNoDevice;
+
+    UInt64 now = HostNow();
+    UInt64 end = transferTime(now, length, mConfig.timing.highSpeed ? 512 : 64, false);
+
+    mStats.bulkTransfers++;
+    HostAdvanceClock(end - now);
+    receiveCommand((const UInt8*)command, length, now, end);
+    return kIOReturnSuccess;
+}
+
+IOReturn SimController::postRead(IOMemoryDescriptor* buffer, UInt32 length, IOUSBHostCompletion* completion)
+{
+    if (!mDevice->isConfigured())
+        return kIOReturnNoDevice;
+    if (mReadPending)
+        return kIOReturnExclusiveAccess;
+
+    mRead.buffer = buffer;
+    mRead.length = length;
+    mRead.completion = *completion;
+    mRead.posted = HostNow();
+    mReadPending = true;
+    scheduleDelivery();
+    return kIOReturnSuccess;
+}
+
+// Complete the pending read right away, like the host controller does
+IOReturn SimController::abortRead()
+{
+    if (!mReadPending)
+        return kIOReturnSuccess;
+
+    IOUSBHostCompletion done = mRead.completion;
+
+    mReadPending = false;
+    mDeliveryScheduled = false;
+    mGeneration++;
+    done.action(done.owner, done.parameter, kIOReturnAborted, 0);
+    return kIOReturnSuccess;
+}
+
+/*
+ * The controller takes commands in order and answers each once processed.
+ * sent is when the driver submitted the command, received when its transfer
+ * ended.
+ */
+void SimController::receiveCommand(const UInt8* command, UInt32 length, UInt64 sent, UInt64 received)
+{
+    if (length < 3)
+        return;
+
+    UInt16 opcode = command[0] | command[1] << 8;
+    UInt32 parameters = std::min((UInt32)command[2], length - 3);
+    UInt64 start = std::max(received, mBusyUntil);
+    UInt8 status = kStatusSuccess;
+    SimCommand recorded = { opcode, 0, parameters, 0x811C9DC5 };
+    const UInt8* payload = command + 3;
+
+    if (opcode == kOpcodeLaunchRam && parameters >= 4)
+    {
+        recorded.address = payload[0] | payload[1] << 8 | payload[2] << 16 | (UInt32)payload[3] << 24;
+        recorded.length -= 4;
+        payload += 4;
+    }
+    for (UInt32 i = 0; i < recorded.length; i++)
+        recorded.hash = (recorded.hash ^ payload[i]) * 0x01000193;
+    mTranscript.push_back(recorded);
+
+    switch (opcode)
+    {
+        case kOpcodeReadVerboseConfig:
+        {
+            UInt16 version = mState == kPatched ? mConfig.patchedVersion : 0;
+            // Chip and target id, then the build the driver reads at offset 10
+            const UInt8 config[] = { 0x07, 0x04, 0x00, 0x00, (UInt8)version, (UInt8)(version >> 8) };
+
+            if (!mUploadStart)
+                mUploadStart = sent;
+            mBusyUntil = start + kVersionTime;
+            queueCommandComplete(mBusyUntil, opcode, kStatusSuccess, config, sizeof(config));
+            return;
+        }
+
+        case kOpcodeDownloadMiniDriver:
+            // A new patch starts from an empty patch RAM
+            mState = kMiniDriver;
+            mMemory.clear();
+            mBusyUntil = start + kMiniDriverTime;
+            break;
+
+        case kOpcodeLaunchRam:
+            if (mState != kMiniDriver)
+                status = kStatusDisallowed;
+            else
+            {
+                for (UInt32 i = 0; i < recorded.length; i++)
+                    mMemory[recorded.address + i] = payload[i];
+            }
+            mBusyUntil = start + kLaunchRamTime + (UInt64)(parameters > 4 ? parameters - 4 : 0) * kLaunchRamByteTime;
+            break;
+
+        case kOpcodeEndOfRecord:
+            if (mState == kMiniDriver)
+                mState = kLaunched;
+            else
+                status = kStatusDisallowed;
+            mBusyUntil = start + kEndOfRecordTime;
+            break;
+
+        case kOpcodeReset:
+            if (mState == kLaunched)
+                mState = kPatched;
+            else if (mState == kMiniDriver)
+                mState = kRom;
+            mBusyUntil = start + kResetTime;
+            break;
+
+        default:
+            mBusyUntil = start + kCommandTime;
+            break;
+    }
+
+    queueCommandComplete(mBusyUntil, opcode, status, NULL, 0);
+
+    // Ready for the reset once the patch is in place
+    if (opcode == kOpcodeEndOfRecord && mState == kLaunched && mConfig.handshake)
+    {
+        const UInt8 ready[] = { kEventVendor, 1, 0x00 };
+        queueEvent(mBusyUntil + kHandshakeTime, ready, sizeof(ready));
+    }
+}
+
+void SimController::queueEvent(UInt64 ready, const UInt8* bytes, UInt32 length)
+{
+    mEvents.push_back(Event { ready, std::vector<UInt8>(bytes, bytes + length) });
+    scheduleDelivery();
+}
+
+void SimController::queueCommandComplete(UInt64 ready, UInt16 opcode, UInt8 status, const UInt8* parameters, UInt32 length)
+{
+    std::vector<UInt8> event = { kEventCommandComplete, (UInt8)(4 + length), 1, (UInt8)opcode, (UInt8)(opcode >> 8), status };
+
+    if (length)
+        event.insert(event.end(), parameters, parameters + length);
+    queueEvent(ready, event.data(), (UInt32)event.size());
+}
+
+/*
+ * An event goes out on the first poll of the interrupt endpoint after it
+ * is ready and a read is posted for it.
+ */
+void SimController::scheduleDelivery()
+{
+    if (!mReadPending || mDeliveryScheduled || mEvents.empty())
+        return;
+
+    UInt64 interval = pollInterval();
+    UInt64 poll = std::max(HostNow(), std::max(mEvents.front().ready, mRead.posted));
+    poll = (poll + interval - 1) / interval * interval;
+
+    UInt64 delivery = poll + busTime((UInt32)mEvents.front().bytes.size(), kInterruptPacketSize, false) +
+                      mConfig.timing.latency + nextJitter();
+    UInt32 generation = mGeneration;
+
+    mDeliveryScheduled = true;
+    HostSchedule(delivery, [this, generation] { deliver(generation); });
+}
+
+void SimController::deliver(UInt32 generation)
+{
+    if (generation != mGeneration || !mReadPending || mEvents.empty())
+        return;
+
+    Event event = mEvents.front();
+    UInt32 length = std::min((UInt32)event.bytes.size(), mRead.length);
+    IOUSBHostCompletion done = mRead.completion;
+    UInt64 now = HostNow();
+
+    mEvents.pop_front();
+    mRead.buffer->writeBytes(0, event.bytes.data(), length);
+    mReadPending = false;
+    mDeliveryScheduled = false;
+    mStats.interruptTransfers++;
+
+    // The driver moves on with this event, which closes a phase
+    if (event.bytes[0] == kEventCommandComplete && event.bytes.size() >= 6)
+    {
+        switch (event.bytes[3] | event.bytes[4] << 8)
+        {
+            case kOpcodeReadVerboseConfig:
+                // Not the version read back after the patch
+                if (mRecordsDone)
+                    break;
+                mVersionDone = now;
+                mPhases.version = now - mUploadStart;
+                break;
+
+            case kOpcodeDownloadMiniDriver:
+                mMiniDriverDone = now;
+                mPhases.miniDriver = now - mVersionDone;
+                break;
+
+            case kOpcodeEndOfRecord:
+                mRecordsDone = now;
+                mPhases.records = now - mMiniDriverDone;
+                break;
+        }
+    }
+
+    done.action(done.owner, done.parameter, kIOReturnSuccess, length);
+}
+
+/*
+ * Unconfiguring the device drops whatever the controller had queued. A
+ * patch that was started survives it, a half written one does not.
+ */
+void SimController::setConfigured(bool configured)
+{
+    if (configured)
+        return;
+
+    UInt64 now = HostNow();
+
+    mStats.usbResets++;
+    mEvents.clear();
+    mBusyUntil = now;
+    mGeneration++;
+    mDeliveryScheduled = false;
+    if (mState != kPatched)
+        mState = kRom;
+
+    // The reset that follows the HCI reset ends the upload
+    if (mState == kPatched && mRecordsDone && !mResetDone)
+    {
+        mPhases.reset = now - mRecordsDone;
+        mResetDone = true;
+    }
+
+    if (mReadPending)
+    {
+        IOUSBHostCompletion done = mRead.completion;
+
+        mReadPending = false;
+        HostSchedule(now, [done] { done.action(done.owner, done.parameter, kIOReturnNoDevice, 0); });
+    }
+}
+
+/*
+ * Patch RAM does not survive sleep. The milestones start over so that the
+ * phases are those of the upload after wake.
+ */
+void SimController::powerCycle()
+{
+    mState = kRom;
+    mEvents.clear();
+    mGeneration++;
+    mDeliveryScheduled = false;
+    mUploadStart = 0;
+    mVersionDone = 0;
+    mMiniDriverDone = 0;
+    mRecordsDone = 0;
+    mResetDone = false;
+}
+
+/***************************************
+ * SimDevice
+ ***************************************/
+SimDevice* SimDevice::withController(SimController* controller)
+{
+    SimDevice* device = new SimDevice;
+
+    if (!device->init(NULL))
+    {
+        device->release();
+        return NULL;
+    }
+    device->mController = controller;
+    device->mInterface = NULL;
+    device->mConfiguration = 0;
+
+    if (OSNumber* locationId = OSNumber::withNumber(0x14100000U | controller->mConfig.productId >> 12, 32))
+    {
+        device->setProperty(kUSBHostDevicePropertyLocationID, locationId);
+        locationId->release();
+    }
+
+    // Configured at enumeration, before the driver matches
+    device->attachInterface(1);
+    return device;
+}
+
+void SimDevice::free()
+{
+    attachInterface(0);
+    IOUSBHostDevice::free();
+}
+
+void SimDevice::attachInterface(UInt8 configuration)
+{
+    mConfiguration = configuration;
+
+    if (configuration && !mInterface)
+    {
+        mInterface = SimInterface::withController(mController);
+        if (mInterface)
+            mInterface->attachToParent(this, gIOServicePlane);
+    }
+    else if (!configuration && mInterface)
+    {
+        mInterface->detachFromParent(this, gIOServicePlane);
+        OSSafeReleaseNULL(mInterface);
+    }
+}
+
+const StandardUSB::DeviceDescriptor* SimDevice::getDeviceDescriptor()
+{
+    return &mController->mDeviceDescriptor;
+}
+
+const StandardUSB::StringDescriptor* SimDevice::getStringDescriptor(uint8_t index, uint16_t languageID)
+{
+    if (index >= sizeof(mController->mStrings) / sizeof(mController->mStrings[0]))
+        return NULL;
+    return (const StandardUSB::StringDescriptor*)mController->mStrings[index];
+}
+
+IOReturn SimDevice::deviceRequest(IOService* forClient, StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs)
+{
+    bytesTransferred = 0;
+
+    switch (request.bRequest)
+    {
+        case kDeviceRequestGetStatus:
+            if (request.wLength < 2)
+                return kIOReturnBadArgument;
+
+            // Bus powered, no remote wakeup
+            bzero(dataBuffer, 2);
+            bytesTransferred = 2;
+            break;
+
+        case kDeviceRequestGetConfiguration:
+            if (request.wLength < 1)
+                return kIOReturnBadArgument;
+
+            *(UInt8*)dataBuffer = mConfiguration;
+            bytesTransferred = 1;
+            break;
+
+        default:
+            return kIOReturnUnsupported;
+    }
+
+    mController->syncControl(bytesTransferred);
+    return kIOReturnSuccess;
+}
+
+IOReturn SimDevice::setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces)
+{
+    if (bConfigurationValue > 1)
+        return kIOReturnBadArgument;
+
+    mController->syncControl(0);
+    attachInterface(bConfigurationValue);
+    mController->setConfigured(bConfigurationValue != 0);
+    return kIOReturnSuccess;
+}
+
+const StandardUSB::ConfigurationDescriptor* SimDevice::getConfigurationDescriptor(uint8_t index)
+{
+    if (index)
+        return NULL;
+    return (const StandardUSB::ConfigurationDescriptor*)mController->mConfigurationBytes;
+}
+
+/***************************************
+ * SimInterface
+ ***************************************/
+SimInterface* SimInterface::withController(SimController* controller)
+{
+    SimInterface* interface = new SimInterface;
+
+    if (!interface->init(NULL))
+    {
+        interface->release();
+        return NULL;
+    }
+    interface->mController = controller;
+    bzero(interface->mPipes, sizeof(interface->mPipes));
+    return interface;
+}
+
+void SimInterface::free()
+{
+    for (int i = 0; i < 3; i++)
+        OSSafeReleaseNULL(mPipes[i]);
+    IOUSBHostInterface::free();
+}
+
+const StandardUSB::ConfigurationDescriptor* SimInterface::getConfigurationDescriptor()
+{
+    return (const StandardUSB::ConfigurationDescriptor*)mController->mConfigurationBytes;
+}
+
+const StandardUSB::InterfaceDescriptor* SimInterface::getInterfaceDescriptor()
+{
+    return (const StandardUSB::InterfaceDescriptor*)(mController->mConfigurationBytes + 9);
+}
+
+IOUSBHostPipe* SimInterface::copyPipe(uint8_t address)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const StandardUSB::EndpointDescriptor* descriptor = (const StandardUSB::EndpointDescriptor*)(mController->mConfigurationBytes + 18 + 7 * i);
+
+        if (descriptor->bEndpointAddress != address)
+            continue;
+
+        if (!mPipes[i])
+            mPipes[i] = SimPipe::withEndpoint(mController, descriptor);
+        if (mPipes[i])
+            mPipes[i]->retain();
+        return mPipes[i];
+    }
+    return NULL;
+}
+
+// HCI commands are class requests to the device
+IOReturn SimInterface::deviceRequest(StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs)
+{
+    if (!mController->mDevice->isConfigured())
+        return kIOReturnNoDevice;
+
+    UInt64 now = HostNow();
+    UInt64 end = mController->transferTime(now, request.wLength, kControlPacketSize, true);
+
+    mController->mStats.controlTransfers++;
+    HostAdvanceClock(end - now);
+    mController->receiveCommand((const UInt8*)dataBuffer, request.wLength, now, end);
+    bytesTransferred = request.wLength;
+    return kIOReturnSuccess;
+}
+
+IOReturn SimInterface::deviceRequest(StandardUSB::DeviceRequest& request, IOMemoryDescriptor* dataBuffer, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs)
+{
+    UInt8 command[3 + 0xFF];
+    UInt32 length = std::min((UInt32)request.wLength, (UInt32)sizeof(command));
+
+    if (!dataBuffer || dataBuffer->readBytes(0, command, length) != length)
+        return kIOReturnBadArgument;
+    return mController->controlTransfer(command, length, completion);
+}
+
+/***************************************
+ * SimPipe
+ ***************************************/
+SimPipe* SimPipe::withEndpoint(SimController* controller, const StandardUSB::EndpointDescriptor* descriptor)
+{
+    SimPipe* pipe = new SimPipe;
+
+    pipe->mController = controller;
+    pipe->mDescriptor = descriptor;
+    return pipe;
+}
+
+IOReturn SimPipe::abort()
+{
+    if (mDescriptor->bEndpointAddress & 0x80)
+        return mController->abortRead();
+    return kIOReturnSuccess;
+}
+
+IOReturn SimPipe::io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs)
+{
+    // Only the interrupt pipe is read asynchronously
+    if (getEndpointType(mDescriptor) != kUSBInterrupt || !completion)
+        return kIOReturnUnsupported;
+    return mController->postRead(dataBuffer, dataBufferLength, completion);
+}
+
+IOReturn SimPipe::io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, uint32_t& bytesTransferred, uint32_t completionTimeoutMs)
+{
+    UInt8 command[3 + 0xFF];
+
+    bytesTransferred = 0;
+    if (getEndpointType(mDescriptor) != kUSBBulk || (mDescriptor->bEndpointAddress & 0x80))
+        return kIOReturnUnsupported;
+    if (dataBufferLength > sizeof(command) || dataBuffer->readBytes(0, command, dataBufferLength) != dataBufferLength)
+        return kIOReturnOverrun;
+
+    IOReturn result = mController->bulkWrite(command, dataBufferLength);
+    if (result == kIOReturnSuccess)
+        bytesTransferred = dataBufferLength;
+    return result;
+}
+
+const StandardUSB::EndpointDescriptor* SimPipe::getEndpointDescriptor()
+{
+    return mDescriptor;
+}
+
+IOReturn SimPipe::clearStall(bool withRequest)
+{
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,260 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Software Broadcom controller behind a modelled USB link, the provider
+ * the driver uploads to on the host.
+ *
+ * The device, its interface and pipes implement the IOUSBHost API the
+ * Catalina driver uses. Every transfer takes modelled time on the virtual
+ * clock of KernelShim.cpp: control and bulk transfers start after the
+ * per-transfer latency and jitter and then take the bus time of their
+ * bytes; interrupt transfers only start on a polling boundary. Commands
+ * are processed one at a time by the controller, each answered with an
+ * event on the interrupt pipe.
+ *
+ * The controller side times (processing, resets) are assumptions of the
+ * model, not measurements, so that a change in how the driver talks to
+ * the controller shows up as a change in modelled time.
+ */
+
+#ifndef __SimController__
+#define __SimController__
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "HostControl.h"
+#include <IOKit/usb/IOUSBHostDevice.h>
+
+struct SimTiming
+{
+    bool highSpeed = true;
+    UInt64 latency = 20 * 1000;     // ns, host controller and stack per transfer
+    UInt64 jitter = 10 * 1000;      // ns, at most, added to the latency
+    UInt32 seed = 1;
+};
+
+struct SimConfig
+{
+    UInt16 vendorId;
+    UInt16 productId;
+    const char* productName;
+    bool handshake;                 // vendor event once the records are written
+    UInt16 patchedVersion;          // reported by READ_VERBOSE_CONFIG once patched
+    bool patched;                   // controller still runs an earlier upload
+    SimTiming timing;
+};
+
+/*
+ * Virtual times of the upload milestones, in nanoseconds. The phases end
+ * when the driver sees the event that moves it on; Reset ends with the
+ * USB reset that follows the HCI reset.
+ */
+struct SimPhases
+{
+    UInt64 version;
+    UInt64 miniDriver;
+    UInt64 records;
+    UInt64 reset;
+
+    UInt64 total() const { return version + miniDriver + records + reset; }
+};
+
+struct SimStats
+{
+    UInt32 controlTransfers;
+    UInt32 bulkTransfers;
+    UInt32 interruptTransfers;
+    UInt64 busBytes;
+    UInt32 usbResets;
+};
+
+/*
+ * A command as the controller received it. LAUNCH_RAM carries its address
+ * in the first four parameter bytes, the payload is what follows; other
+ * commands have no address and all their parameters as payload. The hash
+ * is FNV-1a over the payload.
+ */
+struct SimCommand
+{
+    UInt16 opcode;
+    UInt32 address;
+    UInt32 length;
+    UInt32 hash;
+};
+
+class SimController;
+
+class SimPipe : public IOUSBHostPipe
+{
+public:
+    static SimPipe* withEndpoint(SimController* controller, const StandardUSB::EndpointDescriptor* descriptor);
+
+    virtual IOReturn abort();
+    virtual IOReturn io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs = 0);
+    virtual IOReturn io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, uint32_t& bytesTransferred, uint32_t completionTimeoutMs = 0);
+    virtual const StandardUSB::EndpointDescriptor* getEndpointDescriptor();
+    virtual IOReturn clearStall(bool withRequest);
+
+private:
+    SimController* mController;
+    const StandardUSB::EndpointDescriptor* mDescriptor;
+};
+
+class SimInterface : public IOUSBHostInterface
+{
+public:
+    static SimInterface* withController(SimController* controller);
+
+    virtual const StandardUSB::ConfigurationDescriptor* getConfigurationDescriptor();
+    virtual const StandardUSB::InterfaceDescriptor* getInterfaceDescriptor();
+    virtual IOUSBHostPipe* copyPipe(uint8_t address);
+    virtual IOReturn deviceRequest(StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs);
+    virtual IOReturn deviceRequest(StandardUSB::DeviceRequest& request, IOMemoryDescriptor* dataBuffer, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs = 5000);
+
+protected:
+    virtual void free();
+
+private:
+    SimController* mController;
+    SimPipe* mPipes[3];
+};
+
+class SimDevice : public IOUSBHostDevice
+{
+public:
+    static SimDevice* withController(SimController* controller);
+
+    virtual const StandardUSB::DeviceDescriptor* getDeviceDescriptor();
+    virtual const StandardUSB::StringDescriptor* getStringDescriptor(uint8_t index, uint16_t languageID = 0x409);
+    virtual IOReturn deviceRequest(IOService* forClient, StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs);
+    virtual IOReturn setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces = true);
+    virtual const StandardUSB::ConfigurationDescriptor* getConfigurationDescriptor(uint8_t index);
+
+    bool isConfigured() const { return mConfiguration != 0; }
+
+protected:
+    virtual void free();
+
+private:
+    void attachInterface(UInt8 configuration);
+
+    SimController* mController;
+    SimInterface* mInterface;
+    UInt8 mConfiguration;
+};
+
+class SimController
+{
+public:
+    SimController(const SimConfig& config);
+    ~SimController();
+
+    // The provider to start the driver on
+    SimDevice* getDevice() { return mDevice; }
+
+    const SimPhases& getPhases() const { return mPhases; }
+    const SimStats& getStats() const { return mStats; }
+    bool isPatched() const { return mState == kPatched; }
+
+    // Sleep and wake, the controller runs from ROM again
+    void powerCycle();
+
+    // Every command received, in order
+    const std::vector<SimCommand>& getTranscript() const { return mTranscript; }
+
+    // Patch RAM by address, each byte as the last LAUNCH_RAM accepted wrote it
+    const std::map<UInt32, UInt8>& getMemory() const { return mMemory; }
+
+private:
+    friend class SimDevice;
+    friend class SimInterface;
+    friend class SimPipe;
+
+    enum State
+    {
+        kRom,
+        kMiniDriver,
+        kLaunched,          // END_OF_RECORD done, waiting for HCI reset
+        kPatched,
+    };
+
+    struct Event
+    {
+        UInt64 ready;       // time the controller has it queued
+        std::vector<UInt8> bytes;
+    };
+
+    struct Read
+    {
+        IOMemoryDescriptor* buffer;
+        UInt32 length;
+        IOUSBHostCompletion completion;
+        UInt64 posted;
+    };
+
+    UInt64 nextJitter();
+    UInt64 busTime(UInt32 length, UInt16 packetSize, bool setup) const;
+    UInt64 transferTime(UInt64 start, UInt32 length, UInt16 packetSize, bool setup);
+    UInt64 pollInterval() const;
+    void syncControl(UInt32 length);
+
+    IOReturn controlTransfer(const void* command, UInt32 length, IOUSBHostCompletion* completion);
+    IOReturn bulkWrite(const void* command, UInt32 length);
+    IOReturn postRead(IOMemoryDescriptor* buffer, UInt32 length, IOUSBHostCompletion* completion);
+    IOReturn abortRead();
+
+    void receiveCommand(const UInt8* command, UInt32 length, UInt64 sent, UInt64 received);
+    void queueEvent(UInt64 ready, const UInt8* bytes, UInt32 length);
+    void queueCommandComplete(UInt64 ready, UInt16 opcode, UInt8 status, const UInt8* parameters, UInt32 length);
+    void scheduleDelivery();
+    void deliver(UInt32 generation);
+    void setConfigured(bool configured);
+
+    SimConfig mConfig;
+    SimDevice* mDevice;
+    State mState;
+    UInt64 mBusyUntil;          // end of the command the controller processes
+    UInt64 mBusFreeAt;          // end of the transfer on the bus
+    UInt32 mRandom;
+    std::deque<Event> mEvents;
+    Read mRead;
+    bool mReadPending;
+    bool mDeliveryScheduled;
+    UInt32 mGeneration;         // stale deliveries after an abort or reset
+
+    UInt64 mUploadStart;
+    UInt64 mVersionDone;
+    UInt64 mMiniDriverDone;
+    UInt64 mRecordsDone;
+    bool mResetDone;
+    SimPhases mPhases;
+    SimStats mStats;
+    std::vector<SimCommand> mTranscript;
+    std::map<UInt32, UInt8> mMemory;
+
+    // Descriptors, with the endpoints following the interface
+    StandardUSB::DeviceDescriptor mDeviceDescriptor;
+    UInt8 mConfigurationBytes[39];
+    UInt8 mStrings[4][64];
+};
+
+#endif /* __SimController__ */
@@ -0,0 +1,215 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Upload every firmware of firmwares.plist to a simulated controller and
+ * report the modelled time of each phase. The times are virtual, so they
+ * repeat from run to run for the same timing model and seed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Harness.h"
+#include "SimController.h"
+#include "../BrcmPatchRAM/BrcmFirmwareStore.h"
+
+// Build the firmware runs once patched, from the _v<version> of its key
+static UInt16 patchedVersion(const std::string& firmwareKey)
+{
+    size_t position = firmwareKey.rfind("_v");
+    unsigned long version = position == std::string::npos ? 0 : strtoul(firmwareKey.c_str() + position + 2, NULL, 10);
+
+    return version > 0x1000 ? (UInt16)(version - 0x1000) : 1;
+}
+
+static double microseconds(UInt64 nanoseconds)
+{
+    return nanoseconds / 1000.0;
+}
+
+SimConfig simConfig(const DeviceEntry& device, const SimTiming& timing)
+{
+    SimConfig config = SimConfig();
+
+    config.vendorId = device.vendorId;
+    config.productId = device.productId;
+    config.productName = device.displayName.c_str();
+    config.handshake = DriverHarness::supportsHandshake(device.vendorId, device.productId);
+    config.patchedVersion = patchedVersion(device.firmwareKey);
+    config.timing = timing;
+    return config;
+}
+
+/*
+ * Run the driver on controller with the personality of device, plus
+ * properties if given, and read back the RM,UploadResult it left.
+ */
+bool simulateUpload(SimController* controller, const DeviceEntry& device, OSDictionary* properties, UploadOutcome* outcome)
+{
+    OSDictionary* personality = properties ? OSDictionary::withDictionary(properties) : OSDictionary::withCapacity(2);
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+    OSString* displayName = OSString::withCString(device.displayName.c_str());
+
+    personality->setObject("FirmwareKey", firmwareKey);
+    personality->setObject("DisplayName", displayName);
+    firmwareKey->release();
+    displayName->release();
+
+    // A result left by an earlier run is not this one's
+    controller->getDevice()->removeProperty(kUploadResult);
+    DriverHarness::runDriver(controller->getDevice(), personality);
+    personality->release();
+
+    return getUploadOutcome(OSDynamicCast(OSDictionary, controller->getDevice()->getProperty(kUploadResult)), outcome);
+}
+
+/*
+ * Split RM,Trace into its entries, laid out as TraceEntry in BrcmPatchRAM.h.
+ * Fails when the data is not a whole number of entries.
+ */
+bool decodeTrace(OSData* trace, std::vector<TraceRecord>* records)
+{
+    const size_t entrySize = 16;
+
+    records->clear();
+    if (!trace || trace->getLength() % entrySize)
+        return false;
+
+    const UInt8* bytes = (const UInt8*)trace->getBytesNoCopy();
+    UInt64 first = 0;
+
+    for (size_t offset = 0; offset < trace->getLength(); offset += entrySize)
+    {
+        TraceRecord record;
+        UInt64 timestamp;
+
+        memcpy(&timestamp, bytes + offset, sizeof(timestamp));
+        memcpy(&record.event, bytes + offset + 8, sizeof(record.event));
+        memcpy(&record.arg0, bytes + offset + 10, sizeof(record.arg0));
+        memcpy(&record.arg1, bytes + offset + 12, sizeof(record.arg1));
+        if (!offset)
+            first = timestamp;
+        absolutetime_to_nanoseconds(timestamp - first, &record.nanoseconds);
+        records->push_back(record);
+    }
+    return true;
+}
+
+// One line per entry, time in microseconds, then the event and its arguments
+std::string formatTrace(const std::vector<TraceRecord>& records)
+{
+    static const char* const names[] = { "State", "Command", "CommandError", "Read", "ReadError", "Record", "RecordWritten", "WriteError" };
+    std::string text;
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const TraceRecord& record = records[i];
+        char line[96];
+        char name[16];
+
+        if (record.event < sizeof(names) / sizeof(names[0]))
+            snprintf(name, sizeof(name), "%s", names[record.event]);
+        else
+            snprintf(name, sizeof(name), "Event%u", record.event);
+        snprintf(line, sizeof(line), "%12.3f %-14s %5u 0x%08x\n", microseconds(record.nanoseconds), name, record.arg0, record.arg1);
+        text += line;
+    }
+    return text;
+}
+
+/*
+ * Upload to a controller per device, the phase times go to report and, if
+ * given, a line per device to table and the decoded RM,Trace to trace.
+ */
+int runSimulate(const SimTiming& timing, Report* report, FILE* table, FILE* trace)
+{
+    std::vector<DeviceEntry> devices = loadDevices();
+    SimPhases sum = SimPhases();
+    int failures = 0;
+    OSDictionary* personality = NULL;
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+    properties->release();
+    if (!store)
+    {
+        fprintf(stderr, "Unable to start the firmware store.\n");
+        return 1;
+    }
+
+    if (table)
+        fprintf(table, "%-10s %10s %10s %10s %10s %10s  %s\n", "device", "version", "minidriver", "records", "reset", "total", "result");
+    if (trace && (personality = OSDictionary::withCapacity(1)))
+        personality->setObject("Trace", kOSBooleanTrue);
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        const DeviceEntry& device = devices[i];
+        UploadOutcome outcome = UploadOutcome();
+
+        HostClearEvents();
+        HostResetClock();
+
+        SimController controller(simConfig(device, timing));
+        bool uploaded = simulateUpload(&controller, device, personality, &outcome);
+        const SimPhases& phases = controller.getPhases();
+
+        if (!uploaded || strcmp(outcome.result, "Complete") || !controller.isPatched())
+            failures++;
+
+        if (table)
+            fprintf(table, "%-10s %10.0f %10.0f %10.0f %10.0f %10.0f  %s\n", device.name.c_str(),
+                    microseconds(phases.version), microseconds(phases.miniDriver), microseconds(phases.records),
+                    microseconds(phases.reset), microseconds(phases.total()), uploaded ? outcome.result : "None");
+
+        std::vector<TraceRecord> records;
+        if (trace && decodeTrace(OSDynamicCast(OSData, controller.getDevice()->getProperty("RM,Trace")), &records))
+            fprintf(trace, "%s trace:\n%s", device.name.c_str(), formatTrace(records).c_str());
+
+        std::string prefix = "sim_" + device.name + "_";
+        report->set(prefix + "version_model_us", microseconds(phases.version));
+        report->set(prefix + "minidriver_model_us", microseconds(phases.miniDriver));
+        report->set(prefix + "records_model_us", microseconds(phases.records));
+        report->set(prefix + "reset_model_us", microseconds(phases.reset));
+        report->set(prefix + "total_model_us", microseconds(phases.total()));
+
+        sum.version += phases.version;
+        sum.miniDriver += phases.miniDriver;
+        sum.records += phases.records;
+        sum.reset += phases.reset;
+    }
+
+    report->set("sim_version_model_us", microseconds(sum.version));
+    report->set("sim_minidriver_model_us", microseconds(sum.miniDriver));
+    report->set("sim_records_model_us", microseconds(sum.records));
+    report->set("sim_reset_model_us", microseconds(sum.reset));
+    report->set("sim_total_model_us", microseconds(sum.total()));
+    report->set("sim_devices", devices.size());
+    report->set("sim_failures", failures);
+
+    OSSafeReleaseNULL(personality);
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+
+    if (failures)
+        fprintf(stderr, "%d of %zu uploads did not complete.\n", failures, devices.size());
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The store is built as part of this file, so that the harness reaches
+ * check_sum and the other helpers that are static to it.
+ */
+
+#include "../BrcmPatchRAM/BrcmFirmwareStore.cpp"
+
+#include "Harness.h"
+
+BrcmFirmwareStore* StoreHarness::startStore(OSDictionary* properties)
+{
+    BrcmFirmwareStore* store = new BrcmFirmwareStore;
+
+    if (!store->init(properties) || !store->start(NULL))
+    {
+        store->release();
+        return NULL;
+    }
+    return store;
+}
+
+void StoreHarness::stopStore(BrcmFirmwareStore* store)
+{
+    store->stop(NULL);
+    store->release();
+}
+
+OSData* StoreHarness::decompressFirmware(BrcmFirmwareStore* store, OSData* firmware)
+{
+    return store->decompressFirmware(firmware);
+}
+
+OSArray* StoreHarness::parseFirmware(BrcmFirmwareStore* store, OSData* firmwareData, OSArray* stream)
+{
+    return store->parseFirmware(firmwareData, stream);
+}
+
+OSData* StoreHarness::packFirmware(BrcmFirmwareStore* store, OSData* firmware, UInt32* records)
+{
+    return store->packFirmware(firmware, records);
+}
+
+UInt8 StoreHarness::checkSum(const UInt8* data, UInt16 length)
+{
+    return check_sum(data, length);
+}
+
+OSData* StoreHarness::loadFirmwareFiles(BrcmFirmwareStore* store, UInt16 vendorId, UInt16 productId, OSString* firmwareKey, bool* direct)
+{
+    return store->loadFirmwareFiles(vendorId, productId, firmwareKey, direct);
+}
+
+// Load and decode without adding to the firmwares cache, release with releaseInstructions
+OSArray* StoreHarness::loadFirmware(BrcmFirmwareStore* store, UInt16 vendorId, UInt16 productId, OSString* firmwareKey)
+{
+    return store->loadFirmware(vendorId, productId, firmwareKey, NULL);
+}
+
+OSData* StoreHarness::lookupEmbeddedFirmware(BrcmFirmwareStore* store, const char* filename)
+{
+    return store->lookupEmbeddedFirmware(filename);
+}
+
+AllocationStats StoreHarness::getAllocationStats(AllocationSite site)
+{
+    return allocationStats[site];
+}
+
+// What decodeThread wakes once a decode is done, and getFirmware sleeps on
+const void* StoreHarness::getDecodingEvent(BrcmFirmwareStore* store)
+{
+    return store->mDecoding;
+}
+
+// parseFirmware counts the records as held by the cache until the store stops
+void StoreHarness::releaseInstructions(OSArray* instructions)
+{
+    SInt64 bytes = 0;
+
+    for (unsigned int i = 0; i < instructions->getCount(); i++)
+    {
+        if (OSData* instruction = OSDynamicCast(OSData, instructions->getObject(i)))
+            bytes += instruction->getLength();
+    }
+    trackAllocation(kAllocInstructions, -bytes);
+    instructions->release();
+}
@@ -0,0 +1,319 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Wakeups of the streamed decode of beginFirmware: a record only wakes a
+ * reader sleeping in waitForInstruction, and getFirmware waits for the
+ * whole decode on mDecoding instead of being woken by every record.
+ *
+ * And the streams of CompactCache: they read the same records as
+ * parseFirmware whatever whitespace is between the lines, from a packed
+ * firmware smaller than its .zhx, whether it was loaded as .zhx or .hex.
+ */
+
+#include "Harness.h"
+#include "HostTest.h"
+
+static BrcmFirmwareStore* startStore()
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    BrcmFirmwareStore* store = StoreHarness::startStore(properties);
+
+    properties->release();
+    return store;
+}
+
+static void stopStore(BrcmFirmwareStore* store)
+{
+    StoreHarness::stopStore(store);
+    HostWaitThreads();
+}
+
+HOST_TEST(streamWithoutReaderIsNotWoken)
+{
+    BrcmFirmwareStore* store = startStore();
+    std::vector<DeviceEntry> devices = loadDevices();
+    OSData* source = readFirmwareData(gFirmwareDirectory + "/" + devices.at(0).firmwareKey + ".zhx");
+    OSData* hex = source ? StoreHarness::decompressFirmware(store, source) : NULL;
+    OSArray* stream = OSArray::withCapacity(1);
+
+    EXPECT(hex != NULL);
+    HostResetWakeups();
+
+    OSArray* instructions = hex ? StoreHarness::parseFirmware(store, hex, stream) : NULL;
+    EXPECT(instructions == stream);
+    EXPECT(stream->getCount() > 0);
+    EXPECT_EQ(HostWakeups(stream), 0);
+
+    if (instructions)
+    {
+        StoreHarness::releaseInstructions(instructions);
+        instructions->release();
+    }
+    stream->release();
+    OSSafeReleaseNULL(hex);
+    OSSafeReleaseNULL(source);
+    stopStore(store);
+}
+
+HOST_TEST(getFirmwareWaitsForStreamOnDecoding)
+{
+    BrcmFirmwareStore* store = startStore();
+    const DeviceEntry device = loadDevices().at(0);
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+
+    HostResetWakeups();
+
+    OSArray* stream = store->beginFirmware(device.vendorId, device.productId, firmwareKey);
+    OSArray* instructions = store->getFirmware(device.vendorId, device.productId, firmwareKey);
+
+    EXPECT(stream != NULL);
+    EXPECT(instructions == stream);
+    EXPECT(instructions && instructions->getCount() > 0);
+
+    // The end of the decode, and nothing per record
+    HostWaitThreads();
+    EXPECT(HostWakeups(stream) <= 1);
+    EXPECT(HostWakeups(StoreHarness::getDecodingEvent(store)) <= 1);
+
+    OSSafeReleaseNULL(stream);
+    firmwareKey->release();
+    stopStore(store);
+}
+
+HOST_TEST(streamReaderGetsEveryRecord)
+{
+    BrcmFirmwareStore* store = startStore();
+    const DeviceEntry device = loadDevices().at(0);
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+    UInt32 count = 0;
+
+    HostResetWakeups();
+
+    OSArray* stream = store->beginFirmware(device.vendorId, device.productId, firmwareKey);
+    EXPECT(stream != NULL);
+
+    for (OSData* instruction = NULL; stream; count++)
+    {
+        EXPECT_EQ(store->waitForInstruction(firmwareKey, stream, count, &instruction), kIOReturnSuccess);
+        if (!instruction)
+            break;
+    }
+    HostWaitThreads();
+
+    // Woken at most once per record it waited for, and at the end
+    EXPECT(stream && count == stream->getCount());
+    EXPECT(HostWakeups(stream) <= count + 1);
+    EXPECT(store->getFirmware(device.vendorId, device.productId, firmwareKey) == stream);
+
+    OSSafeReleaseNULL(stream);
+    firmwareKey->release();
+    stopStore(store);
+}
+
+// The records of stream, which is released, NULL if it fails on any
+static OSArray* readStream(BrcmFirmwareStream* stream)
+{
+    OSArray* records = OSArray::withCapacity(1);
+    UInt8 record[kLaunchRamRecordMax];
+    UInt16 length = 0;
+    IOReturn result = kIOReturnError;
+
+    while (stream && (result = stream->readRecord(record, sizeof(record), &length)) == kIOReturnSuccess && length)
+    {
+        OSData* data = OSData::withBytes(record, length);
+        records->setObject(data);
+        data->release();
+    }
+    if (result != kIOReturnSuccess)
+        OSSafeReleaseNULL(records);
+    OSSafeReleaseNULL(stream);
+    return records;
+}
+
+static void releaseParsed(OSArray* instructions)
+{
+    if (instructions)
+    {
+        StoreHarness::releaseInstructions(instructions);
+        instructions->release();
+    }
+}
+
+// The stream over firmware packed by the store, NULL if it does not pack
+static BrcmFirmwareStream* packStream(BrcmFirmwareStore* store, OSData* firmware)
+{
+    UInt32 records;
+    OSData* packed = firmware ? StoreHarness::packFirmware(store, firmware, &records) : NULL;
+    BrcmFirmwareStream* stream = packed ? BrcmFirmwareStream::withSource(packed) : NULL;
+
+    OSSafeReleaseNULL(packed);
+    return stream;
+}
+
+/*
+ * Every firmware of the corpus packs smaller than its .zhx, and is read
+ * back as the records parseFirmware decodes.
+ */
+HOST_TEST(packedFirmwareIsSmallerThanZhx)
+{
+    BrcmFirmwareStore* store = startStore();
+    std::vector<FirmwareFile> files = listFirmwareFiles();
+
+    EXPECT(!files.empty());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        OSData* source = readFirmwareData(files[i].path);
+        OSData* hex = source ? StoreHarness::decompressFirmware(store, source) : NULL;
+        OSArray* expected = hex ? StoreHarness::parseFirmware(store, hex, NULL) : NULL;
+        UInt32 records = 0;
+        OSData* packed = source ? StoreHarness::packFirmware(store, source, &records) : NULL;
+
+        EXPECT(expected != NULL);
+        EXPECT(packed != NULL);
+        if (source && packed && packed->getLength() >= source->getLength())
+            printf("%s: packed to %u bytes from %u\n", files[i].name.c_str(), packed->getLength(), source->getLength());
+        EXPECT(source && packed && packed->getLength() < source->getLength());
+        EXPECT(expected && records == expected->getCount());
+
+        OSArray* streamed = packed ? readStream(BrcmFirmwareStream::withSource(packed)) : NULL;
+        EXPECT(sameInstructions(streamed, expected));
+
+        OSSafeReleaseNULL(streamed);
+        OSSafeReleaseNULL(packed);
+        releaseParsed(expected);
+        OSSafeReleaseNULL(hex);
+        OSSafeReleaseNULL(source);
+    }
+    stopStore(store);
+}
+
+// A packed firmware cut short fails rather than ending early
+HOST_TEST(truncatedPackedFirmwareFails)
+{
+    BrcmFirmwareStore* store = startStore();
+    const DeviceEntry device = loadDevices().at(0);
+    OSData* source = readFirmwareData(gFirmwareDirectory + "/" + device.firmwareKey + ".zhx");
+    UInt32 records = 0;
+    OSData* packed = source ? StoreHarness::packFirmware(store, source, &records) : NULL;
+
+    EXPECT(packed != NULL);
+    if (packed)
+    {
+        OSData* truncated = OSData::withBytes(packed->getBytesNoCopy(), packed->getLength() / 2);
+        EXPECT(readStream(BrcmFirmwareStream::withSource(truncated)) == NULL);
+        truncated->release();
+    }
+
+    OSSafeReleaseNULL(packed);
+    OSSafeReleaseNULL(source);
+    stopStore(store);
+}
+
+HOST_TEST(packedFirmwareSkipsWhitespace)
+{
+    BrcmFirmwareStore* store = startStore();
+    const DeviceEntry device = loadDevices().at(0);
+    OSData* source = readFirmwareData(gFirmwareDirectory + "/" + device.firmwareKey + ".zhx");
+    OSData* hex = source ? StoreHarness::decompressFirmware(store, source) : NULL;
+    OSArray* expected = hex ? StoreHarness::parseFirmware(store, hex, NULL) : NULL;
+    std::string text;
+
+    EXPECT(expected != NULL);
+
+    // Blank lines and trailing whitespace, which parseFirmware skips, in long runs
+    if (hex)
+    {
+        const char* line = (const char*)hex->getBytesNoCopy();
+        const char* end = line + hex->getLength();
+
+        for (int count = 0; line < end; count++)
+        {
+            const char* next = (const char*)memchr(line, '\n', end - line);
+            next = next ? next + 1 : end;
+            text.append(line, next - line);
+            if (count % 7 == 0)
+                text.append(std::string(1500, ' ') + "\r\n\n" + std::string(3000, '\t') + "\n");
+            line = next;
+        }
+    }
+
+    OSData* paddedHex = OSData::withBytes(text.data(), (unsigned int)text.size());
+    OSArray* parsed = StoreHarness::parseFirmware(store, paddedHex, NULL);
+    EXPECT(sameInstructions(parsed, expected));
+
+    OSArray* streamed = readStream(packStream(store, paddedHex));
+    EXPECT(sameInstructions(streamed, expected));
+
+    OSSafeReleaseNULL(streamed);
+    releaseParsed(parsed);
+    releaseParsed(expected);
+    OSSafeReleaseNULL(paddedHex);
+    OSSafeReleaseNULL(hex);
+    OSSafeReleaseNULL(source);
+    stopStore(store);
+}
+
+HOST_TEST(compactCacheKeepsHexPacked)
+{
+    TemporaryDirectory directory("bprstream");
+    const DeviceEntry device = loadDevices().at(0);
+    OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+    OSData* source = readFirmwareData(gFirmwareDirectory + "/" + device.firmwareKey + ".zhx");
+    BrcmFirmwareStore* store = startStore();
+    OSData* hex = source ? StoreHarness::decompressFirmware(store, source) : NULL;
+
+    EXPECT(hex != NULL);
+    stopStore(store);
+    if (hex)
+        EXPECT(writeFile(directory.file(device.firmwareKey + ".hex"), std::string((const char*)hex->getBytesNoCopy(), hex->getLength())));
+
+    OSArray* expected = copyStoreFirmware(device, "FirmwareDirectory", directory.path(), NULL);
+    EXPECT(expected != NULL);
+
+    OSDictionary* properties = OSDictionary::withCapacity(2);
+    OSString* path = OSString::withCString(directory.path().c_str());
+    properties->setObject("FirmwareDirectory", path);
+    properties->setObject("CompactCache", kOSBooleanTrue);
+    path->release();
+    store = StoreHarness::startStore(properties);
+    properties->release();
+
+    SInt64 held = StoreHarness::getAllocationStats(kAllocInstructions).current;
+    BrcmFirmwareStream* stream = store ? store->openFirmwareStream(device.vendorId, device.productId, firmwareKey) : NULL;
+    EXPECT(stream != NULL);
+    OSSafeReleaseNULL(stream);
+
+    // Kept smaller than the .zhx of the same firmware, not as text
+    SInt64 kept = StoreHarness::getAllocationStats(kAllocInstructions).current - held;
+    EXPECT(kept > 0);
+    EXPECT(source && kept < (SInt64)source->getLength());
+
+    stream = store ? store->openFirmwareStream(device.vendorId, device.productId, firmwareKey) : NULL;
+    OSArray* streamed = readStream(stream);
+    EXPECT(sameInstructions(streamed, expected));
+
+    OSSafeReleaseNULL(streamed);
+    OSSafeReleaseNULL(expected);
+    OSSafeReleaseNULL(hex);
+    OSSafeReleaseNULL(source);
+    firmwareKey->release();
+    if (store)
+        stopStore(store);
+}
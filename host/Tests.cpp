@@ -0,0 +1,110 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * Runs the tests registered with HOST_TEST, in name order.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Harness.h"
+#include "HostTest.h"
+
+struct HostTestCase
+{
+    const char* name;
+    HostTestFunction function;
+};
+
+// Function local, registrations run before main in any order
+static std::vector<HostTestCase>& registeredTests()
+{
+    static std::vector<HostTestCase> tests;
+    return tests;
+}
+
+static int gFailures;
+
+HostTestRegistration::HostTestRegistration(const char* name, HostTestFunction function)
+{
+    registeredTests().push_back(HostTestCase { name, function });
+}
+
+void hostExpect(bool condition, const char* expression, const char* file, int line)
+{
+    if (condition)
+        return;
+
+    printf("%s:%d: expected %s\n", file, line, expression);
+    gFailures++;
+}
+
+void hostExpectEqual(unsigned long long actual, unsigned long long expected, const char* expression, const char* file, int line)
+{
+    if (actual == expected)
+        return;
+
+    printf("%s:%d: %s is %llu (0x%llx), expected %llu (0x%llx)\n", file, line, expression, actual, actual, expected, expected);
+    gFailures++;
+}
+
+void hostExpectString(const char* actual, const char* expected, const char* expression, const char* file, int line)
+{
+    if (actual == expected || (actual && expected && !strcmp(actual, expected)))
+        return;
+
+    printf("%s:%d: %s is %s%s%s, expected %s%s%s\n", file, line, expression,
+           actual ? "\"" : "", actual ? actual : "NULL", actual ? "\"" : "",
+           expected ? "\"" : "", expected ? expected : "NULL", expected ? "\"" : "");
+    gFailures++;
+}
+
+/*
+ * Run every test whose name contains filter, all of them without one.
+ */
+int runTests(const char* filter)
+{
+    std::vector<HostTestCase> tests = registeredTests();
+    int failed = 0;
+    int run = 0;
+
+    std::sort(tests.begin(), tests.end(), [](const HostTestCase& a, const HostTestCase& b) { return strcmp(a.name, b.name) < 0; });
+
+    for (size_t i = 0; i < tests.size(); i++)
+    {
+        if (filter && !strstr(tests[i].name, filter))
+            continue;
+
+        int failures = gFailures;
+        tests[i].function();
+        run++;
+
+        if (gFailures != failures)
+            failed++;
+        printf("%-40s %s\n", tests[i].name, gFailures != failures ? "FAILED" : "ok");
+    }
+
+    printf("%d of %d tests failed.\n", failed, run);
+    return failed ? 1 : 0;
+}
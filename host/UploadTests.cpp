@@ -0,0 +1,312 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The RM,UploadResult the driver leaves on the simulated controller, read
+ * back as an UploadOutcome, for a fresh controller, one that still runs an
+ * earlier upload and a firmware the store does not have, and the settle
+ * time saved over several uploads.
+ */
+
+#include "Harness.h"
+#include "HostTest.h"
+#include "SimController.h"
+
+// Store of the firmwares/ corpus for the length of a test, no topology cached
+class StoreScope
+{
+public:
+    StoreScope()
+    {
+        OSDictionary* properties = OSDictionary::withCapacity(1);
+        mStore = StoreHarness::startStore(properties);
+        properties->release();
+        DriverHarness::forgetTopologies();
+    }
+
+    ~StoreScope()
+    {
+        if (mStore)
+            StoreHarness::stopStore(mStore);
+        HostWaitThreads();
+    }
+
+    BrcmFirmwareStore* get() const { return mStore; }
+
+private:
+    BrcmFirmwareStore* mStore;
+};
+
+static OSDictionary* resetPolicy(UInt32 policy)
+{
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSNumber* number = OSNumber::withNumber(policy, 32);
+
+    properties->setObject("ResetPolicy", number);
+    number->release();
+    return properties;
+}
+
+static UInt32 firmwareBytes(OSArray* instructions)
+{
+    UInt32 bytes = 0;
+
+    for (unsigned int i = 0; instructions && i < instructions->getCount(); i++)
+        bytes += ((OSData*)instructions->getObject(i))->getLength();
+    return bytes;
+}
+
+// A driver time in us that is the modelled time in ns, give or take the driver's own work
+static bool withinMicroseconds(UInt64 time, UInt64 modelled)
+{
+    return time + 100 >= modelled / 1000 && time <= modelled / 1000 + 100;
+}
+
+HOST_TEST(uploadCompletesOnEveryDevice)
+{
+    StoreScope store;
+    std::vector<DeviceEntry> devices = loadDevices();
+
+    EXPECT(store.get() != NULL);
+    EXPECT(!devices.empty());
+
+    for (size_t i = 0; store.get() && i < devices.size(); i++)
+    {
+        const DeviceEntry& device = devices[i];
+        UploadOutcome outcome = UploadOutcome();
+
+        HostClearEvents();
+        HostResetClock();
+
+        SimController controller(simConfig(device, SimTiming()));
+        if (!simulateUpload(&controller, device, NULL, &outcome))
+        {
+            EXPECT(!"RM,UploadResult published");
+            continue;
+        }
+
+        OSString* firmwareKey = OSString::withCString(device.firmwareKey.c_str());
+        OSArray* instructions = store.get()->getFirmware(device.vendorId, device.productId, firmwareKey);
+        firmwareKey->release();
+
+        EXPECT(controller.isPatched());
+        EXPECT_STR(outcome.result, "Complete");
+        EXPECT_STR(outcome.topology, "Full");
+        EXPECT_STR(outcome.failedState, NULL);
+        EXPECT_STR(outcome.firmwareKey, device.firmwareKey.c_str());
+        EXPECT_EQ(outcome.records, instructions ? instructions->getCount() : 0);
+        EXPECT_EQ(outcome.bytes, firmwareBytes(instructions));
+        EXPECT_EQ(outcome.retries, 0);
+        EXPECT_EQ(outcome.versionBefore, 0x1000);
+        EXPECT_EQ(outcome.versionAfter, simConfig(device, SimTiming()).patchedVersion + 0x1000U);
+        EXPECT(outcome.time >= outcome.setupTime);
+
+        // The phases the driver timed are the ones the controller modelled
+        const SimPhases& phases = controller.getPhases();
+        EXPECT(withinMicroseconds(outcome.versionTime, phases.version));
+        EXPECT(withinMicroseconds(outcome.miniDriverTime, phases.miniDriver));
+        EXPECT(withinMicroseconds(outcome.recordsTime + outcome.endOfRecordTime, phases.records));
+        EXPECT(withinMicroseconds(outcome.resetTime, phases.reset));
+        EXPECT(outcome.endOfRecordTime > 0);
+    }
+}
+
+/*
+ * A warm reboot: the controller still runs the firmware and only reports
+ * it after the deferred reset, so the upload is retried once and found
+ * not needed.
+ */
+HOST_TEST(uploadNotNeededAfterDeferredReset)
+{
+    StoreScope store;
+    std::vector<DeviceEntry> devices = loadDevices();
+    UploadOutcome outcome = UploadOutcome();
+
+    HostClearEvents();
+    HostResetClock();
+
+    SimConfig config = simConfig(devices.at(0), SimTiming());
+    config.patched = true;
+    SimController controller(config);
+
+    EXPECT(simulateUpload(&controller, devices[0], NULL, &outcome));
+    EXPECT_STR(outcome.result, "NotNeeded");
+    EXPECT_STR(outcome.failedState, NULL);
+    EXPECT_EQ(outcome.retries, 1);
+    EXPECT_EQ(outcome.records, 0);
+    EXPECT_EQ(outcome.versionBefore, config.patchedVersion + 0x1000U);
+    EXPECT_EQ(outcome.versionAfter, config.patchedVersion + 0x1000U);
+    EXPECT(controller.isPatched());
+}
+
+/*
+ * With the reset always done up front there is nothing to retry, and the
+ * second run on the same controller finds its topology cached.
+ */
+HOST_TEST(uploadNotNeededWithResetAlways)
+{
+    StoreScope store;
+    std::vector<DeviceEntry> devices = loadDevices();
+    OSDictionary* properties = resetPolicy(0);     // kResetAlways of BrcmPatchRAM.h
+    UploadOutcome first = UploadOutcome();
+    UploadOutcome second = UploadOutcome();
+
+    HostClearEvents();
+    HostResetClock();
+
+    SimController controller(simConfig(devices.at(0), SimTiming()));
+
+    EXPECT(simulateUpload(&controller, devices[0], properties, &first));
+    EXPECT_STR(first.result, "Complete");
+    EXPECT_STR(first.topology, "Full");
+
+    EXPECT(simulateUpload(&controller, devices[0], properties, &second));
+    EXPECT_STR(second.result, "NotNeeded");
+    EXPECT_STR(second.topology, "Cached");
+    EXPECT_EQ(second.retries, 0);
+    EXPECT_EQ(second.records, 0);
+    properties->release();
+}
+
+HOST_TEST(uploadFailsWithoutFirmware)
+{
+    StoreScope store;
+    std::vector<DeviceEntry> devices = loadDevices();
+    DeviceEntry device = devices.at(0);
+    UploadOutcome outcome = UploadOutcome();
+
+    device.firmwareKey = "BCM00000_v0000";
+
+    HostClearEvents();
+    HostResetClock();
+
+    SimController controller(simConfig(device, SimTiming()));
+
+    EXPECT(simulateUpload(&controller, device, NULL, &outcome));
+    EXPECT_STR(outcome.result, "Failed");
+    EXPECT_STR(outcome.firmwareKey, "BCM00000_v0000");
+    EXPECT_EQ(outcome.records, 0);
+
+    // The controller answered in its ROM state, a reset would not help
+    EXPECT_EQ(outcome.retries, 0);
+    EXPECT(!controller.isPatched());
+}
+
+/*
+ * RM,SavedSettleTime adds up over the uploads to a controller, like a boot
+ * and a wake, while each result has the time saved by that upload alone.
+ */
+HOST_TEST(savedSettleTimeAddsUpOverUploads)
+{
+    StoreScope store;
+    std::vector<DeviceEntry> devices = loadDevices();
+    UploadOutcome first = UploadOutcome();
+    UploadOutcome second = UploadOutcome();
+
+    HostClearEvents();
+    HostResetClock();
+
+    SimController controller(simConfig(devices.at(0), SimTiming()));
+
+    EXPECT(simulateUpload(&controller, devices[0], NULL, &first));
+    EXPECT_STR(first.result, "Complete");
+    EXPECT(first.savedSettleTime > 0);
+
+    // Still patched, so this one needs the reset after all and saves nothing
+    EXPECT(simulateUpload(&controller, devices[0], NULL, &second));
+    EXPECT_STR(second.result, "NotNeeded");
+    EXPECT_EQ(second.retries, 1);
+    EXPECT_EQ(second.savedSettleTime, 0);
+
+    OSNumber* total = OSDynamicCast(OSNumber, controller.getDevice()->getProperty("RM,SavedSettleTime"));
+    EXPECT(total != NULL);
+    EXPECT_EQ(total ? total->unsigned32BitValue() : 0, first.savedSettleTime);
+}
+
+/*
+ * RM,Trace keeps the last kTraceEntries events of the ring oldest first,
+ * and decodes back to what was traced.
+ */
+HOST_TEST(traceRingRoundTrip)
+{
+    std::vector<TraceRecord> records;
+    SimController controller(simConfig(loadDevices().at(0), SimTiming()));
+
+    DriverHarness::publishTrace(controller.getDevice(), 10);
+    OSData* trace = OSDynamicCast(OSData, controller.getDevice()->getProperty("RM,Trace"));
+    EXPECT(decodeTrace(trace, &records));
+    EXPECT_EQ(records.size(), 10);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        EXPECT_EQ(records[i].event, 5);
+        EXPECT_EQ(records[i].arg0, i);
+        EXPECT_EQ(records[i].arg1, ~(UInt32)i);
+    }
+
+    // Wrapped, the first 44 are overwritten
+    DriverHarness::publishTrace(controller.getDevice(), 300);
+    trace = OSDynamicCast(OSData, controller.getDevice()->getProperty("RM,Trace"));
+    EXPECT(decodeTrace(trace, &records));
+    EXPECT_EQ(records.size(), 256);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        EXPECT_EQ(records[i].arg0, 44 + i);
+        EXPECT_EQ(records[i].arg1, ~(UInt32)(44 + i));
+    }
+
+    // Not a whole number of entries
+    OSData* truncated = trace ? OSData::withBytes(trace->getBytesNoCopy(), trace->getLength() - 1) : NULL;
+    EXPECT(truncated && !decodeTrace(truncated, &records));
+    OSSafeReleaseNULL(truncated);
+}
+
+// The trace of an upload ends with its last state change, in time order
+HOST_TEST(uploadTraceIsDecoded)
+{
+    StoreScope store;
+    const DeviceEntry device = loadDevices().at(0);
+    UploadOutcome outcome = UploadOutcome();
+    std::vector<TraceRecord> records;
+
+    HostClearEvents();
+    HostResetClock();
+
+    SimController controller(simConfig(device, SimTiming()));
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    properties->setObject("Trace", kOSBooleanTrue);
+    EXPECT(simulateUpload(&controller, device, properties, &outcome));
+    properties->release();
+    EXPECT_STR(outcome.result, "Complete");
+
+    EXPECT(decodeTrace(OSDynamicCast(OSData, controller.getDevice()->getProperty("RM,Trace")), &records));
+    EXPECT(!records.empty());
+    if (records.empty())
+        return;
+
+    bool endOfRecord = false;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        EXPECT(!i || records[i].nanoseconds >= records[i - 1].nanoseconds);
+        // kTraceCommand of HCI_VSC_END_OF_RECORD
+        endOfRecord |= records[i].event == 1 && records[i].arg1 == 0xfc4e;
+    }
+    EXPECT(endOfRecord);
+    EXPECT_EQ(records.back().event, 0);
+    EXPECT(formatTrace(records).find("RecordWritten") != std::string::npos);
+}
@@ -0,0 +1,623 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * The part of libkern and IOKit that the drivers and the firmware store use,
+ * implemented in KernelShim.cpp so that they build and run as an ordinary
+ * Linux process. Only what the sources in BrcmPatchRAM/ call is provided.
+ *
+ * Kernel time is virtual: it only moves when the simulated controller
+ * completes a transfer or the code sleeps, see HostClock.h.
+ */
+
+#ifndef __HostKernel__
+#define __HostKernel__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <limits.h>
+#include <typeinfo>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+typedef unsigned int u_int;
+typedef uint8_t u_int8_t;
+typedef uint16_t u_int16_t;
+typedef uintptr_t vm_size_t;
+typedef uint64_t mach_vm_address_t;
+
+typedef int kern_return_t;
+typedef kern_return_t IOReturn;
+typedef kern_return_t OSReturn;
+typedef uint32_t IOOptionBits;
+typedef uint64_t IOByteCount;
+typedef uint64_t AbsoluteTime;
+typedef int wait_result_t;
+typedef void* thread_t;
+typedef void* task_t;
+typedef uint32_t OSKextRequestTag;
+typedef int IODirection;
+
+typedef struct kmod_info
+{
+    int id;
+} kmod_info_t;
+
+#define __unused __attribute__((unused))
+
+#define KERN_SUCCESS 0
+#define KERN_FAILURE 5
+
+#define THREAD_AWAKENED 0
+#define THREAD_TIMED_OUT 1
+
+#define kIOReturnSuccess                0
+#define kIOReturnError                  ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory               ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources            ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice               ((IOReturn)0xe00002c0)
+#define kIOReturnBadArgument            ((IOReturn)0xe00002c2)
+#define kIOReturnNoSpace                ((IOReturn)0xe00002c3)
+#define kIOReturnMessageTooLarge        ((IOReturn)0xe00002c4)
+#define kIOReturnExclusiveAccess        ((IOReturn)0xe00002c5)
+#define kIOReturnUnsupported            ((IOReturn)0xe00002c7)
+#define kIOReturnCannotLock             ((IOReturn)0xe00002cc)
+#define kIOReturnNotOpen                ((IOReturn)0xe00002cd)
+#define kIOReturnBusy                   ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout                ((IOReturn)0xe00002d6)
+#define kIOReturnNotReady               ((IOReturn)0xe00002d8)
+#define kIOReturnNotPermitted           ((IOReturn)0xe00002e2)
+#define kIOReturnUnderrun               ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun                ((IOReturn)0xe00002e8)
+#define kIOReturnIsoTooOld              ((IOReturn)0xe00002e9)
+#define kIOReturnIsoTooNew              ((IOReturn)0xe00002ea)
+#define kIOReturnAborted                ((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding          ((IOReturn)0xe00002ed)
+#define kIOReturnNotFound               ((IOReturn)0xe00002f0)
+#define kIOReturnInvalid                ((IOReturn)0xe0000001)
+
+#define kOSReturnSuccess                0
+#define kOSReturnError                  ((OSReturn)0xdc000001)
+#define kOSKextReturnNotFound           ((OSReturn)0xdc008011)
+
+#define kNanosecondScale 1
+#define kMicrosecondScale 1000
+#define kMillisecondScale 1000000
+#define kSecondScale 1000000000
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+#define kIODirectionNone 0
+#define kIODirectionIn 1
+#define kIODirectionOut 2
+#define kIODirectionInOut 3
+
+#define kIOPMPowerStateVersion1 1
+#define kIOPMPowerOn 2
+#define IOPMAckImplied 0
+
+extern task_t kernel_task;
+extern int version_major;
+extern int version_minor;
+
+/***************************************
+ * IOLib
+ ***************************************/
+void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void* IOMalloc(vm_size_t size);
+void IOFree(void* address, vm_size_t size);
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+
+struct IOLock;
+IOLock* IOLockAlloc();
+void IOLockFree(IOLock* lock);
+void IOLockLock(IOLock* lock);
+void IOLockUnlock(IOLock* lock);
+bool IOLockTryLock(IOLock* lock);
+int IOLockSleep(IOLock* lock, void* event, int interruptible);
+int IOLockSleepDeadline(IOLock* lock, void* event, uint64_t deadline, int interruptible);
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread);
+
+struct IONamedValue
+{
+    int value;
+    const char* name;
+};
+const char* IOFindNameForValue(int value, const IONamedValue* table);
+
+bool PE_parse_boot_argn(const char* name, void* value, int size);
+
+void clock_get_uptime(uint64_t* result);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale_factor, uint64_t* result);
+uint64_t mach_absolute_time();
+
+typedef void (*thread_continue_t)(void* parameter, wait_result_t wait);
+kern_return_t kernel_thread_start(thread_continue_t continuation, void* parameter, thread_t* new_thread);
+void thread_deallocate(thread_t thread);
+void thread_terminate(thread_t thread);
+thread_t current_thread();
+
+/***************************************
+ * libkern
+ ***************************************/
+SInt32 OSIncrementAtomic(volatile SInt32* address);
+SInt32 OSDecrementAtomic(volatile SInt32* address);
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address);
+SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address);
+UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32* address);
+
+static inline UInt32 OSReadLittleInt32(const volatile void* base, uintptr_t offset)
+{
+    UInt32 value;
+    memcpy(&value, (const UInt8*)base + offset, sizeof(value));
+    return value;
+}
+
+static inline UInt16 OSReadLittleInt16(const volatile void* base, uintptr_t offset)
+{
+    UInt16 value;
+    memcpy(&value, (const UInt8*)base + offset, sizeof(value));
+    return value;
+}
+
+static inline void OSWriteLittleInt32(volatile void* base, uintptr_t offset, UInt32 data)
+{
+    memcpy((UInt8*)base + offset, &data, sizeof(data));
+}
+
+const char* OSKextGetCurrentIdentifier();
+const char* OSKextGetCurrentVersionString();
+typedef void (*OSKextRequestResourceCallback)(OSKextRequestTag requestTag, OSReturn result, const void* resourceData, uint32_t resourceDataLength, void* context);
+OSReturn OSKextRequestResource(const char* kextIdentifier, const char* resourceName, OSKextRequestResourceCallback callback, void* context, OSKextRequestTag* requestTagOut);
+
+/*
+ * Runtime type information stands in for the OSMetaClass system, so that
+ * OSDynamicCast checks the type like it does in the kernel.
+ */
+class OSMetaClassBase
+{
+public:
+    virtual ~OSMetaClassBase() {}
+};
+
+#define OSDeclareDefaultStructors(className) \
+    public: className(); virtual ~className(); private:
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() {} className::~className() {}
+#define OSDynamicCast(type, inst) \
+    (dynamic_cast<type*>(const_cast<OSMetaClassBase*>(static_cast<const OSMetaClassBase*>(inst))))
+#define OSSafeReleaseNULL(inst) do { if (inst) { (inst)->release(); (inst) = NULL; } } while (0)
+
+class OSObject : public OSMetaClassBase
+{
+public:
+    OSObject();
+    static void* operator new(size_t size);
+    static void operator delete(void* memory, size_t size);
+
+    virtual bool init();
+    virtual void free();
+    void retain() const;
+    void release() const;
+    int getRetainCount() const;
+
+private:
+    mutable volatile SInt32 mRetainCount;
+};
+
+class OSString;
+class OSSymbol;
+
+class OSCollection : public OSObject
+{
+public:
+    virtual unsigned int getCount() const = 0;
+    // object returned by an OSCollectionIterator at index
+    virtual OSObject* iteratorObject(unsigned int index) const = 0;
+};
+
+class OSIterator : public OSObject
+{
+public:
+    virtual OSObject* getNextObject() = 0;
+    virtual void reset() = 0;
+};
+
+class OSCollectionIterator : public OSIterator
+{
+public:
+    static OSCollectionIterator* withCollection(const OSCollection* collection);
+    virtual OSObject* getNextObject();
+    virtual void reset();
+    virtual void free();
+
+private:
+    const OSCollection* mCollection;
+    unsigned int mIndex;
+};
+
+class OSString : public OSObject
+{
+public:
+    static OSString* withCString(const char* cString);
+    static OSString* withCStringNoCopy(const char* cString);
+    const char* getCStringNoCopy() const;
+    unsigned int getLength() const;
+    bool isEqualTo(const char* cString) const;
+    bool isEqualTo(const OSString* string) const;
+    virtual void free();
+
+protected:
+    char* mString;
+    unsigned int mLength;
+    bool initWithCString(const char* cString);
+};
+
+class OSSymbol : public OSString
+{
+public:
+    static const OSSymbol* withCString(const char* cString);
+    static const OSSymbol* withCStringNoCopy(const char* cString);
+    static const OSSymbol* withString(const OSString* string);
+};
+
+class OSNumber : public OSObject
+{
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned int numberOfBits);
+    unsigned short unsigned16BitValue() const;
+    unsigned int unsigned32BitValue() const;
+    unsigned long long unsigned64BitValue() const;
+    unsigned int numberOfBits() const;
+    void setValue(unsigned long long value);
+    void addValue(signed long long value);
+
+private:
+    unsigned long long mValue;
+    unsigned int mSize;
+};
+
+class OSBoolean : public OSObject
+{
+public:
+    bool isTrue() const;
+    bool isFalse() const;
+    static OSBoolean* withBoolean(bool value);
+
+    bool mValue;
+};
+
+extern OSBoolean* kOSBooleanTrue;
+extern OSBoolean* kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+public:
+    static OSData* withCapacity(unsigned int capacity);
+    static OSData* withBytes(const void* bytes, unsigned int numBytes);
+    static OSData* withData(const OSData* other);
+    bool appendBytes(const void* bytes, unsigned int numBytes);
+    bool appendBytes(const OSData* other);
+    const void* getBytesNoCopy() const;
+    const void* getBytesNoCopy(unsigned int start, unsigned int numBytes) const;
+    unsigned int getLength() const;
+    unsigned int getCapacity() const;
+    bool isEqualTo(const OSData* other) const;
+    bool isEqualTo(const void* bytes, unsigned int numBytes) const;
+    virtual void free();
+
+private:
+    UInt8* mData;
+    unsigned int mLength;
+    unsigned int mCapacity;
+    bool ensureCapacity(unsigned int capacity);
+};
+
+class OSArray : public OSCollection
+{
+public:
+    static OSArray* withCapacity(unsigned int capacity);
+    bool setObject(const OSObject* object);
+    bool setObject(unsigned int index, const OSObject* object);
+    OSObject* getObject(unsigned int index) const;
+    virtual unsigned int getCount() const;
+    void removeObject(unsigned int index);
+    void flushCollection();
+    bool merge(const OSArray* other);
+    virtual OSObject* iteratorObject(unsigned int index) const;
+    virtual void free();
+
+private:
+    const OSObject** mArray;
+    unsigned int mCount;
+    unsigned int mCapacity;
+};
+
+class OSDictionary : public OSCollection
+{
+public:
+    // A shallow copy, the kernel one copies nested collections too
+    OSCollection* copyCollection() const;
+    static OSDictionary* withCapacity(unsigned int capacity);
+    static OSDictionary* withDictionary(const OSDictionary* dict, unsigned int capacity = 0);
+    bool setObject(const char* key, const OSObject* object);
+    bool setObject(const OSString* key, const OSObject* object);
+    bool setObject(const OSSymbol* key, const OSObject* object);
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const;
+    OSObject* getObject(const OSSymbol* key) const;
+    void removeObject(const char* key);
+    void removeObject(const OSString* key);
+    void removeObject(const OSSymbol* key);
+    virtual unsigned int getCount() const;
+    void flushCollection();
+    virtual OSObject* iteratorObject(unsigned int index) const;
+    virtual void free();
+
+private:
+    struct Entry
+    {
+        const OSSymbol* key;
+        const OSObject* value;
+    };
+    Entry* mEntries;
+    unsigned int mCount;
+    unsigned int mCapacity;
+    int find(const char* key) const;
+};
+
+class OSOrderedSet : public OSCollection
+{
+public:
+    static OSOrderedSet* withCapacity(unsigned int capacity);
+    bool setLastObject(const OSObject* object);
+    virtual unsigned int getCount() const;
+    virtual OSObject* iteratorObject(unsigned int index) const;
+    virtual void free();
+
+private:
+    OSArray* mArray;
+};
+
+/***************************************
+ * IOKit
+ ***************************************/
+#define kIOProviderClassKey "IOProviderClass"
+#define kIOClassKey "IOClass"
+#define kIOMatchCategoryKey "IOMatchCategory"
+
+class IOService;
+class IONotifier;
+class IOWorkLoop;
+
+struct IORegistryPlane;
+extern const IORegistryPlane* gIOServicePlane;
+extern const OSSymbol* gIOPublishNotification;
+extern const OSSymbol* gIOFirstPublishNotification;
+extern const OSSymbol* gIOMatchedNotification;
+extern const OSSymbol* gIOTerminatedNotification;
+
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+
+class IONotifier : public OSObject
+{
+public:
+    virtual void remove();
+    virtual void disable();
+    virtual void enable(bool was);
+
+    const OSSymbol* mType;
+    OSDictionary* mMatching;
+    IOServiceMatchingNotificationHandler mHandler;
+    void* mTarget;
+    void* mRefCon;
+};
+
+class IORegistryEntry : public OSObject
+{
+public:
+    virtual bool init(OSDictionary* dictionary = 0);
+    virtual void free();
+
+    OSObject* getProperty(const char* name) const;
+    OSObject* getProperty(const OSString* name) const;
+    OSObject* getProperty(const OSSymbol* name) const;
+    OSObject* copyProperty(const char* name) const;
+    bool setProperty(const char* name, OSObject* object);
+    bool setProperty(const OSSymbol* name, OSObject* object);
+    bool setProperty(const OSString* name, OSObject* object);
+    bool setProperty(const char* name, const char* string);
+    bool setProperty(const char* name, bool value);
+    bool setProperty(const char* name, unsigned long long value, unsigned int numberOfBits);
+    bool setProperty(const char* name, void* bytes, unsigned int length);
+    void removeProperty(const char* name);
+    OSDictionary* getPropertyTable() const;
+
+    OSIterator* getChildIterator(const IORegistryPlane* plane) const;
+    IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const;
+    bool attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane);
+    void detachFromParent(IORegistryEntry* parent, const IORegistryPlane* plane);
+    const char* getName(const IORegistryPlane* plane = 0) const;
+
+private:
+    OSDictionary* mProperties;
+    OSArray* mChildren;
+    IORegistryEntry* mParent;
+    mutable char mClassName[64];
+};
+
+class IOService : public IORegistryEntry
+{
+public:
+    virtual bool init(OSDictionary* dictionary = 0);
+    virtual void free();
+    virtual IOService* probe(IOService* provider, SInt32* score);
+    virtual bool start(IOService* provider);
+    virtual void stop(IOService* provider);
+    virtual bool open(IOService* forClient, IOOptionBits options = 0, void* arg = 0);
+    virtual void close(IOService* forClient, IOOptionBits options = 0);
+    virtual bool isOpen(const IOService* forClient = 0) const;
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice);
+    virtual const char* stringFromReturn(IOReturn rtn);
+    virtual IOWorkLoop* getWorkLoop() const;
+
+    IOService* getProvider() const;
+    void registerService(IOOptionBits options = 0);
+    bool terminate(IOOptionBits options = 0);
+    bool isInactive() const;
+
+    static OSDictionary* serviceMatching(const char* className, OSDictionary* table = 0);
+    static IONotifier* addMatchingNotification(const OSSymbol* type, OSDictionary* matching, IOServiceMatchingNotificationHandler handler, void* target, void* ref = 0, SInt32 priority = 0);
+
+    void PMinit();
+    void PMstop();
+    IOReturn registerPowerDriver(IOService* controllingDriver, struct IOPMPowerState* powerStates, unsigned long numberOfStates);
+    IOReturn joinPMtree(IOService* driver);
+    IOReturn makeUsable();
+
+private:
+    IOService* mProvider;
+    IOService* mOpenClient;
+    bool mRegistered;
+};
+
+struct IOPMPowerState
+{
+    unsigned long version;
+    unsigned long capabilityFlags;
+    unsigned long outputPowerCharacter;
+    unsigned long inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long stateOrder;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+class IOEventSource : public OSObject
+{
+public:
+    void enable() {}
+    void disable() {}
+};
+
+/*
+ * Timeouts are events on the virtual clock, the action runs when the
+ * simulation thread sleeps past them like the other events.
+ */
+class IOTimerEventSource : public IOEventSource
+{
+public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = 0);
+    IOReturn setTimeoutMS(UInt32 ms);
+    void cancelTimeout();
+
+private:
+    OSObject* mOwner;
+    Action mAction;
+    UInt32 mGeneration;     // timeouts set before a cancel or a new one are stale
+};
+
+/*
+ * A member function as a timer action, only member functions without
+ * arguments are used as one.
+ */
+template <typename Member, Member function> struct HostTimerAction;
+template <typename Class, typename Result, Result (Class::*function)()>
+struct HostTimerAction<Result (Class::*)(), function>
+{
+    static void action(OSObject* owner, IOTimerEventSource* sender)
+    {
+        (static_cast<Class*>(owner)->*function)();
+    }
+};
+#define OSMemberFunctionCast(cptrtype, self, func) \
+    ((cptrtype)&HostTimerAction<decltype(func), func>::action)
+
+// One work loop for every service, event sources only need to be added
+class IOWorkLoop : public OSObject
+{
+public:
+    IOReturn addEventSource(IOEventSource* source);
+    IOReturn removeEventSource(IOEventSource* source);
+};
+
+/*
+ * Driver personalities, empty at start. Matching compares the values of
+ * every key of the matching dictionary, nothing is matched or terminated.
+ */
+class IOCatalogue : public OSObject
+{
+public:
+    SInt32 getGenerationCount() const;
+    OSOrderedSet* findDrivers(OSDictionary* matching, SInt32* generationCount);
+    bool addDrivers(OSArray* drivers, bool doNubMatching = true);
+    bool removeDrivers(OSDictionary* matching, bool doNubMatching = true);
+    bool startMatching(OSDictionary* matching);
+    IOReturn terminateDriversForModule(OSString* moduleName, bool unload = true);
+};
+
+extern IOCatalogue* gIOCatalogue;
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+    virtual IOReturn prepare(IODirection forDirection = kIODirectionNone);
+    virtual IOReturn complete(IODirection forDirection = kIODirectionNone);
+    virtual IOByteCount getLength() const;
+    IOByteCount writeBytes(IOByteCount offset, const void* bytes, IOByteCount length);
+    IOByteCount readBytes(IOByteCount offset, void* bytes, IOByteCount length);
+
+protected:
+    UInt8* mBuffer;
+    IOByteCount mLength;
+    vm_size_t mCapacity;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+    static IOBufferMemoryDescriptor* inTaskWithOptions(task_t inTask, IOOptionBits options, vm_size_t capacity, vm_size_t alignment = 1);
+    static IOBufferMemoryDescriptor* withCapacity(vm_size_t capacity, IODirection withDirection, bool withContiguousMemory = false);
+    void* getBytesNoCopy();
+    void setLength(vm_size_t length);
+    vm_size_t getCapacity() const;
+    bool appendBytes(const void* bytes, vm_size_t withLength);
+    virtual void free();
+};
+
+#endif /* __HostKernel__ */
@@ -0,0 +1,180 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * IOUSBFamily as used by USBDeviceShim.cpp for the resident driver. The
+ * classes forward to an IOUSBHostDevice, implemented in LegacyUSB.cpp, so
+ * that SimController.cpp serves both drivers.
+ */
+
+#ifndef __HostIOUSBDevice__
+#define __HostIOUSBDevice__
+
+#include "USB.h"
+
+// Same layout as the IOUSBHost ones
+typedef StandardUSB::ConfigurationDescriptor IOUSBConfigurationDescriptor;
+typedef StandardUSB::EndpointDescriptor IOUSBEndpointDescriptor;
+
+typedef UInt16 USBStatus;
+
+enum
+{
+    kUSBNone = 2,
+    kUSBAnyDirn = 3,
+};
+
+enum
+{
+    kUSBStandard = 0,
+    kUSBClass = 1,
+    kUSBVendor = 2,
+};
+
+enum
+{
+    kUSBDevice = 0,
+    kUSBInterface = 1,
+    kUSBEndpoint = 2,
+};
+
+#define USBmakebmRequestType(direction, type, recipient) \
+    (UInt8)((((direction) & 1) << 7) | (((type) & 3) << 5) | ((recipient) & 0x1f))
+
+#define kUSBVendorID "idVendor"
+#define kUSBProductID "idProduct"
+
+#define kIOUSBFindInterfaceDontCare 0xFFFF
+
+typedef void (*IOUSBCompletionAction)(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+struct IOUSBCompletion
+{
+    void* target;
+    IOUSBCompletionAction action;
+    void* parameter;
+};
+
+struct IOUSBDevRequest
+{
+    UInt8 bmRequestType;
+    UInt8 bRequest;
+    UInt16 wValue;
+    UInt16 wIndex;
+    UInt16 wLength;
+    void* pData;
+    UInt32 wLenDone;
+};
+
+struct IOUSBFindInterfaceRequest
+{
+    UInt16 bInterfaceClass;
+    UInt16 bInterfaceSubClass;
+    UInt16 bInterfaceProtocol;
+    UInt16 bAlternateSetting;
+};
+
+struct IOUSBFindEndpointRequest
+{
+    UInt8 type;
+    UInt8 direction;
+    UInt16 maxPacketSize;
+    UInt8 interval;
+};
+
+class IOUSBInterface;
+
+class IOUSBPipe : public OSObject
+{
+public:
+    static IOUSBPipe* withPipe(IOUSBHostPipe* pipe);
+
+    IOReturn Read(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion* completion = 0, IOByteCount* bytesRead = 0);
+    IOReturn Write(IOMemoryDescriptor* buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion* completion = 0);
+    IOReturn Abort();
+    IOReturn Reset();
+    const IOUSBEndpointDescriptor* GetEndpointDescriptor();
+
+    virtual void free();
+
+private:
+    static void transferComplete(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+
+    IOUSBHostPipe* mPipe;
+    // of the asynchronous transfer in flight, one at a time per pipe
+    IOUSBHostCompletion mHostCompletion;
+    IOUSBCompletion mCompletion;
+    UInt32 mRequested;
+};
+
+class IOUSBInterface : public IOService
+{
+public:
+    static IOUSBInterface* withInterface(IOUSBHostInterface* interface);
+
+    UInt8 GetInterfaceNumber();
+    UInt8 GetInterfaceClass();
+    UInt8 GetInterfaceSubClass();
+    UInt8 GetInterfaceProtocol();
+    IOUSBPipe* FindNextPipe(IOUSBPipe* current, IOUSBFindEndpointRequest* request);
+    IOReturn DeviceRequest(IOUSBDevRequest* request, IOUSBCompletion* completion = 0);
+
+    virtual void free();
+
+private:
+    static void requestComplete(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+
+    IOUSBHostInterface* mInterface;
+    IOUSBPipe* mPipes[4];
+    UInt32 mPipeCount;
+    StandardUSB::DeviceRequest mRequest;
+    IOBufferMemoryDescriptor* mRequestBuffer;
+    IOUSBHostCompletion mHostCompletion;
+    IOUSBCompletion mCompletion;
+};
+
+class IOUSBDevice : public IOService
+{
+public:
+    static IOUSBDevice* withDevice(IOUSBHostDevice* device);
+
+    UInt16 GetVendorID();
+    UInt16 GetProductID();
+    UInt16 GetDeviceRelease();
+    UInt32 GetLocationID();
+    UInt8 GetNumConfigurations();
+    UInt8 GetManufacturerStringIndex();
+    UInt8 GetProductStringIndex();
+    UInt8 GetSerialNumberStringIndex();
+    IOReturn GetStringDescriptor(UInt8 index, char* buf, int maxLen, UInt16 lang = 0x409);
+    IOReturn GetDeviceStatus(USBStatus* status);
+    IOReturn ResetDevice();
+    const IOUSBConfigurationDescriptor* GetFullConfigurationDescriptor(UInt8 configIndex);
+    IOReturn GetConfiguration(UInt8* configNumber);
+    IOReturn SetConfiguration(IOService* forClient, UInt8 configValue, bool startMatchingInterfaces = true);
+    IOUSBInterface* FindNextInterface(IOUSBInterface* current, IOUSBFindInterfaceRequest* request);
+
+    virtual void free();
+
+private:
+    IOUSBHostDevice* mDevice;
+    IOUSBInterface* mInterface;
+};
+
+#endif /* __HostIOUSBDevice__ */
@@ -0,0 +1,210 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/*
+ * IOUSBHostFamily as used by USBHostDeviceShim.cpp. The transfer methods
+ * are virtual so that SimController.cpp can stand in for a controller.
+ */
+
+#ifndef __HostIOUSBHostDevice__
+#define __HostIOUSBHostDevice__
+
+#include "../../HostKernel.h"
+
+namespace StandardUSB
+{
+    enum
+    {
+        kDescriptorSize = 2,
+    };
+
+    enum
+    {
+        kDescriptorTypeDevice = 1,
+        kDescriptorTypeConfiguration = 2,
+        kDescriptorTypeString = 3,
+        kDescriptorTypeInterface = 4,
+        kDescriptorTypeEndpoint = 5,
+    };
+
+    struct Descriptor
+    {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+    } __attribute__((packed));
+
+    struct DeviceDescriptor : public Descriptor
+    {
+        uint16_t bcdUSB;
+        uint8_t bDeviceClass;
+        uint8_t bDeviceSubClass;
+        uint8_t bDeviceProtocol;
+        uint8_t bMaxPacketSize0;
+        uint16_t idVendor;
+        uint16_t idProduct;
+        uint16_t bcdDevice;
+        uint8_t iManufacturer;
+        uint8_t iProduct;
+        uint8_t iSerialNumber;
+        uint8_t bNumConfigurations;
+    } __attribute__((packed));
+
+    struct ConfigurationDescriptor : public Descriptor
+    {
+        uint16_t wTotalLength;
+        uint8_t bNumInterfaces;
+        uint8_t bConfigurationValue;
+        uint8_t iConfiguration;
+        uint8_t bmAttributes;
+        uint8_t bMaxPower;
+    } __attribute__((packed));
+
+    struct InterfaceDescriptor : public Descriptor
+    {
+        uint8_t bInterfaceNumber;
+        uint8_t bAlternateSetting;
+        uint8_t bNumEndpoints;
+        uint8_t bInterfaceClass;
+        uint8_t bInterfaceSubClass;
+        uint8_t bInterfaceProtocol;
+        uint8_t iInterface;
+    } __attribute__((packed));
+
+    struct EndpointDescriptor : public Descriptor
+    {
+        uint8_t bEndpointAddress;
+        uint8_t bmAttributes;
+        uint16_t wMaxPacketSize;
+        uint8_t bInterval;
+    } __attribute__((packed));
+
+    struct StringDescriptor : public Descriptor
+    {
+        uint8_t bString[1];
+    } __attribute__((packed));
+
+    struct DeviceRequest
+    {
+        uint8_t bmRequestType;
+        uint8_t bRequest;
+        uint16_t wValue;
+        uint16_t wIndex;
+        uint16_t wLength;
+    } __attribute__((packed));
+
+    const EndpointDescriptor* getNextEndpointDescriptor(const ConfigurationDescriptor* configurationDescriptor, const InterfaceDescriptor* interfaceDescriptor, const Descriptor* currentDescriptor);
+    uint8_t getEndpointDirection(const EndpointDescriptor* descriptor);
+    uint8_t getEndpointType(const EndpointDescriptor* descriptor);
+    uint8_t getEndpointAddress(const EndpointDescriptor* descriptor);
+}
+
+using namespace StandardUSB;
+
+enum
+{
+    kRequestDirectionOut = 0,
+    kRequestDirectionIn = 1,
+};
+
+enum
+{
+    kRequestTypeStandard = 0,
+    kRequestTypeClass = 1,
+    kRequestTypeVendor = 2,
+};
+
+enum
+{
+    kRequestRecipientDevice = 0,
+    kRequestRecipientInterface = 1,
+};
+
+enum
+{
+    kDeviceRequestGetStatus = 0,
+    kDeviceRequestGetConfiguration = 8,
+};
+
+enum
+{
+    kUSBControl = 0,
+    kUSBIsoc = 1,
+    kUSBBulk = 2,
+    kUSBInterrupt = 3,
+    kUSBAnyType = 0xFF,
+};
+
+enum
+{
+    kUSBOut = 0,
+    kUSBIn = 1,
+};
+
+#define kUSBHostStandardRequestCompletionTimeout 5000
+#define kUSBHostDevicePropertyLocationID "locationID"
+#define USBToHost16(x) (x)
+
+static inline uint8_t makeDeviceRequestbmRequestType(int direction, int type, int recipient)
+{
+    return (uint8_t)(((direction & 1) << 7) | ((type & 3) << 5) | (recipient & 0x1f));
+}
+
+typedef void (*IOUSBHostCompletionAction)(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+
+struct IOUSBHostCompletion
+{
+    void* owner;
+    IOUSBHostCompletionAction action;
+    void* parameter;
+};
+
+class IOUSBHostPipe;
+class IOUSBHostInterface;
+
+class IOUSBHostDevice : public IOService
+{
+public:
+    virtual const StandardUSB::DeviceDescriptor* getDeviceDescriptor() = 0;
+    virtual const StandardUSB::StringDescriptor* getStringDescriptor(uint8_t index, uint16_t languageID = 0x409) = 0;
+    virtual IOReturn deviceRequest(IOService* forClient, StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs) = 0;
+    virtual IOReturn setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces = true) = 0;
+    virtual const StandardUSB::ConfigurationDescriptor* getConfigurationDescriptor(uint8_t index) = 0;
+};
+
+class IOUSBHostInterface : public IOService
+{
+public:
+    virtual const StandardUSB::ConfigurationDescriptor* getConfigurationDescriptor() = 0;
+    virtual const StandardUSB::InterfaceDescriptor* getInterfaceDescriptor() = 0;
+    virtual IOUSBHostPipe* copyPipe(uint8_t address) = 0;
+    virtual IOReturn deviceRequest(StandardUSB::DeviceRequest& request, void* dataBuffer, uint32_t& bytesTransferred, uint32_t completionTimeoutMs) = 0;
+    virtual IOReturn deviceRequest(StandardUSB::DeviceRequest& request, IOMemoryDescriptor* dataBuffer, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs = 5000) = 0;
+};
+
+class IOUSBHostPipe : public OSObject
+{
+public:
+    virtual IOReturn abort() = 0;
+    virtual IOReturn io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion* completion, uint32_t completionTimeoutMs = 0) = 0;
+    virtual IOReturn io(IOMemoryDescriptor* dataBuffer, uint32_t dataBufferLength, uint32_t& bytesTransferred, uint32_t completionTimeoutMs = 0) = 0;
+    virtual const StandardUSB::EndpointDescriptor* getEndpointDescriptor() = 0;
+    virtual IOReturn clearStall(bool withRequest) = 0;
+};
+
+#endif /* __HostIOUSBHostDevice__ */
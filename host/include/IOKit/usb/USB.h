@@ -0,0 +1,41 @@
+// Host shim, see HostKernel.h
+#ifndef __HostUSB__
+#define __HostUSB__
+
+#include "IOUSBHostDevice.h"
+
+#define kUSBProductString "USB Product Name"
+
+#define iokit_usb_err(return) ((IOReturn)(0xe0004000 | (return)))
+
+#define kIOUSBUnknownPipeErr                            iokit_usb_err(0x61)
+#define kIOUSBTooManyPipesErr                           iokit_usb_err(0x60)
+#define kIOUSBNoAsyncPortErr                            iokit_usb_err(0x5f)
+#define kIOUSBNotEnoughPipesErr                         iokit_usb_err(0x5e)
+#define kIOUSBNotEnoughPowerErr                         iokit_usb_err(0x5d)
+#define kIOUSBEndpointNotFound                          iokit_usb_err(0x57)
+#define kIOUSBConfigNotFound                            iokit_usb_err(0x56)
+#define kIOUSBTransactionTimeout                        iokit_usb_err(0x51)
+#define kIOUSBTransactionReturned                       iokit_usb_err(0x50)
+#define kIOUSBPipeStalled                               iokit_usb_err(0x4f)
+#define kIOUSBInterfaceNotFound                         iokit_usb_err(0x4e)
+#define kIOUSBLowLatencyBufferNotPreviouslyAllocated    iokit_usb_err(0x4d)
+#define kIOUSBLowLatencyFrameListNotPreviouslyAllocated iokit_usb_err(0x4c)
+#define kIOUSBHighSpeedSplitError                       iokit_usb_err(0x4b)
+#define kIOUSBSyncRequestOnWLThread                     iokit_usb_err(0x4a)
+#define kIOUSBDeviceNotHighSpeed                        iokit_usb_err(0x49)
+#define kIOUSBClearPipeStallNotRecursive                iokit_usb_err(0x48)
+#define kIOUSBLinkErr                                   iokit_usb_err(0x10)
+#define kIOUSBNotSent2Err                               iokit_usb_err(0x0f)
+#define kIOUSBNotSent1Err                               iokit_usb_err(0x0e)
+#define kIOUSBBufferUnderrunErr                         iokit_usb_err(0x0d)
+#define kIOUSBBufferOverrunErr                          iokit_usb_err(0x0c)
+#define kIOUSBReserved2Err                              iokit_usb_err(0x0b)
+#define kIOUSBReserved1Err                              iokit_usb_err(0x0a)
+#define kIOUSBWrongPIDErr                               iokit_usb_err(0x07)
+#define kIOUSBPIDCheckErr                               iokit_usb_err(0x06)
+#define kIOUSBDataToggleErr                             iokit_usb_err(0x03)
+#define kIOUSBBitstufErr                                iokit_usb_err(0x02)
+#define kIOUSBCRCErr                                    iokit_usb_err(0x01)
+
+#endif /* __HostUSB__ */
@@ -0,0 +1,2 @@
+// Host shim, see HostKernel.h
+#include "../HostKernel.h"
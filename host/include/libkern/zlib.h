@@ -0,0 +1,2 @@
+// Host shim, the system zlib
+#include <zlib.h>
@@ -0,0 +1,11 @@
+// Host shim, see HostKernel.h
+#ifndef __HostUtfconv__
+#define __HostUtfconv__
+
+#include "../HostKernel.h"
+
+#define UTF_LITTLE_ENDIAN 0x0080
+
+int utf8_encodestr(const u_int16_t* ucsp, size_t ucslen, u_int8_t* utf8p, size_t* utf8len, size_t buflen, u_int16_t altslash, int flags);
+
+#endif /* __HostUtfconv__ */
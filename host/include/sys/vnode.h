@@ -0,0 +1,60 @@
+// Host shim: vnodes are POSIX file descriptors, see HostKernel.h
+#ifndef __HostVnode__
+#define __HostVnode__
+
+#include "../HostKernel.h"
+#include <fcntl.h>
+
+struct vnode;
+typedef struct vnode* vnode_t;
+struct vfs_context;
+typedef struct vfs_context* vfs_context_t;
+typedef char* caddr_t;
+
+#define NULLVP ((vnode_t)0)
+
+// Kernel open modes, translated to O_RDONLY/O_WRONLY by vnode_open
+#define FREAD 0x0001
+#define FWRITE 0x0002
+
+#define IO_UNIT 0x0001
+#define IO_SYNC 0x0004
+#define IO_NOCACHE 0x0040
+
+struct vnode_timespec
+{
+    long tv_sec;
+    long tv_nsec;
+};
+
+struct vnode_attr
+{
+    uint64_t va_data_size;
+    struct vnode_timespec va_modify_time;
+    uint64_t va_fileid;
+};
+
+#define VATTR_INIT(v) bzero((v), sizeof(*(v)))
+#define VATTR_WANTED(v, a) do { } while (0)
+
+enum uio_rw
+{
+    UIO_READ,
+    UIO_WRITE,
+};
+
+enum uio_seg
+{
+    UIO_SYSSPACE,
+};
+
+vfs_context_t vfs_context_create(vfs_context_t context);
+int vfs_context_rele(vfs_context_t context);
+void* vfs_context_ucred(vfs_context_t context);
+void* vfs_context_proc(vfs_context_t context);
+int vnode_open(const char* path, int fmode, int cmode, int flags, vnode_t* vpp, vfs_context_t context);
+int vnode_close(vnode_t vp, int flags, vfs_context_t context);
+int vnode_getattr(vnode_t vp, struct vnode_attr* vap, vfs_context_t context);
+int vn_rdwr(enum uio_rw rw, vnode_t vp, caddr_t base, int len, long long offset, enum uio_seg segflg, int ioflg, void* cred, int* aresid, void* p);
+
+#endif /* __HostVnode__ */